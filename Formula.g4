@@ -6,10 +6,17 @@ main
 
 expr
     : '(' expr ')'  # Parens
+    | FUNCTION '(' (expr (',' expr)*)? ')'  # Call
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | expr (LT | LE | GT | GE | EQ | NE) expr  # Comparison
+    // a range is only an argument of the lookups and aggregates, checked by the AST builder
+    | CELL ':' CELL  # Range
     | CELL  # Cell
+    | SHEET_CELL  # SheetCell
+    // printed for a reference to a deleted cell or range, reads back as one
+    | REF  # DeletedReference
     | NUMBER  # Literal
     ;
 
@@ -26,5 +33,15 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
+EQ: '=' ;
+NE: '<>' ;
 CELL: [A-Z]+[0-9]+ ;
+// a name without digits, checked against the known functions by the AST builder
+FUNCTION: [A-Z]+ ;
+SHEET_CELL: [A-Za-z_] [A-Za-z0-9_]* '!' [A-Z]+ [0-9]+ ;
+REF: '#REF!' ;
 WS: [ \t\n\r]+ -> skip ;
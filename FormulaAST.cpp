@@ -1,13 +1,26 @@
 #include "FormulaAST.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cmath>
+#include <cstdint>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
 
 namespace ASTImpl {
 
+    namespace {
+        // a range is only valid where a lookup or an aggregate takes one
+        void CheckOperand(const Expr& expr) {
+            if (expr.GetKind() == Expr::Kind::Range) {
+                throw FormulaException("A range is not a value");
+            }
+        }
+    }  // namespace
+
     void Expr::PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -22,7 +35,7 @@ namespace ASTImpl {
     }
 
     BinaryOpExpr::BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-            : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) { }
+            : Expr(Kind::BinaryOp), type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) { }
 
     void BinaryOpExpr::Print(std::ostream& out) const {
         out << '(' << static_cast<char>(type_) << ' ';
@@ -54,42 +67,55 @@ namespace ASTImpl {
         }
     }
 
-    double BinaryOpExpr::Evaluate(const std::function<double(Position)>& get_cell_value) const {
-        double rhs = rhs_->Evaluate(std::ref(get_cell_value));
-        double lhs = lhs_->Evaluate(std::ref(get_cell_value));
+    std::unique_ptr<Expr> BinaryOpExpr::Optimize() const {
+        auto lhs = lhs_->Optimize();
+        auto rhs = rhs_->Optimize();
+        const auto* lhs_number = dynamic_cast<const NumberExpr*>(lhs.get());
+        const auto* rhs_number = dynamic_cast<const NumberExpr*>(rhs.get());
+
+        if (lhs_number && rhs_number) {
+            try {
+                return std::make_unique<NumberExpr>(Apply(type_, lhs_number->GetValue(), rhs_number->GetValue()));
+            }
+            catch (const FormulaError&) {
+                // not folded: the error is reported on every evaluation as before
+            }
+        }
+
+        // x / 2^k == x * 2^-k bit for bit, so only powers of two are strength-reduced
+        if (type_ == Divide && rhs_number && std::abs(rhs_number->GetValue()) >= INACCURACY) {
+            int exponent = 0;
+            const double mantissa = std::frexp(rhs_number->GetValue(), &exponent);
+            const double reciprocal = 1.0 / rhs_number->GetValue();
+            if (std::abs(mantissa) == 0.5 && std::isnormal(reciprocal)) {
+                return std::make_unique<BinaryOpExpr>(Multiply, std::move(lhs), std::make_unique<NumberExpr>(reciprocal));
+            }
+        }
+
+        return std::make_unique<BinaryOpExpr>(type_, std::move(lhs), std::move(rhs));
+    }
+
+    void BinaryOpExpr::Compile(Program& program) const {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
         switch (type_) {
         case Add:
-            if ((lhs > 0 && rhs > 0 && rhs > std::numeric_limits<double>::max() - lhs)
-                || (rhs < 0 && lhs < 0 && lhs < std::numeric_limits<double>::min() - rhs)) {
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs + rhs;
+            program.emplace_back(Instruction::Op::Add);
+            break;
         case Subtract:
-            if ((lhs < 0 && rhs > 0 && std::numeric_limits<double>::min() + rhs > lhs)
-                || (lhs > 0 && rhs < 0 && std::numeric_limits<double>::max() + rhs < lhs)) {
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs - rhs;
+            program.emplace_back(Instruction::Op::Subtract);
+            break;
         case Multiply:
-            if (std::abs(lhs) > INACCURACY && rhs > std::numeric_limits<double>::max() / std::abs(lhs)) {
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs * rhs;
+            program.emplace_back(Instruction::Op::Multiply);
+            break;
         case Divide:
-            if (std::abs(rhs) < INACCURACY) {
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            else {
-                return lhs_->Evaluate(std::ref(get_cell_value)) / rhs;
-            }
-        default:
-            assert(false);
-            return 0;
+            program.emplace_back(Instruction::Op::Divide);
+            break;
         }
     }
 
     UnaryOpExpr::UnaryOpExpr(Type type, std::unique_ptr<Expr> operand) 
-        : type_(type), operand_(std::move(operand)) { }
+        : Expr(Kind::UnaryOp), type_(type), operand_(std::move(operand)) { }
 
         void UnaryOpExpr::Print(std::ostream& out) const {
         out << '(' << static_cast<char>(type_) << ' ';
@@ -106,26 +132,476 @@ namespace ASTImpl {
         return EP_UNARY;
     }
 
-    double UnaryOpExpr::Evaluate(const std::function<double(Position)>& get_cell_value) const {
+    std::unique_ptr<Expr> UnaryOpExpr::Optimize() const {
+        auto operand = operand_->Optimize();
+        if (type_ == UnaryPlus) {
+            return operand;
+        }
+        if (const auto* number = dynamic_cast<const NumberExpr*>(operand.get())) {
+            return std::make_unique<NumberExpr>(-number->GetValue());
+        }
+        if (auto* unary = dynamic_cast<UnaryOpExpr*>(operand.get())) {
+            // operand is already optimized, so it can only be a negation here
+            assert(unary->type_ == UnaryMinus);
+            return std::move(unary->operand_);
+        }
+        return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+    }
+
+    void UnaryOpExpr::Compile(Program& program) const {
+        operand_->Compile(program);
+        if (type_ == UnaryMinus) {
+            program.emplace_back(Instruction::Op::Negate);
+        }
+    }
+
+    ComparisonExpr::ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+        : Expr(Kind::Comparison), type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) { }
+
+    void ComparisonExpr::Print(std::ostream& out) const {
+        out << '(' << ToString(type_) << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
+
+    void ComparisonExpr::DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const {
+        lhs_->PrintFormula(out, precedence);
+        out << ToString(type_);
+        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    }
+
+    ExprPrecedence ComparisonExpr::GetPrecedence() const {
+        return EP_CMP;
+    }
+
+    std::unique_ptr<Expr> ComparisonExpr::Optimize() const {
+        auto lhs = lhs_->Optimize();
+        auto rhs = rhs_->Optimize();
+        const auto* lhs_number = dynamic_cast<const NumberExpr*>(lhs.get());
+        const auto* rhs_number = dynamic_cast<const NumberExpr*>(rhs.get());
+        if (lhs_number && rhs_number) {
+            return std::make_unique<NumberExpr>(Apply(type_, lhs_number->GetValue(), rhs_number->GetValue()));
+        }
+        return std::make_unique<ComparisonExpr>(type_, std::move(lhs), std::move(rhs));
+    }
+
+    void ComparisonExpr::Compile(Program& program) const {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
         switch (type_) {
-        case Type::UnaryPlus:
-            return operand_->Evaluate(std::ref(get_cell_value));
-        case Type::UnaryMinus:
-            return -(operand_->Evaluate(std::ref(get_cell_value)));
-        default:
+        case Less:
+            program.emplace_back(Instruction::Op::Less);
+            break;
+        case LessEqual:
+            program.emplace_back(Instruction::Op::LessEqual);
+            break;
+        case Greater:
+            program.emplace_back(Instruction::Op::Greater);
+            break;
+        case GreaterEqual:
+            program.emplace_back(Instruction::Op::GreaterEqual);
+            break;
+        case Equal:
+            program.emplace_back(Instruction::Op::Equal);
+            break;
+        case NotEqual:
+            program.emplace_back(Instruction::Op::NotEqual);
+            break;
+        }
+    }
+
+    const char* ComparisonExpr::ToString(Type type) {
+        switch (type) {
+        case Less:
+            return "<";
+        case LessEqual:
+            return "<=";
+        case Greater:
+            return ">";
+        case GreaterEqual:
+            return ">=";
+        case Equal:
+            return "=";
+        case NotEqual:
+            return "<>";
+        }
+        assert(false);
+        return "";
+    }
+
+    namespace {
+        struct FunctionSignature {
+            const char* name;
+            CallExpr::Function function;
+            size_t min_args;
+            size_t max_args;
+            unsigned range_args;        // bit i is set if argument i is a range
+            bool aggregate = false;     // any argument may be a range
+        };
+
+        const FunctionSignature FUNCTIONS[] = {
+            { "IF", CallExpr::Function::If, 2, 3, 0 },
+            { "AND", CallExpr::Function::And, 1, SIZE_MAX, 0 },
+            { "OR", CallExpr::Function::Or, 1, SIZE_MAX, 0 },
+            { "IFERROR", CallExpr::Function::IfError, 2, 2, 0 },
+            { "VLOOKUP", CallExpr::Function::VLookup, 3, 4, 0b10 },
+            { "MATCH", CallExpr::Function::Match, 2, 3, 0b10 },
+            { "XLOOKUP", CallExpr::Function::XLookup, 3, 5, 0b110 },
+            { "SUM", CallExpr::Function::Sum, 1, SIZE_MAX, 0, true },
+            { "COUNT", CallExpr::Function::Count, 1, SIZE_MAX, 0, true },
+            { "MIN", CallExpr::Function::Min, 1, SIZE_MAX, 0, true },
+            { "MAX", CallExpr::Function::Max, 1, SIZE_MAX, 0, true },
+            { "AVERAGE", CallExpr::Function::Average, 1, SIZE_MAX, 0, true },
+        };
+
+        const FunctionSignature& FindSignature(CallExpr::Function function) {
+            for (const FunctionSignature& signature : FUNCTIONS) {
+                if (signature.function == function) {
+                    return signature;
+                }
+            }
             assert(false);
-            return 0;
+            return FUNCTIONS[0];
+        }
+
+        bool IsTrue(double value) {
+            return value != 0;
+        }
+
+        // what a lookup reads for an argument written #REF!
+        const CellRange DELETED_RANGE{ Position::NONE, Position::NONE };
+
+        bool IsDeletedReference(const Expr& expr) {
+            return expr.GetKind() == Expr::Kind::Cell && !static_cast<const CellExpr&>(expr).GetPosition().IsValid();
+        }
+
+        bool IsColumn(const Expr& expr) {
+            const CellRange& range = static_cast<const RangeExpr&>(expr).GetRange();
+            return range.first.col == range.last.col;
+        }
+    }  // namespace
+
+    CallExpr::CallExpr(const std::string& name, std::vector<std::unique_ptr<Expr>> args)
+        : Expr(Kind::Call), args_(std::move(args)) {
+        const auto signature = std::find_if(std::begin(FUNCTIONS), std::end(FUNCTIONS), [&name](const FunctionSignature& signature) {
+            return name == signature.name;
+        });
+        if (signature == std::end(FUNCTIONS)) {
+            throw FormulaException("Unknown function: " + name);
+        }
+        if (args_.size() < signature->min_args || args_.size() > signature->max_args) {
+            throw FormulaException("Wrong number of arguments for " + name);
+        }
+        for (size_t i = 0; i < args_.size(); ++i) {
+            if (signature->range_args >> i & 1) {
+                if (IsDeletedReference(*args_[i])) {
+                    args_[i] = std::make_unique<RangeExpr>(&DELETED_RANGE);
+                } else if (args_[i]->GetKind() != Kind::Range) {
+                    throw FormulaException(name + " takes a range as argument " + std::to_string(i + 1));
+                }
+            } else if (!signature->aggregate || args_[i]->GetKind() != Kind::Range) {
+                CheckOperand(*args_[i]);
+            }
+        }
+        function_ = signature->function;
+        if (function_ == Function::Match && !IsColumn(*args_[1])) {
+            throw FormulaException("MATCH searches a single column");
+        }
+        if (function_ == Function::XLookup) {
+            const CellRange& searched = static_cast<const RangeExpr&>(*args_[1]).GetRange();
+            const CellRange& returned = static_cast<const RangeExpr&>(*args_[2]).GetRange();
+            const bool deleted = !searched.first.IsValid() || !returned.first.IsValid();
+            if (!deleted && (!IsColumn(*args_[1]) || !IsColumn(*args_[2])
+                || searched.last.row - searched.first.row != returned.last.row - returned.first.row)) {
+                throw FormulaException("XLOOKUP searches and returns columns of the same height");
+            }
+        }
+    }
+
+    CallExpr::CallExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+        : Expr(Kind::Call), function_(function), args_(std::move(args)) { }
+
+    void CallExpr::Print(std::ostream& out) const {
+        out << '(' << ToString(function_);
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void CallExpr::DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const {
+        out << ToString(function_) << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->PrintFormula(out, EP_ATOM);
         }
+        out << ')';
     }
 
-    CellExpr::CellExpr(const Position* cell) : cell_(cell) { }
+    ExprPrecedence CallExpr::GetPrecedence() const {
+        return EP_ATOM;
+    }
+
+    std::unique_ptr<Expr> CallExpr::Optimize() const {
+        std::vector<std::unique_ptr<Expr>> args;
+        args.reserve(args_.size());
+        for (const auto& arg : args_) {
+            args.push_back(arg->Optimize());
+        }
+        const auto* first = dynamic_cast<const NumberExpr*>(args.front().get());
+        switch (function_) {
+        case Function::If:
+            // a constant condition leaves a single branch
+            if (first) {
+                if (IsTrue(first->GetValue())) {
+                    return std::move(args[1]);
+                }
+                return args.size() > 2 ? std::move(args[2]) : std::make_unique<NumberExpr>(0);
+            }
+            break;
+        case Function::And:
+        case Function::Or: {
+            const bool is_and = function_ == Function::And;
+            std::vector<std::unique_ptr<Expr>> kept;
+            for (auto& arg : args) {
+                if (const auto* number = dynamic_cast<const NumberExpr*>(arg.get())) {
+                    if (IsTrue(number->GetValue()) != is_and) {
+                        // decides the result if the arguments before it do not
+                        if (kept.empty()) {
+                            return std::make_unique<NumberExpr>(is_and ? 0 : 1);
+                        }
+                        kept.push_back(std::move(arg));
+                        break;
+                    }
+                    // neutral, dropped
+                    continue;
+                }
+                kept.push_back(std::move(arg));
+            }
+            if (kept.empty()) {
+                return std::make_unique<NumberExpr>(is_and ? 1 : 0);
+            }
+            return std::make_unique<CallExpr>(function_, std::move(kept));
+        }
+        case Function::IfError:
+            // a number is never an error
+            if (first) {
+                return std::move(args.front());
+            }
+            break;
+        case Function::VLookup:
+        case Function::Match:
+        case Function::XLookup:
+        case Function::Sum:
+        case Function::Count:
+        case Function::Min:
+        case Function::Max:
+        case Function::Average:
+            break;
+        }
+        return std::make_unique<CallExpr>(function_, std::move(args));
+    }
+
+    void CallExpr::Compile(Program& program) const {
+        // jumps are patched once their target is known
+        const auto jump = [&program](Instruction::Op op) {
+            program.emplace_back(op);
+            return program.size() - 1;
+        };
+        const auto land = [&program](size_t from) {
+            program[from].target = program.size();
+        };
+        switch (function_) {
+        case Function::If: {
+            args_[0]->Compile(program);
+            const size_t to_else = jump(Instruction::Op::JumpIfZero);
+            args_[1]->Compile(program);
+            const size_t to_end = jump(Instruction::Op::Jump);
+            land(to_else);
+            if (args_.size() > 2) {
+                args_[2]->Compile(program);
+            } else {
+                program.emplace_back(Instruction::Op::Number);
+            }
+            land(to_end);
+            break;
+        }
+        case Function::And:
+        case Function::Or: {
+            // AND jumps out at the first false argument, OR at the first true one
+            const bool is_and = function_ == Function::And;
+            std::vector<size_t> to_decided;
+            for (const auto& arg : args_) {
+                arg->Compile(program);
+                to_decided.push_back(jump(is_and ? Instruction::Op::JumpIfZero : Instruction::Op::JumpIfNonZero));
+            }
+            program.emplace_back(Instruction::Op::Number).number = is_and ? 1 : 0;
+            const size_t to_end = jump(Instruction::Op::Jump);
+            for (size_t from : to_decided) {
+                land(from);
+            }
+            program.emplace_back(Instruction::Op::Number).number = is_and ? 0 : 1;
+            land(to_end);
+            break;
+        }
+        case Function::IfError: {
+            const size_t to_fallback = jump(Instruction::Op::Try);
+            args_[0]->Compile(program);
+            const size_t to_end = jump(Instruction::Op::EndTry);
+            land(to_fallback);
+            args_[1]->Compile(program);
+            land(to_end);
+            break;
+        }
+        case Function::VLookup:
+        case Function::Match:
+        case Function::XLookup:
+            CompileLookup(program);
+            break;
+        case Function::Sum:
+        case Function::Count:
+        case Function::Min:
+        case Function::Max:
+        case Function::Average:
+            CompileAggregate(program);
+            break;
+        }
+    }
+
+    void CallExpr::CompileLookup(Program& program) const {
+        const auto emit_range = [&program](Instruction::Op op, const Expr& range) -> Instruction& {
+            Instruction& instruction = program.emplace_back(op);
+            instruction.range = &static_cast<const RangeExpr&>(range).GetRange();
+            return instruction;
+        };
+        // the key, then the mode, with its default
+        args_[0]->Compile(program);
+        const size_t mode_arg = function_ == Function::VLookup ? 3 : function_ == Function::Match ? 2 : 4;
+        if (args_.size() > mode_arg) {
+            args_[mode_arg]->Compile(program);
+        } else {
+            program.emplace_back(Instruction::Op::Number).number = function_ == Function::XLookup ? 0 : 1;
+        }
+        Instruction& match = emit_range(Instruction::Op::Match, *args_[1]);
+        switch (function_) {
+        case Function::VLookup:
+            match.mode = Instruction::Mode::VLookup;
+            args_[2]->Compile(program);
+            emit_range(Instruction::Op::Fetch, *args_[1]);
+            break;
+        case Function::Match:
+            match.mode = Instruction::Mode::Match;
+            program.emplace_back(Instruction::Op::Found);
+            break;
+        default: {
+            match.mode = Instruction::Mode::XLookup;
+            size_t to_fallback = 0;
+            if (args_.size() > 3) {
+                program.emplace_back(Instruction::Op::JumpIfNotFound);
+                to_fallback = program.size() - 1;
+            }
+            program.emplace_back(Instruction::Op::Number).number = 1;
+            emit_range(Instruction::Op::Fetch, *args_[2]);
+            if (args_.size() > 3) {
+                program.emplace_back(Instruction::Op::Jump);
+                const size_t to_end = program.size() - 1;
+                program[to_fallback].target = program.size();
+                args_[3]->Compile(program);
+                program[to_end].target = program.size();
+            }
+            break;
+        }
+        }
+    }
+
+    void CallExpr::CompileAggregate(Program& program) const {
+        Instruction::Aggregate aggregate = Instruction::Aggregate::Sum;
+        switch (function_) {
+        case Function::Count:
+            aggregate = Instruction::Aggregate::Count;
+            break;
+        case Function::Min:
+            aggregate = Instruction::Aggregate::Min;
+            break;
+        case Function::Max:
+            aggregate = Instruction::Aggregate::Max;
+            break;
+        case Function::Average:
+            aggregate = Instruction::Aggregate::Average;
+            break;
+        default:
+            break;
+        }
+        // the total and the count
+        program.emplace_back(Instruction::Op::Number);
+        program.emplace_back(Instruction::Op::Number);
+        for (const auto& arg : args_) {
+            if (arg->GetKind() == Kind::Range) {
+                Instruction& fold = program.emplace_back(Instruction::Op::FoldRange);
+                fold.range = &static_cast<const RangeExpr&>(*arg).GetRange();
+                fold.aggregate = aggregate;
+            } else {
+                arg->Compile(program);
+                program.emplace_back(Instruction::Op::Fold).aggregate = aggregate;
+            }
+        }
+        program.emplace_back(Instruction::Op::Total).aggregate = aggregate;
+    }
+
+    const char* CallExpr::ToString(Function function) {
+        return FindSignature(function).name;
+    }
+
+    RangeExpr::RangeExpr(const CellRange* range) : Expr(Kind::Range), range_(range) { }
+
+    void RangeExpr::Print(std::ostream& out) const {
+        if (!range_->first.IsValid()) {
+            out << FormulaError::Category::Ref;
+            return;
+        }
+        char buffer[2 * Position::MAX_STRING_LENGTH + 1];
+        char* end = range_->first.ToChars(buffer, buffer + sizeof(buffer)).ptr;
+        *end++ = ':';
+        end = range_->last.ToChars(end, buffer + sizeof(buffer)).ptr;
+        out.write(buffer, end - buffer);
+    }
+
+    void RangeExpr::DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const {
+        Print(out);
+    }
+
+    ExprPrecedence RangeExpr::GetPrecedence() const {
+        return EP_ATOM;
+    }
+
+    std::unique_ptr<Expr> RangeExpr::Optimize() const {
+        return std::make_unique<RangeExpr>(range_);
+    }
+
+    void RangeExpr::Compile(Program& program) const {
+        // read by the function taking it, see CallExpr::CompileLookup and CompileAggregate
+        assert(false);
+    }
+
+    CellExpr::CellExpr(const Position* cell, const std::string* sheet) : Expr(Kind::Cell), cell_(cell), sheet_(sheet) { }
 
     void CellExpr::Print(std::ostream& out) const {
         if (!cell_->IsValid()) {
             out << FormulaError::Category::Ref;
         }
         else {
-            out << cell_->ToString();
+            if (sheet_) {
+                out << *sheet_ << '!';
+            }
+            char buffer[Position::MAX_STRING_LENGTH];
+            out.write(buffer, cell_->ToChars(buffer, buffer + Position::MAX_STRING_LENGTH).ptr - buffer);
         }
     }
 
@@ -137,11 +613,18 @@ namespace ASTImpl {
         return EP_ATOM;
     }
 
-    double CellExpr::Evaluate(const std::function<double(Position)>& get_cell_value) const {
-        return get_cell_value(*cell_);
+    std::unique_ptr<Expr> CellExpr::Optimize() const {
+        return std::make_unique<CellExpr>(cell_, sheet_);
     }
 
-    NumberExpr::NumberExpr(double value) : value_(value) { }
+    void CellExpr::Compile(Program& program) const {
+        Instruction instruction{ Instruction::Op::Cell };
+        instruction.cell = cell_;
+        instruction.sheet = sheet_;
+        program.push_back(instruction);
+    }
+
+    NumberExpr::NumberExpr(double value) : Expr(Kind::Number), value_(value) { }
 
     void NumberExpr::Print(std::ostream& out) const {
         out << value_;
@@ -155,26 +638,42 @@ namespace ASTImpl {
         return EP_ATOM;
     }
 
-    double NumberExpr::Evaluate(const std::function<double(Position)>&) const {
-        return value_;
+    std::unique_ptr<Expr> NumberExpr::Optimize() const {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    void NumberExpr::Compile(Program& program) const {
+        Instruction instruction{ Instruction::Op::Number };
+        instruction.number = value_;
+        program.push_back(instruction);
     }
 
     std::unique_ptr<Expr> ParseASTListener::MoveRoot() {
         assert(args_.size() == 1);
         auto root = std::move(args_.front());
         args_.clear();
+        CheckOperand(*root);
 
         return root;
     }
 
-    std::forward_list<Position> ParseASTListener::MoveCells() {
+    CellList ParseASTListener::MoveCells() {
         return std::move(cells_);
     }
 
+    ExternalCellList ParseASTListener::MoveExternalCells() {
+        return std::move(external_cells_);
+    }
+
+    RangeList ParseASTListener::MoveRanges() {
+        return std::move(ranges_);
+    }
+
     void ParseASTListener::exitUnaryOp(FormulaParser::UnaryOpContext* ctx) {
         assert(args_.size() >= 1);
 
         auto operand = std::move(args_.back());
+        CheckOperand(*operand);
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -214,6 +713,19 @@ namespace ASTImpl {
         args_.push_back(std::move(node));
     }
 
+    void ParseASTListener::exitSheetCell(FormulaParser::SheetCellContext* ctx) {
+        auto value_str = ctx->SHEET_CELL()->getSymbol()->getText();
+        const auto separator = value_str.find('!');
+        auto value = Position::FromString(std::string_view(value_str).substr(separator + 1));
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + value_str);
+        }
+
+        external_cells_.push_front({ value_str.substr(0, separator), value });
+        auto node = std::make_unique<CellExpr>(&external_cells_.front().pos, &external_cells_.front().sheet);
+        args_.push_back(std::move(node));
+    }
+
     void ParseASTListener::exitBinaryOp(FormulaParser::BinaryOpContext* ctx) {
         assert(args_.size() >= 2);
 
@@ -221,6 +733,8 @@ namespace ASTImpl {
         args_.pop_back();
 
         auto lhs = std::move(args_.back());
+        CheckOperand(*lhs);
+        CheckOperand(*rhs);
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -238,6 +752,60 @@ namespace ASTImpl {
         args_.back() = std::move(node);
     }
 
+    void ParseASTListener::exitComparison(FormulaParser::ComparisonContext* ctx) {
+        assert(args_.size() >= 2);
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+        auto lhs = std::move(args_.back());
+        CheckOperand(*lhs);
+        CheckOperand(*rhs);
+        ComparisonExpr::Type type;
+        if (ctx->LT()) {
+            type = ComparisonExpr::Less;
+        } else if (ctx->LE()) {
+            type = ComparisonExpr::LessEqual;
+        } else if (ctx->GT()) {
+            type = ComparisonExpr::Greater;
+        } else if (ctx->GE()) {
+            type = ComparisonExpr::GreaterEqual;
+        } else if (ctx->EQ()) {
+            type = ComparisonExpr::Equal;
+        } else {
+            assert(ctx->NE() != nullptr);
+            type = ComparisonExpr::NotEqual;
+        }
+        args_.back() = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+    }
+
+    void ParseASTListener::exitCall(FormulaParser::CallContext* ctx) {
+        const size_t count = ctx->expr().size();
+        assert(args_.size() >= count);
+        std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - count)
+            , std::make_move_iterator(args_.end()));
+        args_.resize(args_.size() - count);
+        args_.push_back(std::make_unique<CallExpr>(ctx->FUNCTION()->getSymbol()->getText(), std::move(args)));
+    }
+
+    void ParseASTListener::exitRange(FormulaParser::RangeContext* ctx) {
+        const std::string first_str = ctx->CELL(0)->getSymbol()->getText();
+        const std::string last_str = ctx->CELL(1)->getSymbol()->getText();
+        const Position first = Position::FromString(first_str);
+        const Position last = Position::FromString(last_str);
+        if (!first.IsValid() || !last.IsValid()) {
+            throw FormulaException("Invalid range: " + first_str + ":" + last_str);
+        }
+        // written in any corner order, kept as top left and bottom right
+        ranges_.push_front({ { std::min(first.row, last.row), std::min(first.col, last.col) }
+            , { std::max(first.row, last.row), std::max(first.col, last.col) } });
+        args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+    }
+
+    void ParseASTListener::exitDeletedReference(FormulaParser::DeletedReferenceContext* ctx) {
+        // a cell, or a range if the function takes one there, see CallExpr
+        cells_.push_front(Position::NONE);
+        args_.push_back(std::make_unique<CellExpr>(&cells_.front()));
+    }
+
     void ParseASTListener::visitErrorNode(antlr4::tree::ErrorNode* node) {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
@@ -254,10 +822,103 @@ namespace ASTImpl {
 
 }  // namespace ASTImpl
 
+void CheckFormulaNesting(std::string_view expression) {
+    // A unary operator applies to the next operand, so it stays open until that ends:
+    // after a literal or a reference, or at the parenthesis closing the one it opened
+    size_t nesting = 0;
+    size_t operators = 0;
+    size_t unary = 0;                   // open at the current level of parentheses
+    std::vector<size_t> outer_unary;    // of the levels around it
+    bool operand_expected = true;
+
+    const auto end_operand = [&] {
+        nesting -= unary;
+        unary = 0;
+        operand_expected = false;
+    };
+    const auto is_name = [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    };
+
+    for (size_t i = 0; i < expression.size();) {
+        const char c = expression[i];
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            ++i;
+        } else if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            // the sign of an exponent is not an operator
+            while (i < expression.size() && (std::isdigit(static_cast<unsigned char>(expression[i])) || expression[i] == '.')) {
+                ++i;
+            }
+            if (i < expression.size() && (expression[i] == 'e' || expression[i] == 'E')) {
+                ++i;
+                if (i < expression.size() && (expression[i] == '+' || expression[i] == '-')) {
+                    ++i;
+                }
+                while (i < expression.size() && std::isdigit(static_cast<unsigned char>(expression[i]))) {
+                    ++i;
+                }
+            }
+            end_operand();
+        } else if (is_name(c) || c == '#' || c == '!') {
+            // a reference, or the name of a function whose call ends at its parenthesis
+            while (i < expression.size() && (is_name(expression[i]) || expression[i] == '#' || expression[i] == '!' || expression[i] == ':')) {
+                ++i;
+            }
+            size_t next = i;
+            while (next < expression.size() && std::isspace(static_cast<unsigned char>(expression[next]))) {
+                ++next;
+            }
+            if (next == expression.size() || expression[next] != '(') {
+                end_operand();
+            }
+        } else if (c == '(') {
+            ++i;
+            ++operators;
+            ++nesting;
+            outer_unary.push_back(unary);
+            unary = 0;
+            operand_expected = true;
+        } else if (c == ')') {
+            ++i;
+            if (outer_unary.empty()) {
+                return;
+            }
+            nesting -= 1 + unary;
+            unary = outer_unary.back();
+            outer_unary.pop_back();
+            end_operand();
+        } else if (c == ',') {
+            ++i;
+            nesting -= unary;
+            unary = 0;
+            operand_expected = true;
+        } else {
+            // <=, >= and <> are one operator
+            ++i;
+            if ((c == '<' || c == '>') && i < expression.size() && (expression[i] == '=' || expression[i] == '>')) {
+                ++i;
+            }
+            ++operators;
+            if (operand_expected && (c == '+' || c == '-')) {
+                ++unary;
+                ++nesting;
+            }
+            operand_expected = true;
+        }
+        if (nesting > MAX_FORMULA_NESTING) {
+            throw FormulaException("Formula nested too deeply");
+        }
+        if (operators > MAX_FORMULA_OPERATORS) {
+            throw FormulaException("Formula has too many operators");
+        }
+    }
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) try {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
+    CheckFormulaNesting(input.toString());
 
     FormulaLexer lexer(&input);
     ASTImpl::BailErrorListener error_listener;
@@ -274,7 +935,9 @@ FormulaAST ParseFormulaAST(std::istream& in) try {
     tree::ParseTree* tree = parser.main();
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveExternalCells(), listener.MoveRanges());
+} catch (const FormulaException&) {
+    throw;
 } catch (...) {
     throw FormulaException("");
 }
@@ -285,8 +948,9 @@ FormulaAST ParseFormulaAST(const std::string& in_str) {
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
+    char buffer[Position::MAX_STRING_LENGTH];
     for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+        out.write(buffer, cell.ToChars(buffer, buffer + Position::MAX_STRING_LENGTH).ptr - buffer) << ' ';
     }
 }
 
@@ -298,14 +962,109 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const std::function<double(Position)>& get_cell_value) const {
-    return root_expr_->Evaluate(std::ref(get_cell_value));
+void FormulaAST::BindCells(const ASTImpl::CellResolver& resolve) {
+    for (ASTImpl::Instruction& instruction : program_) {
+        if (instruction.op == ASTImpl::Instruction::Op::Cell) {
+            instruction.handle = instruction.cell->IsValid() ? resolve(instruction.sheet, *instruction.cell) : nullptr;
+        }
+    }
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+namespace {
+    // A corner of a range whose row or column was deleted moves inwards to the nearest
+    // cell left; an edit moves either rows or columns, so one of the walks finds it
+    Position RemapCorner(Position corner, Position opposite, const std::function<Position(Position)>& remap) {
+        if (const Position moved = remap(corner); moved.IsValid()) {
+            return moved;
+        }
+        const int row_step = opposite.row < corner.row ? -1 : 1;
+        for (Position pos = corner; pos.row != opposite.row;) {
+            pos.row += row_step;
+            if (const Position moved = remap(pos); moved.IsValid()) {
+                return moved;
+            }
+        }
+        const int col_step = opposite.col < corner.col ? -1 : 1;
+        for (Position pos = corner; pos.col != opposite.col;) {
+            pos.col += col_step;
+            if (const Position moved = remap(pos); moved.IsValid()) {
+                return moved;
+            }
+        }
+        return Position::NONE;
+    }
+}  // namespace
+
+void FormulaAST::RewriteCells(const std::function<Position(Position)>& remap) {
+    for (Position& cell : cells_) {
+        cell = remap(cell);
+    }
+    cells_.sort();  // nodes keep their addresses, so CellExpr pointers stay valid
+    for (CellRange& range : ranges_) {
+        if (!range.first.IsValid()) {
+            continue;
+        }
+        const Position first = RemapCorner(range.first, range.last, remap);
+        const Position last = RemapCorner(range.last, range.first, remap);
+        range = first.IsValid() && last.IsValid() ? CellRange{ first, last } : CellRange{ Position::NONE, Position::NONE };
+    }
+}
+
+void FormulaAST::RewriteExternalCells(std::string_view sheet, const std::function<Position(Position)>& remap) {
+    for (ExternalCell& cell : external_cells_) {
+        if (cell.sheet == sheet) {
+            cell.pos = remap(cell.pos);
+        }
+    }
+    external_cells_.sort();
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, CellList cells
+    , ExternalCellList external_cells, RangeList ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , external_cells_(std::move(external_cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    external_cells_.sort();
+
+    root_expr_->Optimize()->Compile(program_);
+    program_.shrink_to_fit();
+    // Depths summed in program order: a branch jumped over leaves one value or none,
+    // so no path through the program goes deeper
+    size_t depth = 0;
+    size_t tries = 0;
+    for (const ASTImpl::Instruction& instruction : program_) {
+        switch (instruction.op) {
+        case ASTImpl::Instruction::Op::Number:
+        case ASTImpl::Instruction::Op::Cell:
+            stack_depth_ = std::max(stack_depth_, ++depth);
+            break;
+        case ASTImpl::Instruction::Op::Negate:
+        case ASTImpl::Instruction::Op::Found:
+        case ASTImpl::Instruction::Op::JumpIfNotFound:
+        case ASTImpl::Instruction::Op::FoldRange:
+            break;
+        case ASTImpl::Instruction::Op::Match:
+            conditional_ = true;
+            --depth;
+            break;
+        case ASTImpl::Instruction::Op::Jump:
+            conditional_ = true;
+            break;
+        case ASTImpl::Instruction::Op::Try:
+            conditional_ = true;
+            try_depth_ = std::max(try_depth_, ++tries);
+            break;
+        case ASTImpl::Instruction::Op::EndTry:
+            --tries;
+            break;
+        default:
+            // binary operations and conditional jumps
+            --depth;
+            break;
+        }
+    }
 }
 
 FormulaAST::~FormulaAST() = default;
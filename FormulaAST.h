@@ -1,19 +1,72 @@
 #pragma once
 
 
+#include <cassert>
+#include <cmath>
 #include <forward_list>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <tuple>
+#include <vector>
 
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 #include "common.h"
+#include "memory.h"
+
+// reference qualified with a sheet name, as in Sheet2!A1
+struct ExternalCell {
+    std::string sheet;
+    Position pos;
+
+    bool operator<(const ExternalCell& rhs) const {
+        return std::tie(sheet, pos.row, pos.col) < std::tie(rhs.sheet, rhs.pos.row, rhs.pos.col);
+    }
+};
+
+// range of the formula's own sheet, as in A1:B10; both corners are Position::NONE once
+// every row or every column of it was deleted
+struct CellRange {
+    Position first;     // top left
+    Position last;      // bottom right
+
+    bool Contains(Position pos) const {
+        return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+    }
+};
+
+// How a lookup picks the matching row among the numbers of a column; the numbers need
+// not be sorted. Empty cells, errors and non-numeric texts match nothing
+enum class MatchSearch : char {
+    Exact,              // the first row equal to the key
+    LastNotGreater,     // the largest number not greater than the key, the last row of equal ones
+    LastNotLess,        // the smallest number not less than the key, the last row of equal ones
+    FirstNotGreater,    // the same, the first row of equal ones
+    FirstNotLess,
+};
+
+// What the aggregates read of a range: its numbers, NaN aside, and its first error.
+// Empty cells and non-numeric texts are skipped
+struct RangeSummary {
+    double sum = 0;             // column by column, each added up pairwise, see AggregateTree
+    double min = 0;             // valid if count is not 0
+    double max = 0;
+    int count = 0;
+    std::optional<FormulaError> error;  // of the first cell holding one, row by row
+};
+
+using CellList = std::forward_list<Position, CountingAllocator<Position, MemoryCategory::FormulaCells>>;
+using ExternalCellList = std::forward_list<ExternalCell, CountingAllocator<ExternalCell, MemoryCategory::FormulaCells>>;
+using RangeList = std::forward_list<CellRange, CountingAllocator<CellRange, MemoryCategory::FormulaCells>>;
 
 namespace ASTImpl {
     class Expr;
 
     enum ExprPrecedence {
+        EP_CMP,
         EP_ADD,
         EP_SUB,
         EP_MUL,
@@ -31,25 +84,132 @@ namespace ASTImpl {
     };
 
     constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-        /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
     const double INACCURACY = 10e-6;
 
-    class Expr {
+    // maps a referenced position to the cell object that will stay at it,
+    // sheet is nullptr for a reference to the formula's own sheet
+    using CellResolver = std::function<const CellInterface*(const std::string* sheet, Position)>;
+
+    // One step of the postfix program an optimized tree is compiled to. The program is
+    // run with an explicit operand stack, so evaluation does not recurse on the tree.
+    // Conditionals jump over the instructions of the branches not taken
+    struct Instruction {
+        enum class Op : char {
+            Number,
+            Cell,
+            Negate,
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            Less,
+            LessEqual,
+            Greater,
+            GreaterEqual,
+            Equal,
+            NotEqual,
+            Jump,
+            JumpIfZero,         // pops the condition
+            JumpIfNonZero,
+            Try,                // an error up to the matching EndTry resumes at target
+            EndTry,             // and jumps to target
+            Match,              // pops the mode and the key, pushes the offset of the matching row or -1
+            JumpIfNotFound,     // pops the offset and jumps if it is -1
+            Found,              // the offset as a 1-based position, #N/A for -1
+            Fetch,              // pops the 1-based column and the offset, pushes that cell of the range
+            Fold,               // pops a value into the accumulator below it: the total and the count
+            FoldRange,          // folds the numbers of the range into the accumulator
+            Total,              // pops the count, leaves the result of the aggregate
+        };
+        // how Match reads its mode operand: as the function it was compiled from
+        enum class Mode : char {
+            Match,              // 1 or more, 0, -1 or less
+            VLookup,            // true for approximate
+            XLookup,            // 0, -1 or 1
+        };
+        // what Fold, FoldRange and Total accumulate
+        enum class Aggregate : char {
+            Sum,
+            Count,
+            Min,
+            Max,
+            Average,
+        };
+
+        Op op;
+        Mode mode = Mode::Match;
+        Aggregate aggregate = Aggregate::Sum;
+        union {
+            double number;                          // for Number
+            const Position* cell;                   // for Cell, the reference of the formula
+            const CellRange* range;                 // for Match, Fetch and FoldRange
+            size_t target;                          // for jumps, index of the next instruction
+        };
+        const std::string* sheet = nullptr;         // nullptr for the formula's own sheet
+        const CellInterface* handle = nullptr;      // set at link time, see BindCells
+
+        explicit Instruction(Op op) : op(op), number(0) { }
+    };
+    using Program = std::vector<Instruction, CountingAllocator<Instruction, MemoryCategory::AstNodes>>;
+
+    // scratch array of `size` elements, on the native stack up to N of them
+    template <typename T, size_t N>
+    class ScratchBuffer {
+    private:        // fields
+        T inline_[N];
+        std::unique_ptr<T[]> heap_;
+        T* data_ = inline_;
+
     public:         // constructors
+        explicit ScratchBuffer(size_t size) {
+            if (size > N) {
+                heap_ = std::make_unique<T[]>(size);
+                data_ = heap_.get();
+            }
+        }
+
+    public:         // methods
+        T& operator[](size_t i) { return data_[i]; }
+    };
+
+    class Expr : public CountedNew<MemoryCategory::AstNodes> {
+    public:         // fields
+        enum class Kind : char {
+            BinaryOp,
+            UnaryOp,
+            Comparison,
+            Call,
+            Range,
+            Cell,
+            Number,
+        };
+
+    private:        // fields
+        const Kind kind_;
+
+    public:         // constructors
+        explicit Expr(Kind kind) : kind_(kind) { }
         virtual ~Expr() = default;
 
     public:         // methods
         virtual void Print(std::ostream& out) const = 0;
         virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const std::function<double(Position)>& get_cell_value) const = 0;
         virtual ExprPrecedence GetPrecedence() const = 0;
+        Kind GetKind() const { return kind_; }
+
+        // appends the postfix instructions computing this subtree
+        virtual void Compile(Program& program) const = 0;
+        // returns an equivalent tree with constant subtrees folded, the original tree is kept for printing
+        virtual std::unique_ptr<Expr> Optimize() const = 0;
         void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, bool right_child) const;
     };
 
@@ -74,7 +234,10 @@ namespace ASTImpl {
         void Print(std::ostream& out) const override;
         void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override;
         ExprPrecedence GetPrecedence() const;
-        double Evaluate(const std::function<double(Position)>& get_cell_value) const override;
+        std::unique_ptr<Expr> Optimize() const override;
+        void Compile(Program& program) const override;
+
+        static double Apply(Type type, double lhs, double rhs);
     };
 
     class UnaryOpExpr final : public Expr {
@@ -95,21 +258,121 @@ namespace ASTImpl {
         void Print(std::ostream& out) const override;
         void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override;
         ExprPrecedence GetPrecedence() const override;
-        double Evaluate(const std::function<double(Position)>& get_cell_value) const override;
+        std::unique_ptr<Expr> Optimize() const override;
+        void Compile(Program& program) const override;
+    };
+
+    // results 1 for true and 0 for false, like every logical value
+    class ComparisonExpr final : public Expr {
+    public:         // fields
+        enum Type : char {
+            Less,
+            LessEqual,
+            Greater,
+            GreaterEqual,
+            Equal,
+            NotEqual,
+        };
+
+    private:        // fields
+        Type type_;
+        std::unique_ptr<Expr> lhs_;
+        std::unique_ptr<Expr> rhs_;
+
+    public:         // constructors
+        explicit ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs);
+
+    public:         // methods
+        void Print(std::ostream& out) const override;
+        void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override;
+        ExprPrecedence GetPrecedence() const override;
+        std::unique_ptr<Expr> Optimize() const override;
+        void Compile(Program& program) const override;
+
+        static double Apply(Type type, double lhs, double rhs);
+        static const char* ToString(Type type);
+    };
+
+    // Functions evaluating only the arguments they need: any non-zero number is true.
+    // The lookups read the ranges through the per-column indexes of the sheet, a value
+    // not found is #N/A. The aggregates take ranges and operands in any order, the first
+    // error of a range is theirs (but for COUNT)
+    class CallExpr final : public Expr {
+    public:         // fields
+        enum class Function : char {
+            If,         // IF(condition, then[, else]), else defaults to 0
+            And,        // AND(value, ...), stops at the first false one
+            Or,         // OR(value, ...), stops at the first true one
+            IfError,    // IFERROR(value, fallback), the fallback replaces any error
+            VLookup,    // VLOOKUP(key, table, column[, approximate]), approximate by default
+            Match,      // MATCH(key, column[, mode]): 1 by default for LastNotGreater, 0, -1
+            XLookup,    // XLOOKUP(key, column, column[, if_not_found[, mode]]): 0 by default, -1, 1
+            Sum,        // SUM(value or range, ...), #DIV/0! for an overflow as +
+            Count,      // COUNT(value or range, ...), the numbers of the ranges, errors skipped
+            Min,        // MIN(value or range, ...), 0 without numbers
+            Max,
+            Average,    // AVERAGE(value or range, ...), #DIV/0! without numbers
+        };
+
+    private:        // fields
+        Function function_;
+        std::vector<std::unique_ptr<Expr>> args_;
+
+    public:         // constructors
+        // throws FormulaException for an unknown function or a wrong number of arguments
+        explicit CallExpr(const std::string& name, std::vector<std::unique_ptr<Expr>> args);
+        explicit CallExpr(Function function, std::vector<std::unique_ptr<Expr>> args);
+
+    public:         // methods
+        void Print(std::ostream& out) const override;
+        void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override;
+        ExprPrecedence GetPrecedence() const override;
+        std::unique_ptr<Expr> Optimize() const override;
+        void Compile(Program& program) const override;
+
+        static const char* ToString(Function function);
+
+    private:        // methods
+        // the key and the mode, Match, then what the function makes of the matching row
+        void CompileLookup(Program& program) const;
+        // an accumulator, each argument folded into it, then the Total
+        void CompileAggregate(Program& program) const;
+    };
+
+    // only an argument of a lookup or an aggregate, never evaluated on its own
+    class RangeExpr final : public Expr {
+    private:        // fields
+        const CellRange* range_;
+
+    public:         // constructors
+        explicit RangeExpr(const CellRange* range);
+
+    public:         // methods
+        void Print(std::ostream& out) const override;
+        void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override;
+        ExprPrecedence GetPrecedence() const override;
+        std::unique_ptr<Expr> Optimize() const override;
+        void Compile(Program& program) const override;
+
+        const CellRange& GetRange() const { return *range_; }
     };
 
     class CellExpr final : public Expr {
     private:        // fields
         const Position* cell_;
+        const std::string* sheet_;                  // nullptr for the formula's own sheet
 
     public:         // constructors
-        explicit CellExpr(const Position* cell);
+        explicit CellExpr(const Position* cell, const std::string* sheet = nullptr);
 
     public:         // methods
         void Print(std::ostream& out) const override;
         void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override;
         ExprPrecedence GetPrecedence() const override;
-        double Evaluate(const std::function<double(Position)>& get_cell_value) const override;
+        std::unique_ptr<Expr> Optimize() const override;
+        void Compile(Program& program) const override;
+
+        const Position& GetPosition() const { return *cell_; }
     };
 
     class NumberExpr final : public Expr {
@@ -123,22 +386,34 @@ namespace ASTImpl {
         void Print(std::ostream& out) const override;
         void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override;
         ExprPrecedence GetPrecedence() const override;
-        double Evaluate(const std::function<double(Position)>&) const override;
+        std::unique_ptr<Expr> Optimize() const override;
+        void Compile(Program& program) const override;
+
+        double GetValue() const { return value_; }
     };
 
     class ParseASTListener final : public FormulaBaseListener {
     private:        // fields
         std::vector<std::unique_ptr<Expr>> args_;
-        std::forward_list<Position> cells_;
+        CellList cells_;
+        ExternalCellList external_cells_;
+        RangeList ranges_;
 
     public:         // methods
         std::unique_ptr<Expr> MoveRoot();
-        std::forward_list<Position> MoveCells();
+        CellList MoveCells();
+        ExternalCellList MoveExternalCells();
+        RangeList MoveRanges();
 
         void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override;
         void exitLiteral(FormulaParser::LiteralContext* ctx) override;
         void exitCell(FormulaParser::CellContext* ctx) override;
+        void exitSheetCell(FormulaParser::SheetCellContext* ctx) override;
         void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override;
+        void exitComparison(FormulaParser::ComparisonContext* ctx) override;
+        void exitCall(FormulaParser::CallContext* ctx) override;
+        void exitRange(FormulaParser::RangeContext* ctx) override;
+        void exitDeletedReference(FormulaParser::DeletedReferenceContext* ctx) override;
         void visitErrorNode(antlr4::tree::ErrorNode* node) override;
     };
 
@@ -152,6 +427,76 @@ namespace ASTImpl {
             , const std::string& msg,
             std::exception_ptr e) override;
     };
+
+    inline double BinaryOpExpr::Apply(Type type, double lhs, double rhs) {
+        double result = 0;
+        switch (type) {
+        case Add:
+            result = lhs + rhs;
+            break;
+        case Subtract:
+            result = lhs - rhs;
+            break;
+        case Multiply:
+            result = lhs * rhs;
+            break;
+        case Divide:
+            if (std::abs(rhs) < INACCURACY) {
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            result = lhs / rhs;
+            break;
+        default:
+            assert(false);
+            return 0;
+        }
+        // overflow (and inf/nan coming from operands) is detected on the result
+        if (!std::isfinite(result)) {
+            throw FormulaError(FormulaError::Category::Div0);
+        }
+        return result;
+    }
+
+    inline double ComparisonExpr::Apply(Type type, double lhs, double rhs) {
+        switch (type) {
+        case Less:
+            return lhs < rhs;
+        case LessEqual:
+            return lhs <= rhs;
+        case Greater:
+            return lhs > rhs;
+        case GreaterEqual:
+            return lhs >= rhs;
+        case Equal:
+            return lhs == rhs;
+        case NotEqual:
+            return lhs != rhs;
+        }
+        assert(false);
+        return 0;
+    }
+
+    // throws #VALUE! for a mode the function does not have
+    inline MatchSearch ToMatchSearch(Instruction::Mode mode, double value) {
+        switch (mode) {
+        case Instruction::Mode::Match:
+            return value > 0 ? MatchSearch::LastNotGreater : value < 0 ? MatchSearch::LastNotLess : MatchSearch::Exact;
+        case Instruction::Mode::VLookup:
+            return value != 0 ? MatchSearch::LastNotGreater : MatchSearch::Exact;
+        case Instruction::Mode::XLookup:
+            if (value == 0) {
+                return MatchSearch::Exact;
+            }
+            if (value == -1) {
+                return MatchSearch::FirstNotGreater;
+            }
+            if (value == 1) {
+                return MatchSearch::FirstNotLess;
+            }
+            break;
+        }
+        throw FormulaError(FormulaError::Category::Value);
+    }
 }       // namespace ASTImpl 
 
 class ParsingError : public std::runtime_error {
@@ -160,24 +505,279 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 private:        // fields 
+    // operands of a program up to this depth stay on the native stack
+    static constexpr size_t INLINE_STACK_DEPTH = 32;
+    static constexpr size_t INLINE_TRY_DEPTH = 4;
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    ASTImpl::Program program_;      // of the optimized root_expr_, shares cells_ and ranges_
+    size_t stack_depth_ = 0;        // operands the program needs at most
+    size_t try_depth_ = 0;          // nested IFERROR
+    bool conditional_ = false;
+    CellList cells_;
+    ExternalCellList external_cells_;
+    RangeList ranges_;
 
 public:         // constructors 
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells);
+    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, CellList cells
+        , ExternalCellList external_cells = {}, RangeList ranges = {});
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
 public:         // methods 
-    double Execute(const std::function<double(Position)>& get_cell_value) const;
+    // CellValueGetter is double(Position, const CellInterface* handle, const std::string* sheet),
+    // handle is nullptr until BindCells was called, sheet is nullptr for a reference to the
+    // formula's own sheet; ColumnFinder is std::optional<int>(const CellRange&, double key,
+    // MatchSearch), the row matching the key in the first column of the range;
+    // RangeAggregator is RangeSummary(const CellRange&)
+    template <typename CellValueGetter, typename ColumnFinder, typename RangeAggregator>
+    double Execute(const CellValueGetter& get_cell_value, const ColumnFinder& find_in_column
+        , const RangeAggregator& aggregate_range) const {
+        using ASTImpl::BinaryOpExpr;
+        using ASTImpl::ComparisonExpr;
+        using Op = ASTImpl::Instruction::Op;
+
+        struct Handler {
+            size_t target;      // the fallback
+            size_t top;         // operands below the failed value
+        };
+        ASTImpl::ScratchBuffer<double, INLINE_STACK_DEPTH> stack(stack_depth_);
+        ASTImpl::ScratchBuffer<Handler, INLINE_TRY_DEPTH> handlers(try_depth_);
+        size_t top = 0;         // stack[top - 1] is the last operand
+        size_t tries = 0;       // handlers[tries - 1] is the innermost one
+        const auto apply = [&stack, &top](BinaryOpExpr::Type type) {
+            --top;
+            stack[top - 1] = BinaryOpExpr::Apply(type, stack[top - 1], stack[top]);
+        };
+        const auto compare = [&stack, &top](ComparisonExpr::Type type) {
+            --top;
+            stack[top - 1] = ComparisonExpr::Apply(type, stack[top - 1], stack[top]);
+        };
+        // into the accumulator on top, the count above the total
+        const auto fold = [&stack, &top](ASTImpl::Instruction::Aggregate aggregate, const RangeSummary& part) {
+            using Aggregate = ASTImpl::Instruction::Aggregate;
+            double& total = stack[top - 2];
+            double& count = stack[top - 1];
+            if (aggregate == Aggregate::Sum || aggregate == Aggregate::Average) {
+                total += part.sum;
+            } else if (aggregate == Aggregate::Min && part.count > 0) {
+                total = count == 0 || part.min < total ? part.min : total;
+            } else if (aggregate == Aggregate::Max && part.count > 0) {
+                total = count == 0 || part.max > total ? part.max : total;
+            }
+            count += part.count;
+        };
+
+        size_t pc = 0;
+        for (;;) {
+            try {
+                while (pc < program_.size()) {
+                    const ASTImpl::Instruction& instruction = program_[pc++];
+                    switch (instruction.op) {
+                    case Op::Number:
+                        stack[top++] = instruction.number;
+                        break;
+                    case Op::Cell:
+                        if (instruction.sheet && !instruction.handle) {
+                            // the sheet is missing or unloaded
+                            throw FormulaError(FormulaError::Category::Ref);
+                        }
+                        stack[top++] = get_cell_value(*instruction.cell, instruction.handle, instruction.sheet);
+                        break;
+                    case Op::Negate:
+                        stack[top - 1] = -stack[top - 1];
+                        break;
+                    case Op::Add:
+                        apply(BinaryOpExpr::Add);
+                        break;
+                    case Op::Subtract:
+                        apply(BinaryOpExpr::Subtract);
+                        break;
+                    case Op::Multiply:
+                        apply(BinaryOpExpr::Multiply);
+                        break;
+                    case Op::Divide:
+                        apply(BinaryOpExpr::Divide);
+                        break;
+                    case Op::Less:
+                        compare(ComparisonExpr::Less);
+                        break;
+                    case Op::LessEqual:
+                        compare(ComparisonExpr::LessEqual);
+                        break;
+                    case Op::Greater:
+                        compare(ComparisonExpr::Greater);
+                        break;
+                    case Op::GreaterEqual:
+                        compare(ComparisonExpr::GreaterEqual);
+                        break;
+                    case Op::Equal:
+                        compare(ComparisonExpr::Equal);
+                        break;
+                    case Op::NotEqual:
+                        compare(ComparisonExpr::NotEqual);
+                        break;
+                    case Op::Jump:
+                        pc = instruction.target;
+                        break;
+                    case Op::JumpIfZero:
+                        if (stack[--top] == 0) {
+                            pc = instruction.target;
+                        }
+                        break;
+                    case Op::JumpIfNonZero:
+                        if (stack[--top] != 0) {
+                            pc = instruction.target;
+                        }
+                        break;
+                    case Op::Try:
+                        handlers[tries++] = { instruction.target, top };
+                        break;
+                    case Op::EndTry:
+                        --tries;
+                        pc = instruction.target;
+                        break;
+                    case Op::Match: {
+                        const CellRange& range = *instruction.range;
+                        --top;
+                        const MatchSearch search = ASTImpl::ToMatchSearch(instruction.mode, stack[top]);
+                        if (!range.first.IsValid()) {
+                            throw FormulaError(FormulaError::Category::Ref);
+                        }
+                        const std::optional<int> row = find_in_column(range, stack[top - 1], search);
+                        stack[top - 1] = row ? *row - range.first.row : -1;
+                        break;
+                    }
+                    case Op::JumpIfNotFound:
+                        if (stack[top - 1] < 0) {
+                            --top;
+                            pc = instruction.target;
+                        }
+                        break;
+                    case Op::Found:
+                        if (stack[top - 1] < 0) {
+                            throw FormulaError(FormulaError::Category::NA);
+                        }
+                        stack[top - 1] += 1;
+                        break;
+                    case Op::Fetch: {
+                        const CellRange& range = *instruction.range;
+                        --top;
+                        const double column = stack[top];
+                        const double offset = stack[top - 1];
+                        if (!range.first.IsValid()) {
+                            throw FormulaError(FormulaError::Category::Ref);
+                        }
+                        if (offset < 0) {
+                            throw FormulaError(FormulaError::Category::NA);
+                        }
+                        if (!(column >= 1)) {
+                            throw FormulaError(FormulaError::Category::Value);
+                        }
+                        if (column >= range.last.col - range.first.col + 2) {
+                            throw FormulaError(FormulaError::Category::Ref);
+                        }
+                        // a fractional column is truncated
+                        const Position pos{ range.first.row + static_cast<int>(offset)
+                            , range.first.col + static_cast<int>(column) - 1 };
+                        if (pos.row > range.last.row) {
+                            // the returned range is shorter than the one searched
+                            throw FormulaError(FormulaError::Category::Ref);
+                        }
+                        stack[top - 1] = get_cell_value(pos, nullptr, nullptr);
+                        break;
+                    }
+                    case Op::Fold: {
+                        const double value = stack[--top];
+                        fold(instruction.aggregate, std::isnan(value) ? RangeSummary{} : RangeSummary{ value, value, value, 1, std::nullopt });
+                        break;
+                    }
+                    case Op::FoldRange: {
+                        if (!instruction.range->first.IsValid()) {
+                            throw FormulaError(FormulaError::Category::Ref);
+                        }
+                        const RangeSummary summary = aggregate_range(*instruction.range);
+                        if (summary.error && instruction.aggregate != ASTImpl::Instruction::Aggregate::Count) {
+                            throw *summary.error;
+                        }
+                        fold(instruction.aggregate, summary);
+                        break;
+                    }
+                    case Op::Total: {
+                        using Aggregate = ASTImpl::Instruction::Aggregate;
+                        const double count = stack[--top];
+                        double& result = stack[top - 1];
+                        switch (instruction.aggregate) {
+                        case Aggregate::Count:
+                            result = count;
+                            break;
+                        case Aggregate::Min:
+                        case Aggregate::Max:
+                            result = count == 0 ? 0 : result;
+                            break;
+                        case Aggregate::Average:
+                            if (count == 0) {
+                                throw FormulaError(FormulaError::Category::Div0);
+                            }
+                            result /= count;
+                            [[fallthrough]];
+                        case Aggregate::Sum:
+                            // as an overflow of the operators
+                            if (!std::isfinite(result)) {
+                                throw FormulaError(FormulaError::Category::Div0);
+                            }
+                            break;
+                        }
+                        break;
+                    }
+                    }
+                }
+                break;
+            }
+            catch (const FormulaError&) {
+                if (tries == 0) {
+                    throw;
+                }
+                const Handler& handler = handlers[--tries];
+                top = handler.top;
+                pc = handler.target;
+            }
+        }
+        assert(top == 1);
+        return stack[0];
+    }
+    // true if some references are read or not depending on values, see CallExpr;
+    // a lookup reads the cells of its ranges it needs
+    bool IsConditional() const { return conditional_; }
+    void BindCells(const ASTImpl::CellResolver& resolve);
+    // moves every reference to remap(position) in place, Position::NONE makes it #REF!;
+    // a range keeps its cells left and becomes #REF! once none is
+    void RewriteCells(const std::function<Position(Position)>& remap);
+    // the same for references qualified with the given sheet name
+    void RewriteExternalCells(std::string_view sheet, const std::function<Position(Position)>& remap);
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
     
-    std::forward_list<Position>& GetCells() { return cells_; }
-    const std::forward_list<Position>& GetCells() const { return cells_; }
+    // the compiled program and the operands it needs, for ColumnKernel
+    const ASTImpl::Program& GetProgram() const { return program_; }
+    size_t GetStackDepth() const { return stack_depth_; }
+    CellList& GetCells() { return cells_; }
+    const CellList& GetCells() const { return cells_; }
+    const ExternalCellList& GetExternalCells() const { return external_cells_; }
+    const RangeList& GetRanges() const { return ranges_; }
 };
 
+// ParseFormulaAST rejects formulas nested deeper than these, since the parser, the walk
+// over its tree and the passes over the AST recurse once per level: parentheses, calls
+// and unary operators open at once, and operators and parentheses in all
+inline constexpr size_t MAX_FORMULA_NESTING = 256;
+inline constexpr size_t MAX_FORMULA_OPERATORS = 4096;
+
+// Throws FormulaException if the expression goes past the limits above; a malformed one
+// is left to the parser
+void CheckFormulaNesting(std::string_view expression);
+
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
@@ -0,0 +1,946 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "data_table.h"
+#include "edit_log.h"
+#include "fork.h"
+#include "formula.h"
+#include "log_duration.h"
+#include "memory.h"
+#include "number_format.h"
+#include "sheet.h"
+
+namespace {
+    void BenchmarkDivisionChain() {
+        const int chain_length = 30;
+        const int repeats = 100000;
+
+        auto sheet = CreateSheet();
+        std::string formula = "="s;
+        for (int i = 0; i < chain_length; ++i) {
+            sheet->SetCell(Position{ i, 0 }, "1");
+            formula += (i ? "/A"s : "A"s) + std::to_string(i + 1);
+        }
+        sheet->SetCell(Position{ 0, 1 }, formula);
+        sheet->SetCell(Position{ 1, 1 }, "=B1");
+
+        double sink = 0;
+        {
+            LOG_DURATION("division chain A1/.../A30, x"s + std::to_string(repeats));
+            for (int i = 0; i < repeats; ++i) {
+                // re-setting a chain cell invalidates the cached B1 value
+                sheet->SetCell(Position{ 0, 0 }, (i % 2) ? "1" : "2");
+                sink += std::get<double>(sheet->GetCell(Position{ 1, 1 })->GetValue());
+            }
+        }
+        std::cerr << "  checksum " << sink << std::endl;
+    }
+
+    // recomputing a long chain of cells, each reading the next one
+    void BenchmarkDependencyChain() {
+        const int length = 5000;
+        const int repeats = 200;
+
+        auto sheet = CreateSheet();
+        for (int i = 0; i + 1 < length; ++i) {
+            sheet->SetCell(Position{ i, 0 }, "=A"s + std::to_string(i + 2) + "+1"s);
+        }
+        double sink = 0;
+        {
+            LOG_DURATION("chain of "s + std::to_string(length) + " cells, x"s + std::to_string(repeats));
+            for (int i = 0; i < repeats; ++i) {
+                sheet->SetCell(Position{ length - 1, 0 }, std::to_string(i));
+                sink += std::get<double>(sheet->GetCell(Position{ 0, 0 })->GetValue());
+            }
+        }
+        std::cerr << "  checksum " << sink << std::endl;
+    }
+
+    void BenchmarkConstantFolding() {
+        const int repeats = 1000000;
+
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{ 0, 0 }, "7");
+        const auto evaluate = [&](const std::string& id, const std::string& expression) {
+            auto formula = ParseFormula(expression);
+            double sink = 0;
+            {
+                LOG_DURATION(id + " x"s + std::to_string(repeats));
+                for (int i = 0; i < repeats; ++i) {
+                    sink += std::get<double>(formula->Evaluate(*sheet));
+                }
+            }
+            std::cerr << "  checksum " << sink << std::endl;
+        };
+
+        // the folded form is what the optimizer should reduce the first one to
+        evaluate("constant-heavy (1+2)*(4-1)*A1/8+-(-(2*3))"s, "(1+2)*(4-1)*A1/8+-(-(2*3))"s);
+        evaluate("hand-folded 9*A1*0.125+6"s, "9*A1*0.125+6"s);
+    }
+
+    void BenchmarkNumericTextOperands() {
+        const int operand_count = 20;
+        const int repeats = 200000;
+
+        Sheet sheet;
+        std::string expression;
+        for (int i = 0; i < operand_count; ++i) {
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i * 1.25));
+            expression += (i ? "+A"s : "A"s) + std::to_string(i + 1);
+        }
+        auto formula = ParseFormula(expression);
+        double sink = 0;
+        {
+            LOG_DURATION("sum of "s + std::to_string(operand_count) + " numeric text cells x"s + std::to_string(repeats));
+            for (int i = 0; i < repeats; ++i) {
+                sink += std::get<double>(formula->Evaluate(sheet));
+            }
+        }
+        std::cerr << "  checksum " << sink << std::endl;
+    }
+
+    // formulas reading a cell only in a branch they do not take keep their values when it changes
+    void BenchmarkUntakenBranchEdits() {
+        const int formulas = 2000;
+        const int repeats = 200;
+
+        auto sheet = CreateSheet();
+        sheet->SetCell(Position{ 0, 0 }, "1");
+        for (int i = 0; i < formulas; ++i) {
+            sheet->SetCell(Position{ i, 3 }, "=IF(A1>0,B1+"s + std::to_string(i) + ",C1+"s + std::to_string(i) + ")"s);
+        }
+        const auto edit = [&](const std::string& id, Position edited) {
+            double sink = 0;
+            {
+                LOG_DURATION(id + ", "s + std::to_string(formulas) + " IFs read, x"s + std::to_string(repeats));
+                for (int i = 0; i < repeats; ++i) {
+                    sheet->SetCell(edited, std::to_string(i));
+                    for (int row = 0; row < formulas; ++row) {
+                        sink += std::get<double>(sheet->GetCell(Position{ row, 3 })->GetValue());
+                    }
+                }
+            }
+            std::cerr << "  checksum " << sink << std::endl;
+        };
+
+        edit("edit of the taken branch B1"s, Position{ 0, 1 });
+        edit("edit of the untaken branch C1"s, Position{ 0, 2 });
+    }
+
+    // a sheet seen only through SheetInterface, whose lookups and aggregates scan their ranges
+    class UnindexedSheet : public SheetInterface {
+    private:        // fields
+        SheetInterface& sheet_;
+
+    public:         // constructors
+        explicit UnindexedSheet(SheetInterface& sheet) : sheet_(sheet) { }
+
+    public:         // methods
+        void SetCell(Position pos, std::string text) override { sheet_.SetCell(pos, std::move(text)); }
+        const CellInterface* GetCell(Position pos) const override { return std::as_const(sheet_).GetCell(pos); }
+        CellInterface* GetCell(Position pos) override { return sheet_.GetCell(pos); }
+        void ClearCell(Position pos) override { sheet_.ClearCell(pos); }
+        Size GetPrintableSize() const override { return sheet_.GetPrintableSize(); }
+        void PrintValues(std::ostream& output) const override { sheet_.PrintValues(output); }
+        void PrintTexts(std::ostream& output) const override { sheet_.PrintTexts(output); }
+    };
+
+    void BenchmarkLookups() {
+        const int rows = 10000;
+        const int lookups = 200;
+        const int rounds = 5;
+
+        auto sheet = CreateSheet();
+        for (int row = 0; row < rows; ++row) {
+            sheet->SetCell(Position{ row, 0 }, std::to_string(row * 2));
+            sheet->SetCell(Position{ row, 1 }, std::to_string(row));
+        }
+        // exact searches of present keys and approximate ones between them
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        const std::string table = "A1:B"s + std::to_string(rows);
+        for (int i = 0; i < lookups; ++i) {
+            const int key = i * 7919 % (rows * 2);
+            formulas.push_back(ParseFormula(key % 2 ? "MATCH("s + std::to_string(key) + ",A1:A"s + std::to_string(rows) + ")"s
+                                                    : "VLOOKUP("s + std::to_string(key) + ","s + table + ",2,0)"s));
+        }
+        const auto run = [&](const std::string& id, const SheetInterface& target) {
+            double sink = 0;
+            {
+                LOG_DURATION(id + ", "s + std::to_string(lookups) + " lookups in "s + std::to_string(rows)
+                    + " rows after an edit, x"s + std::to_string(rounds));
+                for (int round = 0; round < rounds; ++round) {
+                    sheet->SetCell(Position{ round, 0 }, std::to_string(round * 2));
+                    for (const auto& formula : formulas) {
+                        const FormulaInterface::Value value = formula->Evaluate(target);
+                        sink += std::holds_alternative<double>(value) ? std::get<double>(value) : -1;
+                    }
+                }
+            }
+            std::cerr << "  checksum " << sink << std::endl;
+        };
+
+        run("column indexes"s, *sheet);
+        run("linear scans"s, UnindexedSheet(*sheet));
+    }
+
+    void BenchmarkAggregates() {
+        const int rows = Position::MAX_ROWS;
+        const int rounds = 20;
+
+        // a full column of numbers and a formula every 16 rows next to it
+        auto sheet = CreateSheet();
+        for (int row = 0; row < rows; ++row) {
+            sheet->SetCell(Position{ row, 0 }, std::to_string(row % 1000) + ".25"s);
+            if (row % 16 == 0) {
+                sheet->SetCell(Position{ row, 1 }, "=A"s + std::to_string(row + 1) + "*2"s);
+            }
+        }
+        std::vector<std::unique_ptr<FormulaInterface>> formulas;
+        const std::string range = "A1:B"s + std::to_string(rows);
+        for (const char* function : { "SUM", "COUNT", "MIN", "MAX", "AVERAGE" }) {
+            formulas.push_back(ParseFormula(function + "("s + range + ")"s));
+        }
+        const auto run = [&](const std::string& id, const SheetInterface& target) {
+            double sink = 0;
+            {
+                LOG_DURATION(id + ", "s + std::to_string(formulas.size()) + " aggregates of "s + std::to_string(rows)
+                    + " rows after an edit, x"s + std::to_string(rounds));
+                for (int round = 0; round < rounds; ++round) {
+                    sheet->SetCell(Position{ 0, 0 }, std::to_string(round));
+                    for (const auto& formula : formulas) {
+                        const FormulaInterface::Value value = formula->Evaluate(target);
+                        sink += std::holds_alternative<double>(value) ? std::get<double>(value) : -1;
+                    }
+                }
+            }
+            std::cerr << "  checksum " << sink << std::endl;
+        };
+
+        run("column trees"s, *sheet);
+        run("linear scans"s, UnindexedSheet(*sheet));
+    }
+
+    void BenchmarkColumnKernels() {
+        const int rows = Position::MAX_ROWS;
+        const int rounds = 20;
+
+        // a filled column =A1*B1+C1*E1 down to the last row, staled as a whole by E1
+        const auto make_sheet = [] {
+            auto sheet = std::make_unique<Sheet>();
+            std::vector<Sheet::CellEdit> edits;
+            for (int row = 0; row < rows; ++row) {
+                const std::string n = std::to_string(row + 1);
+                edits.push_back({ Position{ row, 0 }, std::to_string(row % 1000) + ".5"s });
+                edits.push_back({ Position{ row, 1 }, std::to_string(row % 7 + 1) });
+                edits.push_back({ Position{ row, 2 }, std::to_string(row % 13) });
+                edits.push_back({ Position{ row, 3 }, "=A" + n + "*B" + n + "+C" + n + "*E1" });
+            }
+            edits.push_back({ Position{ 0, 4 }, "1"s });
+            sheet->SetCells(std::move(edits));
+            return sheet;
+        };
+        const auto run = [&](const std::string& id, bool kernels) {
+            std::unique_ptr<Sheet> sheet = make_sheet();
+            sheet->SetColumnKernels(kernels);
+            double sink = 0;
+            // the reads only, the edit invalidating the column is the same either way
+            std::chrono::steady_clock::duration elapsed{};
+            for (int round = 0; round < rounds; ++round) {
+                sheet->SetCell(Position{ 0, 4 }, std::to_string(round));
+                const auto start = std::chrono::steady_clock::now();
+                for (int row = 0; row < rows; ++row) {
+                    sink += std::get<double>(sheet->GetCell(Position{ row, 3 })->GetValue());
+                }
+                elapsed += std::chrono::steady_clock::now() - start;
+            }
+            std::cerr << id << ", " << rows << " formulas recomputed after an edit, x" << rounds << ": "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << " ms" << std::endl;
+            std::cerr << "  checksum " << sink << std::endl;
+        };
+
+        run("column kernels"s, true);
+        run("formula by formula"s, false);
+    }
+
+    // latency of the reads of a query path between edits under each recalculation policy
+    void BenchmarkRecalcPolicies() {
+        const int rows = 1000;
+        const int edits = 200;
+        const int reads_per_edit = 20;
+
+        // a chain B1..B1000 adding E1 and C = A*B beside it: an edit of E1 stales 2000 formulas
+        const auto make_sheet = [] {
+            auto sheet = std::make_unique<Sheet>();
+            std::vector<Sheet::CellEdit> cells;
+            for (int row = 0; row < rows; ++row) {
+                const std::string n = std::to_string(row + 1);
+                cells.push_back({ Position{ row, 0 }, std::to_string(row % 10 + 1) });
+                cells.push_back({ Position{ row, 1 }, row == 0 ? "=E1"s : "=B" + std::to_string(row) + "+E1" });
+                cells.push_back({ Position{ row, 2 }, "=A" + n + "*B" + n });
+            }
+            cells.push_back({ Position{ 0, 4 }, "1"s });
+            sheet->SetCells(std::move(cells));
+            sheet->Publish();
+            return sheet;
+        };
+        using Duration = std::chrono::steady_clock::duration;
+        const auto percentile = [](std::vector<Duration>& durations, int percent) {
+            const size_t index = std::min(durations.size() - 1, durations.size() * percent / 100);
+            std::nth_element(durations.begin(), durations.begin() + index, durations.end());
+            return std::chrono::duration<double, std::micro>(durations[index]).count();
+        };
+        const auto run = [&](const std::string& id, RecalcPolicy policy) {
+            std::unique_ptr<Sheet> sheet = make_sheet();
+            sheet->SetRecalcPolicy(policy);
+            std::vector<Duration> read_times;
+            std::vector<Duration> edit_times;
+            read_times.reserve(edits * reads_per_edit);
+            double sink = 0;
+            int pending = 0;
+            uint32_t random = 1;
+            for (int edit = 0; edit < edits; ++edit) {
+                auto start = std::chrono::steady_clock::now();
+                sheet->SetCell(Position{ 0, 4 }, std::to_string(edit % 10));
+                edit_times.push_back(std::chrono::steady_clock::now() - start);
+                for (int read = 0; read < reads_per_edit; ++read) {
+                    random = random * 1103515245 + 12345;
+                    const Position pos{ static_cast<int>(random >> 16) % rows, 2 };
+                    start = std::chrono::steady_clock::now();
+                    if (policy == RecalcPolicy::Background) {
+                        auto snapshot = sheet->ReadSnapshot();
+                        sink += std::get<double>(snapshot->GetCell(pos)->value);
+                        pending += snapshot->IsPending(pos);
+                    } else {
+                        sink += std::get<double>(sheet->GetCell(pos)->GetValue());
+                    }
+                    read_times.push_back(std::chrono::steady_clock::now() - start);
+                }
+            }
+            sheet->Publish();
+            const Duration slowest = *std::max_element(read_times.begin(), read_times.end());
+            std::cerr << id << " policy, " << read_times.size() << " reads after edits staling " << 2 * rows
+                      << " formulas: read p50 " << percentile(read_times, 50) << " us, p99 " << percentile(read_times, 99)
+                      << " us, max " << std::chrono::duration<double, std::micro>(slowest).count()
+                      << " us; edit p50 " << percentile(edit_times, 50) << " us, p99 " << percentile(edit_times, 99) << " us" << std::endl;
+            std::cerr << "  " << pending << " reads of a pending value, checksum " << sink << std::endl;
+        };
+
+        run("lazy"s, RecalcPolicy::Lazy);
+        run("eager"s, RecalcPolicy::Eager);
+        run("background"s, RecalcPolicy::Background);
+    }
+
+    void BenchmarkEditLog() {
+        const int edits = 1000000;
+        const int unbatched_edits = 2000;
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_benchmark").string();
+        const auto remove_files = [&path] {
+            for (const char* suffix : { ".log", ".snapshot" }) {
+                std::filesystem::remove(path + suffix);
+            }
+        };
+        // 1000 x 100 cells edited 10 times over, every 8th edit a formula reading its left neighbour
+        const auto edit = [](int i, const auto& set_cell) {
+            const Position pos{ i / 100 % 1000, i % 100 };
+            set_cell(pos, i % 8 == 0 && pos.col > 0 ? "=" + Position{ pos.row, pos.col - 1 }.ToString() + "*2"
+                                                    : std::to_string(i % 1000));
+        };
+        const auto report = [](const std::string& id, int count, std::chrono::steady_clock::duration elapsed) {
+            const double seconds = std::chrono::duration<double>(elapsed).count();
+            std::cerr << id << ": " << static_cast<int64_t>(count / seconds) << " edits/s" << std::endl;
+        };
+
+        {
+            Sheet sheet;
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < edits; ++i) {
+                edit(i, [&sheet](Position pos, std::string text) {
+                    sheet.SetCell(pos, std::move(text));
+                });
+            }
+            report("edits without a log"s, edits, std::chrono::steady_clock::now() - start);
+        }
+
+        // one fsync per edit, what the grouping saves
+        remove_files();
+        {
+            Sheet sheet;
+            EditLog::Options options;
+            options.group_edits = 1;
+            EditLog log(sheet, path, options);
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < unbatched_edits; ++i) {
+                edit(i, [&log](Position pos, std::string text) {
+                    log.SetCell(pos, std::move(text));
+                });
+            }
+            report("logged edits, an fsync each"s, unbatched_edits, std::chrono::steady_clock::now() - start);
+        }
+
+        remove_files();
+        uint64_t log_bytes = 0;
+        {
+            Sheet sheet;
+            EditLog log(sheet, path);
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < edits; ++i) {
+                edit(i, [&log](Position pos, std::string text) {
+                    log.SetCell(pos, std::move(text));
+                });
+            }
+            log.Sync();
+            report("logged edits, an fsync per group of "s + std::to_string(EditLog::Options{}.group_edits), edits
+                , std::chrono::steady_clock::now() - start);
+            log_bytes = std::filesystem::file_size(path + ".log");
+        }
+
+        std::string values;
+        {
+            Sheet sheet;
+            std::optional<EditLog> log;
+            {
+                LOG_DURATION("recovery of "s + std::to_string(edits) + " logged edits, "s + std::to_string(log_bytes >> 20)
+                    + " MiB"s);
+                log.emplace(sheet, path);
+            }
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            values = out.str();
+            LOG_DURATION("compaction"s);
+            log->Compact();
+        }
+        {
+            Sheet sheet;
+            {
+                LOG_DURATION("recovery from the snapshot"s);
+                EditLog log(sheet, path);
+            }
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            std::cerr << "  same values: " << std::boolalpha << (out.str() == values) << std::endl;
+        }
+        remove_files();
+    }
+
+    // undo and redo on a sheet of 100000 cells, against undoing by reloading a dump of
+    // every cell text taken before the edit
+    void BenchmarkUndo() {
+        const int rows = 1000;
+        const int cols = 100;
+        const int steps = static_cast<int>(UndoHistory::DEFAULT_LIMIT);
+        const int reloads = 10;
+        // every 4th column a formula reading its left neighbour
+        const auto fill = [&](Sheet& sheet, const auto& text_at) {
+            std::vector<Sheet::CellEdit> edits;
+            edits.reserve(rows * cols);
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    edits.push_back({ Position{ row, col }, text_at(row, col) });
+                }
+            }
+            sheet.SetCells(std::move(edits));
+        };
+        const auto initial_text = [](int row, int col) {
+            return col % 4 == 3 ? "=" + Position{ row, col - 1 }.ToString() + "+1" : std::to_string(row * cols + col);
+        };
+        const auto edit = [](Sheet& sheet, int i) {
+            const Position pos{ i * 37 % rows, i % cols };
+            sheet.SetCell(pos, i % 2 ? "=A1*"s + std::to_string(i) : std::to_string(i));
+        };
+        const auto printed = [](const Sheet& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        const auto report = [](const std::string& id, int count, std::chrono::steady_clock::duration elapsed) {
+            const double seconds = std::chrono::duration<double>(elapsed).count();
+            std::cerr << id << ": " << seconds * 1e6 / count << " us/step" << std::endl;
+        };
+
+        Sheet sheet;
+        fill(sheet, initial_text);
+        sheet.ClearUndoHistory();
+        const std::string texts = printed(sheet);
+        const int64_t empty_history = sheet.GetMemoryUsage()[MemoryCategory::UndoHistory];
+        for (int i = 0; i < steps; ++i) {
+            edit(sheet, i);
+        }
+        std::cerr << "undo history: " << (sheet.GetMemoryUsage()[MemoryCategory::UndoHistory] - empty_history) / steps
+                  << " bytes/step" << std::endl;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; ++i) {
+            sheet.Undo();
+        }
+        report("undo"s, steps, std::chrono::steady_clock::now() - start);
+        const bool undone = printed(sheet) == texts;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; ++i) {
+            sheet.Redo();
+        }
+        report("redo"s, steps, std::chrono::steady_clock::now() - start);
+
+        // a batch of every cell, undone through the same path
+        start = std::chrono::steady_clock::now();
+        fill(sheet, [](int row, int col) {
+            return std::to_string(row + col);
+        });
+        report("batch of "s + std::to_string(rows * cols) + " cells"s, 1, std::chrono::steady_clock::now() - start);
+        start = std::chrono::steady_clock::now();
+        sheet.Undo();
+        report("its undo"s, 1, std::chrono::steady_clock::now() - start);
+
+        std::chrono::steady_clock::duration dumps{};
+        std::chrono::steady_clock::duration loads{};
+        std::unique_ptr<Sheet> reloaded = std::make_unique<Sheet>();
+        fill(*reloaded, initial_text);
+        for (int i = 0; i < reloads; ++i) {
+            start = std::chrono::steady_clock::now();
+            std::vector<Sheet::CellEdit> dump;
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    if (const CellInterface* cell = reloaded->GetCell(Position{ row, col })) {
+                        dump.push_back({ Position{ row, col }, cell->GetText() });
+                    }
+                }
+            }
+            dumps += std::chrono::steady_clock::now() - start;
+            edit(*reloaded, i);
+            start = std::chrono::steady_clock::now();
+            reloaded = std::make_unique<Sheet>();
+            reloaded->SetCells(std::move(dump));
+            loads += std::chrono::steady_clock::now() - start;
+        }
+        report("dump before an edit"s, reloads, dumps);
+        report("undo by reloading the dump"s, reloads, loads);
+        std::cerr << "  same texts: " << std::boolalpha << (undone && printed(*reloaded) == texts) << std::endl;
+    }
+
+    void BenchmarkForks() {
+        const int rows = 1000;
+        const int cols = 100;
+        const int forks = 10000;
+        const int scenarios = 2000;
+        const int thread_count = 8;
+        const Position input = Position::FromString("CX1");
+        const Position output = Position::FromString("CY1");
+        const auto report = [](const std::string& id, const std::string& unit, int count, std::chrono::steady_clock::duration elapsed) {
+            const double seconds = std::chrono::duration<double>(elapsed).count();
+            std::cerr << id << ": " << seconds * 1e6 / count << " us/" << unit << std::endl;
+        };
+
+        // 100k cells, every 4th column a formula reading its left neighbour; column CW
+        // scales the first column by the input CX1 and CY1 sums it
+        Sheet sheet;
+        std::vector<Sheet::CellEdit> edits;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                edits.push_back({ Position{ row, col }, col % 4 == 3 ? "=" + Position{ row, col - 1 }.ToString() + "+1"
+                                                                     : std::to_string(row * cols + col) });
+            }
+            edits.push_back({ Position{ row, cols }, "=A"s + std::to_string(row + 1) + "*CX1"s });
+        }
+        edits.push_back({ input, "1" });
+        edits.push_back({ output, "=SUM(CW1:CW" + std::to_string(rows) + ")" });
+        sheet.SetCells(std::move(edits));
+        sheet.Publish();
+
+        auto start = std::chrono::steady_clock::now();
+        size_t sink = 0;
+        for (int i = 0; i < forks; ++i) {
+            SheetFork fork(sheet);
+            sink += fork.GetDivergedCount();
+        }
+        report("fork of 101k cells"s, "fork"s, forks, std::chrono::steady_clock::now() - start);
+
+        start = std::chrono::steady_clock::now();
+        {
+            SheetFork fork(sheet);
+            fork.SetCell(input, "2");
+        }
+        report("first edit of a version, indexes 26k formulas"s, "edit"s, 1, std::chrono::steady_clock::now() - start);
+
+        // a scenario: the input changed, the total read
+        const auto run_scenario = [&sheet, input, output](int i) {
+            SheetFork fork(sheet);
+            fork.SetCell(input, std::to_string(i));
+            return std::get<double>(fork.GetCell(output)->value);
+        };
+        double total = 0;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < scenarios; ++i) {
+            total += run_scenario(i);
+        }
+        report("scenario on a fork, 1 thread"s, "scenario"s, scenarios, std::chrono::steady_clock::now() - start);
+
+        std::vector<std::thread> threads;
+        std::atomic<int> next{ 0 };
+        std::atomic<int64_t> parallel_total{ 0 };
+        start = std::chrono::steady_clock::now();
+        for (int t = 0; t < thread_count; ++t) {
+            threads.emplace_back([&] {
+                int64_t local = 0;
+                for (int i = next++; i < scenarios; i = next++) {
+                    local += static_cast<int64_t>(run_scenario(i));
+                }
+                parallel_total += local;
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        report("scenario on a fork, "s + std::to_string(thread_count) + " threads"s, "scenario"s, scenarios
+            , std::chrono::steady_clock::now() - start);
+
+        // the same on the sheet itself, one scenario after the other
+        double sheet_total = 0;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < scenarios; ++i) {
+            sheet.SetCell(input, std::to_string(i));
+            sheet_total += std::get<double>(sheet.GetCell(output)->GetValue());
+        }
+        report("scenario on the sheet"s, "scenario"s, scenarios, std::chrono::steady_clock::now() - start);
+        std::cerr << "  same totals: " << std::boolalpha
+                  << (total == sheet_total && static_cast<double>(parallel_total.load()) == total && sink == 0) << std::endl;
+    }
+
+    void BenchmarkDataTable() {
+        const int rows = 1000;
+        const int rates = 40;
+        const int amounts = 50;
+        const Position rate = Position::FromString("C1");
+        const Position amount = Position::FromString("D1");
+        const Position output = Position::FromString("E1");
+        const auto report = [](const std::string& id, int points, std::chrono::steady_clock::duration elapsed) {
+            const double seconds = std::chrono::duration<double>(elapsed).count();
+            std::cerr << id << ": " << seconds * 1e6 / points << " us/point" << std::endl;
+        };
+
+        // a loan book: column B the yearly payment of each loan of column A at the rate
+        // C1, plus the fee D1; E1 totals it
+        Sheet sheet;
+        std::vector<Sheet::CellEdit> edits;
+        for (int row = 0; row < rows; ++row) {
+            const std::string n = std::to_string(row + 1);
+            edits.push_back({ Position{ row, 0 }, std::to_string(1000 + row) });
+            edits.push_back({ Position{ row, 1 }, "=A" + n + "*C1/100+D1" });
+        }
+        edits.push_back({ rate, "5" });
+        edits.push_back({ amount, "10" });
+        edits.push_back({ output, "=SUM(B1:B" + std::to_string(rows) + ")" });
+        sheet.SetCells(std::move(edits));
+        sheet.Publish();
+
+        DataTable table({ rate, amount }, { output });
+        for (int i = 0; i < rates; ++i) {
+            for (int j = 0; j < amounts; ++j) {
+                table.AddPoint({ std::to_string(i), std::to_string(j) });
+            }
+        }
+        const int points = rates * amounts;
+        const auto sum_results = [&table, points] {
+            double total = 0;
+            for (int point = 0; point < points; ++point) {
+                total += std::get<double>(table.GetResult(point, 0));
+            }
+            return total;
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        table.Evaluate(sheet, 1);
+        report("data table of "s + std::to_string(points) + " points, 1 thread"s, points, std::chrono::steady_clock::now() - start);
+        const double total = sum_results();
+
+        const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        start = std::chrono::steady_clock::now();
+        table.Evaluate(sheet);
+        report("data table, "s + std::to_string(cores) + " threads"s, points, std::chrono::steady_clock::now() - start);
+        const double parallel_total = sum_results();
+
+        // the sweep done on the sheet itself
+        double sheet_total = 0;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rates; ++i) {
+            for (int j = 0; j < amounts; ++j) {
+                sheet.SetCells({ { rate, std::to_string(i) }, { amount, std::to_string(j) } });
+                sheet_total += std::get<double>(sheet.GetCell(output)->GetValue());
+            }
+        }
+        report("the same sweep with edits of the sheet"s, points, std::chrono::steady_clock::now() - start);
+        std::cerr << "  same totals: " << std::boolalpha << (total == sheet_total && parallel_total == total) << std::endl;
+    }
+
+    void BenchmarkPositionConversions() {
+        const int repeats = 4;
+        const int64_t conversions = int64_t{ repeats } * Position::MAX_ROWS * 64;
+
+        // every row with the columns of one, two and three letters
+        const auto for_each_position = [](const auto& action) {
+            for (int r = 0; r < repeats; ++r) {
+                for (int row = 0; row < Position::MAX_ROWS; ++row) {
+                    for (int col = 0; col < Position::MAX_COLS; col += Position::MAX_COLS / 64) {
+                        action(Position{ row, col });
+                    }
+                }
+            }
+        };
+        const auto report = [&](const std::string& id, std::chrono::steady_clock::duration elapsed, int64_t sink) {
+            const double seconds = std::chrono::duration<double>(elapsed).count();
+            std::cerr << id << ": " << static_cast<int64_t>(conversions / seconds) << " conversions/s (checksum "
+                      << sink << ')' << std::endl;
+        };
+
+        int64_t sink = 0;
+        auto start = std::chrono::steady_clock::now();
+        for_each_position([&sink](Position pos) {
+            char buffer[Position::MAX_STRING_LENGTH];
+            sink += pos.ToChars(buffer, buffer + Position::MAX_STRING_LENGTH).ptr - buffer;
+        });
+        report("Position::ToChars"s, std::chrono::steady_clock::now() - start, sink);
+
+        sink = 0;
+        start = std::chrono::steady_clock::now();
+        for_each_position([&sink](Position pos) {
+            sink += pos.ToString().size();
+        });
+        report("Position::ToString"s, std::chrono::steady_clock::now() - start, sink);
+
+        std::vector<std::string> texts;
+        for_each_position([&texts](Position pos) {
+            if (texts.size() < static_cast<size_t>(Position::MAX_ROWS) * 64) {
+                texts.push_back(pos.ToString());
+            }
+        });
+        sink = 0;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; ++r) {
+            for (const std::string& text : texts) {
+                sink += Position::FromString(text).col;
+            }
+        }
+        report("Position::FromString"s, std::chrono::steady_clock::now() - start, sink);
+    }
+
+    void BenchmarkPrintFormulaTexts() {
+        const int repeats = 20;
+
+        Sheet sheet;
+        for (int i = 0; i < 10000; ++i) {
+            const Position pos{ i / 100, i % 100 };
+            sheet.SetCell(pos, "=(A"s + std::to_string(pos.row + 101) + "+B"s + std::to_string(pos.row + 101)
+                + ")*2-C"s + std::to_string(pos.row + 101) + "/(1+D"s + std::to_string(pos.row + 101) + ")"s);
+        }
+        size_t sink = 0;
+        {
+            LOG_DURATION("PrintTexts of 10000 formula cells x"s + std::to_string(repeats));
+            for (int i = 0; i < repeats; ++i) {
+                std::ostringstream output;
+                sheet.PrintTexts(output);
+                sink += output.str().size();
+            }
+        }
+        std::cerr << "  checksum " << sink << std::endl;
+    }
+
+    // 10M numbers written as PrintValues writes them, by the stream and by each format
+    void BenchmarkNumberFormats() {
+        const int count = 10000000;
+        std::vector<double> numbers;
+        numbers.reserve(count);
+        uint64_t random = 1;
+        for (int i = 0; i < count; ++i) {
+            random = random * 6364136223846793005u + 1442695040888963407u;
+            // magnitudes from 1e-6 to 1e9, integers among them
+            const double mantissa = static_cast<double>(random >> 11) / static_cast<double>(1ull << 53);
+            numbers.push_back(i % 4 == 0 ? static_cast<double>(random >> 44) : mantissa * std::pow(10.0, i % 16 - 6));
+        }
+        const auto run = [&numbers](const std::string& id, const auto& print) {
+            std::ostringstream output;
+            const auto start = std::chrono::steady_clock::now();
+            for (double number : numbers) {
+                print(output, number);
+                output << '\t';
+            }
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            std::cerr << id << ", " << numbers.size() << " numbers: "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << " ms, "
+                      << output.str().size() << " bytes" << std::endl;
+        };
+
+        run("operator<< of the stream"s, [](std::ostream& output, double number) {
+            output << number;
+        });
+        for (const auto& [id, format] : { std::pair{ "NumberFormat::General(6)"s, NumberFormat::General() }
+            , std::pair{ "NumberFormat::Shortest()"s, NumberFormat::Shortest() }
+            , std::pair{ "NumberFormat::Fixed(2)"s, NumberFormat::Fixed(2) } }) {
+            run(id, [&format](std::ostream& output, double number) {
+                format.Print(output, number);
+            });
+        }
+    }
+
+    void BenchmarkSnapshotReaders() {
+        const int reader_count = 4;
+        const auto duration = std::chrono::milliseconds(500);
+
+        Sheet sheet;
+        for (int i = 0; i < 1000; ++i) {
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+            sheet.SetCell(Position{ i, 1 }, "=A"s + std::to_string(i + 1) + "*2"s);
+        }
+        sheet.Publish();
+
+        std::atomic<bool> done = false;
+        std::atomic<uint64_t> reads = 0;
+        std::vector<std::thread> readers;
+        for (int i = 0; i < reader_count; ++i) {
+            readers.emplace_back([&, i] {
+                uint64_t local_reads = 0;
+                double sink = 0;
+                while (!done) {
+                    auto snapshot = sheet.ReadSnapshot();
+                    const auto* entry = snapshot->GetCell(Position{ static_cast<int>(local_reads % 1000), 1 });
+                    sink += std::get<double>(entry->value);
+                    ++local_reads;
+                }
+                reads += local_reads + (sink < 0);
+            });
+        }
+
+        uint64_t publishes = 0;
+        const auto start = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() - start < duration) {
+            sheet.SetCell(Position{ static_cast<int>(publishes % 1000), 0 }, std::to_string(publishes));
+            sheet.Publish();
+            ++publishes;
+        }
+        done = true;
+        for (auto& reader : readers) {
+            reader.join();
+        }
+
+        const double seconds = std::chrono::duration<double>(duration).count();
+        std::cerr << "snapshot readers x" << reader_count << ": " << static_cast<uint64_t>(reads / seconds)
+                  << " reads/s with " << static_cast<uint64_t>(publishes / seconds) << " publishes/s" << std::endl;
+    }
+
+    // output cost of one edit on a large sheet: redrawing it all or only what changed
+    void BenchmarkChangedCellsOutput() {
+        const int rows = 1000;
+        const int cols = 20;
+        const int edits = 1000;
+
+        Sheet sheet;
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 1; j < cols; ++j) {
+                sheet.SetCell(Position{ i, j }, "=A"s + std::to_string(i + 1) + "*"s + std::to_string(j));
+            }
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+        }
+        uint64_t version = sheet.Publish();
+
+        size_t sink = 0;
+        {
+            LOG_DURATION("edit + PrintValues of 1000x20, x"s + std::to_string(edits));
+            for (int i = 0; i < edits; ++i) {
+                sheet.SetCell(Position{ i % rows, 0 }, std::to_string(i));
+                sheet.Publish();
+                std::ostringstream output;
+                sheet.ReadSnapshot()->PrintValues(output);
+                sink += output.str().size();
+            }
+        }
+        {
+            LOG_DURATION("edit + GetChangesSince of 1000x20, x"s + std::to_string(edits));
+            for (int i = 0; i < edits; ++i) {
+                sheet.SetCell(Position{ i % rows, 0 }, std::to_string(i + 1));
+                const uint64_t published = sheet.Publish();
+                const auto changes = sheet.GetChangesSince(version);
+                std::ostringstream output;
+                for (const CellChange& change : *changes) {
+                    output << change.pos.ToString() << '\t';
+                    std::visit([&output](const auto& value) {
+                        output << value;
+                    }, *change.value);
+                    output << '\n';
+                }
+                sink += output.str().size();
+                version = published;
+            }
+        }
+        std::cerr << "  checksum " << sink << std::endl;
+    }
+
+    // bytes per cell of a published sheet filled with one kind of cell,
+    // a footprint regression shows up as a larger number here
+    void BenchmarkMemoryFootprint() {
+        const int cell_count = 10000;
+
+        const auto measure = [&](const std::string& id, const auto& make_text) {
+            Sheet sheet;
+            for (int i = 0; i < cell_count; ++i) {
+                sheet.SetCell(Position{ i / 100, i % 100 }, make_text(i));
+            }
+            sheet.Publish();
+            const MemoryReport report = sheet.GetMemoryUsage();
+            std::cerr << id << ": " << static_cast<double>(report.Total()) / cell_count << " bytes/cell (";
+            for (size_t i = 0; i < report.bytes.size(); ++i) {
+                std::cerr << (i ? ", "s : ""s) << ToString(static_cast<MemoryCategory>(i)) << ' '
+                          << static_cast<double>(report.bytes[i]) / cell_count;
+            }
+            std::cerr << ')' << std::endl;
+        };
+
+        measure("number cells"s, [](int i) {
+            return std::to_string(i);
+        });
+        measure("short text cells"s, [](int i) {
+            return "text"s + std::to_string(i % 10);
+        });
+        measure("long text cells"s, [](int i) {
+            return "a text long enough to be stored on the heap "s + std::to_string(i);
+        });
+        measure("repeated label cells"s, [](int i) {
+            return "a repeated label long enough for the heap "s + std::to_string(i % 10);
+        });
+        measure("formula cells"s, [](int i) {
+            // refers to the cell below, the last row to empty cells
+            return "=1+"s + Position{ i / 100 + 1, i % 100 }.ToString() + "*2"s;
+        });
+    }
+}  // namespace
+
+void RunBenchmarks() {
+    BenchmarkDivisionChain();
+    BenchmarkDependencyChain();
+    BenchmarkConstantFolding();
+    BenchmarkNumericTextOperands();
+    BenchmarkUntakenBranchEdits();
+    BenchmarkLookups();
+    BenchmarkAggregates();
+    BenchmarkColumnKernels();
+    BenchmarkRecalcPolicies();
+    BenchmarkEditLog();
+    BenchmarkUndo();
+    BenchmarkForks();
+    BenchmarkDataTable();
+    BenchmarkPositionConversions();
+    BenchmarkPrintFormulaTexts();
+    BenchmarkNumberFormats();
+    BenchmarkSnapshotReaders();
+    BenchmarkChangedCellsOutput();
+    BenchmarkMemoryFootprint();
+}
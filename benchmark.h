@@ -0,0 +1,4 @@
+#pragma once
+
+// Performance regression benchmarks, run with `spreadsheet --bench`
+void RunBenchmarks();
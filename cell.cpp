@@ -1,60 +1,75 @@
 #include "cell.h"
+#include "column_kernel.h"
+#include "sheet.h"
+#include "workbook.h"
 
 #include <cassert>
+#include <charconv>
 #include <iostream>
 #include <string>
 #include <optional>
 #include <algorithm>
+#include <atomic>
 
 using namespace std::string_literals;
+using namespace std::string_view_literals;
+
+namespace {
+    // shortest text that parses back to the same value
+    std::string FormatNumber(double value) {
+        char buffer[32];
+        const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        return std::string(buffer, result.ptr);
+    }
+}  // namespace
 
-Cell::Cell(SheetInterface& sheet)
+Cell::Cell(Sheet& sheet, Position pos)
     : impl_(std::make_unique<EmptyImpl>(this))
-    , sheet_(sheet) { }
+    , sheet_(sheet)
+    , pos_(pos) { }
 
 Cell::~Cell() { }
 
-void Cell::Set(std::string& text) {
-    if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>(this);
-    }
-
-    switch (text[0]) {
-    case '\'' :
-        impl_ = std::make_unique<TextImpl>(text, this);
-        break;
-    case '=' :
-        if (text.size() > 1) {
-            auto formula = ParseFormula(text.substr(1));
-            std::vector<Position> referenced_cells = formula->GetReferencedCells();
-            std::unordered_set<Cell*> ref_cells;
-            std::for_each(referenced_cells.begin(), referenced_cells.end(), [&](const Position pos) {
-                ref_cells.insert(dynamic_cast<Cell*>(sheet_.GetCell(pos)));
-            });
-            if (ref_cells.count(this)) {
-                throw CircularDependencyException(""s);
-            }
-            ref_cells.insert(this);
-            for (const Cell* cell : ref_cells) {
-                std::vector<std::unordered_set<Cell*>> cells_stack;
-                cells_stack.push_back(ref_cells);
-                if (cell && cell->impl_ && cell->IsCircular(cells_stack)) {
-                    throw CircularDependencyException(""s);
-                }
-            }
-            impl_ = std::make_unique<FormulaImpl>(std::move(formula), sheet_, this);
-            AddChilds(referenced_cells);
-        } else {
-            impl_ = std::make_unique<TextImpl>(text, this);
+void Cell::Exchange(CellContent& content) {
+    const std::string* text = std::get_if<std::string>(&content);
+    std::shared_ptr<FormulaInterface> parsed;
+    if (text && text->size() > 1 && (*text)[0] == '=') {
+        parsed = ParseFormula(text->substr(1));
+    }
+    std::shared_ptr<FormulaInterface>* formula = parsed ? &parsed : std::get_if<std::shared_ptr<FormulaInterface>>(&content);
+
+    std::unique_ptr<Impl> impl;
+    FormulaImpl* compiled = nullptr;
+    if (formula) {
+        if (IsReachableFrom(FindReferencedCells(**formula), (*formula)->GetReferencedRanges())) {
+            throw CircularDependencyException(""s);
         }
-        break;
-    default:
-        impl_ = std::make_unique<TextImpl>(text, this);
-        break;
+        auto formula_impl = std::make_unique<FormulaImpl>(std::move(*formula), sheet_, this);
+        compiled = formula_impl.get();
+        impl = std::move(formula_impl);
+    } else if (text) {
+        impl = MakeText(*text);
+    } else {
+        impl = std::make_unique<EmptyImpl>(this);
+    }
+    content = impl_->TakeContent();
+    impl_ = std::move(impl);
+    if (compiled) {
+        compiled->Link(true);
+    }
+}
+
+std::unique_ptr<Cell::Impl> Cell::MakeText(const std::string& text) {
+    // an escaped text never parses as a number
+    if (std::optional<double> number = TextToNumber(text); number && FormatNumber(*number) == text) {
+        return std::make_unique<NumberImpl>(*number, this);
     }
+    return std::make_unique<TextImpl>(text, this);
 }
 
 Cell::Value Cell::GetValue() const {
+    // a cell kept from before an edit is read while its sheet recalculates
+    sheet_.JoinRecalculation();
     return impl_->GetValue();
 }
 
@@ -62,33 +77,57 @@ std::string Cell::GetText() const {
     return impl_->GetText();
 }
 
+double Cell::GetNumber() const {
+    return impl_->GetNumber();
+}
+
+std::optional<double> Cell::GetConstantNumber() const {
+    return impl_->GetConstantNumber();
+}
+
+bool Cell::IsFormula() const {
+    return impl_->AsFormula() != nullptr;
+}
+
+std::shared_ptr<const FormulaInterface> Cell::GetFormula() const {
+    const FormulaImpl* formula = impl_->AsFormula();
+    return formula ? formula->GetFormula() : nullptr;
+}
+
 std::vector<Position> Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 }
 
+std::vector<CellRange> Cell::GetReferencedRanges() const {
+    return impl_->GetReferencedRanges();
+}
+
 void Cell::AddParent(Cell *cell) {
+    MemoryScope scope(sheet_.GetMemoryAccount());
     parents_.insert(cell);
 }
 
 void Cell::EraseParent(Cell *parent) {
+    MemoryScope scope(sheet_.GetMemoryAccount());
     if (impl_ && !parents_.empty() && parents_.count(parent)) {
         parents_.erase(parent);
     }
 }
 
-void Cell::AddChilds(const std::vector<Position>& new_childs) {
+void Cell::AddChilds(Sheet& sheet, const std::vector<Position>& new_childs) {
     for (const Position& new_child : new_childs) {
-        Cell* child = dynamic_cast<Cell*>(sheet_.GetCell(new_child));
-        if (!child) {
-            sheet_.SetCell(new_child, ""s);
-            child = dynamic_cast<Cell*>(sheet_.GetCell(new_child));
-        }
+        Cell* child = sheet.MakeReferencedCell(new_child);
         child->AddParent(this);
         impl_->AddChild(child);
     }
 }
 
+bool Cell::IsReferenced() const {
+    return !parents_.empty();
+}
+
 void Cell::Clear() {
+    MemoryScope scope(sheet_.GetMemoryAccount());
     impl_ = std::make_unique<EmptyImpl>(this);
 }
 
@@ -100,8 +139,118 @@ void Cell::InvalidateCache() {
     impl_->InvalidateCache();
 }
 
-bool Cell::IsCircular(std::vector<std::unordered_set<Cell*>>& cells_stack) const {
-    return impl_->IsCircular(cells_stack);
+void Cell::InvalidateParents() {
+    // a worklist rather than recursion, dependency chains can be arbitrarily long;
+    // every parent is visited along with the child that changed, the lookups whose
+    // range covers it drop their value whatever they read last
+    std::vector<std::pair<Cell*, const Cell*>> to_visit;
+    const auto push_parents = [&to_visit](const Cell* changed) {
+        for (Cell* parent : changed->parents_) {
+            to_visit.emplace_back(parent, changed);
+        }
+        changed->sheet_.GetLookupIndex().ForEachWatcher(changed->pos_, [&to_visit](Cell* watcher) {
+            to_visit.emplace_back(watcher, nullptr);
+        });
+    };
+    push_parents(this);
+    while (!to_visit.empty()) {
+        const auto [cell, changed] = to_visit.back();
+        to_visit.pop_back();
+        if (cell->impl_->DropCache(changed)) {
+            push_parents(cell);
+        }
+    }
+}
+
+Sheet& Cell::GetSheet() const {
+    return sheet_;
+}
+
+Position Cell::GetPosition() const {
+    return pos_;
+}
+
+void Cell::SetPosition(Position pos) {
+    pos_ = pos;
+}
+
+const Cell::CellSet& Cell::GetParents() const {
+    return parents_;
+}
+
+void Cell::ForgetParents() {
+    MemoryScope scope(sheet_.GetMemoryAccount());
+    parents_.clear();
+}
+
+void Cell::EraseChild(Cell* child) {
+    MemoryScope scope(sheet_.GetMemoryAccount());
+    impl_->EraseChild(child);
+}
+
+void Cell::RewriteReferences(const Sheet& edited, const std::function<Position(Position)>& remap) {
+    MemoryScope scope(sheet_.GetMemoryAccount());
+    impl_->RewriteReferences(remap, &edited == &sheet_, edited.GetName());
+    sheet_.MarkChanged(pos_);
+}
+
+void Cell::Relink() {
+    MemoryScope scope(sheet_.GetMemoryAccount());
+    impl_->Relink();
+}
+
+std::vector<const Cell*> Cell::FindReferencedCells(const FormulaInterface& formula) const {
+    std::vector<const Cell*> cells;
+    for (const Position& pos : formula.GetReferencedCells()) {
+        if (const Cell* cell = sheet_.FindCell(pos)) {
+            cells.push_back(cell);
+        }
+    }
+    for (const ExternalCell& ref : formula.GetExternalReferencedCells()) {
+        if (const Sheet* sheet = sheet_.FindSheet(ref.sheet)) {
+            if (const Cell* cell = sheet->FindCell(ref.pos)) {
+                cells.push_back(cell);
+            }
+        }
+    }
+    return cells;
+}
+
+bool Cell::IsReachableFrom(const std::vector<const Cell*>& cells, const std::vector<CellRange>& ranges) const {
+    std::unordered_set<const Cell*> visited;
+    std::vector<const Cell*> to_visit = cells;
+    // only the formulas of a range lead further, its other cells reference nothing
+    const auto visit_ranges = [this, &to_visit](const Sheet& sheet, const std::vector<CellRange>& ranges) {
+        for (const CellRange& range : ranges) {
+            if (&sheet == &sheet_ && range.Contains(pos_)) {
+                return true;
+            }
+            sheet.ForEachFormulaInRange(range, [&to_visit](const Cell* cell) {
+                to_visit.push_back(cell);
+            });
+        }
+        return false;
+    };
+    if (visit_ranges(sheet_, ranges)) {
+        return true;
+    }
+    while (!to_visit.empty()) {
+        const Cell* cell = to_visit.back();
+        to_visit.pop_back();
+        if (cell == this) {
+            return true;
+        }
+        if (!visited.insert(cell).second) {
+            continue;
+        }
+        for (const Cell* child : cell->impl_->GetChilds()) {
+            to_visit.push_back(child);
+        }
+        if (visit_ranges(cell->sheet_, cell->impl_->GetReferencedRanges())) {
+            return true;
+        }
+    }
+    return false;
 }
 
 Cell::Impl::Impl(Cell* cell) : this_cell_(cell) { }
@@ -125,89 +274,354 @@ std::string Cell::EmptyImpl::GetText() {
 }
 
 void Cell::EmptyImpl::InvalidateCache() {
-    for (Cell* parent : this_cell_->parents_) {
-        parent->InvalidateCache();
-    }
+    this_cell_->InvalidateParents();
 }
 
-Cell::TextImpl::TextImpl(std::string text, Cell* cell) : Impl(cell), value_(text) { }
+Cell::TextImpl::TextImpl(std::string text, Cell* cell)
+    : Impl(cell)
+    , number_(TextToNumber(text[0] == '\'' ? text.substr(1) : text)) {
+    text_ = GetPool().Intern(text);
+}
 
 Cell::TextImpl::~TextImpl() {
     InvalidateCache();
+    GetPool().Release(text_);
 }
 
 CellInterface::Value Cell::TextImpl::GetValue() {
-    return value_[0] == '\'' ? value_.substr(1) : value_;
+    std::string_view text = GetPool().View(text_);
+    if (!text.empty() && text[0] == '\'') {
+        text.remove_prefix(1);
+    }
+    return std::string(text);
 }
 
 std::string Cell::TextImpl::GetText() {
-    return value_;
+    return std::string(GetPool().View(text_));
 }
 
-void Cell::TextImpl::InvalidateCache() {
-    for (Cell* parent : this_cell_->parents_) {
-        parent->InvalidateCache();
+double Cell::TextImpl::GetNumber() {
+    if (!number_) {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    return *number_;
+}
+
+std::optional<double> Cell::TextImpl::GetConstantNumber() const {
+    const std::string_view text = GetPool().View(text_);
+    if (text.empty() || text == "'"sv) {
+        return std::nullopt;
     }
+    return number_;
 }
 
-Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface>&& value
+StringPool& Cell::TextImpl::GetPool() const {
+    return this_cell_->sheet_.GetStringPool();
+}
+
+void Cell::TextImpl::InvalidateCache() {
+    this_cell_->InvalidateParents();
+}
+
+Cell::NumberImpl::NumberImpl(double value, Cell* cell) : Impl(cell), value_(value) { }
+
+Cell::NumberImpl::~NumberImpl() {
+    InvalidateCache();
+}
+
+CellInterface::Value Cell::NumberImpl::GetValue() {
+    // still a text cell to the sheet's users
+    return GetText();
+}
+
+std::string Cell::NumberImpl::GetText() {
+    return FormatNumber(value_);
+}
+
+void Cell::NumberImpl::InvalidateCache() {
+    this_cell_->InvalidateParents();
+}
+
+Cell::FormulaImpl::FormulaImpl(std::shared_ptr<FormulaInterface> value
     , SheetInterface& sheet
     , Cell* cell)
     : Impl(cell), value_(std::move(value)), sheet_(sheet) { }
 
 Cell::FormulaImpl::~FormulaImpl() {
-    ClearThisInChilds();
+    if (value_) {
+        ClearThisInChilds();
+    }
+    if (Workbook* workbook = this_cell_->sheet_.GetWorkbook()) {
+        workbook->EraseUnresolved(this_cell_);
+    }
     InvalidateCache();
 }
 
 CellInterface::Value Cell::FormulaImpl::GetValue() {
     if (!cache_) {
-        FormulaInterface::Value result = value_->Evaluate(sheet_);
-        cache_ = std::holds_alternative<double>(result) ? Value(std::get<double>(result))
-                                                        : Value(std::get<FormulaError>(result));
+        ComputeValue();
     }
     return *cache_;
 }
 
+void Cell::FormulaImpl::ComputeValue() {
+    // a cached formula has all its childs cached: invalidation reaches every parent
+    const size_t base = pending_.size();
+    pending_.emplace_back(this, false);
+    try {
+        while (pending_.size() > base) {
+            Recalculation::CheckCancelled();
+            auto [formula, childs_pushed] = pending_.back();
+            if (formula->cache_) {
+                pending_.pop_back();
+            } else if (!childs_pushed) {
+                pending_.back().second = true;
+                const auto push_uncached = [](const Cell* child) {
+                    if (FormulaImpl* child_formula = child->impl_->AsFormula(); child_formula && !child_formula->cache_) {
+                        pending_.emplace_back(child_formula, false);
+                    }
+                };
+                if (!formula->value_->IsConditional()) {
+                    for (Cell* child : formula->childs_) {
+                        push_uncached(child);
+                    }
+                }
+                // a lookup evaluates every formula of its range, one retry each would be
+                // quadratic; only the stale ones of a range can be uncached
+                for (const CellRange& range : formula->value_->GetReferencedRanges()) {
+                    formula->this_cell_->sheet_.ForEachStaleFormulaInRange(range, push_uncached);
+                }
+            } else {
+                try {
+                    if (!formula->EvaluateColumnRun()) {
+                        formula->Evaluate();
+                    }
+                    pending_.pop_back();
+                }
+                catch (const UncachedChild& child) {
+                    pending_.emplace_back(child.formula, false);
+                }
+            }
+        }
+    }
+    catch (...) {
+        pending_.resize(base);
+        throw;
+    }
+}
+
+void Cell::FormulaImpl::Evaluate() {
+    FormulaInterface::Value result;
+    if (value_->IsConditional()) {
+        read_.clear();
+        result = value_->Evaluate(sheet_, read_);
+    } else {
+        result = value_->Evaluate(sheet_);
+    }
+    cache_ = std::holds_alternative<double>(result) ? Value(std::get<double>(result))
+                                                    : Value(std::get<FormulaError>(result));
+}
+
+bool Cell::FormulaImpl::EvaluateColumnRun() {
+    const Sheet& sheet = this_cell_->sheet_;
+    const FormulaAST& ast = value_->GetAST();
+    if (!sheet.UsesColumnKernels() || !ColumnKernel::Supports(ast)) {
+        return false;
+    }
+    const Position pos = this_cell_->pos_;
+    const auto uncached_at = [&sheet, col = pos.col](int row) -> FormulaImpl* {
+        const Cell* cell = row >= 0 && row < Position::MAX_ROWS ? sheet.FindCell({ row, col }) : nullptr;
+        FormulaImpl* formula = cell ? cell->impl_->AsFormula() : nullptr;
+        return formula && !formula->cache_ ? formula : nullptr;
+    };
+    std::optional<ColumnKernel> kernel;
+    for (const int row : { pos.row + 1, pos.row - 1 }) {
+        if (const FormulaImpl* other = uncached_at(row); other && ColumnKernel::Supports(other->value_->GetAST())) {
+            if (kernel = ColumnKernel::Match(ast, pos.row, other->value_->GetAST(), row); kernel) {
+                break;
+            }
+        }
+    }
+    if (!kernel) {
+        return false;
+    }
+
+    // as the evaluation of each formula reads its operands, through the cells it is bound
+    // to; a formula reading one not computed yet, another of the run, is left out of it
+    const auto read = [&sheet](const ASTImpl::Instruction& instruction) -> std::optional<double> {
+        const Cell* cell = instruction.handle ? static_cast<const Cell*>(instruction.handle) : sheet.FindCell(*instruction.cell);
+        try {
+            return cell ? cell->GetNumber() : 0.0;
+        }
+        catch (const UncachedChild&) {
+            return std::nullopt;
+        }
+    };
+    ColumnKernel::Operands operands;
+    std::vector<FormulaImpl*> run;
+    // the childs of this one were computed
+    kernel->Gather(ast, read, operands);
+    run.push_back(this);
+    for (const int step : { 1, -1 }) {
+        for (int row = pos.row + step;; row += step) {
+            FormulaImpl* formula = uncached_at(row);
+            if (!formula || !kernel->Matches(formula->value_->GetAST(), row)
+                || !kernel->Gather(formula->value_->GetAST(), read, operands)) {
+                break;
+            }
+            run.push_back(formula);
+        }
+    }
+    if (run.size() < MIN_COLUMN_RUN) {
+        return false;
+    }
+
+    std::vector<ColumnKernel::Result> results;
+    kernel->Run(operands, results);
+    for (size_t i = 0; i < run.size(); ++i) {
+        run[i]->cache_ = results[i].error ? Value(FormulaError(*results[i].error)) : Value(results[i].value);
+    }
+    return true;
+}
+
+double Cell::FormulaImpl::GetNumber() {
+    if (!cache_ && !pending_.empty()) {
+        // read by an evaluation of ComputeValue
+        throw UncachedChild{ this };
+    }
+    const Value value = GetValue();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    throw std::get<FormulaError>(value);
+}
+
 std::string Cell::FormulaImpl::GetText() {
-    return '=' + value_->GetExpression();
+    const std::string_view expression = value_->GetExpression();
+    std::string text;
+    text.reserve(expression.size() + 1);
+    return text.append(1, '=').append(expression);
 }
 
 void Cell::FormulaImpl::InvalidateCache() {
-    cache_ = std::nullopt;
-    for (Cell* parent : this_cell_->parents_) {
-        if (parent) parent->InvalidateCache();
+    // parents can only hold a value computed from a cached one
+    if (DropCache(nullptr)) {
+        this_cell_->InvalidateParents();
+    }
+}
+
+bool Cell::FormulaImpl::DropCache(const Cell* changed) {
+    if (!cache_) {
+        return false;
     }
+    if (changed && value_->IsConditional() && std::find(read_.begin(), read_.end(), changed) == read_.end()) {
+        return false;
+    }
+    cache_ = std::nullopt;
+    this_cell_->sheet_.MarkChanged(this_cell_->pos_);
+    return true;
+}
+
+CellContent Cell::FormulaImpl::TakeContent() {
+    // the handles bound in the formula are bound again when it is put back
+    ClearThisInChilds();
+    childs_.clear();
+    return std::move(value_);
 }
 
 void Cell::FormulaImpl::ClearThisInChilds() {
     for (Cell* child : childs_) {
         if (child->impl_) child->EraseParent(this_cell_);
     }
+    for (const CellRange& range : value_->GetReferencedRanges()) {
+        this_cell_->sheet_.GetLookupIndex().Unwatch(this_cell_, range);
+    }
 }
 
 void Cell::FormulaImpl::AddChild(Cell *cell) {
     childs_.insert(cell);
 }
 
-bool Cell::FormulaImpl::IsCircular(std::vector<std::unordered_set<Cell*>>& cells_stack) const {
-    for (Cell* child : childs_) {
-        for (auto cells_set : cells_stack) {
-            if (cells_set.count(child)) {
-                return true;
-            }
-        }
+void Cell::FormulaImpl::EraseChild(Cell* cell) {
+    childs_.erase(cell);
+}
+
+void Cell::FormulaImpl::RewriteReferences(const std::function<Position(Position)>& remap
+    , bool local, std::string_view sheet_name) {
+    const std::vector<CellRange> ranges = value_->GetReferencedRanges();
+    LookupIndex& lookup = this_cell_->sheet_.GetLookupIndex();
+    for (const CellRange& range : ranges) {
+        lookup.Unwatch(this_cell_, range);
     }
-    cells_stack.push_back(childs_);
-    for (Cell* child : childs_) {
-        if (child->IsCircular(cells_stack)) {
-            return true;
+    Unshare();
+    value_->RewriteReferences(remap, local, sheet_name);
+    BindCells();
+    for (const CellRange& range : value_->GetReferencedRanges()) {
+        lookup.Watch(this_cell_, range);
+    }
+    if (local && !ranges.empty()) {
+        // the cells of a range moved within it or out of it, positions found are stale
+        InvalidateCache();
+    }
+}
+
+void Cell::FormulaImpl::Relink() {
+    ClearThisInChilds();
+    childs_.clear();
+    if (Workbook* workbook = this_cell_->sheet_.GetWorkbook()) {
+        workbook->EraseUnresolved(this_cell_);
+    }
+    Link(!this_cell_->IsReachableFrom(this_cell_->FindReferencedCells(*value_)));
+    this_cell_->sheet_.MarkChanged(this_cell_->pos_);
+    InvalidateCache();
+}
+
+void Cell::FormulaImpl::Link(bool resolve_external) {
+    Sheet& own_sheet = this_cell_->sheet_;
+    this_cell_->AddChilds(own_sheet, value_->GetReferencedCells());
+    for (const CellRange& range : value_->GetReferencedRanges()) {
+        own_sheet.GetLookupIndex().Watch(this_cell_, range);
+    }
+    for (const ExternalCell& ref : value_->GetExternalReferencedCells()) {
+        if (Sheet* sheet = resolve_external ? own_sheet.FindSheet(ref.sheet) : nullptr) {
+            this_cell_->AddChilds(*sheet, { ref.pos });
+        } else if (Workbook* workbook = own_sheet.GetWorkbook()) {
+            workbook->AddUnresolved(ref.sheet, this_cell_);
         }
     }
-    cells_stack.pop_back();
-    return false;
+    // all linked cells exist now and are kept by their sheets while referenced
+    BindCells();
+}
+
+void Cell::FormulaImpl::BindCells() {
+    Unshare();
+    value_->BindCells([this](const std::string* sheet_name, Position pos) -> const CellInterface* {
+        Sheet* sheet = sheet_name ? this_cell_->sheet_.FindSheet(*sheet_name) : &this_cell_->sheet_;
+        Cell* cell = sheet ? dynamic_cast<Cell*>(sheet->GetCell(pos)) : nullptr;
+        // a handle always comes with the dependency link that keeps its cell alive
+        return childs_.count(cell) ? cell : nullptr;
+    });
+}
+
+void Cell::FormulaImpl::Unshare() {
+    if (value_.use_count() > 1) {
+        // a snapshot or a fork may still evaluate it, the copy is parsed from its text
+        MemoryScope scope(this_cell_->sheet_.GetMemoryAccount());
+        value_ = ParseFormula(std::string(value_->GetExpression()));
+    } else {
+        // the last reads of the owners that let it go happen before the change
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+}
+
+const Cell::CellSet& Cell::FormulaImpl::GetChilds() const {
+    return childs_;
 }
 
 std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
     return value_->GetReferencedCells();
-}
\ No newline at end of file
+}
+
+std::vector<CellRange> Cell::FormulaImpl::GetReferencedRanges() const {
+    return value_->GetReferencedRanges();
+}
@@ -1,39 +1,94 @@
 #pragma once
 
 #include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <unordered_set>
 #include <optional>
+#include <utility>
+#include <variant>
+#include <vector>
 
 #include "common.h"
 #include "formula.h"
+#include "memory.h"
+#include "string_pool.h"
 
 class Sheet;
 
-class Cell : public CellInterface {
+// The content of a cell as the undo history keeps it: no cell at all, an empty cell kept
+// for the formulas referencing it, a text, or a compiled formula moved out of its cell
+// (published snapshots may share it still)
+struct EmptyCellContent { };
+using CellContent = std::variant<std::monostate, EmptyCellContent, std::string, std::shared_ptr<FormulaInterface>>;
+
+class Cell final : public CellInterface, public CountedNew<MemoryCategory::CellStorage> {
+public:     // types
+    using CellSet = std::unordered_set<Cell*, std::hash<Cell*>, std::equal_to<Cell*>
+        , CountingAllocator<Cell*, MemoryCategory::Dependencies>>;
+
 public:     // constructors 
-    Cell(SheetInterface& sheet);
+    Cell(Sheet& sheet, Position pos);
     ~Cell();
 
 public:     // methods 
-    void Set(std::string& text);
+    // Puts `content` in the cell and leaves the replaced content in it, a formula is moved
+    // out unlinked. A text is parsed, a kept formula is linked again as it is. Throws before
+    // any change if the formula is invalid or would close a cycle
+    void Exchange(CellContent& content);
 
     Value GetValue() const override;
     std::string GetText() const override;
+    // the value as a formula operand, throws FormulaError for an error or non-numeric text
+    double GetNumber() const;
+    // the number a lookup finds in a text cell, numeric texts included; nullopt otherwise
+    std::optional<double> GetConstantNumber() const;
+    bool IsFormula() const;
+    // the compiled formula, for the snapshots to share; nullptr for a text
+    std::shared_ptr<const FormulaInterface> GetFormula() const;
     std::vector<Position> GetReferencedCells() const override;
+    // the ranges of the lookups and aggregates
+    std::vector<CellRange> GetReferencedRanges() const;
 
     void AddParent(Cell* cell);
     void EraseParent(Cell* parent);
-    void AddChilds(const std::vector<Position>& new_childs);
+    // links to the cells at the given positions of `sheet`, creating missing ones
+    void AddChilds(Sheet& sheet, const std::vector<Position>& new_childs);
 
+    bool IsReferenced() const;
     void Clear();
     void ClearThisInChilds();
 
     void InvalidateCache();
+    // drops the cached values of the formulas depending on this cell, directly or not
+    void InvalidateParents();
+
+    Sheet& GetSheet() const;
+    Position GetPosition() const;
+    // structural edits of the sheet: rows or columns inserted or deleted
+    void SetPosition(Position pos);
+    const CellSet& GetParents() const;
+    void ForgetParents();
+    void EraseChild(Cell* child);
+    // `edited` is the sheet whose rows or columns moved, this one or another
+    void RewriteReferences(const Sheet& edited, const std::function<Position(Position)>& remap);
+    // A sheet this formula refers to was loaded or unloaded: resolves the references
+    // to other sheets again. A reference closing a cycle through the loaded sheet stays #REF!
+    void Relink();
 
-    bool IsCircular(std::vector<std::unordered_set<Cell*>>& cells_stack) const;
+    // true if this cell is one of `cells` or is referenced by them, directly or not;
+    // a range of a lookup references every cell in it
+    bool IsReachableFrom(const std::vector<const Cell*>& cells, const std::vector<CellRange>& ranges = {}) const;
+
+private:        // methods
+    // the existing cells the formula refers to, on this sheet or others
+    std::vector<const Cell*> FindReferencedCells(const FormulaInterface& formula) const;
 
 private:        // Implementations 
-    class Impl {
+    class FormulaImpl;
+
+    class Impl : public CountedNew<MemoryCategory::CellStorage> {
     public:    // fields
         Cell* this_cell_;
 
@@ -44,13 +99,28 @@ private:        // Implementations
     public:     // methods 
         virtual CellInterface::Value GetValue() = 0;
         virtual std::string GetText() = 0;
+        virtual double GetNumber() = 0;
+        virtual std::optional<double> GetConstantNumber() const { return std::nullopt; }
         virtual void InvalidateCache() = 0;
+        // `changed` is a child whose value changed, nullptr if the formula itself did;
+        // true if a cached value was dropped, its parents must drop theirs then
+        virtual bool DropCache(const Cell* changed) { return false; }
+        virtual FormulaImpl* AsFormula() { return nullptr; }
+        // the content for Exchange, a formula is unlinked from its childs
+        virtual CellContent TakeContent() = 0;
         void EraseParent(Cell* parent);
 
         virtual void ClearThisInChilds() { }
         virtual void AddChild(Cell*) = 0;
-        virtual bool IsCircular(std::vector<std::unordered_set<Cell*>>& cells_stack) const { return false; }
+        virtual void EraseChild(Cell*) { }
+        virtual void RewriteReferences(const std::function<Position(Position)>&, bool, std::string_view) { }
+        virtual void Relink() { }
+        virtual const CellSet& GetChilds() const {
+            static const CellSet no_childs;
+            return no_childs;
+        }
         virtual std::vector<Position> GetReferencedCells() const { return {}; }
+        virtual std::vector<CellRange> GetReferencedRanges() const { return {}; }
     };
 
     class EmptyImpl : public Impl {
@@ -61,13 +131,16 @@ private:        // Implementations
     public:     // methods 
         CellInterface::Value GetValue() override;
         std::string GetText() override;
+        double GetNumber() override { return 0.0; }
         void InvalidateCache() override;
+        CellContent TakeContent() override { return EmptyCellContent{}; }
         void AddChild(Cell*) override { }
     };
 
     class TextImpl : public Impl {
     private:        // fields 
-        std::string value_;
+        StringPool::Id text_;                   // in the sheet's pool
+        std::optional<double> number_;          // parsed once, for formulas reading the cell
 
     public:         // constructors 
         TextImpl(std::string text, Cell* cell);
@@ -76,34 +149,113 @@ private:        // Implementations
     public:         //methods 
         CellInterface::Value GetValue() override;
         std::string GetText() override;
+        double GetNumber() override;
+        std::optional<double> GetConstantNumber() const override;
         void InvalidateCache() override;
+        CellContent TakeContent() override { return GetText(); }
+        void AddChild(Cell*) override { }
+
+    private:        // methods
+        StringPool& GetPool() const;
+    };
+
+    // text that is the shortest form of a number, only the number is stored
+    class NumberImpl : public Impl {
+    private:        // fields 
+        double value_;
+
+    public:         // constructors 
+        NumberImpl(double value, Cell* cell);
+        ~NumberImpl();
+
+    public:         //methods 
+        CellInterface::Value GetValue() override;
+        std::string GetText() override;
+        double GetNumber() override { return value_; }
+        std::optional<double> GetConstantNumber() const override { return value_; }
+        void InvalidateCache() override;
+        CellContent TakeContent() override { return GetText(); }
         void AddChild(Cell*) override { }
     };
 
     class FormulaImpl : public Impl {
+    private:        // types
+        // thrown by an evaluation reading a formula not computed yet, which is
+        // computed first before the evaluation is retried
+        struct UncachedChild {
+            FormulaImpl* formula;
+        };
+
+    private:        // constants
+        static constexpr size_t MIN_COLUMN_RUN = 16;
+
     private:        // fields 
-        std::unique_ptr<FormulaInterface> value_;
+        // formulas of a thread waiting for their childs to be computed, and whether
+        // their childs were pushed yet; nested evaluations push on top
+        static inline thread_local std::vector<std::pair<FormulaImpl*, bool>> pending_;
+
+        // nullptr once taken; shared with the published snapshots, which read it on
+        // other threads: it is copied before any change while they hold it
+        std::shared_ptr<FormulaInterface> value_;
         std::optional<Value> cache_;
+        // for a conditional formula, the cells read to compute cache_: edits of the
+        // cells in branches not taken leave the value as it is
+        FormulaInterface::ReadCells read_;
         SheetInterface& sheet_;
-        std::unordered_set<Cell*> childs_;
+        CellSet childs_;      // on any sheet
 
     public:         // constructors 
-        FormulaImpl(std::unique_ptr<FormulaInterface>&& value, SheetInterface& sheet, Cell* cell);
+        FormulaImpl(std::shared_ptr<FormulaInterface> value, SheetInterface& sheet, Cell* cell);
         ~FormulaImpl();
 
     public:         // methods 
         CellInterface::Value GetValue() override;
         std::string GetText() override;
+        double GetNumber() override;
         void InvalidateCache() override;
+        bool DropCache(const Cell* changed) override;
+        FormulaImpl* AsFormula() override { return this; }
+        const std::shared_ptr<FormulaInterface>& GetFormula() const { return value_; }
+        CellContent TakeContent() override;
         void ClearThisInChilds() override;
         void AddChild(Cell* cell) override;
-        bool IsCircular(std::vector<std::unordered_set<Cell*>>& cells_stack) const override;
+        void EraseChild(Cell* cell) override;
+        void RewriteReferences(const std::function<Position(Position)>& remap
+            , bool local, std::string_view sheet_name) override;
+        void Relink() override;
+        const CellSet& GetChilds() const override;
         std::vector<Position> GetReferencedCells() const override;
+        std::vector<CellRange> GetReferencedRanges() const override;
+
+        // links the formula to the cells it refers to and binds it to them;
+        // references to absent sheets wait in the workbook for the sheet to be loaded
+        void Link(bool resolve_external);
+        void BindCells();
+
+    private:        // methods
+        // Computes the uncached formulas this one depends on, deepest first, then this
+        // one, so that no evaluation reads an uncached cell and recurses into it. The
+        // childs of a conditional formula are computed only once it reads them, the
+        // formulas in the ranges of lookups always beforehand
+        void ComputeValue();
+        void Evaluate();
+        // Computes this formula at once with the uncached ones above and below it that
+        // compute the same relative to their row and whose childs are computed, see
+        // ColumnKernel; false, with nothing computed, for a run of fewer than
+        // MIN_COLUMN_RUN rows
+        bool EvaluateColumnRun();
+        // makes value_ this cell's own before it is changed
+        void Unshare();
     };
 
+private:        // methods
+    // a text, or the number it is the shortest form of
+    std::unique_ptr<Impl> MakeText(const std::string& text);
+
 private:        // fields 
     std::unique_ptr<Impl> impl_;
-    SheetInterface& sheet_;
-    std::unordered_set<Cell*> parents_;
+    Sheet& sheet_;
+    Position pos_;
+    CellSet parents_;
 
 };
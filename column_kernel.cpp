@@ -0,0 +1,249 @@
+#include "column_kernel.h"
+
+#include <cmath>
+#include <limits>
+#include <utility>
+
+using Op = ASTImpl::Instruction::Op;
+
+namespace {
+    // the rows of a block; each loop runs over whole arrays, with no early exit nor
+    // call, for the compiler to vectorize it. A row keeps its first error, the values
+    // computed after it are never read
+    template <typename Operation>
+    void ApplyBinary(double* lhs, const double* rhs, size_t rows, Operation operation) {
+        for (size_t i = 0; i < rows; ++i) {
+            lhs[i] = operation(lhs[i], rhs[i]);
+        }
+    }
+
+    // the error of a row at the first instruction it fails, as FormulaError thrown there
+    void MarkErrors(uint8_t* errors, const uint8_t* found, size_t rows) {
+        for (size_t i = 0; i < rows; ++i) {
+            errors[i] = errors[i] ? errors[i] : found[i];
+        }
+    }
+
+    // BinaryOpExpr::Apply: an overflow, and inf or nan from the operands, is #DIV/0!
+    void MarkNonFinite(uint8_t* errors, const double* values, size_t rows, uint8_t div0) {
+        for (size_t i = 0; i < rows; ++i) {
+            const bool finite = std::abs(values[i]) <= std::numeric_limits<double>::max();
+            errors[i] = errors[i] ? errors[i] : finite ? 0 : div0;
+        }
+    }
+}  // namespace
+
+ColumnKernel::ColumnKernel(const FormulaAST& anchor, int anchor_row, std::vector<bool> relative)
+    : program_(&anchor.GetProgram())
+    , stack_depth_(anchor.GetStackDepth())
+    , anchor_row_(anchor_row)
+    , relative_(std::move(relative)) { }
+
+bool ColumnKernel::Supports(const FormulaAST& ast) {
+    bool reads_cells = false;
+    for (const ASTImpl::Instruction& instruction : ast.GetProgram()) {
+        switch (instruction.op) {
+        case Op::Number:
+        case Op::Negate:
+        case Op::Add:
+        case Op::Subtract:
+        case Op::Multiply:
+        case Op::Divide:
+        case Op::Less:
+        case Op::LessEqual:
+        case Op::Greater:
+        case Op::GreaterEqual:
+        case Op::Equal:
+        case Op::NotEqual:
+            break;
+        case Op::Cell:
+            // other sheets and #REF! read no cell of the column's sheet
+            if (instruction.sheet || !instruction.cell->IsValid()) {
+                return false;
+            }
+            reads_cells = true;
+            break;
+        default:
+            return false;
+        }
+    }
+    return reads_cells;
+}
+
+std::optional<ColumnKernel> ColumnKernel::Match(const FormulaAST& anchor, int anchor_row
+    , const FormulaAST& other, int other_row) {
+    const ASTImpl::Program& anchor_program = anchor.GetProgram();
+    const ASTImpl::Program& other_program = other.GetProgram();
+    if (anchor_program.size() != other_program.size() || anchor_row == other_row) {
+        return std::nullopt;
+    }
+    std::vector<bool> relative;
+    for (size_t i = 0; i < anchor_program.size(); ++i) {
+        const ASTImpl::Instruction& lhs = anchor_program[i];
+        const ASTImpl::Instruction& rhs = other_program[i];
+        if (lhs.op != rhs.op) {
+            return std::nullopt;
+        }
+        if (lhs.op == Op::Number && !(lhs.number == rhs.number && std::signbit(lhs.number) == std::signbit(rhs.number))) {
+            return std::nullopt;
+        }
+        if (lhs.op != Op::Cell) {
+            continue;
+        }
+        const Position& lhs_cell = *lhs.cell;
+        const Position& rhs_cell = *rhs.cell;
+        if (lhs_cell.col != rhs_cell.col) {
+            return std::nullopt;
+        }
+        if (lhs_cell.row - anchor_row == rhs_cell.row - other_row) {
+            relative.push_back(true);
+        } else if (lhs_cell.row == rhs_cell.row) {
+            relative.push_back(false);
+        } else {
+            return std::nullopt;
+        }
+    }
+    return ColumnKernel(anchor, anchor_row, std::move(relative));
+}
+
+bool ColumnKernel::Matches(const FormulaAST& ast, int row) const {
+    const ASTImpl::Program& program = ast.GetProgram();
+    if (program.size() != program_->size()) {
+        return false;
+    }
+    size_t cell = 0;
+    for (size_t i = 0; i < program.size(); ++i) {
+        const ASTImpl::Instruction& lhs = (*program_)[i];
+        const ASTImpl::Instruction& rhs = program[i];
+        if (lhs.op != rhs.op || lhs.sheet != rhs.sheet) {
+            return false;
+        }
+        if (lhs.op == Op::Number && !(lhs.number == rhs.number && std::signbit(lhs.number) == std::signbit(rhs.number))) {
+            return false;
+        }
+        if (lhs.op != Op::Cell) {
+            continue;
+        }
+        const Position expected = relative_[cell++]
+            ? Position{ lhs.cell->row + row - anchor_row_, lhs.cell->col }
+            : *lhs.cell;
+        if (!(*rhs.cell == expected)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ColumnKernel::Run(const Operands& operands, std::vector<Result>& results) const {
+    const size_t cell_count = relative_.size();
+    const size_t row_count = operands.values.size() / cell_count;
+    Scratch scratch;
+    scratch.cells.resize(cell_count * BLOCK_ROWS);
+    scratch.cell_errors.resize(cell_count * BLOCK_ROWS);
+    scratch.stack.resize(stack_depth_ * BLOCK_ROWS);
+    scratch.errors.resize(BLOCK_ROWS);
+    results.resize(row_count);
+    for (size_t start = 0; start < row_count; start += BLOCK_ROWS) {
+        const size_t rows = std::min(BLOCK_ROWS, row_count - start);
+        // by instruction for the loops of the block
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t cell = 0; cell < cell_count; ++cell) {
+                scratch.cells[cell * BLOCK_ROWS + i] = operands.values[(start + i) * cell_count + cell];
+                scratch.cell_errors[cell * BLOCK_ROWS + i] = operands.errors[(start + i) * cell_count + cell];
+            }
+        }
+        RunBlock(scratch, rows, results.data() + start);
+    }
+}
+
+void ColumnKernel::RunBlock(Scratch& scratch, size_t rows, Result* results) const {
+    const uint8_t div0 = ToCode(FormulaError::Category::Div0);
+    uint8_t* errors = scratch.errors.data();
+    std::fill(errors, errors + rows, 0);
+    const auto operand = [&scratch](size_t index) {
+        return &scratch.stack[index * BLOCK_ROWS];
+    };
+    size_t top = 0;
+    size_t cell = 0;
+    for (const ASTImpl::Instruction& instruction : *program_) {
+        double* lhs = top >= 2 ? operand(top - 2) : nullptr;
+        const double* rhs = top >= 1 ? operand(top - 1) : nullptr;
+        switch (instruction.op) {
+        case Op::Number: {
+            double* values = operand(top++);
+            std::fill(values, values + rows, instruction.number);
+            break;
+        }
+        case Op::Cell: {
+            const double* values = &scratch.cells[cell * BLOCK_ROWS];
+            std::copy(values, values + rows, operand(top++));
+            MarkErrors(errors, &scratch.cell_errors[cell * BLOCK_ROWS], rows);
+            ++cell;
+            break;
+        }
+        case Op::Negate: {
+            double* values = operand(top - 1);
+            for (size_t i = 0; i < rows; ++i) {
+                values[i] = -values[i];
+            }
+            break;
+        }
+        case Op::Add:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return x + y; });
+            MarkNonFinite(errors, lhs, rows, div0);
+            --top;
+            break;
+        case Op::Subtract:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return x - y; });
+            MarkNonFinite(errors, lhs, rows, div0);
+            --top;
+            break;
+        case Op::Multiply:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return x * y; });
+            MarkNonFinite(errors, lhs, rows, div0);
+            --top;
+            break;
+        case Op::Divide:
+            // as BinaryOpExpr::Apply, a divisor near zero fails before the division
+            for (size_t i = 0; i < rows; ++i) {
+                errors[i] = errors[i] ? errors[i] : std::abs(rhs[i]) < ASTImpl::INACCURACY ? div0 : 0;
+            }
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return x / y; });
+            MarkNonFinite(errors, lhs, rows, div0);
+            --top;
+            break;
+        case Op::Less:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return static_cast<double>(x < y); });
+            --top;
+            break;
+        case Op::LessEqual:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return static_cast<double>(x <= y); });
+            --top;
+            break;
+        case Op::Greater:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return static_cast<double>(x > y); });
+            --top;
+            break;
+        case Op::GreaterEqual:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return static_cast<double>(x >= y); });
+            --top;
+            break;
+        case Op::Equal:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return static_cast<double>(x == y); });
+            --top;
+            break;
+        case Op::NotEqual:
+            ApplyBinary(lhs, rhs, rows, [](double x, double y) { return static_cast<double>(x != y); });
+            --top;
+            break;
+        default:
+            // not Supports()
+            break;
+        }
+    }
+    const double* values = operand(0);
+    for (size_t i = 0; i < rows; ++i) {
+        results[i].value = values[i];
+        results[i].error = errors[i] ? std::optional(static_cast<FormulaError::Category>(errors[i] - 1)) : std::nullopt;
+    }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "FormulaAST.h"
+#include "common.h"
+
+// Evaluates a run of formulas down a column at once: the formulas of consecutive rows
+// that compute the same relative to their row, as =A1*B1+C1 filled down. Only
+// straight-line programs qualify, arithmetic and comparisons of numbers and of cells of
+// the formula's own sheet. The program of one row of the run is executed instruction
+// after instruction over blocks of rows, with loops over arrays of doubles that the
+// compiler vectorizes. Each row gets the value, or the first error, its own evaluation
+// would give, bit for bit
+class ColumnKernel {
+public:         // types
+    // the value of a row unless error is set
+    struct Result {
+        double value = 0;
+        std::optional<FormulaError::Category> error;
+    };
+
+    // what the Cell instructions of the rows of a run read, row after row
+    struct Operands {
+        std::vector<double> values;
+        std::vector<uint8_t> errors;        // 0, or the category read plus one
+    };
+
+private:        // types
+    // the arrays of one block of rows
+    struct Scratch {
+        std::vector<double> cells;          // by Cell instruction, then by row
+        std::vector<uint8_t> cell_errors;   // as Operands::errors
+        std::vector<double> stack;          // by operand, then by row
+        std::vector<uint8_t> errors;        // of the rows, as cell_errors
+    };
+
+public:         // constants
+    static constexpr size_t BLOCK_ROWS = 256;
+
+private:        // fields
+    const ASTImpl::Program* program_;   // of the formula at anchor_row_
+    size_t stack_depth_;
+    int anchor_row_;
+    // by Cell instruction, in program order: true if the reference moves with the row,
+    // false if every row reads the same cell
+    std::vector<bool> relative_;
+
+public:         // methods
+    // true if the formula is a straight-line program reading cells, which a kernel runs
+    static bool Supports(const FormulaAST& ast);
+    // The kernel of the two supported formulas at these rows of a column, nullopt if they
+    // differ by more than their row. The anchor must outlive the kernel
+    static std::optional<ColumnKernel> Match(const FormulaAST& anchor, int anchor_row
+        , const FormulaAST& other, int other_row);
+    // true if the supported formula at `row` computes what the anchor does at its row
+    bool Matches(const FormulaAST& ast, int row) const;
+
+    // Appends the operands of a formula the kernel Matches, as its evaluation reads them.
+    // CellReader is std::optional<double>(const ASTImpl::Instruction&), the operand of a
+    // Cell instruction, nullopt for a formula not computed yet: false then, with nothing
+    // appended. It throws FormulaError as the operand would
+    template <typename CellReader>
+    bool Gather(const FormulaAST& ast, const CellReader& read, Operands& operands) const;
+    // computes the rows gathered, in the order they were, into results
+    void Run(const Operands& operands, std::vector<Result>& results) const;
+
+private:        // constructors
+    ColumnKernel(const FormulaAST& anchor, int anchor_row, std::vector<bool> relative);
+
+private:        // methods
+    // the operands read of the cells are in scratch, the results of `rows` rows go to results
+    void RunBlock(Scratch& scratch, size_t rows, Result* results) const;
+    static uint8_t ToCode(FormulaError::Category category) { return static_cast<uint8_t>(category) + 1; }
+};
+
+template <typename CellReader>
+bool ColumnKernel::Gather(const FormulaAST& ast, const CellReader& read, Operands& operands) const {
+    const size_t size = operands.values.size();
+    for (const ASTImpl::Instruction& instruction : ast.GetProgram()) {
+        if (instruction.op != ASTImpl::Instruction::Op::Cell) {
+            continue;
+        }
+        try {
+            const std::optional<double> value = read(instruction);
+            if (!value) {
+                operands.values.resize(size);
+                operands.errors.resize(size);
+                return false;
+            }
+            operands.values.push_back(*value);
+            operands.errors.push_back(0);
+        }
+        catch (const FormulaError& exc) {
+            operands.values.push_back(0);
+            operands.errors.push_back(ToCode(exc.GetCategory()));
+        }
+    }
+    return true;
+}
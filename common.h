@@ -1,5 +1,6 @@
 #pragma once
 
+#include <charconv>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -20,11 +21,16 @@ struct Position {
 
     bool IsValid() const;
     std::string ToString() const;
+    // Writes ToString() to [first, last) without a terminating zero, like std::to_chars:
+    // errc::value_too_large if it does not fit, nothing at all for an invalid position
+    std::to_chars_result ToChars(char* first, char* last) const;
 
+    // Position::NONE unless str is a valid position
     static Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    static const int MAX_STRING_LENGTH = 8;     // XFD16384
     static const Position NONE;
 };
 
@@ -37,7 +43,7 @@ struct Size {
 
 class FormulaError {
 public:
-    enum class Category { Ref, Value, Div0 };
+    enum class Category { Ref, Value, Div0, NA };
     FormulaError(Category category);
     Category GetCategory() const;
     bool operator==(FormulaError rhs) const;
@@ -46,9 +52,10 @@ public:
 private:
     Category category_ = Category::Div0;
     std::map<Category, std::string> category_string_ = {
-        {Category::Ref, "#DIV/0!"s},
+        {Category::Ref, "#REF!"s},
         {Category::Value, "#VALUE!"s},
-        {Category::Div0, "#DIV/0!"s}
+        {Category::Div0, "#DIV/0!"s},
+        {Category::NA, "#N/A"s}
     };
 };
 
@@ -0,0 +1,94 @@
+#include "data_table.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "fork.h"
+#include "sheet.h"
+
+DataTable::DataTable(std::vector<Position> inputs, std::vector<Position> outputs)
+    : inputs_(std::move(inputs))
+    , outputs_(std::move(outputs)) {
+    for (const std::vector<Position>* positions : { &inputs_, &outputs_ }) {
+        if (!std::all_of(positions->begin(), positions->end(), [](Position pos) { return pos.IsValid(); })) {
+            throw InvalidPositionException("");
+        }
+    }
+}
+
+void DataTable::AddPoint(std::vector<std::string> texts) {
+    if (texts.size() != inputs_.size()) {
+        throw std::invalid_argument("a data table point needs a text for each input");
+    }
+    std::move(texts.begin(), texts.end(), std::back_inserter(points_));
+}
+
+size_t DataTable::GetPointCount() const {
+    return inputs_.empty() ? 0 : points_.size() / inputs_.size();
+}
+
+void DataTable::Evaluate(const Sheet& sheet, size_t threads) {
+    const size_t point_count = GetPointCount();
+    std::vector<CellInterface::Value> results(point_count * outputs_.size());
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max<size_t>(1, std::min(threads, point_count));
+
+    // one version for every point
+    const SheetFork base(sheet);
+    std::atomic<size_t> next_point{ 0 };
+    // by thread: the point that failed, and why
+    std::vector<std::pair<size_t, std::exception_ptr>> failures(threads, { point_count, nullptr });
+    const auto work = [&](size_t thread) {
+        SheetFork fork(base);
+        size_t point = 0;
+        try {
+            while ((point = next_point.fetch_add(1, std::memory_order_relaxed)) < point_count) {
+                for (size_t i = 0; i < inputs_.size(); ++i) {
+                    fork.SetCell(inputs_[i], points_[point * inputs_.size() + i]);
+                }
+                for (size_t i = 0; i < outputs_.size(); ++i) {
+                    const SheetFork::Entry* entry = fork.GetCell(outputs_[i]);
+                    results[point * outputs_.size() + i] = entry ? entry->value : CellInterface::Value(std::string());
+                }
+                fork.Reset();
+            }
+        }
+        catch (...) {
+            failures[thread] = { point, std::current_exception() };
+            // the points are taken in order, those before this one are still evaluated
+            next_point = point_count;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t thread = 1; thread < threads; ++thread) {
+        workers.emplace_back(work, thread);
+    }
+    work(0);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    const auto first_failure = std::min_element(failures.begin(), failures.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    if (first_failure->second) {
+        std::rethrow_exception(first_failure->second);
+    }
+    results_ = std::move(results);
+}
+
+const CellInterface::Value& DataTable::GetResult(size_t point, size_t output) const {
+    if (output >= outputs_.size()) {
+        throw std::out_of_range("no such output in the data table");
+    }
+    return results_.at(point * outputs_.size() + output);
+}
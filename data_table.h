@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+class Sheet;
+
+// A what-if table of a sheet: the values of output cells at each point, a set of texts
+// of the input cells. The points are evaluated in parallel on forks of the last
+// published state of the sheet, which is left as it is. The forks share the compiled
+// formulas of the version and the index of their references; each thread holds one
+// fork, reset between its points, for the cells that diverge
+class DataTable {
+private:        // fields
+    std::vector<Position> inputs_;
+    std::vector<Position> outputs_;
+    std::vector<std::string> points_;               // the texts of the inputs, point after point
+    std::vector<CellInterface::Value> results_;     // the outputs, point after point
+
+public:         // constructors
+    // throws InvalidPositionException
+    DataTable(std::vector<Position> inputs, std::vector<Position> outputs);
+
+public:         // methods
+    // the texts to set in the inputs, in their order, as Sheet::SetCell takes them;
+    // throws std::invalid_argument if they are not one for each input
+    void AddPoint(std::vector<std::string> texts);
+    size_t GetPointCount() const;
+
+    // threads: 0 for one per core. Throws as Sheet::SetCell for the first point whose
+    // texts cannot be set, the results of the previous evaluation are kept then
+    void Evaluate(const Sheet& sheet, size_t threads = 0);
+    // of the last evaluation: the value of the output at the point, an empty text if
+    // there is no cell
+    const CellInterface::Value& GetResult(size_t point, size_t output) const;
+};
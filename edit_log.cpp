@@ -0,0 +1,585 @@
+#include "edit_log.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "sheet.h"
+
+namespace {
+    // File layout: an 8-byte magic, the number of the last edit before the records, then
+    // the records. A record is its payload size and CRC-32, then the payload: the
+    // operation, two 32-bit arguments (a position, or the first row and the count) and
+    // for SetCell the text. A Batch has the structure of its structural edit, one byte,
+    // then its cells: position, text size or -1 to clear, text. Integers are little-endian
+    constexpr const char LOG_MAGIC[] = "SSEDLOG1";
+    constexpr const char SNAPSHOT_MAGIC[] = "SSSNAPS1";
+    constexpr size_t MAGIC_SIZE = 8;
+    constexpr size_t HEADER_SIZE = MAGIC_SIZE + 8;
+    constexpr size_t RECORD_HEADER_SIZE = 8;
+    constexpr size_t PAYLOAD_HEADER_SIZE = 9;
+    constexpr size_t BATCH_CELL_HEADER_SIZE = 12;
+
+    constexpr std::array<uint32_t, 256> MakeCrcTable() {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = crc & 1 ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+            }
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    constexpr std::array<uint32_t, 256> CRC_TABLE = MakeCrcTable();
+
+    uint32_t Crc32(std::string_view data) {
+        uint32_t crc = 0xFFFFFFFFu;
+        for (const char c : data) {
+            crc = CRC_TABLE[(crc ^ static_cast<uint8_t>(c)) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    template <typename Int>
+    void PutInt(std::string& out, Int value) {
+        for (size_t i = 0; i < sizeof(Int); ++i) {
+            out.push_back(static_cast<char>(static_cast<uint64_t>(value) >> (8 * i) & 0xFF));
+        }
+    }
+
+    template <typename Int>
+    Int GetInt(const char* data) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < sizeof(Int); ++i) {
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+        }
+        return static_cast<Int>(value);
+    }
+
+    // appends a record with room for its header, then fills the header in
+    void PutRecord(std::string& out, uint8_t op, int32_t a, int32_t b, std::string_view text) {
+        const size_t start = out.size();
+        out.resize(start + RECORD_HEADER_SIZE);
+        out.push_back(static_cast<char>(op));
+        PutInt(out, a);
+        PutInt(out, b);
+        out.append(text);
+        const std::string_view payload(out.data() + start + RECORD_HEADER_SIZE, out.size() - start - RECORD_HEADER_SIZE);
+        std::string header;
+        PutInt(header, static_cast<uint32_t>(payload.size()));
+        PutInt(header, Crc32(payload));
+        out.replace(start, RECORD_HEADER_SIZE, header);
+    }
+
+    // one cell of a Batch, nullptr text to clear it
+    void PutBatchCell(std::string& out, Position pos, const std::string* text) {
+        PutInt(out, static_cast<int32_t>(pos.row));
+        PutInt(out, static_cast<int32_t>(pos.col));
+        PutInt(out, text ? static_cast<int32_t>(text->size()) : int32_t{ -1 });
+        if (text) {
+            out.append(*text);
+        }
+    }
+
+    // the payload of the record at `offset`, nullopt if it is cut or does not match its checksum
+    std::optional<std::string_view> ReadRecord(std::string_view data, size_t offset) {
+        if (data.size() - offset < RECORD_HEADER_SIZE) {
+            return std::nullopt;
+        }
+        const uint32_t size = GetInt<uint32_t>(data.data() + offset);
+        const uint32_t crc = GetInt<uint32_t>(data.data() + offset + 4);
+        if (data.size() - offset - RECORD_HEADER_SIZE < size) {
+            return std::nullopt;
+        }
+        const std::string_view payload = data.substr(offset + RECORD_HEADER_SIZE, size);
+        if (Crc32(payload) != crc) {
+            return std::nullopt;
+        }
+        return payload;
+    }
+
+    [[noreturn]] void ThrowSystemError(const std::string& what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+#ifdef _WIN32
+    int OpenFile(const std::string& path, int flags) {
+        return _open(path.c_str(), flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+    }
+    int WriteSome(int fd, const char* data, size_t size) {
+        return _write(fd, data, static_cast<unsigned>(std::min<size_t>(size, 1 << 30)));
+    }
+    int SyncFile(int fd) {
+        return _commit(fd);
+    }
+    int TruncateFile(int fd, uint64_t size) {
+        return _chsize_s(fd, static_cast<__int64>(size));
+    }
+    int CloseFile(int fd) {
+        return _close(fd);
+    }
+    constexpr int APPEND_FLAGS = _O_WRONLY | _O_APPEND;
+    constexpr int CREATE_FLAGS = _O_WRONLY | _O_CREAT | _O_TRUNC;
+#else
+    int OpenFile(const std::string& path, int flags) {
+        return open(path.c_str(), flags | O_CLOEXEC, 0644);
+    }
+    ssize_t WriteSome(int fd, const char* data, size_t size) {
+        return write(fd, data, size);
+    }
+    int SyncFile(int fd) {
+        return fsync(fd);
+    }
+    int TruncateFile(int fd, uint64_t size) {
+        return ftruncate(fd, static_cast<off_t>(size));
+    }
+    int CloseFile(int fd) {
+        return close(fd);
+    }
+    constexpr int APPEND_FLAGS = O_WRONLY | O_APPEND;
+    constexpr int CREATE_FLAGS = O_WRONLY | O_CREAT | O_TRUNC;
+#endif
+
+    void WriteAll(int fd, std::string_view data, const std::string& path) {
+        while (!data.empty()) {
+            const auto written = WriteSome(fd, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ThrowSystemError("cannot write " + path);
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+    }
+
+    // makes a rename in the directory of `path` durable
+    void SyncDirectory(const std::string& path) {
+#ifndef _WIN32
+        std::string directory = std::filesystem::path(path).parent_path().string();
+        const int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ThrowSystemError("cannot open the directory of " + path);
+        }
+        const int result = fsync(fd);
+        close(fd);
+        if (result != 0) {
+            ThrowSystemError("cannot sync the directory of " + path);
+        }
+#endif
+    }
+
+    std::optional<std::string> ReadWholeFile(const std::string& path) {
+        std::ifstream input(path, std::ios::binary);
+        if (!input) {
+            return std::nullopt;
+        }
+        std::string data;
+        input.seekg(0, std::ios::end);
+        data.resize(static_cast<size_t>(input.tellg()));
+        input.seekg(0);
+        if (!input.read(data.data(), static_cast<std::streamsize>(data.size()))) {
+            throw std::runtime_error("cannot read " + path);
+        }
+        return data;
+    }
+
+    // the number in the header, throws if `data` is not a file of this kind
+    uint64_t ReadHeader(std::string_view data, const char* magic, const std::string& path) {
+        if (data.size() < HEADER_SIZE || data.substr(0, MAGIC_SIZE) != std::string_view(magic, MAGIC_SIZE)) {
+            throw std::runtime_error("not a file of an edit log: " + path);
+        }
+        return GetInt<uint64_t>(data.data() + MAGIC_SIZE);
+    }
+}  // namespace
+
+EditLog::EditLog(Sheet& sheet, std::string path, Options options)
+    : sheet_(sheet), path_(std::move(path)), options_(options) {
+    sheet_.CancelRecalculation();
+    {
+        MemoryScope scope(*sheet_.memory_);
+        if (const std::optional<std::string> snapshot = ReadWholeFile(path_ + ".snapshot")) {
+            sequence_ = ReplaySnapshot(*snapshot);
+        }
+        const uint64_t snapshot_sequence = sequence_;
+        if (std::optional<std::string> log = ReadWholeFile(path_ + ".log")) {
+            ReplayLog(*log, snapshot_sequence);
+        } else {
+            WriteFile(path_ + ".log", sequence_, LOG_MAGIC, {});
+            log_base_ = sequence_;
+        }
+    }
+    OpenLog();
+    // the recovered cells are where the edits to undo start from
+    sheet_.ClearUndoHistory();
+    // the values of every replayed cell, computed once whatever the policy
+    sheet_.stale_.clear();
+    sheet_.Publish();
+}
+
+EditLog::~EditLog() {
+    try {
+        Sync();
+    }
+    catch (...) {
+        // the group is lost as if the process had crashed
+    }
+    CloseLog();
+}
+
+void EditLog::SetCell(Position pos, std::string text) {
+    Append(Op::SetCell, pos.row, pos.col, text, [&] {
+        sheet_.SetCell(pos, std::move(text));
+    });
+}
+
+void EditLog::ClearCell(Position pos) {
+    Append(Op::ClearCell, pos.row, pos.col, {}, [&] {
+        sheet_.ClearCell(pos);
+    });
+}
+
+void EditLog::InsertRows(int before, int count) {
+    Append(Op::InsertRows, before, count, {}, [&] {
+        sheet_.InsertRows(before, count);
+    });
+}
+
+void EditLog::DeleteRows(int first, int count) {
+    Append(Op::DeleteRows, first, count, {}, [&] {
+        sheet_.DeleteRows(first, count);
+    });
+}
+
+void EditLog::InsertCols(int before, int count) {
+    Append(Op::InsertCols, before, count, {}, [&] {
+        sheet_.InsertCols(before, count);
+    });
+}
+
+void EditLog::DeleteCols(int first, int count) {
+    Append(Op::DeleteCols, first, count, {}, [&] {
+        sheet_.DeleteCols(first, count);
+    });
+}
+
+void EditLog::SetCells(std::vector<Sheet::CellEdit> edits) {
+    std::string batch(1, static_cast<char>(UndoHistory::Structure::None));
+    for (const Sheet::CellEdit& edit : edits) {
+        PutBatchCell(batch, edit.pos, edit.text ? &*edit.text : nullptr);
+    }
+    Append(Op::Batch, 0, 0, batch, [&] {
+        sheet_.SetCells(std::move(edits));
+    });
+}
+
+bool EditLog::Undo() {
+    CheckNotFailed();
+    if (!sheet_.CanUndo()) {
+        return false;
+    }
+    const UndoHistory::Step& step = sheet_.undo_.PeekUndo();
+    const UndoHistory::Structure structure = UndoHistory::Inverse(step.structure);
+    const int first = step.first;
+    const int count = step.count;
+    // the cells made for references go after the formulas, they are removed then
+    std::vector<Position> cells;
+    for (const auto* records : { &step.cells, &step.created }) {
+        for (const UndoHistory::CellRecord& record : *records) {
+            cells.push_back(record.pos);
+        }
+    }
+    sheet_.Undo();
+    AppendChanges(structure, first, count, cells);
+    return true;
+}
+
+bool EditLog::Redo() {
+    CheckNotFailed();
+    if (!sheet_.CanRedo()) {
+        return false;
+    }
+    const UndoHistory::Step& step = sheet_.undo_.PeekRedo();
+    const UndoHistory::Structure structure = step.structure;
+    const int first = step.first;
+    const int count = step.count;
+    std::vector<Position> cells;
+    for (const UndoHistory::CellRecord& record : step.cells) {
+        cells.push_back(record.pos);
+    }
+    sheet_.Redo();
+    AppendChanges(structure, first, count, cells);
+    return true;
+}
+
+void EditLog::Sync() {
+    if (group_.empty()) {
+        return;
+    }
+    CheckNotFailed();
+    try {
+        WriteAll(fd_, group_, path_ + ".log");
+        if (options_.fsync && SyncFile(fd_) != 0) {
+            ThrowSystemError("cannot sync " + path_ + ".log");
+        }
+    }
+    catch (...) {
+        // Part of the group may be in the log. It is cut off, so that the next sync writes
+        // the group whole where it would have started; written again after a torn copy
+        // of itself, the recovery would stop at the torn record or replay some twice
+        if (TruncateFile(fd_, log_size_) != 0) {
+            failed_ = true;
+        }
+        throw;
+    }
+    log_size_ += group_.size();
+    group_.clear();
+    group_edits_ = 0;
+    if (sequence_ - log_base_ >= options_.compact_after) {
+        Compact();
+    }
+}
+
+void EditLog::Compact() {
+    Sync();
+    std::vector<Position> positions;
+    for (const auto& [row, cells] : sheet_.data_) {
+        for (const auto& [col, cell] : cells) {
+            positions.push_back({ row, col });
+        }
+    }
+    // in position order, so that a snapshot of a given sheet is always the same
+    std::sort(positions.begin(), positions.end());
+    std::string records;
+    for (const Position& pos : positions) {
+        if (const std::string text = sheet_.FindCell(pos)->GetText(); !text.empty()) {
+            PutRecord(records, static_cast<uint8_t>(Op::SetCell), pos.row, pos.col, text);
+        }
+    }
+    // A crash between the two replacements leaves the new snapshot with the old log,
+    // whose edits up to the snapshot are skipped by their numbers
+    WriteFile(path_ + ".snapshot", sequence_, SNAPSHOT_MAGIC, records);
+    CloseLog();
+    WriteFile(path_ + ".log", sequence_, LOG_MAGIC, {});
+    log_base_ = sequence_;
+    OpenLog();
+}
+
+template <typename Apply>
+void EditLog::Append(Op op, int32_t a, int32_t b, std::string_view text, Apply apply) {
+    CheckNotFailed();
+    const size_t start = group_.size();
+    PutRecord(group_, static_cast<uint8_t>(op), a, b, text);
+    try {
+        apply();
+    }
+    catch (...) {
+        group_.resize(start);
+        throw;
+    }
+    EndRecord();
+}
+
+void EditLog::EndRecord() {
+    ++sequence_;
+    if (++group_edits_ >= options_.group_edits) {
+        Sync();
+    }
+}
+
+void EditLog::AppendChanges(UndoHistory::Structure structure, int first, int count, const std::vector<Position>& cells) {
+    std::string batch(1, static_cast<char>(structure));
+    for (const Position& pos : cells) {
+        if (const Cell* cell = sheet_.FindCell(pos)) {
+            const std::string text = cell->GetText();
+            PutBatchCell(batch, pos, &text);
+        } else {
+            PutBatchCell(batch, pos, nullptr);
+        }
+    }
+    PutRecord(group_, static_cast<uint8_t>(Op::Batch), first, count, batch);
+    EndRecord();
+}
+
+bool EditLog::Replay(std::string_view payload) {
+    if (payload.size() < PAYLOAD_HEADER_SIZE) {
+        return false;
+    }
+    const auto op = static_cast<Op>(payload[0]);
+    const int32_t a = GetInt<int32_t>(payload.data() + 1);
+    const int32_t b = GetInt<int32_t>(payload.data() + 5);
+    if (op != Op::SetCell && op != Op::Batch && payload.size() != PAYLOAD_HEADER_SIZE) {
+        return false;
+    }
+    // Applied as the public edits apply theirs, but neither recorded to be undone nor
+    // followed by the recalculation policy: the recovery computes once at the end
+    UndoHistory::Step step;
+    switch (op) {
+    case Op::SetCell:
+    case Op::ClearCell:
+        if (!Position{ a, b }.IsValid()) {
+            return false;
+        }
+        step.cells.push_back({ { a, b }, op == Op::SetCell ? CellContent(std::string(payload.substr(PAYLOAD_HEADER_SIZE)))
+                                                          : CellContent() });
+        sheet_.ApplyStep(step, false);
+        return true;
+    case Op::InsertRows:
+        sheet_.ApplyStructure(UndoHistory::Structure::InsertRows, a, b, false);
+        return true;
+    case Op::DeleteRows:
+        sheet_.ApplyStructure(UndoHistory::Structure::DeleteRows, a, b, false);
+        return true;
+    case Op::InsertCols:
+        sheet_.ApplyStructure(UndoHistory::Structure::InsertCols, a, b, false);
+        return true;
+    case Op::DeleteCols:
+        sheet_.ApplyStructure(UndoHistory::Structure::DeleteCols, a, b, false);
+        return true;
+    case Op::Batch:
+        return ReplayBatch(a, b, payload.substr(PAYLOAD_HEADER_SIZE));
+    }
+    return false;
+}
+
+bool EditLog::ReplayBatch(int32_t first, int32_t count, std::string_view data) {
+    if (data.empty() || static_cast<uint8_t>(data[0]) > static_cast<uint8_t>(UndoHistory::Structure::DeleteCols)) {
+        return false;
+    }
+    const auto structure = static_cast<UndoHistory::Structure>(data[0]);
+    // read whole before anything is applied
+    UndoHistory::Step step;
+    for (size_t offset = 1; offset < data.size();) {
+        if (data.size() - offset < BATCH_CELL_HEADER_SIZE) {
+            return false;
+        }
+        const Position pos{ GetInt<int32_t>(data.data() + offset), GetInt<int32_t>(data.data() + offset + 4) };
+        const int32_t size = GetInt<int32_t>(data.data() + offset + 8);
+        offset += BATCH_CELL_HEADER_SIZE;
+        if (!pos.IsValid() || size < -1 || (size > 0 && data.size() - offset < static_cast<size_t>(size))) {
+            return false;
+        }
+        if (size < 0) {
+            step.cells.push_back({ pos, CellContent() });
+        } else {
+            step.cells.push_back({ pos, CellContent(std::string(data.substr(offset, size))) });
+            offset += size;
+        }
+    }
+    if (structure != UndoHistory::Structure::None) {
+        sheet_.ApplyStructure(structure, first, count, false);
+    }
+    sheet_.ApplyStep(step, false);
+    return true;
+}
+
+uint64_t EditLog::ReplaySnapshot(const std::string& data) {
+    const std::string path = path_ + ".snapshot";
+    const uint64_t sequence = ReadHeader(data, SNAPSHOT_MAGIC, path);
+    // written whole before it replaced the previous one, so every record must be sound
+    for (size_t offset = HEADER_SIZE; offset < data.size();) {
+        const std::optional<std::string_view> payload = ReadRecord(data, offset);
+        if (!payload || payload->empty() || static_cast<Op>((*payload)[0]) != Op::SetCell || !Replay(*payload)) {
+            throw std::runtime_error("corrupt snapshot " + path);
+        }
+        ++recovery_.snapshot_edits;
+        offset += RECORD_HEADER_SIZE + payload->size();
+    }
+    return sequence;
+}
+
+void EditLog::ReplayLog(const std::string& data, uint64_t snapshot_sequence) {
+    const std::string path = path_ + ".log";
+    log_base_ = ReadHeader(data, LOG_MAGIC, path);
+    if (log_base_ > snapshot_sequence) {
+        throw std::runtime_error("the snapshot is older than the edit log " + path);
+    }
+    uint64_t sequence = log_base_;
+    size_t offset = HEADER_SIZE;
+    // the last group may be cut anywhere by a crash, the log ends before it
+    while (const std::optional<std::string_view> payload = ReadRecord(data, offset)) {
+        if (++sequence > snapshot_sequence) {
+            if (!Replay(*payload)) {
+                throw std::runtime_error("corrupt edit log " + path);
+            }
+            ++recovery_.log_edits;
+        }
+        offset += RECORD_HEADER_SIZE + payload->size();
+    }
+    recovery_.torn_bytes = data.size() - offset;
+    sequence_ = std::max(sequence, snapshot_sequence);
+
+    if (log_base_ < snapshot_sequence) {
+        // a compaction was cut before it emptied the log
+        WriteFile(path, sequence_, LOG_MAGIC, {});
+        log_base_ = sequence_;
+    } else if (recovery_.torn_bytes > 0) {
+        std::filesystem::resize_file(path, offset);
+    }
+}
+
+void EditLog::WriteFile(const std::string& path, uint64_t sequence, const char* magic, const std::string& records) const {
+    const std::string temporary = path + ".tmp";
+    const int fd = OpenFile(temporary, CREATE_FLAGS);
+    if (fd < 0) {
+        ThrowSystemError("cannot create " + temporary);
+    }
+    try {
+        std::string header(magic, MAGIC_SIZE);
+        PutInt(header, sequence);
+        WriteAll(fd, header, temporary);
+        WriteAll(fd, records, temporary);
+        if (options_.fsync && SyncFile(fd) != 0) {
+            ThrowSystemError("cannot sync " + temporary);
+        }
+    }
+    catch (...) {
+        CloseFile(fd);
+        throw;
+    }
+    if (CloseFile(fd) != 0) {
+        ThrowSystemError("cannot close " + temporary);
+    }
+    std::filesystem::rename(temporary, path);
+    if (options_.fsync) {
+        SyncDirectory(path);
+    }
+}
+
+void EditLog::OpenLog() {
+    fd_ = OpenFile(path_ + ".log", APPEND_FLAGS);
+    if (fd_ < 0) {
+        ThrowSystemError("cannot open " + path_ + ".log");
+    }
+    log_size_ = std::filesystem::file_size(path_ + ".log");
+}
+
+void EditLog::CloseLog() {
+    if (fd_ >= 0) {
+        CloseFile(fd_);
+        fd_ = -1;
+    }
+}
+
+void EditLog::CheckNotFailed() const {
+    if (failed_) {
+        throw std::runtime_error("the edit log " + path_ + ".log failed and takes no more edits");
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "sheet.h"
+
+// Durable edits of a sheet: every edit made through the log is applied to the sheet and
+// appended to a binary write-ahead log, `<path>.log`. Appends are buffered and written
+// in groups, one write and one fsync per group, so an edit is durable once the group
+// holding it is synced. Compaction writes every cell text to `<path>.snapshot` and
+// empties the log; it runs after `compact_after` logged edits or on request.
+// A group that fails to be written or synced is cut off the log again and stays
+// buffered for the next sync; if the log cannot be cut, it takes no more edits.
+// Edits made to the sheet directly are not logged and are lost on a crash.
+class EditLog {
+public:         // types
+    struct Options {
+        size_t group_edits = 1024;          // a group is synced once this many edits are buffered
+        uint64_t compact_after = 1 << 20;   // logged edits that trigger a compaction at a sync
+        bool fsync = true;                  // off, a group survives a crash of the process only
+    };
+
+    // what the opening found on disk
+    struct Recovery {
+        uint64_t snapshot_edits = 0;    // cells set from the snapshot
+        uint64_t log_edits = 0;         // edits replayed from the log
+        uint64_t torn_bytes = 0;        // of a last group cut by the crash, dropped
+    };
+
+private:        // types
+    // Batch: a structural edit or none, then cells set or cleared in order, replayed as
+    // one edit; a SetCells, or what an undo or a redo changed
+    enum class Op : uint8_t { SetCell = 1, ClearCell, InsertRows, DeleteRows, InsertCols, DeleteCols, Batch };
+
+private:        // fields
+    Sheet& sheet_;
+    std::string path_;
+    Options options_;
+    int fd_ = -1;               // of the log, opened for appending
+    uint64_t log_size_ = 0;     // of the log up to the last group synced
+    bool failed_ = false;       // a failed group may be partly in the log
+    std::string group_;         // encoded edits not written yet
+    size_t group_edits_ = 0;
+    uint64_t sequence_ = 0;     // number of the last edit, they are numbered from 1
+    uint64_t log_base_ = 0;     // the log holds the edits after this one
+    Recovery recovery_;
+
+public:         // constructors
+    // Restores the empty `sheet` from the snapshot and the log found at `path`, if any,
+    // and publishes it once at the end; the replay records nothing to undo and computes
+    // no value, whatever the recalculation policy of the sheet.
+    // Throws std::runtime_error if the files cannot be read or written, or are corrupt
+    // elsewhere than at the end of the log
+    EditLog(Sheet& sheet, std::string path, Options options);
+    EditLog(Sheet& sheet, std::string path) : EditLog(sheet, std::move(path), Options{}) { }
+    EditLog(const EditLog&) = delete;
+    EditLog& operator=(const EditLog&) = delete;
+    // syncs the last group
+    ~EditLog();
+
+public:         // methods
+    // As the methods of Sheet; a rejected edit is not logged. An edit filling its group
+    // syncs it and throws as Sync does, the edit made and buffered. Once the log failed
+    // they throw std::runtime_error, leaving the sheet as it is
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+    void InsertRows(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteCols(int first, int count = 1);
+    void SetCells(std::vector<Sheet::CellEdit> edits);
+    // As Sheet::Undo and Sheet::Redo, on the steps of the sheet; logged as the structural
+    // edit and the cell texts they changed, the history itself is not kept on disk
+    bool Undo();
+    bool Redo();
+
+    // writes and fsyncs the buffered edits, they survive any crash from then on.
+    // Throws std::system_error if that fails, the edits are then still buffered
+    void Sync();
+    // syncs, then replaces the snapshot with the current cell texts and empties the log
+    void Compact();
+
+    Sheet& GetSheet() const { return sheet_; }
+    const Recovery& GetRecovery() const { return recovery_; }
+    // edits made through the log, including the recovered ones
+    uint64_t GetSequence() const { return sequence_; }
+
+private:        // methods
+    // encodes the edit, applies it and keeps the record if it was accepted
+    template <typename Apply>
+    void Append(Op op, int32_t a, int32_t b, std::string_view text, Apply apply);
+    // counts the record just kept, syncs a full group
+    void EndRecord();
+    // appends a Batch of the structural edit and the current texts of `cells`, once
+    // an undo or a redo applied them
+    void AppendChanges(UndoHistory::Structure structure, int first, int count, const std::vector<Position>& cells);
+    // applies the payload of a record, false if it is malformed
+    bool Replay(std::string_view payload);
+    bool ReplayBatch(int32_t first, int32_t count, std::string_view data);
+    uint64_t ReplaySnapshot(const std::string& data);
+    void ReplayLog(const std::string& data, uint64_t snapshot_sequence);
+    // atomically replaces `path` with a file of the header and the records
+    void WriteFile(const std::string& path, uint64_t sequence, const char* magic, const std::string& records) const;
+    void OpenLog();
+    void CloseLog();
+    void CheckNotFailed() const;
+};
@@ -0,0 +1,440 @@
+#include "fork.h"
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_set>
+#include <utility>
+
+#include "sheet.h"
+
+void ReaderIndex::Add(Position reader, const FormulaInterface& formula) {
+    for (const Position& pos : formula.GetReferencedCells()) {
+        if (pos.IsValid()) {
+            cells_[pos].push_back(reader);
+        }
+    }
+    for (const CellRange& range : formula.GetReferencedRanges()) {
+        if (!range.first.IsValid()) {
+            continue;
+        }
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            columns_[col].push_back({ range.first.row, range.last.row, reader });
+        }
+    }
+}
+
+void ReaderIndex::Clear() {
+    cells_.clear();
+    columns_.clear();
+}
+
+SheetFork::SheetFork(const Sheet& sheet) {
+    const SnapshotPublisher::ReadGuard snapshot = sheet.ReadSnapshot();
+    const auto make_base = [&sheet](const SheetSnapshot* latest) {
+        auto base = std::make_shared<ForkBase>();
+        base->memory = sheet.memory_;
+        if (latest) {
+            base->version = latest->GetVersion();
+            base->size = latest->GetPrintableSize();
+            base->rows = latest->rows_;
+        } else {
+            base->rows = std::make_shared<const std::vector<SheetSnapshot::RowPtr>>();
+        }
+        return base;
+    };
+    if (!snapshot.Get()) {
+        base_ = make_base(nullptr);
+        return;
+    }
+    // the forks of a version share its base, and the index built in it
+    std::call_once(snapshot->fork_base_made_, [&] {
+        snapshot->fork_base_ = make_base(snapshot.Get());
+    });
+    base_ = snapshot->fork_base_;
+}
+
+SheetFork::~SheetFork() {
+    if (!base_) {
+        return;
+    }
+    // the last rows and formulas of a version may go with this fork
+    const std::shared_ptr<MemoryAccount> memory = base_->memory;
+    MemoryScope scope(*memory);
+    cells_.clear();
+    base_.reset();
+}
+
+void SheetFork::SetCell(Position pos, std::string text) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("");
+    }
+    MemoryScope scope(*base_->memory);
+    Diverged cell;
+    cell.entry.col = pos.col;
+    if (text.size() > 1 && text[0] == '=') {
+        std::shared_ptr<const FormulaInterface> formula = ParseFormula(text.substr(1));
+        if (IsReachable(pos, *formula)) {
+            throw CircularDependencyException("");
+        }
+        cell.entry.text.reserve(formula->GetExpression().size() + 1);
+        cell.entry.text.append(1, '=').append(formula->GetExpression());
+        cell.computed = false;
+        // as in the sheet, a referenced cell exists, empty if it was missing
+        for (const Position& ref : formula->GetReferencedCells()) {
+            if (ref.IsValid() && !FindEntry(ref)) {
+                Replace(ref, Diverged{ Entry{ ref.col, std::string(), std::string(), nullptr } });
+            }
+        }
+        readers_.Add(pos, *formula);
+        cell.entry.formula = std::move(formula);
+    } else {
+        cell.entry.value = text[0] == '\'' ? text.substr(1) : text;
+        cell.entry.text = std::move(text);
+    }
+    Replace(pos, std::move(cell));
+}
+
+void SheetFork::ClearCell(Position pos) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("");
+    }
+    if (!FindEntry(pos)) {
+        return;
+    }
+    MemoryScope scope(*base_->memory);
+    Diverged cell;
+    if (IsReferenced(pos)) {
+        // kept for the formulas referencing it, as an empty cell of the sheet
+        cell.entry = Entry{ pos.col, std::string(), 0.0, nullptr };
+    } else {
+        cell.removed = true;
+    }
+    Replace(pos, std::move(cell));
+}
+
+void SheetFork::Reset() {
+    MemoryScope scope(*base_->memory);
+    cells_.clear();
+    readers_.Clear();
+}
+
+const SheetFork::Entry* SheetFork::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("");
+    }
+    const auto it = cells_.find(pos);
+    if (it == cells_.end()) {
+        return SheetSnapshot::FindEntry(*base_->rows, pos);
+    }
+    Diverged& cell = it->second;
+    if (cell.removed) {
+        return nullptr;
+    }
+    if (!cell.computed) {
+        ComputeValue(cell);
+    }
+    return &cell.entry;
+}
+
+Size SheetFork::GetPrintableSize() const {
+    if (cells_.empty()) {
+        return base_->size;
+    }
+    Size size;
+    ForEachRow([&size](int row, const std::vector<std::pair<int, const Entry*>>& cells) {
+        size.rows = row + 1;
+        size.cols = std::max(size.cols, cells.back().first + 1);
+    });
+    return size;
+}
+
+namespace {
+    // same layout as Sheet::PrintValues / Sheet::PrintTexts
+    template <typename ForEachRow, typename EntryPrinter>
+    void PrintRows(std::ostream& output, Size size, ForEachRow for_each_row, EntryPrinter print) {
+        if (size.rows == 0 || size.cols == 0) {
+            return;
+        }
+        int next_row = 0;
+        const auto print_empty_rows = [&output, &next_row](int end) {
+            for (; next_row < end; ++next_row) {
+                output << '\t' << '\n';
+            }
+        };
+        for_each_row([&](int row, const std::vector<std::pair<int, const SheetSnapshot::Entry*>>& cells) {
+            print_empty_rows(row);
+            auto cell = cells.begin();
+            for (int j = 0; j < size.cols; ++j) {
+                if (j > 0) {
+                    output << '\t';
+                }
+                if (cell != cells.end() && cell->first == j) {
+                    print(*cell->second);
+                    ++cell;
+                }
+            }
+            output << '\n';
+            ++next_row;
+        });
+        print_empty_rows(size.rows);
+    }
+}  // namespace
+
+void SheetFork::PrintValues(std::ostream& output, const NumberFormat& format) const {
+    for (auto& [pos, cell] : cells_) {
+        if (!cell.removed && !cell.computed) {
+            ComputeValue(cell);
+        }
+    }
+    PrintRows(output, GetPrintableSize(), [this](const auto& action) { ForEachRow(action); }
+        , [&output, &format](const Entry& entry) {
+        format.Print(output, entry.value);
+    });
+}
+
+void SheetFork::PrintTexts(std::ostream& output) const {
+    PrintRows(output, GetPrintableSize(), [this](const auto& action) { ForEachRow(action); }
+        , [&output](const Entry& entry) {
+        output << entry.text;
+    });
+}
+
+const SheetFork::Entry* SheetFork::FindEntry(Position pos) const {
+    const auto it = cells_.find(pos);
+    if (it == cells_.end()) {
+        return SheetSnapshot::FindEntry(*base_->rows, pos);
+    }
+    return it->second.removed ? nullptr : &it->second.entry;
+}
+
+const FormulaInterface* SheetFork::FindFormula(Position pos) const {
+    const Entry* entry = FindEntry(pos);
+    return entry ? entry->formula.get() : nullptr;
+}
+
+bool SheetFork::IsReferenced(Position pos) const {
+    bool referenced = false;
+    // the indexes may list formulas replaced since
+    const auto check = [this, pos, &referenced](Position reader) {
+        if (const FormulaInterface* formula = referenced ? nullptr : FindFormula(reader)) {
+            const std::vector<Position> refs = formula->GetReferencedCells();
+            referenced = std::find(refs.begin(), refs.end(), pos) != refs.end();
+        }
+    };
+    GetBaseReaders().ForEachCellReader(pos, check);
+    readers_.ForEachCellReader(pos, check);
+    return referenced;
+}
+
+bool SheetFork::IsReachable(Position pos, const FormulaInterface& formula) const {
+    // a worklist rather than recursion, as Cell::IsReachableFrom
+    std::vector<const FormulaInterface*> to_visit{ &formula };
+    std::unordered_set<Position, ReaderIndex::PositionHash> visited;
+    const auto visit = [&to_visit, &visited](Position ref, const FormulaInterface* referenced) {
+        if (referenced && visited.insert(ref).second) {
+            to_visit.push_back(referenced);
+        }
+    };
+    while (!to_visit.empty()) {
+        const FormulaInterface* current = to_visit.back();
+        to_visit.pop_back();
+        for (const Position& ref : current->GetReferencedCells()) {
+            if (ref == pos) {
+                return true;
+            }
+            visit(ref, FindFormula(ref));
+        }
+        for (const CellRange& range : current->GetReferencedRanges()) {
+            if (!range.first.IsValid()) {
+                continue;
+            }
+            if (range.Contains(pos)) {
+                return true;
+            }
+            ForEachFormulaInRange(range, visit);
+        }
+    }
+    return false;
+}
+
+template <typename Action>
+void SheetFork::ForEachFormulaInRange(const CellRange& range, Action action) const {
+    const std::vector<SheetSnapshot::RowPtr>& rows = *base_->rows;
+    const int last_row = std::min(range.last.row, static_cast<int>(rows.size()) - 1);
+    for (int row = range.first.row; row <= last_row; ++row) {
+        if (!rows[row]) {
+            continue;
+        }
+        auto entry = std::lower_bound(rows[row]->begin(), rows[row]->end(), range.first.col, [](const Entry& entry, int col) {
+            return entry.col < col;
+        });
+        for (; entry != rows[row]->end() && entry->col <= range.last.col; ++entry) {
+            const Position pos{ row, entry->col };
+            if (entry->formula && !cells_.count(pos)) {
+                action(pos, entry->formula.get());
+            }
+        }
+    }
+    for (const auto& [pos, cell] : cells_) {
+        if (!cell.removed && cell.entry.formula && range.Contains(pos)) {
+            action(pos, cell.entry.formula.get());
+        }
+    }
+}
+
+void SheetFork::Replace(Position pos, Diverged cell) {
+    cells_.insert_or_assign(pos, std::move(cell));
+    // a worklist of the cells whose value changed, their readers go stale: a formula
+    // already stale has its own readers stale
+    std::vector<Position> changed{ pos };
+    const auto mark_stale = [this, &changed](Position reader) {
+        const auto it = cells_.find(reader);
+        if (it == cells_.end()) {
+            const Entry* entry = SheetSnapshot::FindEntry(*base_->rows, reader);
+            if (!entry || !entry->formula) {
+                return;
+            }
+            cells_.emplace(reader, Diverged{ *entry, false, false });
+        } else if (it->second.removed || !it->second.entry.formula || !it->second.computed) {
+            return;
+        } else {
+            it->second.computed = false;
+        }
+        changed.push_back(reader);
+    };
+    while (!changed.empty()) {
+        const Position current = changed.back();
+        changed.pop_back();
+        GetBaseReaders().ForEachReader(current, mark_stale);
+        readers_.ForEachReader(current, mark_stale);
+    }
+}
+
+void SheetFork::ComputeValue(Diverged& cell) const {
+    const FormulaInterface::EntryReader read = [this](Position pos) -> const Entry* {
+        const auto it = cells_.find(pos);
+        if (it == cells_.end()) {
+            return SheetSnapshot::FindEntry(*base_->rows, pos);
+        }
+        if (it->second.removed) {
+            return nullptr;
+        }
+        if (!it->second.computed) {
+            throw Uncomputed{ &it->second };
+        }
+        return &it->second.entry;
+    };
+    // deepest first as Cell::FormulaImpl::ComputeValue, with whether the stale cells
+    // read were pushed yet
+    std::vector<std::pair<Diverged*, bool>> pending{ { &cell, false } };
+    while (!pending.empty()) {
+        auto [current, reads_pushed] = pending.back();
+        const FormulaInterface& formula = *current->entry.formula;
+        if (current->computed) {
+            pending.pop_back();
+        } else if (!reads_pushed) {
+            pending.back().second = true;
+            const auto push_stale = [&pending](Diverged& read_cell) {
+                if (!read_cell.removed && !read_cell.computed) {
+                    pending.emplace_back(&read_cell, false);
+                }
+            };
+            if (!formula.IsConditional()) {
+                for (const Position& pos : formula.GetReferencedCells()) {
+                    if (const auto it = cells_.find(pos); it != cells_.end()) {
+                        push_stale(it->second);
+                    }
+                }
+            }
+            // a lookup reads its whole range, one retry per stale formula would be quadratic
+            const std::vector<CellRange> ranges = formula.GetReferencedRanges();
+            if (!ranges.empty()) {
+                for (auto& [pos, read_cell] : cells_) {
+                    const Position read_pos = pos;
+                    if (std::any_of(ranges.begin(), ranges.end(), [read_pos](const CellRange& range) {
+                        return range.first.IsValid() && range.Contains(read_pos);
+                    })) {
+                        push_stale(read_cell);
+                    }
+                }
+            }
+        } else {
+            try {
+                const FormulaInterface::Value result = formula.EvaluateDetached(read);
+                current->entry.value = std::holds_alternative<double>(result)
+                    ? CellInterface::Value(std::get<double>(result))
+                    : CellInterface::Value(std::get<FormulaError>(result));
+                current->computed = true;
+                pending.pop_back();
+            }
+            catch (const Uncomputed& read_cell) {
+                pending.emplace_back(read_cell.cell, false);
+            }
+        }
+    }
+}
+
+const ReaderIndex& SheetFork::GetBaseReaders() const {
+    std::call_once(base_->indexed, [this] {
+        const std::vector<SheetSnapshot::RowPtr>& rows = *base_->rows;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (!rows[i]) {
+                continue;
+            }
+            for (const Entry& entry : *rows[i]) {
+                if (entry.formula) {
+                    base_->readers.Add({ static_cast<int>(i), entry.col }, *entry.formula);
+                }
+            }
+        }
+    });
+    return base_->readers;
+}
+
+template <typename Action>
+void SheetFork::ForEachRow(Action action) const {
+    std::vector<Position> diverged;
+    diverged.reserve(cells_.size());
+    for (const auto& [pos, cell] : cells_) {
+        if (!cell.removed) {
+            diverged.push_back(pos);
+        }
+    }
+    std::sort(diverged.begin(), diverged.end());
+
+    const std::vector<SheetSnapshot::RowPtr>& rows = *base_->rows;
+    const int base_rows = static_cast<int>(rows.size());
+    auto next_diverged = diverged.begin();
+    std::vector<std::pair<int, const Entry*>> cells;
+    for (int row = 0;; ++row) {
+        // the next row with a cell of the snapshot or a diverged one
+        const bool has_diverged = next_diverged != diverged.end();
+        while (row < base_rows && !rows[row] && !(has_diverged && next_diverged->row == row)) {
+            ++row;
+        }
+        if (row >= base_rows) {
+            if (!has_diverged) {
+                break;
+            }
+            row = std::max(row, next_diverged->row);
+        }
+        cells.clear();
+        if (row < base_rows && rows[row]) {
+            for (const Entry& entry : *rows[row]) {
+                if (!cells_.count({ row, entry.col })) {
+                    cells.emplace_back(entry.col, &entry);
+                }
+            }
+        }
+        for (; next_diverged != diverged.end() && next_diverged->row == row; ++next_diverged) {
+            cells.emplace_back(next_diverged->col, &cells_.at(*next_diverged).entry);
+        }
+        if (cells.empty()) {
+            continue;
+        }
+        std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+        action(row, cells);
+    }
+}
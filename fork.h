@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "formula.h"
+#include "memory.h"
+#include "number_format.h"
+#include "snapshot.h"
+
+class Sheet;
+
+// The formulas reading each cell: by reference, or through a range of a lookup or an
+// aggregate. An entry may be stale, the formula at the reader's position is checked
+class ReaderIndex {
+public:         // types
+    struct PositionHash {
+        size_t operator()(Position pos) const {
+            return std::hash<uint64_t>{}(static_cast<uint64_t>(static_cast<uint32_t>(pos.row)) << 32
+                | static_cast<uint32_t>(pos.col));
+        }
+    };
+
+private:        // types
+    struct RangeReader {
+        int first_row;
+        int last_row;
+        Position reader;
+    };
+
+private:        // fields
+    std::unordered_map<Position, std::vector<Position>, PositionHash> cells_;
+    std::unordered_map<int, std::vector<RangeReader>> columns_;     // by column of the range
+
+public:         // methods
+    void Add(Position reader, const FormulaInterface& formula);
+    void Clear();
+
+    // the formulas referencing pos, ranges excluded: a range makes no cell
+    template <typename Action>
+    void ForEachCellReader(Position pos, Action action) const {
+        if (const auto readers = cells_.find(pos); readers != cells_.end()) {
+            for (const Position reader : readers->second) {
+                action(reader);
+            }
+        }
+    }
+    template <typename Action>
+    void ForEachReader(Position pos, Action action) const {
+        ForEachCellReader(pos, action);
+        if (const auto ranges = columns_.find(pos.col); ranges != columns_.end()) {
+            for (const RangeReader& range : ranges->second) {
+                if (pos.row >= range.first_row && pos.row <= range.last_row) {
+                    action(range.reader);
+                }
+            }
+        }
+    }
+};
+
+// What the forks of one published version share
+struct ForkBase {
+    // the sheet's, charged for the rows and formulas that forks free last
+    std::shared_ptr<MemoryAccount> memory;
+    uint64_t version = 0;
+    Size size;
+    std::shared_ptr<const std::vector<SheetSnapshot::RowPtr>> rows;
+    // of the formulas in the rows, made by the first fork that edits a cell
+    std::once_flag indexed;
+    ReaderIndex readers;
+};
+
+// A what-if copy of the last published state of a sheet. Forking copies nothing: the
+// fork shares the rows of the snapshot with their values and compiled formulas, and
+// holds only the cells it diverges on, the edited ones and the formulas depending on
+// them, which it computes again on demand. The sheet, its snapshots and the forks
+// change independently; a fork is used by one thread at a time, any number of forks
+// run concurrently with each other and with the sheet's writer.
+// The first fork of a version to edit a cell indexes the references of its formulas
+// once for all of them. A fork sees its own sheet only: the formulas it computes read
+// references to other sheets as #REF!, and their lookups and aggregates scan the ranges
+class SheetFork {
+public:         // types
+    using Entry = SheetSnapshot::Entry;
+
+private:        // types
+    struct Diverged {
+        Entry entry;
+        bool removed = false;
+        bool computed = true;       // false for a formula whose value is stale
+    };
+
+    // thrown by an evaluation reading a formula not computed yet, which is computed
+    // first before the evaluation is retried
+    struct Uncomputed {
+        Diverged* cell;
+    };
+
+private:        // fields
+    std::shared_ptr<ForkBase> base_;
+    mutable std::unordered_map<Position, Diverged, ReaderIndex::PositionHash> cells_;
+    ReaderIndex readers_;       // of the formulas set in the fork
+
+public:         // constructors
+    // any thread: forks the last published state of `sheet`, empty before the first Publish
+    explicit SheetFork(const Sheet& sheet);
+    SheetFork(const SheetFork&) = default;
+    SheetFork(SheetFork&&) = default;
+    SheetFork& operator=(const SheetFork&) = delete;
+    SheetFork& operator=(SheetFork&&) = delete;
+    ~SheetFork();
+
+public:         // methods
+    // As the methods of Sheet, with the same exceptions
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+    // drops the edits: the fork is as it was forked, and keeps its buckets for the next
+    void Reset();
+    // nullptr if there is no cell at pos, the value is computed if needed;
+    // valid until the next edit
+    const Entry* GetCell(Position pos) const;
+
+    // found by going through the cells once the fork is edited
+    Size GetPrintableSize() const;
+    void PrintValues(std::ostream& output, const NumberFormat& format = NumberFormat()) const;
+    void PrintTexts(std::ostream& output) const;
+
+    // of the snapshot forked, 0 for an empty sheet
+    uint64_t GetBaseVersion() const { return base_->version; }
+    // the cells held apart from the snapshot: edited, or depending on an edited one
+    size_t GetDivergedCount() const { return cells_.size(); }
+
+private:        // methods
+    // the cell as the fork sees it without computing it, nullptr if there is none
+    const Entry* FindEntry(Position pos) const;
+    const FormulaInterface* FindFormula(Position pos) const;
+    // true if a formula of the fork references pos, ranges excluded
+    bool IsReferenced(Position pos) const;
+    // true if pos is read by the formula, directly or not
+    bool IsReachable(Position pos, const FormulaInterface& formula) const;
+    template <typename Action>
+    void ForEachFormulaInRange(const CellRange& range, Action action) const;
+    // puts the entry at pos and marks the formulas reading pos as stale
+    void Replace(Position pos, Diverged cell);
+    void ComputeValue(Diverged& cell) const;
+    const ReaderIndex& GetBaseReaders() const;
+    // the cells of each row in col order, the rows without any are skipped
+    template <typename Action>
+    void ForEachRow(Action action) const;
+};
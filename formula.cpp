@@ -1,7 +1,12 @@
 #include "formula.h"
 
 #include <algorithm>
-#include <functional>
+#include <cerrno>
+#include <cstdlib>
+#include <sstream>
+#include <type_traits>
+
+#include "sheet.h"
 
 using namespace std::literals;
 
@@ -13,54 +18,252 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
 }
 
+std::optional<double> TextToNumber(const std::string& text) {
+    char* endptr;
+    errno = 0;
+    double result = std::strtod(text.c_str(), &endptr);
+    if (*endptr != '\0' || (result == 0.0 && errno == ERANGE && !text.empty())) {
+        return std::nullopt;
+    }
+    return result;
+}
+
 Formula::Formula(std::string expression) try
-    : ast_(ParseFormulaAST(expression)) { }
+    : ast_(ParseFormulaAST(expression)) {
+    PrintExpression();
+}
 catch (const FormulaException& exc) {
     throw FormulaException(expression);
 }
 
-Formula::Value Formula::Evaluate(const SheetInterface& sheet) const try {
-    const std::function<double(Position)> get_cell_value = [&sheet](Position pos) {
-        if (!pos.IsValid()) {
-            throw FormulaError(FormulaError::Category::Ref);
-        }
-        const CellInterface* cell = sheet.GetCell(pos);
+namespace {
+    // what the operators and the scans read of a cell, or of a snapshot entry
+    CellInterface::Value ValueOf(const CellInterface& cell) {
+        return cell.GetValue();
+    }
+    const CellInterface::Value& ValueOf(const SheetSnapshot::Entry& entry) {
+        return entry.value;
+    }
+    bool HasEmptyText(const CellInterface& cell) {
+        return cell.GetText().empty();
+    }
+    bool HasEmptyText(const SheetSnapshot::Entry& entry) {
+        return entry.text.empty();
+    }
+
+    template <typename CellType>
+    double CellValueToNumber(const CellType* cell) {
         if (!cell) {
             return 0.0;
         }
-        CellInterface::Value val = cell->GetValue();
+        decltype(auto) val = ValueOf(*cell);
         if (std::holds_alternative<std::string>(val)) {
-            const std::string str = std::get<std::string>(val);
-            char* endptr;
-            double result = std::strtod(str.c_str(), &endptr);
-            if (*endptr != '\0' || (result == 0.0 && errno == ERANGE && !str.empty())) {
-                throw FormulaError(FormulaError::Category::Value);
+            if (std::optional<double> result = TextToNumber(std::get<std::string>(val))) {
+                return *result;
             }
-            return result;
+            throw FormulaError(FormulaError::Category::Value);
         }
         if (std::holds_alternative<double>(val)) {
             return std::get<double>(val);
         }
         throw std::get<FormulaError>(val);
-    };
-    return ast_.Execute(std::ref(get_cell_value));
+    }
+
+    // the number a lookup compares, nullopt for a cell matching nothing
+    template <typename CellType>
+    std::optional<double> CellValueToLookupNumber(const CellType& cell) {
+        if (HasEmptyText(cell)) {
+            return std::nullopt;
+        }
+        decltype(auto) val = ValueOf(cell);
+        if (std::holds_alternative<std::string>(val)) {
+            // an empty text is no number here, unlike for the operators
+            const std::string& text = std::get<std::string>(val);
+            return text.empty() ? std::nullopt : TextToNumber(text);
+        }
+        if (std::holds_alternative<double>(val)) {
+            return std::get<double>(val);
+        }
+        return std::nullopt;
+    }
+
+    // the cell at pos of a sheet other than Sheet, or of a detached evaluation
+    const CellInterface* FindIn(const SheetInterface& sheet, Position pos) {
+        return sheet.GetCell(pos);
+    }
+    const SheetSnapshot::Entry* FindIn(const FormulaInterface::EntryReader& read, Position pos) {
+        return read(pos);
+    }
+
+    // lookup without an index, for sheets other than Sheet
+    template <typename SheetType>
+    std::optional<int> ScanColumn(const SheetType& sheet, const CellRange& range, double key, MatchSearch search) {
+        std::optional<LookupMatch> best;
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            const auto* cell = FindIn(sheet, { row, range.first.col });
+            if (const std::optional<double> number = cell ? CellValueToLookupNumber(*cell) : std::nullopt) {
+                if (IsBetterMatch(search, key, { *number, row }, best)) {
+                    best = LookupMatch{ *number, row };
+                }
+            }
+        }
+        return best ? std::optional(best->row) : std::nullopt;
+    }
+
+    // aggregates without an index, for sheets other than Sheet
+    template <typename SheetType>
+    RangeSummary ScanRange(const SheetType& sheet, const CellRange& range) {
+        return SummarizeColumns(range, [&sheet, &range](int col) {
+            AggregateTree column;
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                const auto* cell = FindIn(sheet, { row, col });
+                if (!cell) {
+                    continue;
+                }
+                decltype(auto) value = ValueOf(*cell);
+                if (std::holds_alternative<FormulaError>(value)) {
+                    column.Set(row, ColumnAggregate::Error(row, std::get<FormulaError>(value).GetCategory()));
+                } else if (const std::optional<double> number = CellValueToLookupNumber(*cell); number && !std::isnan(*number)) {
+                    column.Set(row, ColumnAggregate::Number(*number));
+                }
+            }
+            return column.Query(range.first.row, range.last.row);
+        });
+    }
+
+    // SheetType is either the concrete Sheet, whose FindCell is inlined, SheetInterface
+    // for any other implementation, or the EntryReader of a detached evaluation
+    template <typename SheetType>
+    Formula::Value EvaluateOn(const FormulaAST& ast, const SheetType& sheet, Formula::ReadCells* read) try {
+        const auto find_in_column = [&sheet](const CellRange& range, double key, MatchSearch search) {
+            if constexpr (std::is_same_v<SheetType, Sheet>) {
+                return sheet.FindInColumn(range, key, search);
+            } else {
+                return ScanColumn(sheet, range, key, search);
+            }
+        };
+        const auto aggregate_range = [&sheet](const CellRange& range) {
+            if constexpr (std::is_same_v<SheetType, Sheet>) {
+                return sheet.AggregateRange(range);
+            } else {
+                return ScanRange(sheet, range);
+            }
+        };
+        return ast.Execute([&sheet, read](Position pos, [[maybe_unused]] const CellInterface* handle
+            , [[maybe_unused]] const std::string* sheet_name) {
+            if (!pos.IsValid()) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            if constexpr (std::is_same_v<SheetType, Sheet>) {
+                // handles are bound by the cells of a Sheet, which keep numeric text parsed
+                const Cell* cell = handle ? static_cast<const Cell*>(handle) : sheet.FindCell(pos);
+                if (read && cell) {
+                    read->push_back(cell);
+                }
+                return cell ? cell->GetNumber() : 0.0;
+            } else if constexpr (std::is_same_v<SheetType, FormulaInterface::EntryReader>) {
+                // the bound cells belong to the sheet, not to the copy read
+                if (sheet_name) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                return CellValueToNumber(sheet(pos));
+            } else {
+                const CellInterface* cell = handle ? handle : sheet.GetCell(pos);
+                if (read && cell) {
+                    read->push_back(cell);
+                }
+                return CellValueToNumber(cell);
+            }
+        }, find_in_column, aggregate_range);
+    }
+    catch (const FormulaError& exc) {
+        return exc;
+    }
+}  // namespace
+
+Formula::Value Formula::Evaluate(const SheetInterface& sheet) const {
+    if (const auto* concrete = dynamic_cast<const Sheet*>(&sheet)) {
+        return EvaluateOn(ast_, *concrete, nullptr);
+    }
+    return EvaluateOn(ast_, sheet, nullptr);
+}
+
+Formula::Value Formula::Evaluate(const SheetInterface& sheet, ReadCells& read) const {
+    if (const auto* concrete = dynamic_cast<const Sheet*>(&sheet)) {
+        return EvaluateOn(ast_, *concrete, &read);
+    }
+    return EvaluateOn(ast_, sheet, &read);
 }
-catch (const FormulaError& exc) {
-    return exc;
+
+Formula::Value Formula::EvaluateDetached(const EntryReader& read) const {
+    return EvaluateOn(ast_, read, nullptr);
 }
 
-std::string Formula::GetExpression() const try {
-    std::stringstream str;
-    ast_.PrintFormula(str);
-    return str.str();
+bool Formula::IsConditional() const {
+    return ast_.IsConditional();
+}
+
+const FormulaAST& Formula::GetAST() const {
+    return ast_;
+}
+
+void Formula::BindCells(const ASTImpl::CellResolver& resolve) {
+    ast_.BindCells(resolve);
+}
+
+void Formula::RewriteReferences(const std::function<Position(Position)>& remap
+    , bool local, std::string_view sheet_name) {
+    if (local) {
+        ast_.RewriteCells(remap);
+    }
+    ast_.RewriteExternalCells(sheet_name, remap);
+    PrintExpression();
+}
+
+std::string_view Formula::GetExpression() const {
+    return expression_;
 }
-catch (const FormulaError& exc) {
+
+void Formula::PrintExpression() {
     std::stringstream str;
-    str << exc;
-    return str.str();
+    try {
+        ast_.PrintFormula(str);
+    }
+    catch (const FormulaError& exc) {
+        str.str("");
+        str << exc;
+    }
+    const std::string text = str.str();
+    // exact capacity, the text is not appended to
+    expression_ = decltype(expression_)(text.begin(), text.end());
 }
 
 std::vector<Position> Formula::GetReferencedCells() const {
-    auto tmp = ast_.GetCells();
-    return { tmp.begin(), std::unique(tmp.begin(), tmp.end()) };
+    std::vector<Position> cells;
+    for (const Position& cell : ast_.GetCells()) {
+        if (cell.IsValid() && (cells.empty() || !(cells.back() == cell))) {
+            cells.push_back(cell);
+        }
+    }
+    return cells;
+}
+
+std::vector<CellRange> Formula::GetReferencedRanges() const {
+    std::vector<CellRange> ranges;
+    for (const CellRange& range : ast_.GetRanges()) {
+        if (range.first.IsValid()) {
+            ranges.push_back(range);
+        }
+    }
+    return ranges;
+}
+
+std::vector<ExternalCell> Formula::GetExternalReferencedCells() const {
+    std::vector<ExternalCell> cells;
+    for (const ExternalCell& cell : ast_.GetExternalCells()) {
+        if (cell.pos.IsValid() && (cells.empty() || cells.back() < cell)) {
+            cells.push_back(cell);
+        }
+    }
+    return cells;
 }
\ No newline at end of file
@@ -1,33 +1,85 @@
 #pragma once 
 
+#include <functional> 
+#include <optional> 
 #include <string> 
+#include <string_view> 
 #include <vector> 
 
 #include "common.h"
 #include "FormulaAST.h"
+#include "memory.h"
+#include "snapshot.h"
 
-class FormulaInterface {
+class FormulaInterface : public CountedNew<MemoryCategory::AstNodes> {
 public:
     using Value = std::variant<double, FormulaError>;
+    // cells read by one evaluation, in the order they were read, with repeats
+    using ReadCells = std::vector<const CellInterface*>;
+    // the cell at a position of the sheet a detached evaluation reads, nullptr if there is none
+    using EntryReader = std::function<const SheetSnapshot::Entry*(Position)>;
 
     FormulaInterface() = default;
     virtual ~FormulaInterface() = default;
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
-    virtual std::string GetExpression() const = 0;
+    // also collects the cells the evaluation actually read, a branch not taken reads none
+    virtual Value Evaluate(const SheetInterface& sheet, ReadCells& read) const = 0;
+    // Evaluates against the cells `read` gives by position, without the cells the formula
+    // is bound to: for a copy of its sheet, on any thread. References to other sheets
+    // evaluate to #REF!, lookups and aggregates scan their ranges
+    virtual Value EvaluateDetached(const EntryReader& read) const = 0;
+    // true if the references read depend on the values (IF, AND, OR, IFERROR, lookups),
+    // otherwise every evaluation reads all of them up to the first error
+    virtual bool IsConditional() const = 0;
+    // the compiled program, for the column kernels
+    virtual const FormulaAST& GetAST() const = 0;
+    // canonical text of the expression, valid until the references are rewritten
+    virtual std::string_view GetExpression() const = 0;
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    // references qualified with a sheet name, sorted by sheet
+    virtual std::vector<ExternalCell> GetExternalReferencedCells() const = 0;
+    // the ranges of the lookups, not part of GetReferencedCells
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+
+    // Resolves every reference to the cell currently stored at it. The sheets must keep
+    // these cells alive (and at the same address) for as long as the formula exists.
+    // Unresolved references to other sheets evaluate to #REF!
+    virtual void BindCells(const ASTImpl::CellResolver& resolve) = 0;
+    // Moves references after rows or columns were inserted or deleted in the formula's
+    // own sheet (local) or in the sheet named sheet_name,
+    // references mapped to Position::NONE are printed and evaluated as #REF!
+    virtual void RewriteReferences(const std::function<Position(Position)>& remap
+        , bool local, std::string_view sheet_name) = 0;
 };
 
 class Formula : public FormulaInterface {
 private:        // fields
     FormulaAST ast_;
+    // printed at parse time and again whenever references are rewritten
+    std::basic_string<char, std::char_traits<char>, CountingAllocator<char, MemoryCategory::AstNodes>> expression_;
 
 public:         // constructors
     explicit Formula(std::string expression);
 
 public:         // methods
     Value Evaluate(const SheetInterface& sheet) const override;
-    std::string GetExpression() const override;
+    Value Evaluate(const SheetInterface& sheet, ReadCells& read) const override;
+    Value EvaluateDetached(const EntryReader& read) const override;
+    bool IsConditional() const override;
+    const FormulaAST& GetAST() const override;
+    std::string_view GetExpression() const override;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<ExternalCell> GetExternalReferencedCells() const override;
+    std::vector<CellRange> GetReferencedRanges() const override;
+    void BindCells(const ASTImpl::CellResolver& resolve) override;
+    void RewriteReferences(const std::function<Position(Position)>& remap
+        , bool local, std::string_view sheet_name) override;
+
+private:        // methods
+    void PrintExpression();
 };
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Text read by a formula: its value if the whole text is a number, nullopt if it is not
+std::optional<double> TextToNumber(const std::string& text);
\ No newline at end of file
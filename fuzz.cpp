@@ -0,0 +1,1044 @@
+#include "fuzz.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "common.h"
+#include "sheet.h"
+
+using namespace std::string_literals;
+
+namespace {
+    // edits stay in a small grid so that formulas often refer to each other
+    const int GRID_SIZE = 6;
+    const size_t LOG_LENGTH = 32;
+
+    class FuzzSource {
+    private:        // fields
+        const uint8_t* data_ = nullptr;
+        size_t size_ = 0;
+        std::mt19937_64 random_;
+        bool from_bytes_;
+
+    public:         // constructors
+        explicit FuzzSource(uint64_t seed) : random_(seed), from_bytes_(false) { }
+        FuzzSource(const uint8_t* data, size_t size) : data_(data), size_(size), from_bytes_(true) { }
+
+    public:         // methods
+        bool IsExhausted() const { return from_bytes_ && size_ == 0; }
+
+        // uniform enough in [0, bound), 0 once the bytes run out
+        uint32_t Next(uint32_t bound) {
+            if (!from_bytes_) {
+                return std::uniform_int_distribution<uint32_t>(0, bound - 1)(random_);
+            }
+            uint32_t value = 0;
+            for (int i = 0; i < 2 && size_ > 0; ++i, ++data_, --size_) {
+                value = value << 8 | *data_;
+            }
+            return value % bound;
+        }
+
+        bool Chance(uint32_t percent) {
+            return Next(100) < percent;
+        }
+    };
+
+    // Formula tree of the reference model, built by the generator rather than parsed
+    struct ModelExpr {
+        enum class Kind { Number, Cell, Range, Unary, Binary, Comparison, Call };
+
+        Kind kind = Kind::Number;
+        std::string op;                         // operator, or function name of a call
+        double number = 0;
+        std::string literal;
+        Position cell;                          // or the first corner of a range
+        Position last;
+        std::shared_ptr<const ModelExpr> lhs;   // the operand of a unary operation
+        std::shared_ptr<const ModelExpr> rhs;
+        std::vector<std::shared_ptr<const ModelExpr>> args;
+    };
+
+    // precedence and parenthesization as specified for the canonical formula text
+    enum Precedence { CMP, ADD, SUB, MUL, DIV, UNARY, ATOM };
+    const bool NEED_PARENS_LEFT[7][7] = {
+        { false, false, false, false, false, false, false },
+        { true, false, false, false, false, false, false },
+        { true, false, false, false, false, false, false },
+        { true, true, true, false, false, false, false },
+        { true, true, true, false, false, false, false },
+        { true, true, true, false, false, false, false },
+        { false, false, false, false, false, false, false },
+    };
+    const bool NEED_PARENS_RIGHT[7][7] = {
+        { true, false, false, false, false, false, false },
+        { true, false, false, false, false, false, false },
+        { true, true, true, false, false, false, false },
+        { true, true, true, false, false, false, false },
+        { true, true, true, true, true, false, false },
+        { true, true, true, false, false, false, false },
+        { false, false, false, false, false, false, false },
+    };
+
+    Precedence GetPrecedence(const ModelExpr& expr) {
+        switch (expr.kind) {
+        case ModelExpr::Kind::Unary:
+            return UNARY;
+        case ModelExpr::Kind::Binary:
+            return expr.op == "+" ? ADD : expr.op == "-" ? SUB : expr.op == "*" ? MUL : DIV;
+        case ModelExpr::Kind::Comparison:
+            return CMP;
+        default:
+            return ATOM;
+        }
+    }
+
+    void PrintCanonical(std::ostream& out, const ModelExpr& expr, Precedence parent, bool right_child) {
+        const Precedence precedence = GetPrecedence(expr);
+        const bool parens = right_child ? NEED_PARENS_RIGHT[parent][precedence] : NEED_PARENS_LEFT[parent][precedence];
+        if (parens) {
+            out << '(';
+        }
+        switch (expr.kind) {
+        case ModelExpr::Kind::Number:
+            out << expr.number;
+            break;
+        case ModelExpr::Kind::Cell:
+            out << expr.cell.ToString();
+            break;
+        case ModelExpr::Kind::Range:
+            out << expr.cell.ToString() << ':' << expr.last.ToString();
+            break;
+        case ModelExpr::Kind::Unary:
+            out << expr.op;
+            PrintCanonical(out, *expr.lhs, precedence, false);
+            break;
+        case ModelExpr::Kind::Binary:
+        case ModelExpr::Kind::Comparison:
+            PrintCanonical(out, *expr.lhs, precedence, false);
+            out << expr.op;
+            PrintCanonical(out, *expr.rhs, precedence, true);
+            break;
+        case ModelExpr::Kind::Call:
+            out << expr.op << '(';
+            for (size_t i = 0; i < expr.args.size(); ++i) {
+                out << (i ? "," : "");
+                PrintCanonical(out, *expr.args[i], ATOM, false);
+            }
+            out << ')';
+            break;
+        }
+        if (parens) {
+            out << ')';
+        }
+    }
+
+    void CollectCells(const ModelExpr& expr, std::set<Position>& cells) {
+        if (expr.kind == ModelExpr::Kind::Cell) {
+            cells.insert(expr.cell);
+        }
+        if (expr.lhs) {
+            CollectCells(*expr.lhs, cells);
+        }
+        if (expr.rhs) {
+            CollectCells(*expr.rhs, cells);
+        }
+        for (const auto& arg : expr.args) {
+            CollectCells(*arg, cells);
+        }
+    }
+
+    // the cells of the ranges of lookups and aggregates
+    void CollectRangeCells(const ModelExpr& expr, std::set<Position>& cells) {
+        if (expr.kind == ModelExpr::Kind::Range) {
+            for (int row = expr.cell.row; row <= expr.last.row; ++row) {
+                for (int col = expr.cell.col; col <= expr.last.col; ++col) {
+                    cells.insert({ row, col });
+                }
+            }
+        }
+        if (expr.lhs) {
+            CollectRangeCells(*expr.lhs, cells);
+        }
+        if (expr.rhs) {
+            CollectRangeCells(*expr.rhs, cells);
+        }
+        for (const auto& arg : expr.args) {
+            CollectRangeCells(*arg, cells);
+        }
+    }
+
+    // the whole text must be a number for strtod
+    std::optional<double> ParseNumber(const std::string& text) {
+        char* end;
+        errno = 0;
+        const double number = std::strtod(text.c_str(), &end);
+        if (*end != '\0' || (number == 0.0 && errno == ERANGE && !text.empty())) {
+            return std::nullopt;
+        }
+        return number;
+    }
+
+    enum class Outcome { Ok, FormulaException, CircularDependency, InvalidPosition, OtherException };
+
+    std::string ToString(Outcome outcome) {
+        switch (outcome) {
+        case Outcome::Ok:
+            return "ok";
+        case Outcome::FormulaException:
+            return "FormulaException";
+        case Outcome::CircularDependency:
+            return "CircularDependencyException";
+        case Outcome::InvalidPosition:
+            return "InvalidPositionException";
+        default:
+            return "other exception";
+        }
+    }
+
+    // The straightforward semantics, with none of the engine's caching, handles or indexes
+    class ModelSheet {
+    private:        // types
+        struct Cell {
+            std::string text;
+            bool cleared = false;                           // emptied but kept, being referenced
+            std::shared_ptr<const ModelExpr> formula;
+            std::set<Position> references;
+            std::set<Position> covered;                     // by the ranges, neither created nor kept
+        };
+
+    private:        // fields
+        std::map<Position, Cell> cells_;
+        mutable std::map<Position, CellInterface::Value> values_;   // memo, valid until the next edit
+        // whole copies of the cells before each edit, most recent last
+        std::deque<std::map<Position, Cell>> undo_;
+        std::deque<std::map<Position, Cell>> redo_;
+
+    public:         // methods
+        Outcome SetText(Position pos, const std::string& text) {
+            if (!pos.IsValid()) {
+                return Outcome::InvalidPosition;
+            }
+            Remember();
+            cells_[pos] = Cell{ text, false, nullptr, {}, {} };
+            return Outcome::Ok;
+        }
+
+        Outcome SetFormula(Position pos, std::shared_ptr<const ModelExpr> formula) {
+            if (!pos.IsValid()) {
+                return Outcome::InvalidPosition;
+            }
+            std::set<Position> references;
+            CollectCells(*formula, references);
+            std::set<Position> covered;
+            CollectRangeCells(*formula, covered);
+            std::set<Position> read = covered;
+            read.insert(references.begin(), references.end());
+            if (Reaches(read, pos)) {
+                return Outcome::CircularDependency;
+            }
+            Remember();
+            std::ostringstream text;
+            text << '=';
+            PrintCanonical(text, *formula, ATOM, false);
+            cells_[pos] = Cell{ text.str(), false, std::move(formula), references, std::move(covered) };
+            // referenced cells come into existence as empty texts
+            for (const Position& ref : references) {
+                cells_.try_emplace(ref, Cell{ ""s, false, nullptr, {}, {} });
+            }
+            return Outcome::Ok;
+        }
+
+        Outcome Clear(Position pos) {
+            if (!pos.IsValid()) {
+                return Outcome::InvalidPosition;
+            }
+            if (!cells_.count(pos)) {
+                return Outcome::Ok;
+            }
+            Remember();
+            for (const auto& [other, cell] : cells_) {
+                if (cell.references.count(pos)) {
+                    cells_[pos] = Cell{ ""s, true, nullptr, {}, {} };
+                    return Outcome::Ok;
+                }
+            }
+            cells_.erase(pos);
+            return Outcome::Ok;
+        }
+
+        bool Undo() {
+            if (undo_.empty()) {
+                return false;
+            }
+            values_.clear();
+            redo_.push_back(std::move(cells_));
+            cells_ = std::move(undo_.back());
+            undo_.pop_back();
+            return true;
+        }
+
+        bool Redo() {
+            if (redo_.empty()) {
+                return false;
+            }
+            values_.clear();
+            undo_.push_back(std::move(cells_));
+            cells_ = std::move(redo_.back());
+            redo_.pop_back();
+            return true;
+        }
+
+        bool HasCell(Position pos) const {
+            return cells_.count(pos) > 0;
+        }
+
+        std::string GetText(Position pos) const {
+            return cells_.at(pos).text;
+        }
+
+        CellInterface::Value GetValue(Position pos) const {
+            if (const auto it = values_.find(pos); it != values_.end()) {
+                return it->second;
+            }
+            const Cell& cell = cells_.at(pos);
+            CellInterface::Value value;
+            if (cell.cleared) {
+                value = 0.0;
+            } else if (cell.formula) {
+                try {
+                    value = Evaluate(*cell.formula);
+                }
+                catch (const FormulaError& error) {
+                    value = error;
+                }
+            } else {
+                value = cell.text.empty() || cell.text[0] != '\'' ? cell.text : cell.text.substr(1);
+            }
+            values_[pos] = value;
+            return value;
+        }
+
+        Size GetPrintableSize() const {
+            Size size;
+            for (const auto& [pos, cell] : cells_) {
+                size.rows = std::max(size.rows, pos.row + 1);
+                size.cols = std::max(size.cols, pos.col + 1);
+            }
+            return size;
+        }
+
+    private:        // methods
+        // called before every edit
+        void Remember() {
+            values_.clear();
+            undo_.push_back(cells_);
+            if (undo_.size() > UndoHistory::DEFAULT_LIMIT) {
+                undo_.pop_front();
+            }
+            redo_.clear();
+        }
+
+        // true if `target` is one of `from` or is referenced by them, directly or not
+        bool Reaches(const std::set<Position>& from, Position target) const {
+            std::set<Position> visited;
+            std::vector<Position> to_visit(from.begin(), from.end());
+            while (!to_visit.empty()) {
+                const Position pos = to_visit.back();
+                to_visit.pop_back();
+                if (pos == target) {
+                    return true;
+                }
+                if (!visited.insert(pos).second) {
+                    continue;
+                }
+                if (const auto it = cells_.find(pos); it != cells_.end()) {
+                    to_visit.insert(to_visit.end(), it->second.references.begin(), it->second.references.end());
+                    to_visit.insert(to_visit.end(), it->second.covered.begin(), it->second.covered.end());
+                }
+            }
+            return false;
+        }
+
+        double ReadOperand(Position pos) const {
+            if (!cells_.count(pos)) {
+                return 0.0;
+            }
+            const CellInterface::Value value = GetValue(pos);
+            if (const auto* number = std::get_if<double>(&value)) {
+                return *number;
+            }
+            if (const auto* error = std::get_if<FormulaError>(&value)) {
+                throw *error;
+            }
+            if (const std::optional<double> number = ParseNumber(std::get<std::string>(value))) {
+                return *number;
+            }
+            throw FormulaError(FormulaError::Category::Value);
+        }
+
+        // what a lookup compares: the value of a formula, the number of a whole text
+        std::optional<double> ReadLookupNumber(Position pos) const {
+            const auto it = cells_.find(pos);
+            if (it == cells_.end() || it->second.cleared) {
+                return std::nullopt;
+            }
+            const CellInterface::Value value = GetValue(pos);
+            if (const auto* number = std::get_if<double>(&value)) {
+                return *number;
+            }
+            if (const auto* text = std::get_if<std::string>(&value); text && !text->empty()) {
+                return ParseNumber(*text);
+            }
+            return std::nullopt;
+        }
+
+        double Evaluate(const ModelExpr& expr) const {
+            switch (expr.kind) {
+            case ModelExpr::Kind::Number:
+                return expr.number;
+            case ModelExpr::Kind::Cell:
+                return ReadOperand(expr.cell);
+            case ModelExpr::Kind::Unary:
+                return expr.op == "-" ? -Evaluate(*expr.lhs) : Evaluate(*expr.lhs);
+            case ModelExpr::Kind::Comparison:
+                return Compare(expr) ? 1 : 0;
+            case ModelExpr::Kind::Call:
+                return Call(expr);
+            case ModelExpr::Kind::Range:
+                // only ever an argument of a lookup, never evaluated
+                return 0;
+            case ModelExpr::Kind::Binary:
+                break;
+            }
+            const double lhs = Evaluate(*expr.lhs);
+            const double rhs = Evaluate(*expr.rhs);
+            double result = 0;
+            if (expr.op == "+") {
+                result = lhs + rhs;
+            } else if (expr.op == "-") {
+                result = lhs - rhs;
+            } else if (expr.op == "*") {
+                result = lhs * rhs;
+            } else {
+                if (std::abs(rhs) < 1e-5) {
+                    throw FormulaError(FormulaError::Category::Div0);
+                }
+                result = lhs / rhs;
+            }
+            if (!std::isfinite(result)) {
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            return result;
+        }
+
+        bool Compare(const ModelExpr& expr) const {
+            const double lhs = Evaluate(*expr.lhs);
+            const double rhs = Evaluate(*expr.rhs);
+            if (expr.op == "<") {
+                return lhs < rhs;
+            }
+            if (expr.op == "<=") {
+                return lhs <= rhs;
+            }
+            if (expr.op == ">") {
+                return lhs > rhs;
+            }
+            if (expr.op == ">=") {
+                return lhs >= rhs;
+            }
+            return expr.op == "=" ? lhs == rhs : lhs != rhs;
+        }
+
+        // arguments are evaluated only as far as the result needs them
+        double Call(const ModelExpr& expr) const {
+            const auto& args = expr.args;
+            if (expr.op == "IF") {
+                if (Evaluate(*args[0]) != 0) {
+                    return Evaluate(*args[1]);
+                }
+                return args.size() > 2 ? Evaluate(*args[2]) : 0;
+            }
+            if (expr.op == "IFERROR") {
+                try {
+                    return Evaluate(*args[0]);
+                }
+                catch (const FormulaError&) {
+                    return Evaluate(*args[1]);
+                }
+            }
+            if (expr.op == "MATCH" || expr.op == "VLOOKUP" || expr.op == "XLOOKUP") {
+                return Lookup(expr);
+            }
+            if (expr.op == "SUM" || expr.op == "COUNT" || expr.op == "MIN" || expr.op == "MAX" || expr.op == "AVERAGE") {
+                return Aggregate(expr);
+            }
+            const bool deciding = expr.op == "OR";
+            for (const auto& arg : args) {
+                if ((Evaluate(*arg) != 0) == deciding) {
+                    return deciding ? 1 : 0;
+                }
+            }
+            return deciding ? 0 : 1;
+        }
+
+        // the key, then the mode, then the column of VLOOKUP, as the engine evaluates them
+        double Lookup(const ModelExpr& expr) const {
+            const auto& args = expr.args;
+            const ModelExpr& range = *args[1];
+            const double key = Evaluate(*args[0]);
+            const size_t mode_arg = expr.op == "MATCH" ? 2 : expr.op == "VLOOKUP" ? 3 : 4;
+            const double mode = args.size() > mode_arg ? Evaluate(*args[mode_arg]) : expr.op == "XLOOKUP" ? 0 : 1;
+            const std::optional<int> row = Search(expr.op, mode, range, key);
+            if (expr.op == "MATCH") {
+                if (!row) {
+                    throw FormulaError(FormulaError::Category::NA);
+                }
+                return *row - range.cell.row + 1;
+            }
+            if (expr.op == "XLOOKUP") {
+                if (!row) {
+                    if (args.size() > 3) {
+                        return Evaluate(*args[3]);
+                    }
+                    throw FormulaError(FormulaError::Category::NA);
+                }
+                return ReadOperand({ args[2]->cell.row + *row - range.cell.row, args[2]->cell.col });
+            }
+            const double column = Evaluate(*args[2]);
+            if (!row) {
+                throw FormulaError(FormulaError::Category::NA);
+            }
+            if (!(column >= 1)) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+            if (column >= range.last.col - range.cell.col + 2) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            return ReadOperand({ *row, range.cell.col + static_cast<int>(column) - 1 });
+        }
+
+        // the arguments in order: a scalar fails the aggregate with its error, a range with
+        // its first error row by row, but for COUNT
+        double Aggregate(const ModelExpr& expr) const {
+            const bool sum = expr.op == "SUM" || expr.op == "AVERAGE";
+            double total = 0;
+            int count = 0;
+            const auto add = [&](double number) {
+                if (expr.op == "MIN" ? count == 0 || number < total : expr.op == "MAX" ? count == 0 || number > total : false) {
+                    total = number;
+                }
+                ++count;
+            };
+            for (const auto& arg : expr.args) {
+                if (arg->kind != ModelExpr::Kind::Range) {
+                    if (const double number = Evaluate(*arg); !std::isnan(number)) {
+                        total += sum ? number : 0;
+                        add(number);
+                    }
+                    continue;
+                }
+                double range_sum = 0;
+                std::optional<std::pair<Position, FormulaError>> error;
+                for (int col = arg->cell.col; col <= arg->last.col; ++col) {
+                    std::map<int, double> numbers;
+                    for (int row = arg->cell.row; row <= arg->last.row; ++row) {
+                        try {
+                            if (const std::optional<double> number = ReadAggregateNumber({ row, col })) {
+                                numbers.emplace(row, *number);
+                            }
+                        }
+                        catch (const FormulaError& cell_error) {
+                            if (!error || Position{ row, col } < error->first) {
+                                error.emplace(Position{ row, col }, cell_error);
+                            }
+                        }
+                    }
+                    if (const auto [column_sum, column_count] = PairwiseSum(numbers, 0, Position::MAX_ROWS); column_count > 0) {
+                        range_sum += column_sum;
+                    }
+                    for (const auto& [row, number] : numbers) {
+                        add(number);
+                    }
+                }
+                if (error && expr.op != "COUNT") {
+                    throw error->second;
+                }
+                total += sum ? range_sum : 0;
+            }
+            if (expr.op == "COUNT") {
+                return count;
+            }
+            if (expr.op == "MIN" || expr.op == "MAX") {
+                return count == 0 ? 0 : total;
+            }
+            if (expr.op == "AVERAGE") {
+                if (count == 0) {
+                    throw FormulaError(FormulaError::Category::Div0);
+                }
+                total /= count;
+            }
+            if (!std::isfinite(total)) {
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            return total;
+        }
+
+        // The sum of the numbers of the rows [first, first + size), as halves added up
+        // recursively; a half with no number adds nothing. Also their count
+        static std::pair<double, int> PairwiseSum(const std::map<int, double>& numbers, int first, int size) {
+            const auto begin = numbers.lower_bound(first);
+            if (begin == numbers.end() || begin->first >= first + size) {
+                return { 0, 0 };
+            }
+            if (size == 1) {
+                return { begin->second, 1 };
+            }
+            const auto [upper, upper_count] = PairwiseSum(numbers, first, size / 2);
+            const auto [lower, lower_count] = PairwiseSum(numbers, first + size / 2, size / 2);
+            if (upper_count == 0 || lower_count == 0) {
+                return { upper_count == 0 ? lower : upper, upper_count + lower_count };
+            }
+            return { upper + lower, upper_count + lower_count };
+        }
+
+        // what an aggregate reads of a range: numbers but NaN, numeric texts, errors
+        std::optional<double> ReadAggregateNumber(Position pos) const {
+            const auto it = cells_.find(pos);
+            if (it == cells_.end() || it->second.cleared) {
+                return std::nullopt;
+            }
+            const CellInterface::Value value = GetValue(pos);
+            if (const auto* error = std::get_if<FormulaError>(&value)) {
+                throw *error;
+            }
+            std::optional<double> number;
+            if (const auto* text = std::get_if<std::string>(&value)) {
+                number = text->empty() ? std::nullopt : ParseNumber(*text);
+            } else {
+                number = std::get<double>(value);
+            }
+            return number && !std::isnan(*number) ? number : std::nullopt;
+        }
+
+        // a scan of the first column of the range, the row found
+        std::optional<int> Search(const std::string& function, double mode, const ModelExpr& range, double key) const {
+            enum { EXACT, LARGEST_NOT_GREATER, SMALLEST_NOT_LESS } kind = EXACT;
+            bool last_row = true;
+            if (function == "MATCH") {
+                kind = mode > 0 ? LARGEST_NOT_GREATER : mode < 0 ? SMALLEST_NOT_LESS : EXACT;
+            } else if (function == "VLOOKUP") {
+                kind = mode != 0 ? LARGEST_NOT_GREATER : EXACT;
+            } else if (mode == -1 || mode == 1) {
+                kind = mode < 0 ? LARGEST_NOT_GREATER : SMALLEST_NOT_LESS;
+                last_row = false;
+            } else if (mode != 0) {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+
+            std::vector<std::pair<double, int>> numbers;
+            for (int row = range.cell.row; row <= range.last.row; ++row) {
+                if (const std::optional<double> number = ReadLookupNumber({ row, range.cell.col })) {
+                    numbers.emplace_back(*number, row);
+                }
+            }
+            std::optional<double> target;
+            for (const auto& [number, row] : numbers) {
+                if (kind == EXACT) {
+                    if (number == key) {
+                        return row;
+                    }
+                } else if (kind == LARGEST_NOT_GREATER ? number <= key : number >= key) {
+                    if (!target || (kind == LARGEST_NOT_GREATER ? number > *target : number < *target)) {
+                        target = number;
+                    }
+                }
+            }
+            std::optional<int> found;
+            for (const auto& [number, row] : numbers) {
+                if (target && number == *target && (!found || last_row)) {
+                    found = row;
+                }
+            }
+            return found;
+        }
+    };
+
+    std::string Describe(const CellInterface::Value& value) {
+        std::ostringstream out;
+        if (const auto* text = std::get_if<std::string>(&value)) {
+            out << '"' << *text << '"';
+        } else if (const auto* number = std::get_if<double>(&value)) {
+            out.precision(17);
+            out << *number;
+        } else {
+            out << std::get<FormulaError>(value).ToString();
+        }
+        return out.str();
+    }
+
+    bool SameValue(const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+        const auto* lhs_number = std::get_if<double>(&lhs);
+        const auto* rhs_number = std::get_if<double>(&rhs);
+        if (lhs_number && rhs_number && std::isnan(*lhs_number) && std::isnan(*rhs_number)) {
+            return true;
+        }
+        return lhs == rhs;
+    }
+
+    class DifferentialRun {
+    private:        // fields
+        FuzzSource& source_;
+        Sheet sheet_;
+        ModelSheet model_;
+        std::deque<std::string> log_;
+        FuzzReport report_;
+
+    public:         // constructors
+        explicit DifferentialRun(FuzzSource& source) : source_(source) { }
+
+    public:         // methods
+        FuzzReport Run(size_t operations) {
+            const auto start = std::chrono::steady_clock::now();
+            while (report_.operations < operations && !source_.IsExhausted()) {
+                Step();
+                ++report_.operations;
+            }
+            report_.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return report_;
+        }
+
+    private:        // methods
+        Position RandomPosition() {
+            return { static_cast<int>(source_.Next(GRID_SIZE)), static_cast<int>(source_.Next(GRID_SIZE)) };
+        }
+
+        std::shared_ptr<const ModelExpr> RandomExpr(int depth) {
+            auto expr = std::make_shared<ModelExpr>();
+            const uint32_t choice = depth > 0 ? source_.Next(100) : 100;
+            if (choice < 32) {
+                static const char* const OPS[] = { "+", "-", "*", "/" };
+                expr->kind = ModelExpr::Kind::Binary;
+                expr->op = OPS[source_.Next(4)];
+                expr->lhs = RandomExpr(depth - 1);
+                expr->rhs = RandomExpr(depth - 1);
+            } else if (choice < 40) {
+                static const char* const OPS[] = { "<", "<=", ">", ">=", "=", "<>" };
+                expr->kind = ModelExpr::Kind::Comparison;
+                expr->op = OPS[source_.Next(std::size(OPS))];
+                expr->lhs = RandomExpr(depth - 1);
+                expr->rhs = RandomExpr(depth - 1);
+            } else if (choice < 44) {
+                RandomLookup(*expr, depth);
+            } else if (choice < 48) {
+                RandomAggregate(*expr, depth);
+            } else if (choice < 52) {
+                static const char* const FUNCTIONS[] = { "IF", "AND", "OR", "IFERROR" };
+                expr->kind = ModelExpr::Kind::Call;
+                expr->op = FUNCTIONS[source_.Next(std::size(FUNCTIONS))];
+                size_t count = 2;
+                if (expr->op == "IF") {
+                    count = source_.Chance(50) ? 3 : 2;
+                } else if (expr->op != "IFERROR") {
+                    count = 1 + source_.Next(3);
+                }
+                for (size_t i = 0; i < count; ++i) {
+                    expr->args.push_back(RandomExpr(depth - 1));
+                }
+            } else if (choice < 60) {
+                expr->kind = ModelExpr::Kind::Unary;
+                expr->op = source_.Chance(70) ? "-" : "+";
+                expr->lhs = RandomExpr(depth - 1);
+            } else if (source_.Chance(50)) {
+                expr->kind = ModelExpr::Kind::Cell;
+                expr->cell = RandomPosition();
+            } else {
+                static const char* const LITERALS[] = { "0", "1", "2", "3", "4", "7", "10", "0.5", ".25", "2.5", "1e3", "8" };
+                expr->kind = ModelExpr::Kind::Number;
+                expr->literal = LITERALS[source_.Next(std::size(LITERALS))];
+                expr->number = std::strtod(expr->literal.c_str(), nullptr);
+            }
+            return expr;
+        }
+
+        std::shared_ptr<const ModelExpr> RandomRange(int width, std::optional<int> height = std::nullopt) {
+            auto range = std::make_shared<ModelExpr>();
+            range->kind = ModelExpr::Kind::Range;
+            const int rows = height ? *height : 1 + static_cast<int>(source_.Next(GRID_SIZE));
+            range->cell = { static_cast<int>(source_.Next(GRID_SIZE - rows + 1)), static_cast<int>(source_.Next(GRID_SIZE - width + 1)) };
+            range->last = { range->cell.row + rows - 1, range->cell.col + width - 1 };
+            return range;
+        }
+
+        // a mode or a column: mostly the few meaningful values
+        std::shared_ptr<const ModelExpr> RandomSelector(int depth) {
+            if (source_.Chance(30)) {
+                return RandomExpr(depth - 1);
+            }
+            static const char* const LITERALS[] = { "0", "1", "2", "3", "1.5" };
+            auto literal = std::make_shared<ModelExpr>();
+            literal->literal = LITERALS[source_.Next(std::size(LITERALS))];
+            literal->number = std::strtod(literal->literal.c_str(), nullptr);
+            if (!source_.Chance(25)) {
+                return literal;
+            }
+            auto negated = std::make_shared<ModelExpr>();
+            negated->kind = ModelExpr::Kind::Unary;
+            negated->op = "-";
+            negated->lhs = std::move(literal);
+            return negated;
+        }
+
+        void RandomLookup(ModelExpr& expr, int depth) {
+            static const char* const FUNCTIONS[] = { "MATCH", "VLOOKUP", "XLOOKUP" };
+            expr.kind = ModelExpr::Kind::Call;
+            expr.op = FUNCTIONS[source_.Next(std::size(FUNCTIONS))];
+            expr.args.push_back(RandomExpr(depth - 1));
+            if (expr.op == "MATCH") {
+                expr.args.push_back(RandomRange(1));
+                if (source_.Chance(60)) {
+                    expr.args.push_back(RandomSelector(depth));
+                }
+            } else if (expr.op == "VLOOKUP") {
+                expr.args.push_back(RandomRange(1 + static_cast<int>(source_.Next(3))));
+                expr.args.push_back(RandomSelector(depth));
+                if (source_.Chance(60)) {
+                    expr.args.push_back(RandomSelector(depth));
+                }
+            } else {
+                const auto lookup = RandomRange(1);
+                expr.args.push_back(lookup);
+                expr.args.push_back(RandomRange(1, lookup->last.row - lookup->cell.row + 1));
+                if (source_.Chance(50)) {
+                    expr.args.push_back(RandomExpr(depth - 1));
+                    if (source_.Chance(60)) {
+                        expr.args.push_back(RandomSelector(depth));
+                    }
+                }
+            }
+        }
+
+        void RandomAggregate(ModelExpr& expr, int depth) {
+            static const char* const FUNCTIONS[] = { "SUM", "COUNT", "MIN", "MAX", "AVERAGE" };
+            expr.kind = ModelExpr::Kind::Call;
+            expr.op = FUNCTIONS[source_.Next(std::size(FUNCTIONS))];
+            const size_t count = 1 + source_.Next(3);
+            for (size_t i = 0; i < count; ++i) {
+                if (source_.Chance(70)) {
+                    expr.args.push_back(RandomRange(1 + static_cast<int>(source_.Next(3))));
+                } else {
+                    expr.args.push_back(RandomExpr(depth - 1));
+                }
+            }
+        }
+
+        // every operation in parentheses, with random spacing: parses to exactly this tree
+        void Render(std::ostream& out, const ModelExpr& expr) {
+            const auto space = [&] {
+                if (source_.Chance(20)) {
+                    out << ' ';
+                }
+            };
+            const auto operand = [&](const ModelExpr& child) {
+                const bool atom = child.kind == ModelExpr::Kind::Number || child.kind == ModelExpr::Kind::Cell;
+                const bool parens = !atom || source_.Chance(10);
+                out << (parens ? "(" : "");
+                space();
+                Render(out, child);
+                space();
+                out << (parens ? ")" : "");
+            };
+            switch (expr.kind) {
+            case ModelExpr::Kind::Number:
+                out << expr.literal;
+                break;
+            case ModelExpr::Kind::Cell:
+                out << expr.cell.ToString();
+                break;
+            case ModelExpr::Kind::Range:
+                // the corners in either order
+                if (source_.Chance(20)) {
+                    out << expr.last.ToString() << ':' << expr.cell.ToString();
+                } else {
+                    out << expr.cell.ToString() << ':' << expr.last.ToString();
+                }
+                break;
+            case ModelExpr::Kind::Unary:
+                out << expr.op;
+                operand(*expr.lhs);
+                break;
+            case ModelExpr::Kind::Binary:
+            case ModelExpr::Kind::Comparison:
+                operand(*expr.lhs);
+                out << expr.op;
+                operand(*expr.rhs);
+                break;
+            case ModelExpr::Kind::Call:
+                out << expr.op << '(';
+                for (size_t i = 0; i < expr.args.size(); ++i) {
+                    out << (i ? "," : "");
+                    space();
+                    Render(out, *expr.args[i]);
+                    space();
+                }
+                out << ')';
+                break;
+            }
+        }
+
+        template <typename Action>
+        Outcome Apply(Action action) {
+            try {
+                action();
+                return Outcome::Ok;
+            }
+            catch (const CircularDependencyException&) {
+                return Outcome::CircularDependency;
+            }
+            catch (const FormulaException&) {
+                return Outcome::FormulaException;
+            }
+            catch (const InvalidPositionException&) {
+                return Outcome::InvalidPosition;
+            }
+            catch (...) {
+                return Outcome::OtherException;
+            }
+        }
+
+        void Step() {
+            const uint32_t choice = source_.Next(100);
+            Position pos = RandomPosition();
+            if (choice >= 98) {
+                pos = source_.Chance(50) ? Position{ -1, 0 } : Position{ 0, Position::MAX_COLS };
+            }
+            std::string text;
+            Outcome expected;
+            Outcome actual;
+
+            if (choice < 45) {
+                auto formula = RandomExpr(static_cast<int>(source_.Next(4)));
+                std::ostringstream rendered;
+                rendered << '=';
+                Render(rendered, *formula);
+                text = rendered.str();
+                expected = model_.SetFormula(pos, std::move(formula));
+                actual = Apply([&] { sheet_.SetCell(pos, text); });
+            } else if (choice < 70 || choice >= 98) {
+                static const char* const TEXTS[] = { "", "42", "-3.5", "1e400", " 7", "7 ", "'12", "abc", "=", "'=1+2", "0", "nan", "label" };
+                text = TEXTS[source_.Next(std::size(TEXTS))];
+                expected = model_.SetText(pos, text);
+                actual = Apply([&] { sheet_.SetCell(pos, text); });
+            } else if (choice < 73) {
+                static const char* const INVALID[] = { "=1+", "=(", "=A1B", "=1 2", "=)", "=ZZZZ1" };
+                text = INVALID[source_.Next(std::size(INVALID))];
+                expected = pos.IsValid() ? Outcome::FormulaException : Outcome::InvalidPosition;
+                actual = Apply([&] { sheet_.SetCell(pos, text); });
+            } else if (choice < 88) {
+                text = "<clear>";
+                expected = model_.Clear(pos);
+                actual = Apply([&] { sheet_.ClearCell(pos); });
+            } else if (choice < 91) {
+                text = "<undo>";
+                const bool undone = model_.Undo();
+                expected = Outcome::Ok;
+                actual = Apply([&] {
+                    if (sheet_.Undo() != undone) {
+                        throw std::logic_error("undo");
+                    }
+                });
+            } else if (choice < 93) {
+                text = "<redo>";
+                const bool redone = model_.Redo();
+                expected = Outcome::Ok;
+                actual = Apply([&] {
+                    if (sheet_.Redo() != redone) {
+                        throw std::logic_error("redo");
+                    }
+                });
+            } else {
+                // reads are checked by the comparison below
+                text = "<read>";
+                expected = Outcome::Ok;
+                actual = Outcome::Ok;
+                if (model_.HasCell(pos)) {
+                    sheet_.GetCell(pos)->GetValue();
+                }
+            }
+
+            log_.push_back(pos.ToString() + " <- "s + text);
+            if (log_.size() > LOG_LENGTH) {
+                log_.pop_front();
+            }
+            if (expected != actual) {
+                Mismatch("outcome "s + ToString(actual) + ", expected "s + ToString(expected));
+                return;
+            }
+            Compare();
+        }
+
+        void Compare() {
+            const Size size = sheet_.GetPrintableSize();
+            const Size expected_size = model_.GetPrintableSize();
+            if (!(size == expected_size)) {
+                Mismatch("printable size " + std::to_string(size.rows) + "x" + std::to_string(size.cols)
+                    + ", expected " + std::to_string(expected_size.rows) + "x" + std::to_string(expected_size.cols));
+                return;
+            }
+            for (int row = 0; row < GRID_SIZE; ++row) {
+                for (int col = 0; col < GRID_SIZE; ++col) {
+                    const Position pos{ row, col };
+                    const CellInterface* cell = sheet_.GetCell(pos);
+                    if (!cell || !model_.HasCell(pos)) {
+                        if (cell || model_.HasCell(pos)) {
+                            Mismatch(pos.ToString() + (cell ? " exists"s : " is missing"s));
+                            return;
+                        }
+                        continue;
+                    }
+                    if (cell->GetText() != model_.GetText(pos)) {
+                        Mismatch(pos.ToString() + " text " + cell->GetText() + ", expected " + model_.GetText(pos));
+                        return;
+                    }
+                    if (!SameValue(cell->GetValue(), model_.GetValue(pos))) {
+                        Mismatch(pos.ToString() + " value " + Describe(cell->GetValue())
+                            + ", expected " + Describe(model_.GetValue(pos)));
+                        return;
+                    }
+                }
+            }
+        }
+
+        void Mismatch(const std::string& what) {
+            if (report_.mismatches++ > 0) {
+                return;
+            }
+            std::ostringstream out;
+            out << what << " after:\n";
+            for (const std::string& entry : log_) {
+                out << "  " << entry << '\n';
+            }
+            report_.first_mismatch = out.str();
+        }
+    };
+}  // namespace
+
+FuzzReport RunDifferentialFuzz(uint64_t seed, size_t operations) {
+    FuzzSource source(seed);
+    return DifferentialRun(source).Run(operations);
+}
+
+FuzzReport RunDifferentialFuzz(const uint8_t* data, size_t size) {
+    FuzzSource source(data, size);
+    return DifferentialRun(source).Run(SIZE_MAX);
+}
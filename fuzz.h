@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Differential testing of Sheet against a naive reference model. Random sequences of
+// SetCell / ClearCell / GetValue with formulas are applied to both; after every step the
+// values and texts of all cells, the printable size and the thrown exceptions must agree.
+// Run with `spreadsheet --fuzz [seed] [operations]`, or as a libFuzzer target built with
+// the SPREADSHEET_FUZZ CMake option.
+struct FuzzReport {
+    uint64_t operations = 0;
+    uint64_t mismatches = 0;
+    std::string first_mismatch;     // with the last operations before it, to reproduce
+    double seconds = 0;
+};
+
+// property-based run: `operations` random steps drawn from `seed`
+FuzzReport RunDifferentialFuzz(uint64_t seed, size_t operations);
+// libFuzzer run: the steps are decoded from the input bytes until they run out
+FuzzReport RunDifferentialFuzz(const uint8_t* data, size_t size);
@@ -0,0 +1,18 @@
+#ifdef SPREADSHEET_LIBFUZZER
+
+#include <cstdlib>
+#include <iostream>
+
+#include "fuzz.h"
+
+// libFuzzer entry point, a mismatch with the reference model is reported as a crash
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    const FuzzReport report = RunDifferentialFuzz(data, size);
+    if (report.mismatches > 0) {
+        std::cerr << report.first_mismatch;
+        std::abort();
+    }
+    return 0;
+}
+
+#endif  // SPREADSHEET_LIBFUZZER
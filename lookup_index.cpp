@@ -0,0 +1,395 @@
+#include "lookup_index.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <iterator>
+
+#include "cell.h"
+#include "sheet.h"
+
+bool IsBetterMatch(MatchSearch search, double key, LookupMatch candidate, const std::optional<LookupMatch>& best) {
+    // written so that NaN is never accepted
+    const double value = candidate.value;
+    switch (search) {
+    case MatchSearch::Exact:
+        return value == key && (!best || candidate.row < best->row);
+    case MatchSearch::LastNotGreater:
+        return value <= key && (!best || value > best->value || (value == best->value && candidate.row > best->row));
+    case MatchSearch::FirstNotGreater:
+        return value <= key && (!best || value > best->value || (value == best->value && candidate.row < best->row));
+    case MatchSearch::LastNotLess:
+        return value >= key && (!best || value < best->value || (value == best->value && candidate.row > best->row));
+    case MatchSearch::FirstNotLess:
+        return value >= key && (!best || value < best->value || (value == best->value && candidate.row < best->row));
+    }
+    return false;
+}
+
+ColumnAggregate ColumnAggregate::Number(double value) {
+    ColumnAggregate leaf;
+    leaf.sum = leaf.min = leaf.max = value;
+    leaf.count = 1;
+    return leaf;
+}
+
+ColumnAggregate ColumnAggregate::Error(int row, FormulaError::Category category) {
+    ColumnAggregate leaf;
+    leaf.error_row = row;
+    leaf.error = category;
+    return leaf;
+}
+
+void AggregateTree::Set(int row, const ColumnAggregate& leaf) {
+    if (row >= capacity_) {
+        if (leaf.count == 0 && leaf.error_row == INT_MAX) {
+            return;
+        }
+        // the old tree is the first block of the new one
+        int capacity = std::max(capacity_, 1);
+        while (capacity <= row) {
+            capacity *= 2;
+        }
+        decltype(nodes_) nodes(2 * static_cast<size_t>(capacity));
+        std::copy(nodes_.begin() + capacity_, nodes_.end(), nodes.begin() + capacity);
+        nodes_ = std::move(nodes);
+        capacity_ = capacity;
+        for (size_t node = capacity_ - 1; node > 0; --node) {
+            nodes_[node] = Combine(nodes_[2 * node], nodes_[2 * node + 1]);
+        }
+    }
+    size_t node = static_cast<size_t>(capacity_) + row;
+    nodes_[node] = leaf;
+    for (node /= 2; node > 0; node /= 2) {
+        nodes_[node] = Combine(nodes_[2 * node], nodes_[2 * node + 1]);
+    }
+}
+
+ColumnAggregate AggregateTree::Query(int first, int last) const {
+    last = std::min(last, capacity_ - 1);
+    if (first > last) {
+        return {};
+    }
+    return Query(1, 0, capacity_, first, last);
+}
+
+ColumnAggregate AggregateTree::Combine(const ColumnAggregate& upper, const ColumnAggregate& lower) {
+    ColumnAggregate result = upper.error_row <= lower.error_row ? upper : lower;
+    // an empty block adds nothing, not even +0.0
+    if (upper.count == 0 || lower.count == 0) {
+        const ColumnAggregate& numbers = upper.count == 0 ? lower : upper;
+        result.sum = numbers.sum;
+        result.min = numbers.min;
+        result.max = numbers.max;
+    } else {
+        result.sum = upper.sum + lower.sum;
+        result.min = std::min(upper.min, lower.min);
+        result.max = std::max(upper.max, lower.max);
+    }
+    result.count = upper.count + lower.count;
+    return result;
+}
+
+ColumnAggregate AggregateTree::Query(size_t node, int node_first, int node_size, int first, int last) const {
+    if (first <= node_first && node_first + node_size - 1 <= last) {
+        return nodes_[node];
+    }
+    const int half = node_size / 2;
+    if (last < node_first + half) {
+        return Query(2 * node, node_first, half, first, last);
+    }
+    if (first >= node_first + half) {
+        return Query(2 * node + 1, node_first + half, half, first, last);
+    }
+    return Combine(Query(2 * node, node_first, half, first, last), Query(2 * node + 1, node_first + half, half, first, last));
+}
+
+RangeSummary SummarizeColumns(const CellRange& range, const std::function<ColumnAggregate(int col)>& aggregate_column) {
+    RangeSummary summary;
+    Position error = Position::NONE;
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        const ColumnAggregate column = aggregate_column(col);
+        if (column.error_row != INT_MAX && (!error.IsValid() || column.error_row < error.row)) {
+            error = { column.error_row, col };
+            summary.error = FormulaError(column.error);
+        }
+        if (column.count == 0) {
+            continue;
+        }
+        summary.sum += column.sum;
+        summary.min = summary.count == 0 ? column.min : std::min(summary.min, column.min);
+        summary.max = summary.count == 0 ? column.max : std::max(summary.max, column.max);
+        summary.count += column.count;
+    }
+    return summary;
+}
+
+std::optional<int> LookupIndex::Find(const Sheet& sheet, const CellRange& range, double key, MatchSearch search) {
+    if (std::isnan(key)) {
+        // equal to nothing and not ordered
+        return std::nullopt;
+    }
+    Column& column = GetColumn(sheet, range.first.col);
+    ReadStaleFormulas(sheet, column, range.first.col, range);
+    const std::optional<LookupMatch> best = search == MatchSearch::Exact ? FindExact(column, range, key)
+                                                                         : FindNearest(column, range, key, search);
+    return best ? std::optional(best->row) : std::nullopt;
+}
+
+void LookupIndex::ForEachFormula(const Sheet& sheet, const CellRange& range, const std::function<void(const Cell*)>& action) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        const Column& column = GetColumn(sheet, col);
+        const auto end = column.formula_rows.upper_bound(range.last.row);
+        for (auto it = column.formula_rows.lower_bound(range.first.row); it != end; ++it) {
+            action(sheet.FindCell({ *it, col }));
+        }
+    }
+}
+
+void LookupIndex::ForEachStaleFormula(const Sheet& sheet, const CellRange& range, const std::function<void(const Cell*)>& action) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        const Column& column = GetColumn(sheet, col);
+        const auto end = column.stale_rows.upper_bound(range.last.row);
+        for (auto it = column.stale_rows.lower_bound(range.first.row); it != end; ++it) {
+            action(sheet.FindCell({ *it, col }));
+        }
+    }
+}
+
+RangeSummary LookupIndex::Aggregate(const Sheet& sheet, const CellRange& range) {
+    return SummarizeColumns(range, [this, &sheet, &range](int col) {
+        Column& column = GetColumn(sheet, col);
+        if (!column.aggregates) {
+            // the errors of the formulas are not indexed, they are read again
+            for (int row : column.formula_rows) {
+                MarkStale(column, row);
+            }
+            column.aggregates.emplace();
+            for (const auto& [row, number] : column.numbers) {
+                column.aggregates->Set(row, ColumnAggregate::Number(number));
+            }
+        }
+        ReadStaleFormulas(sheet, column, col, range);
+        return column.aggregates->Query(range.first.row, range.last.row);
+    });
+}
+
+void LookupIndex::Update(Position pos, const Cell* cell) {
+    const auto it = columns_.find(pos.col);
+    if (it == columns_.end()) {
+        return;
+    }
+    Column& column = it->second;
+    if (const auto number = column.numbers.find(pos.row); number != column.numbers.end()) {
+        RemoveNumber(column, pos.row, number->second);
+    }
+    column.formula_rows.erase(pos.row);
+    column.stale_rows.erase(pos.row);
+    if (column.aggregates) {
+        column.aggregates->Set(pos.row, {});
+    }
+    if (!cell) {
+        return;
+    }
+    if (cell->IsFormula()) {
+        column.formula_rows.insert(pos.row);
+        column.stale_rows.insert(pos.row);
+    } else if (const std::optional<double> number = cell->GetConstantNumber(); number && !std::isnan(*number)) {
+        AddNumber(column, pos.row, *number);
+        if (column.aggregates) {
+            column.aggregates->Set(pos.row, ColumnAggregate::Number(*number));
+        }
+    }
+}
+
+void LookupIndex::Clear() {
+    columns_.clear();
+}
+
+void LookupIndex::Watch(Cell* formula, const CellRange& range) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        watchers_[col].emplace(formula, RowSpan{ range.first.row, range.last.row });
+    }
+}
+
+void LookupIndex::Unwatch(Cell* formula, const CellRange& range) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        const auto column = watchers_.find(col);
+        if (column == watchers_.end()) {
+            continue;
+        }
+        // a formula may watch the column for several ranges
+        const auto [first, last] = column->second.equal_range(formula);
+        for (auto it = first; it != last; ++it) {
+            if (it->second.first == range.first.row && it->second.last == range.last.row) {
+                column->second.erase(it);
+                break;
+            }
+        }
+        if (column->second.empty()) {
+            watchers_.erase(column);
+        }
+    }
+}
+
+std::vector<Cell*> LookupIndex::FindWatchers(bool by_rows, int first) const {
+    std::vector<Cell*> found;
+    for (auto column = by_rows ? watchers_.begin() : watchers_.lower_bound(first); column != watchers_.end(); ++column) {
+        for (const auto& [formula, rows] : column->second) {
+            if (!by_rows || rows.last >= first) {
+                found.push_back(formula);
+            }
+        }
+    }
+    return found;
+}
+
+LookupIndex::Column& LookupIndex::GetColumn(const Sheet& sheet, int col) {
+    if (const auto it = columns_.find(col); it != columns_.end()) {
+        return it->second;
+    }
+    columns_.emplace(col, Column{});
+    for (const auto& [row, cells] : sheet.data_) {
+        if (cells.count(col)) {
+            Update({ row, col }, cells.at(col).get());
+        }
+    }
+    return columns_.at(col);
+}
+
+void LookupIndex::MarkStale(Column& column, int row) {
+    if (!column.stale_rows.insert(row).second) {
+        return;
+    }
+    if (const auto number = column.numbers.find(row); number != column.numbers.end()) {
+        RemoveNumber(column, row, number->second);
+    }
+}
+
+void LookupIndex::ReadStaleFormulas(const Sheet& sheet, Column& column, int col, const CellRange& range) {
+    // reading a formula may evaluate others reading this column
+    const auto end = column.stale_rows.upper_bound(range.last.row);
+    const std::vector<int> stale(column.stale_rows.lower_bound(range.first.row), end);
+    for (int row : stale) {
+        if (column.stale_rows.count(row)) {
+            ReadFormula(sheet, column, { row, col });
+        }
+    }
+}
+
+void LookupIndex::ReadFormula(const Sheet& sheet, Column& column, Position pos) {
+    ColumnAggregate leaf;
+    try {
+        if (const double value = sheet.FindCell(pos)->GetNumber(); !std::isnan(value)) {
+            leaf = ColumnAggregate::Number(value);
+            AddNumber(column, pos.row, value);
+        }
+    }
+    catch (const FormulaError& error) {
+        leaf = ColumnAggregate::Error(pos.row, error.GetCategory());
+    }
+    if (column.aggregates) {
+        column.aggregates->Set(pos.row, leaf);
+    }
+    column.stale_rows.erase(pos.row);
+}
+
+void LookupIndex::AddNumber(Column& column, int row, double number) {
+    column.numbers.emplace(row, number);
+    if (column.exact) {
+        Rows& rows = (*column.exact)[number];
+        rows.insert(std::lower_bound(rows.begin(), rows.end(), row), row);
+    }
+    if (column.sorted) {
+        column.sorted->emplace(number, row);
+    }
+}
+
+void LookupIndex::RemoveNumber(Column& column, int row, double number) {
+    column.numbers.erase(row);
+    if (column.exact) {
+        const auto it = column.exact->find(number);
+        Rows& rows = it->second;
+        rows.erase(std::lower_bound(rows.begin(), rows.end(), row));
+        if (rows.empty()) {
+            column.exact->erase(it);
+        }
+    }
+    if (column.sorted) {
+        column.sorted->erase({ number, row });
+    }
+}
+
+std::optional<LookupMatch> LookupIndex::FindExact(Column& column, const CellRange& range, double key) {
+    if (!column.exact) {
+        column.exact.emplace();
+        for (const auto& [row, number] : column.numbers) {
+            (*column.exact)[number].push_back(row);
+        }
+        for (auto& [number, rows] : *column.exact) {
+            std::sort(rows.begin(), rows.end());
+        }
+    }
+    const auto it = column.exact->find(key);
+    if (it == column.exact->end()) {
+        return std::nullopt;
+    }
+    const auto row = std::lower_bound(it->second.begin(), it->second.end(), range.first.row);
+    if (row == it->second.end() || *row > range.last.row) {
+        return std::nullopt;
+    }
+    return LookupMatch{ key, *row };
+}
+
+std::optional<LookupMatch> LookupIndex::FindNearest(Column& column, const CellRange& range, double key, MatchSearch search) {
+    if (!column.sorted) {
+        column.sorted.emplace();
+        for (const auto& [row, number] : column.numbers) {
+            column.sorted->emplace(number, row);
+        }
+    }
+    const auto& sorted = *column.sorted;
+    const auto in_range = [&range](int row) {
+        return row >= range.first.row && row <= range.last.row;
+    };
+
+    // The nearest number with a row in the range. The numbers of the rows outside it are
+    // stepped over, at most as many as the range has rows: past that the rows of the range
+    // are read instead, so that a search costs what its range does, not what its column does
+    const size_t max_steps = static_cast<size_t>(range.last.row - range.first.row) + 1;
+    size_t steps = 0;
+    std::optional<double> nearest;
+    if (search == MatchSearch::LastNotGreater || search == MatchSearch::FirstNotGreater) {
+        for (auto it = sorted.upper_bound({ key, INT_MAX }); it != sorted.begin() && steps < max_steps; ++steps) {
+            if (in_range((--it)->second)) {
+                nearest = it->first;
+                break;
+            }
+        }
+    } else {
+        for (auto it = sorted.lower_bound({ key, INT_MIN }); it != sorted.end() && steps < max_steps; ++it, ++steps) {
+            if (in_range(it->second)) {
+                nearest = it->first;
+                break;
+            }
+        }
+    }
+    if (!nearest) {
+        if (steps < max_steps) {
+            return std::nullopt;
+        }
+        std::optional<LookupMatch> best;
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            if (const auto number = column.numbers.find(row); number != column.numbers.end()
+                && IsBetterMatch(search, key, { number->second, row }, best)) {
+                best = LookupMatch{ number->second, row };
+            }
+        }
+        return best;
+    }
+    // then the first or the last of its rows in the range
+    const auto it = search == MatchSearch::LastNotGreater || search == MatchSearch::LastNotLess
+        ? std::prev(sorted.upper_bound({ *nearest, range.last.row }))
+        : sorted.lower_bound({ *nearest, range.first.row });
+    return LookupMatch{ it->first, it->second };
+}
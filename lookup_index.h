@@ -0,0 +1,161 @@
+#pragma once
+
+#include <climits>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "FormulaAST.h"
+#include "common.h"
+#include "memory.h"
+
+class Cell;
+class Sheet;
+
+// a number of a searched column and its row
+struct LookupMatch {
+    double value;
+    int row;
+};
+
+// true if `candidate` satisfies the search for `key` and comes before `best`, see MatchSearch
+bool IsBetterMatch(MatchSearch search, double key, LookupMatch candidate, const std::optional<LookupMatch>& best);
+
+// the numbers of some rows of a column, NaN aside, and the first row holding an error
+struct ColumnAggregate {
+    double sum = 0;
+    double min = 0;             // valid if count is not 0
+    double max = 0;
+    int count = 0;
+    int error_row = INT_MAX;
+    FormulaError::Category error = FormulaError::Category::Value;
+
+    static ColumnAggregate Number(double value);
+    static ColumnAggregate Error(int row, FormulaError::Category category);
+};
+
+// Aggregates of a column over any span of rows, in a segment tree over aligned blocks of
+// rows: setting a row is O(log rows). A sum adds the halves of each block, so it depends
+// on the numbers only, not on the order they were set in, and is more accurate than
+// adding the rows one by one
+class AggregateTree {
+private:        // fields
+    // nodes_[1] is the root, the leaves start at capacity_
+    std::vector<ColumnAggregate, CountingAllocator<ColumnAggregate, MemoryCategory::LookupIndexes>> nodes_;
+    int capacity_ = 0;
+
+public:         // methods
+    void Set(int row, const ColumnAggregate& leaf);
+    ColumnAggregate Query(int first, int last) const;
+
+    static ColumnAggregate Combine(const ColumnAggregate& upper, const ColumnAggregate& lower);
+
+private:        // methods
+    ColumnAggregate Query(size_t node, int node_first, int node_size, int first, int last) const;
+};
+
+// the columns of a range added up left to right
+RangeSummary SummarizeColumns(const CellRange& range, const std::function<ColumnAggregate(int col)>& aggregate_column);
+
+// Per-column indexes of a sheet for the lookups and aggregates, and the formulas whose
+// ranges cover each column. The index of a column is made on the first function reading
+// it and then kept up to date by the sheet on every edit of the column. Constant numbers,
+// numeric texts included, are indexed: a hash index for the exact searches and a sorted
+// one for the others, each built on the first search needing it, and an AggregateTree.
+// The formulas of a column are listed with those whose value may have changed since it
+// was last read; the numbers of the others are indexed as the constants are, so that a
+// lookup or an aggregate only reads these stale ones again.
+class LookupIndex {
+private:        // types
+    template <typename T>
+    using Allocator = CountingAllocator<T, MemoryCategory::LookupIndexes>;
+    using Rows = std::vector<int, Allocator<int>>;
+
+    struct Column {
+        std::set<int, std::less<int>, Allocator<int>> formula_rows;
+        std::unordered_map<int, double, std::hash<int>, std::equal_to<int>
+            , Allocator<std::pair<const int, double>>> numbers;        // by row, no NaN, stale formulas aside
+        // number -> rows holding it, ascending
+        std::optional<std::unordered_map<double, Rows, std::hash<double>, std::equal_to<double>
+            , Allocator<std::pair<const double, Rows>>>> exact;
+        std::optional<std::set<std::pair<double, int>, std::less<std::pair<double, int>>
+            , Allocator<std::pair<double, int>>>> sorted;
+        // every formula not in it is cached, with its number in `numbers` and its value in `aggregates`
+        std::set<int, std::less<int>, Allocator<int>> stale_rows;
+        std::optional<AggregateTree> aggregates;
+    };
+
+    struct RowSpan {
+        int first;
+        int last;
+    };
+    using Watchers = std::unordered_multimap<Cell*, RowSpan, std::hash<Cell*>, std::equal_to<Cell*>
+        , CountingAllocator<std::pair<Cell* const, RowSpan>, MemoryCategory::Dependencies>>;
+
+private:        // fields
+    std::unordered_map<int, Column, std::hash<int>, std::equal_to<int>
+        , Allocator<std::pair<const int, Column>>> columns_;
+    std::map<int, Watchers, std::less<int>
+        , CountingAllocator<std::pair<const int, Watchers>, MemoryCategory::Dependencies>> watchers_;  // by column
+
+public:         // methods
+    // The row of the first column of `range` matching `key`, reading the stale formulas
+    // of the range; their uncomputed values are reported as by Cell::GetNumber
+    std::optional<int> Find(const Sheet& sheet, const CellRange& range, double key, MatchSearch search);
+    void ForEachFormula(const Sheet& sheet, const CellRange& range, const std::function<void(const Cell*)>& action);
+    // the formulas of the range that may be uncached
+    void ForEachStaleFormula(const Sheet& sheet, const CellRange& range, const std::function<void(const Cell*)>& action);
+    // reads the stale formulas of the range, their uncomputed values are reported as by Cell::GetNumber
+    RangeSummary Aggregate(const Sheet& sheet, const CellRange& range);
+    // called by the sheet after the cell at `pos` was set or cleared, nullptr if it was removed
+    void Update(Position pos, const Cell* cell);
+    // cells moved, the indexes are made again on the next lookups
+    void Clear();
+    // called by the sheet for every cell whose text or computed value is about to change
+    void MarkStale(Position pos) {
+        if (columns_.empty()) {
+            return;
+        }
+        if (const auto column = columns_.find(pos.col); column != columns_.end() && column->second.formula_rows.count(pos.row)) {
+            MarkStale(column->second, pos.row);
+        }
+    }
+
+    // the formula is told of any change of the values in `range`
+    void Watch(Cell* formula, const CellRange& range);
+    void Unwatch(Cell* formula, const CellRange& range);
+    template <typename Action>
+    void ForEachWatcher(Position pos, Action action) const {
+        if (watchers_.empty()) {
+            return;
+        }
+        const auto column = watchers_.find(pos.col);
+        if (column == watchers_.end()) {
+            return;
+        }
+        for (const auto& [formula, rows] : column->second) {
+            if (pos.row >= rows.first && pos.row <= rows.last) {
+                action(formula);
+            }
+        }
+    }
+    // the formulas with a range reaching row (column) `first` or past it
+    std::vector<Cell*> FindWatchers(bool by_rows, int first) const;
+
+private:        // methods
+    Column& GetColumn(const Sheet& sheet, int col);
+    // drops the number of a formula row from the indexes until it is read again
+    void MarkStale(Column& column, int row);
+    // reads the stale formulas of the rows of `range` in column `col`
+    void ReadStaleFormulas(const Sheet& sheet, Column& column, int col, const CellRange& range);
+    // reads a stale formula into the indexes, it is no longer stale then
+    void ReadFormula(const Sheet& sheet, Column& column, Position pos);
+    void AddNumber(Column& column, int row, double number);
+    void RemoveNumber(Column& column, int row, double number);
+    std::optional<LookupMatch> FindExact(Column& column, const CellRange& range, double key);
+    std::optional<LookupMatch> FindNearest(Column& column, const CellRange& range, double key, MatchSearch search);
+};
@@ -1,9 +1,33 @@
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <functional>
 #include <limits>
+#include <random>
 #include <fstream>
+#include <sstream>
+#include <system_error>
+#include <thread>
 
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#endif
+
+#include "benchmark.h"
 #include "common.h"
+#include "data_table.h"
+#include "edit_log.h"
+#include "fork.h"
 #include "formula.h"
+#include "fuzz.h"
+#include "memory.h"
+#include "number_format.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "workbook.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -27,6 +51,41 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
 }
 
 namespace {
+	void TestPositionRoundTripFullGrid() {
+		char buffer[Position::MAX_STRING_LENGTH];
+		int64_t failures = 0;
+		Position first_failure = Position::NONE;
+		for (int row = 0; row < Position::MAX_ROWS; ++row) {
+			for (int col = 0; col < Position::MAX_COLS; ++col) {
+				const Position pos{ row, col };
+				const auto [end, ec] = pos.ToChars(buffer, buffer + Position::MAX_STRING_LENGTH);
+				if (ec != std::errc() || !(Position::FromString(std::string_view(buffer, end - buffer)) == pos)) {
+					if (failures++ == 0) {
+						first_failure = pos;
+					}
+				}
+			}
+		}
+		ASSERT_EQUAL(first_failure, Position::NONE);
+		ASSERT_EQUAL(failures, 0);
+
+		// the string variant agrees with the buffer one
+		for (const Position pos : { Position{ 0, 0 }, Position{ 136, 2 }, Position{ 0, 701 }, Position{ 0, 702 }
+			, Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } }) {
+			const auto result = pos.ToChars(buffer, buffer + Position::MAX_STRING_LENGTH);
+			ASSERT_EQUAL(pos.ToString(), std::string(buffer, result.ptr));
+		}
+
+		const auto too_small = Position{ 136, 2 }.ToChars(buffer, buffer + 3);
+		ASSERT(too_small.ec == std::errc::value_too_large);
+		const auto invalid = Position::NONE.ToChars(buffer, buffer + Position::MAX_STRING_LENGTH);
+		ASSERT(invalid.ec == std::errc() && invalid.ptr == buffer);
+		ASSERT_EQUAL(Position::FromString("A01"), (Position{ 0, 0 }));
+		ASSERT(!Position::FromString("AAAA1").IsValid());
+		ASSERT(!Position::FromString("A1 ").IsValid());
+		ASSERT(!Position::FromString("a1").IsValid());
+	}
+
 	void TestPositionAndStringConversion() {
 		auto testSingle = [](Position pos, std::string_view str) {
 			ASSERT_EQUAL(pos.ToString(), str);
@@ -170,7 +229,7 @@ namespace {
 
 	void TestFormulaExpressionFormatting() {
 		auto reformat = [](std::string expr) {
-			return ParseFormula(std::move(expr))->GetExpression();
+			return std::string(ParseFormula(std::move(expr))->GetExpression());
 		};
 
 		ASSERT_EQUAL(reformat("  1  "), "1");
@@ -181,6 +240,341 @@ namespace {
 		ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
 	}
 
+	void TestConditionalFunctions() {
+		auto sheet = CreateSheet();
+		const auto value_of = [&sheet](const std::string& text) {
+			sheet->SetCell("Z1"_pos, text);
+			return sheet->GetCell("Z1"_pos)->GetValue();
+		};
+		sheet->SetCell("A1"_pos, "1");
+		sheet->SetCell("C1"_pos, "abc");
+
+		ASSERT_EQUAL(value_of("=1<2"), CellInterface::Value(1.0));
+		ASSERT_EQUAL(value_of("=2<=1"), CellInterface::Value(0.0));
+		ASSERT_EQUAL(value_of("=A1=1"), CellInterface::Value(1.0));
+		ASSERT_EQUAL(value_of("=A1<>1"), CellInterface::Value(0.0));
+		ASSERT_EQUAL(value_of("=1+2>=3"), CellInterface::Value(1.0));
+		ASSERT_EQUAL(value_of("=IF(B1>0,1,2)"), CellInterface::Value(2.0));
+		ASSERT_EQUAL(value_of("=IF(A1,5)"), CellInterface::Value(5.0));
+		ASSERT_EQUAL(value_of("=IF(A1-1,5)"), CellInterface::Value(0.0));
+
+		// branches not taken are not evaluated
+		ASSERT_EQUAL(value_of("=IF(A1,5,1/0)"), CellInterface::Value(5.0));
+		ASSERT_EQUAL(value_of("=IF(A1-1,1/0,C1)"), CellInterface::Value(FormulaError::Category::Value));
+		ASSERT_EQUAL(value_of("=AND(A1-1,1/0)"), CellInterface::Value(0.0));
+		ASSERT_EQUAL(value_of("=AND(A1,1/0)"), CellInterface::Value(FormulaError::Category::Div0));
+		ASSERT_EQUAL(value_of("=AND(A1,2,A1>0)"), CellInterface::Value(1.0));
+		ASSERT_EQUAL(value_of("=OR(A1,1/0)"), CellInterface::Value(1.0));
+		ASSERT_EQUAL(value_of("=OR(B1,A1-1)"), CellInterface::Value(0.0));
+
+		ASSERT_EQUAL(value_of("=IFERROR(1/(A1-1),7)"), CellInterface::Value(7.0));
+		ASSERT_EQUAL(value_of("=IFERROR(A1*3,7)"), CellInterface::Value(3.0));
+		ASSERT_EQUAL(value_of("=IFERROR(C1+1,-1)*2"), CellInterface::Value(-2.0));
+		ASSERT_EQUAL(value_of("=1+IFERROR(IFERROR(1/B1,C1),4)"), CellInterface::Value(5.0));
+		ASSERT_EQUAL(value_of("=IFERROR(1/B1,C1)"), CellInterface::Value(FormulaError::Category::Value));
+		ASSERT_EQUAL(value_of("=IFERROR(IF(A1,Sheet2!A1),9)"), CellInterface::Value(9.0));
+
+		ASSERT_EQUAL(sheet->GetCell("Z1"_pos)->GetText(), "=IFERROR(IF(A1,Sheet2!A1),9)");
+		sheet->SetCell("Z1"_pos, "= IF( (A1 + 2) > 3 , 1, -(A1 < 2) )");
+		ASSERT_EQUAL(sheet->GetCell("Z1"_pos)->GetText(), "=IF(A1+2>3,1,-(A1<2))");
+		ASSERT_EQUAL(std::string(ParseFormula("(1<2)+(3<(4<5))")->GetExpression()), "(1<2)+(3<(4<5))");
+		ASSERT_EQUAL(std::string(ParseFormula("(1<2)<3")->GetExpression()), "1<2<3");
+		ASSERT_EQUAL(ParseFormula("IF(A1,B2,C3)+AND(D4)")->GetReferencedCells()
+			, (std::vector{ "A1"_pos, "B2"_pos, "C3"_pos, "D4"_pos }));
+
+		for (const char* invalid : { "=FOO(1)", "=IF(1)", "=IF(1,2,3,4)", "=AND()", "=IFERROR(1)", "=IF(1;2)" }) {
+			bool caught = false;
+			try {
+				sheet->SetCell("Z2"_pos, invalid);
+			}
+			catch (const FormulaException&) {
+				caught = true;
+			}
+			ASSERT(caught);
+		}
+	}
+
+	void TestLookupFunctions() {
+		auto sheet = CreateSheet();
+		const auto value_of = [&sheet](const std::string& text) {
+			sheet->SetCell("Z1"_pos, text);
+			return sheet->GetCell("Z1"_pos)->GetValue();
+		};
+		for (int i = 1; i <= 5; ++i) {
+			sheet->SetCell(Position{ i - 1, 0 }, std::to_string(i * 10));
+			sheet->SetCell(Position{ i - 1, 1 }, std::to_string(i * 100));
+		}
+		sheet->SetCell("A3"_pos, "'30");
+
+		ASSERT_EQUAL(value_of("=VLOOKUP(30,A1:B5,2,0)"), CellInterface::Value(300.0));
+		ASSERT_EQUAL(value_of("=VLOOKUP(35,A1:B5,2)"), CellInterface::Value(300.0));
+		ASSERT_EQUAL(value_of("=VLOOKUP(35,A1:B5,2,0)"), CellInterface::Value(FormulaError::Category::NA));
+		ASSERT_EQUAL(value_of("=VLOOKUP(5,A1:B5,2)"), CellInterface::Value(FormulaError::Category::NA));
+		ASSERT_EQUAL(value_of("=VLOOKUP(30,A1:B5,3,0)"), CellInterface::Value(FormulaError::Category::Ref));
+		ASSERT_EQUAL(value_of("=VLOOKUP(30,A1:B5,0,0)"), CellInterface::Value(FormulaError::Category::Value));
+		ASSERT_EQUAL(value_of("=MATCH(40,A1:A5,0)"), CellInterface::Value(4.0));
+		ASSERT_EQUAL(value_of("=MATCH(45,A1:A5)"), CellInterface::Value(4.0));
+		ASSERT_EQUAL(value_of("=MATCH(45,A1:A5,-1)"), CellInterface::Value(5.0));
+		ASSERT_EQUAL(value_of("=MATCH(45,A2:A3,-1)"), CellInterface::Value(FormulaError::Category::NA));
+		ASSERT_EQUAL(value_of("=XLOOKUP(20,A1:A5,B1:B5)"), CellInterface::Value(200.0));
+		ASSERT_EQUAL(value_of("=XLOOKUP(25,A1:A5,B1:B5)"), CellInterface::Value(FormulaError::Category::NA));
+		ASSERT_EQUAL(value_of("=XLOOKUP(25,A1:A5,B1:B5,-7)"), CellInterface::Value(-7.0));
+		ASSERT_EQUAL(value_of("=XLOOKUP(25,A1:A5,B1:B5,0,-1)"), CellInterface::Value(200.0));
+		ASSERT_EQUAL(value_of("=XLOOKUP(25,A1:A5,B1:B5,0,1)"), CellInterface::Value(300.0));
+		ASSERT_EQUAL(value_of("=XLOOKUP(25,A1:A5,B1:B5,0,2)"), CellInterface::Value(FormulaError::Category::Value));
+		ASSERT_EQUAL(value_of("=XLOOKUP(30,A2:A4,B1:B3)"), CellInterface::Value(200.0));
+		ASSERT_EQUAL(value_of("=1+XLOOKUP(1/0,A1:A5,B1:B5,7)"), CellInterface::Value(FormulaError::Category::Div0));
+		ASSERT_EQUAL(sheet->GetCell("Z1"_pos)->GetText(), "=1+XLOOKUP(1/0,A1:A5,B1:B5,7)");
+
+		// formulas of a range are matched by value, duplicates by their first row
+		sheet->SetCell("A6"_pos, "=A1+5");
+		sheet->SetCell("A7"_pos, "=1/0");
+		sheet->SetCell("A8"_pos, "15");
+		ASSERT_EQUAL(value_of("=MATCH(15,A1:A8,0)"), CellInterface::Value(6.0));
+		ASSERT_EQUAL(value_of("=MATCH(15,A7:A8,0)"), CellInterface::Value(2.0));
+		ASSERT_EQUAL(value_of("=MATCH(16,A1:A8,1)"), CellInterface::Value(8.0));
+		ASSERT_EQUAL(value_of("=MATCH(B1, A1 : A8 , 0)"), CellInterface::Value(FormulaError::Category::NA));
+		ASSERT_EQUAL(sheet->GetCell("Z1"_pos)->GetText(), "=MATCH(B1,A1:A8,0)");
+		ASSERT_EQUAL(ParseFormula("VLOOKUP(C1,B2:A1,2)")->GetReferencedCells(), std::vector{ "C1"_pos });
+		ASSERT_EQUAL(std::string(ParseFormula("VLOOKUP(C1,B2:A1,2)")->GetExpression()), "VLOOKUP(C1,A1:B2,2)");
+
+		for (const char* invalid : { "=A1:B2", "=1+A1:A2", "=MATCH(1,A1:B2)", "=XLOOKUP(1,A1:A3,B1:B4)"
+			, "=VLOOKUP(1,2,3)", "=VLOOKUP(A1:A2,A1:B2,1)", "=IF(A1:A2,1)", "=MATCH(1)" }) {
+			bool caught = false;
+			try {
+				sheet->SetCell("Z2"_pos, invalid);
+			}
+			catch (const FormulaException&) {
+				caught = true;
+			}
+			ASSERT(caught);
+		}
+	}
+
+	void TestLookupIndexMaintenance() {
+		Sheet sheet;
+		for (int row = 0; row < 100; ++row) {
+			sheet.SetCell(Position{ row, 0 }, std::to_string(row % 5));
+		}
+		sheet.SetCell("Z1"_pos, "=MATCH(7,A1:A100,0)");
+		sheet.SetCell("Z2"_pos, "=VLOOKUP(7.5,A1:A100,1)");
+		const auto z1 = [&sheet]() {
+			return sheet.GetCell("Z1"_pos)->GetValue();
+		};
+		ASSERT_EQUAL(z1(), CellInterface::Value(FormulaError::Category::NA));
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetValue(), CellInterface::Value(4.0));
+
+		// edits of the indexed column reach the lookups
+		sheet.SetCell("A50"_pos, "7");
+		ASSERT_EQUAL(z1(), CellInterface::Value(50.0));
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetValue(), CellInterface::Value(7.0));
+		sheet.SetCell("A20"_pos, "7");
+		ASSERT_EQUAL(z1(), CellInterface::Value(20.0));
+		sheet.ClearCell("A20"_pos);
+		ASSERT_EQUAL(z1(), CellInterface::Value(50.0));
+		sheet.SetCell("A50"_pos, "=B1+7");
+		ASSERT_EQUAL(z1(), CellInterface::Value(50.0));
+		sheet.SetCell("B1"_pos, "1");
+		ASSERT_EQUAL(z1(), CellInterface::Value(FormulaError::Category::NA));
+		sheet.SetCell("B1"_pos, "");
+		ASSERT_EQUAL(z1(), CellInterface::Value(50.0));
+		sheet.Publish();
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell("Z1"_pos)->value, CellInterface::Value(50.0));
+
+		// a lookup references every cell of its range
+		for (const auto& [pos, text] : { std::pair{ "A10"_pos, "=MATCH(1,A1:A20,0)" }, { "A60"_pos, "=Z1" }
+			, { "B1"_pos, "=Z2" } }) {
+			bool caught = false;
+			try {
+				sheet.SetCell(pos, text);
+			}
+			catch (const CircularDependencyException&) {
+				caught = true;
+			}
+			ASSERT(caught);
+		}
+		ASSERT_EQUAL(sheet.GetCell("A10"_pos)->GetText(), "4");
+
+		// ranges follow the rows inserted or deleted
+		sheet.InsertRows(0);
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetText(), "=MATCH(7,A2:A101,0)");
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetValue(), CellInterface::Value(50.0));
+		sheet.InsertRows(30, 2);
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetText(), "=MATCH(7,A2:A103,0)");
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetValue(), CellInterface::Value(52.0));
+		sheet.DeleteRows(10, 5);
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetText(), "=MATCH(7,A2:A98,0)");
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetValue(), CellInterface::Value(47.0));
+		sheet.SetCell("A2"_pos, "7");
+		ASSERT_EQUAL(sheet.GetCell("Z2"_pos)->GetValue(), CellInterface::Value(1.0));
+		sheet.DeleteCols(0);
+		ASSERT_EQUAL(sheet.GetCell("Y2"_pos)->GetText(), "=MATCH(7,#REF!,0)");
+		ASSERT_EQUAL(sheet.GetCell("Y2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+	}
+
+	void TestLookupFormulaRows() {
+		Sheet sheet;
+		for (int row = 0; row < 1000; ++row) {
+			sheet.SetCell(Position{ row, 1 }, std::to_string(row + 1));
+			sheet.SetCell(Position{ row, 0 }, "=B" + std::to_string(row + 1) + "*2");
+		}
+		sheet.SetCell("Z1"_pos, "=MATCH(1000,A1:A1000,0)");
+		sheet.SetCell("Z2"_pos, "=VLOOKUP(1001,A400:A600,1)");
+		// the numbers nearest to the key are all outside the range
+		sheet.SetCell("Z3"_pos, "=MATCH(5000,A10:A12,1)");
+		const auto value = [&sheet](Position pos) {
+			return sheet.GetCell(pos)->GetValue();
+		};
+		ASSERT_EQUAL(value("Z1"_pos), CellInterface::Value(500.0));
+		ASSERT_EQUAL(value("Z2"_pos), CellInterface::Value(1000.0));
+		ASSERT_EQUAL(value("Z3"_pos), CellInterface::Value(3.0));
+
+		// the cached values of the formulas are indexed until they change
+		sheet.SetCell("B500"_pos, "7");
+		ASSERT_EQUAL(value("Z1"_pos), CellInterface::Value(FormulaError::Category::NA));
+		ASSERT_EQUAL(value("Z2"_pos), CellInterface::Value(998.0));
+		sheet.SetCell("B300"_pos, "500");
+		ASSERT_EQUAL(value("Z1"_pos), CellInterface::Value(300.0));
+		sheet.SetCell("B11"_pos, "5000");
+		ASSERT_EQUAL(value("Z3"_pos), CellInterface::Value(3.0));
+		sheet.SetCell("B12"_pos, "=B11-2000");
+		ASSERT_EQUAL(value("Z3"_pos), CellInterface::Value(1.0));
+		sheet.SetCell("B10"_pos, "=1/0");
+		ASSERT_EQUAL(value("Z3"_pos), CellInterface::Value(FormulaError::Category::NA));
+		sheet.SetCell("B11"_pos, "1000");
+		ASSERT_EQUAL(value("Z3"_pos), CellInterface::Value(2.0));
+		ASSERT_EQUAL(sheet.GetCell("Z4"_pos), nullptr);
+		sheet.SetCell("Z4"_pos, "=SUM(A10:A12)");
+		ASSERT_EQUAL(value("Z4"_pos), CellInterface::Value(FormulaError::Category::Div0));
+		sheet.SetCell("B10"_pos, "1");
+		ASSERT_EQUAL(value("Z4"_pos), CellInterface::Value(2.0 + 2000 - 2000));
+		sheet.SetCell("B11"_pos, "-1");
+		ASSERT_EQUAL(value("Z3"_pos), CellInterface::Value(1.0));
+		ASSERT_EQUAL(value("Z4"_pos), CellInterface::Value(2.0 - 2 - 4002));
+	}
+
+	void TestAggregateFunctions() {
+		auto sheet = CreateSheet();
+		const auto value_of = [&sheet](const std::string& text) {
+			sheet->SetCell("Z1"_pos, text);
+			return sheet->GetCell("Z1"_pos)->GetValue();
+		};
+		for (int i = 1; i <= 5; ++i) {
+			sheet->SetCell(Position{ i - 1, 0 }, std::to_string(i));
+			sheet->SetCell(Position{ i - 1, 1 }, std::to_string(-i * 10));
+		}
+		sheet->SetCell("A3"_pos, "'3");
+		sheet->SetCell("A6"_pos, "text");
+		sheet->SetCell("A7"_pos, "");
+
+		// numeric texts count, other texts and empty cells are skipped
+		ASSERT_EQUAL(value_of("=SUM(A1:A10)"), CellInterface::Value(15.0));
+		ASSERT_EQUAL(value_of("=COUNT(A1:A10)"), CellInterface::Value(5.0));
+		ASSERT_EQUAL(value_of("=AVERAGE(A1:A10)"), CellInterface::Value(3.0));
+		ASSERT_EQUAL(value_of("=MIN(A1:B5)"), CellInterface::Value(-50.0));
+		ASSERT_EQUAL(value_of("=MAX(B1:B5)"), CellInterface::Value(-10.0));
+		ASSERT_EQUAL(value_of("=SUM(A1:B5,100,A1)"), CellInterface::Value(-34.0));
+		ASSERT_EQUAL(value_of("=COUNT(1,2,C1:C9)"), CellInterface::Value(2.0));
+		ASSERT_EQUAL(value_of("=MAX(C1:C9)"), CellInterface::Value(0.0));
+		ASSERT_EQUAL(value_of("=AVERAGE(C1:C9)"), CellInterface::Value(FormulaError::Category::Div0));
+		ASSERT_EQUAL(value_of("=MIN(C1:C9,-1)*2"), CellInterface::Value(-2.0));
+		ASSERT_EQUAL(value_of("=SUM(A6)"), CellInterface::Value(FormulaError::Category::Value));
+		ASSERT_EQUAL(value_of("=SUM(1e308,A1:A1)"), CellInterface::Value(1e308 + 1));
+		ASSERT_EQUAL(value_of("=SUM(1e308,1e308)"), CellInterface::Value(FormulaError::Category::Div0));
+		ASSERT_EQUAL(value_of("=SUM( A1 : A2 ,1)"), CellInterface::Value(4.0));
+		ASSERT_EQUAL(sheet->GetCell("Z1"_pos)->GetText(), "=SUM(A1:A2,1)");
+
+		// the first error of a range, row by row, fails all but COUNT
+		sheet->SetCell("B4"_pos, "=1/0");
+		sheet->SetCell("A5"_pos, "=B10");
+		sheet->SetCell("B10"_pos, "=MATCH(1,A1:A2,0)+A20");
+		sheet->SetCell("A20"_pos, "=Z9");
+		ASSERT_EQUAL(value_of("=SUM(A1:B5)"), CellInterface::Value(FormulaError::Category::Div0));
+		ASSERT_EQUAL(value_of("=COUNT(A1:B5)"), CellInterface::Value(9.0));
+		sheet->SetCell("Z9"_pos, "=1+Z8");
+		sheet->SetCell("Z8"_pos, "'x");
+		ASSERT_EQUAL(value_of("=MAX(A5:B5,A4:B4)"), CellInterface::Value(FormulaError::Category::Value));
+		ASSERT_EQUAL(value_of("=MAX(A4:B4,A5:B5)"), CellInterface::Value(FormulaError::Category::Div0));
+		ASSERT_EQUAL(value_of("=IFERROR(SUM(A1:B5),-1)"), CellInterface::Value(-1.0));
+
+		for (const char* invalid : { "=SUM()", "=COUNT(A1:B2+1)", "=1+MIN" }) {
+			bool caught = false;
+			try {
+				sheet->SetCell("Z2"_pos, invalid);
+			}
+			catch (const FormulaException&) {
+				caught = true;
+			}
+			ASSERT(caught);
+		}
+		bool caught = false;
+		try {
+			sheet->SetCell("B2"_pos, "=AVERAGE(A1:B3)");
+		}
+		catch (const CircularDependencyException&) {
+			caught = true;
+		}
+		ASSERT(caught);
+	}
+
+	void TestAggregateMaintenance() {
+		Sheet sheet;
+		for (int row = 0; row < 1000; ++row) {
+			sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+		}
+		sheet.SetCell("C1"_pos, "=SUM(A1:A1000)");
+		sheet.SetCell("C2"_pos, "=MAX(A1:B1000)");
+		sheet.SetCell("C3"_pos, "=COUNT(A500:A1000)");
+		const auto value = [&sheet](const char* cell) {
+			return sheet.GetCell(Position::FromString(cell))->GetValue();
+		};
+		ASSERT_EQUAL(value("C1"), CellInterface::Value(499500.0));
+		ASSERT_EQUAL(value("C2"), CellInterface::Value(999.0));
+		ASSERT_EQUAL(value("C3"), CellInterface::Value(501.0));
+
+		// edits of constants and of the formulas of a range reach the aggregates
+		sheet.SetCell("A1000"_pos, "-1");
+		ASSERT_EQUAL(value("C1"), CellInterface::Value(498500.0));
+		ASSERT_EQUAL(value("C2"), CellInterface::Value(998.0));
+		sheet.ClearCell("A999"_pos);
+		ASSERT_EQUAL(value("C2"), CellInterface::Value(997.0));
+		ASSERT_EQUAL(value("C3"), CellInterface::Value(500.0));
+		sheet.SetCell("B10"_pos, "=D1*2");
+		ASSERT_EQUAL(value("C2"), CellInterface::Value(997.0));
+		sheet.SetCell("D1"_pos, "5000");
+		ASSERT_EQUAL(value("C2"), CellInterface::Value(10000.0));
+		sheet.SetCell("A600"_pos, "=D1");
+		const double sum = 499500.0 - 999 - 1 - 998 - 599;
+		ASSERT_EQUAL(value("C1"), CellInterface::Value(sum + 5000));
+		sheet.SetCell("D1"_pos, "=1/0");
+		ASSERT_EQUAL(value("C1"), CellInterface::Value(FormulaError::Category::Div0));
+		ASSERT_EQUAL(value("C3"), CellInterface::Value(499.0));
+		sheet.SetCell("D1"_pos, "1");
+		ASSERT_EQUAL(value("C1"), CellInterface::Value(sum + 1));
+		ASSERT_EQUAL(value("C2"), CellInterface::Value(997.0));
+		sheet.Publish();
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell("C2"_pos)->value, CellInterface::Value(997.0));
+
+		// chains of aggregates over each other
+		sheet.SetCell("E1"_pos, "1");
+		for (int row = 1; row < 200; ++row) {
+			sheet.SetCell(Position{ row, 4 }, "=SUM(E1:E" + std::to_string(row) + ")");
+		}
+		ASSERT_EQUAL(value("E200"), CellInterface::Value(std::pow(2.0, 198)));
+		sheet.SetCell("E1"_pos, "2");
+		ASSERT_EQUAL(value("E200"), CellInterface::Value(std::pow(2.0, 199)));
+
+		// ranges follow the rows inserted or deleted
+		sheet.InsertRows(0, 2);
+		ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=SUM(A3:A1002)");
+		ASSERT_EQUAL(value("C3"), CellInterface::Value(sum + 1));
+		sheet.DeleteRows(10, 10);
+		ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=SUM(A3:A992)");
+		ASSERT_EQUAL(value("C3"), CellInterface::Value(sum + 1 - 125));
+		sheet.SetCell("A3"_pos, "100");
+		ASSERT_EQUAL(value("C3"), CellInterface::Value(sum + 1 - 125 + 100));
+	}
+
 	void TestFormulaReferencedCells() {
 		ASSERT(ParseFormula("1")->GetReferencedCells().empty());
 
@@ -248,6 +642,45 @@ namespace {
 		}
 	}
 
+	void TestDivisionChain() {
+		auto sheet = CreateSheet();
+		std::string formula = "=";
+		for (int i = 0; i < 30; ++i) {
+			sheet->SetCell(Position{ i, 0 }, "2");
+			formula += (i ? "/A" : "A") + std::to_string(i + 1);
+		}
+		sheet->SetCell("B1"_pos, formula);
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0 / (1 << 28)));
+
+		sheet->SetCell("A30"_pos, "0");
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(),
+			CellInterface::Value(FormulaError::Category::Div0));
+	}
+
+	void TestConstantFolding() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("A1"_pos, "10");
+
+		int row = 0;
+		auto check = [&](std::string expr, std::string text, CellInterface::Value value) {
+			const Position pos{ row++, 1 };
+			sheet->SetCell(pos, "=" + expr);
+			ASSERT_EQUAL(sheet->GetCell(pos)->GetText(), "=" + text);
+			ASSERT_EQUAL(sheet->GetCell(pos)->GetValue(), value);
+		};
+
+		check("(1+2)*A1/100*3", "(1+2)*A1/100*3", CellInterface::Value((1.0 + 2) * 10 / 100 * 3));
+		check("A1/4", "A1/4", CellInterface::Value(2.5));
+		check("A1/3", "A1/3", CellInterface::Value(10.0 / 3));
+		check("+A1", "+A1", CellInterface::Value(10.0));
+		check("--A1", "--A1", CellInterface::Value(10.0));
+		check("-(-(-A1))", "---A1", CellInterface::Value(-10.0));
+		check("A1/(2-2)", "A1/(2-2)", CellInterface::Value(FormulaError::Category::Div0));
+		check("1/0+A1", "1/0+A1", CellInterface::Value(FormulaError::Category::Div0));
+		check("A1/0.000001", "A1/1e-06", CellInterface::Value(FormulaError::Category::Div0));
+		check("1e200*1e200*0", "1e+200*1e+200*0", CellInterface::Value(FormulaError::Category::Div0));
+	}
+
 	void TestEmptyCellTreatedAsZero() {
 		auto sheet = CreateSheet();
 		sheet->SetCell("A1"_pos, "=B2");
@@ -315,6 +748,369 @@ namespace {
 		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{ "C3"_pos });
 	}
 
+	void TestReferencedCellLifetime() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("A1"_pos, "2");
+		sheet->SetCell("B1"_pos, "=A1*C1");
+		sheet->SetCell("C1"_pos, "3");
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+		// a referenced cell survives clearing as an empty one, the formula keeps reading it
+		sheet->ClearCell("A1"_pos);
+		ASSERT(sheet->GetCell("A1"_pos) != nullptr);
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+		sheet->SetCell("A1"_pos, "5");
+		ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(15.0));
+
+		sheet->ClearCell("B1"_pos);
+		sheet->ClearCell("A1"_pos);
+		ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 3 }));
+		sheet->ClearCell("C1"_pos);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
+	}
+
+	void TestSnapshotIsolation() {
+		Sheet sheet;
+		ASSERT(sheet.ReadSnapshot().Get() == nullptr);
+
+		sheet.SetCell("A1"_pos, "2");
+		sheet.SetCell("B2"_pos, "=A1*10");
+		ASSERT_EQUAL(sheet.Publish(), 1u);
+
+		auto first = sheet.ReadSnapshot();
+		sheet.SetCell("A1"_pos, "3");
+		sheet.SetCell("C3"_pos, "meow");
+		ASSERT_EQUAL(first->GetCell("B2"_pos)->value, CellInterface::Value(20.0));
+		ASSERT(first->GetCell("C3"_pos) == nullptr);
+
+		sheet.Publish();
+		auto second = sheet.ReadSnapshot();
+		ASSERT_EQUAL(first->GetVersion(), 1u);
+		ASSERT_EQUAL(second->GetVersion(), 2u);
+		ASSERT_EQUAL(second->GetCell("B2"_pos)->value, CellInterface::Value(30.0));
+		ASSERT_EQUAL(second->GetCell("B2"_pos)->text, "=A1*10");
+		ASSERT_EQUAL(second->GetPrintableSize(), (Size{ 3, 3 }));
+
+		std::ostringstream sheet_values, snapshot_values, sheet_texts, snapshot_texts;
+		sheet.PrintValues(sheet_values);
+		second->PrintValues(snapshot_values);
+		ASSERT_EQUAL(snapshot_values.str(), sheet_values.str());
+		sheet.PrintTexts(sheet_texts);
+		second->PrintTexts(snapshot_texts);
+		ASSERT_EQUAL(snapshot_texts.str(), sheet_texts.str());
+
+		sheet.ClearCell("C3"_pos);
+		sheet.Publish();
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetPrintableSize(), (Size{ 2, 2 }));
+		ASSERT_EQUAL(second->GetCell("C3"_pos)->text, "meow");
+	}
+
+	void TestChangesSinceVersion() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "1");
+		sheet.SetCell("B1"_pos, "=A1*2");
+		const uint64_t first = sheet.Publish();
+		auto changes = sheet.GetChangesSince(0);
+		ASSERT(changes.has_value());
+		ASSERT_EQUAL(changes->size(), 2u);
+		ASSERT_EQUAL((*changes)[1].pos, "B1"_pos);
+		ASSERT((*changes)[1].value == std::optional(CellInterface::Value(2.0)));
+
+		// B1 is recomputed to the same value, only C2 is new
+		auto before = sheet.ReadSnapshot();
+		sheet.SetCell("A1"_pos, "1");
+		sheet.SetCell("C2"_pos, "meow");
+		const uint64_t second = sheet.Publish();
+		changes = sheet.GetChangesSince(first);
+		ASSERT_EQUAL(changes->size(), 1u);
+		ASSERT_EQUAL(changes->front().pos, "C2"_pos);
+		ASSERT(changes->front().value == std::optional(CellInterface::Value("meow"s)));
+
+		auto after = sheet.ReadSnapshot();
+		std::vector<Position> diff;
+		after->ForEachChange(*before, [&diff](Position pos, const SheetSnapshot::Entry* entry) {
+			ASSERT(entry != nullptr);
+			diff.push_back(pos);
+		});
+		ASSERT_EQUAL(diff, std::vector<Position>{ "C2"_pos });
+
+		sheet.SetCell("A1"_pos, "5");
+		sheet.ClearCell("C2"_pos);
+		sheet.Publish();
+		changes = sheet.GetChangesSince(second);
+		ASSERT_EQUAL(changes->size(), 3u);
+		ASSERT((*changes)[0].value == std::optional(CellInterface::Value("5"s)));
+		ASSERT((*changes)[1].value == std::optional(CellInterface::Value(10.0)));
+		ASSERT_EQUAL((*changes)[2].pos, "C2"_pos);
+		ASSERT(!(*changes)[2].value.has_value());
+		ASSERT(sheet.GetChangesSince(sheet.Publish())->empty());
+	}
+
+	void TestChangesSinceForgottenVersion() {
+		Sheet sheet;
+		for (int i = 0; i < 70000; ++i) {
+			sheet.SetCell(Position{ i / 100, i % 100 }, "x");
+		}
+		const uint64_t version = sheet.Publish();
+		ASSERT(!sheet.GetChangesSince(0).has_value());
+		ASSERT(sheet.GetChangesSince(version)->empty());
+	}
+
+	// run under -fsanitize=thread to check the publication protocol
+	void TestSnapshotConcurrentReaders() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "0");
+		sheet.SetCell("B1"_pos, "=A1*2");
+		sheet.SetCell("C1"_pos, "=A1");
+		sheet.Publish();
+
+		std::atomic<bool> done = false;
+		std::atomic<int> violations = 0;
+		std::vector<std::thread> readers;
+		for (int i = 0; i < 4; ++i) {
+			readers.emplace_back([&] {
+				uint64_t last_version = 0;
+				while (!done) {
+					auto snapshot = sheet.ReadSnapshot();
+					const double b1 = std::get<double>(snapshot->GetCell("B1"_pos)->value);
+					const double c1 = std::get<double>(snapshot->GetCell("C1"_pos)->value);
+					if (b1 != 2 * c1 || snapshot->GetVersion() < last_version) {
+						++violations;
+					}
+					last_version = snapshot->GetVersion();
+				}
+			});
+		}
+		for (int i = 1; i <= 2000; ++i) {
+			sheet.SetCell("A1"_pos, std::to_string(i));
+			sheet.SetCell(Position{ i % 50 + 1, i % 7 }, "=A1+" + std::to_string(i));
+			sheet.Publish();
+		}
+		done = true;
+		for (auto& reader : readers) {
+			reader.join();
+		}
+		ASSERT_EQUAL(violations.load(), 0);
+	}
+
+	// more guards than slots in one block, all held by one thread
+	void TestSnapshotManyGuards() {
+		Sheet sheet;
+		std::vector<SnapshotPublisher::ReadGuard> guards;
+		for (int i = 0; i < 200; ++i) {
+			sheet.SetCell("A1"_pos, std::to_string(i));
+			sheet.Publish();
+			guards.push_back(sheet.ReadSnapshot());
+		}
+		// none of the pinned versions is freed by later publishes
+		sheet.SetCell("A1"_pos, "x");
+		sheet.Publish();
+		for (int i = 0; i < 200; ++i) {
+			ASSERT_EQUAL(guards[i]->GetCell("A1"_pos)->text, std::to_string(i));
+		}
+		guards.clear();
+		sheet.Publish();
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell("A1"_pos)->text, "x"s);
+	}
+
+	// edits of cells in branches not taken leave the formula cached
+	void TestConditionalDependencies() {
+		Sheet sheet;
+		sheet.SetCell("B1"_pos, "1");
+		sheet.SetCell("C1"_pos, "10");
+		sheet.SetCell("D1"_pos, "20");
+		sheet.SetCell("A1"_pos, "=IF(B1>0,C1,D1)");
+		sheet.SetCell("A2"_pos, "=A1*2");
+		sheet.Publish();
+		const auto cells_to_compute = [&sheet](Position pos, const std::string& text) {
+			sheet.SetCell(pos, text);
+			auto recalc = sheet.RecalculateAsync();
+			ASSERT(recalc.Wait().has_value());
+			return recalc.GetProgress().total;
+		};
+
+		ASSERT_EQUAL(cells_to_compute("D1"_pos, "21"), 1u);
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell("A2"_pos)->value, CellInterface::Value(20.0));
+		ASSERT_EQUAL(cells_to_compute("C1"_pos, "11"), 3u);
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell("A2"_pos)->value, CellInterface::Value(22.0));
+
+		// the other branch is read from now on
+		ASSERT_EQUAL(cells_to_compute("B1"_pos, "0"), 3u);
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell("A2"_pos)->value, CellInterface::Value(42.0));
+		ASSERT_EQUAL(cells_to_compute("C1"_pos, "12"), 1u);
+		ASSERT_EQUAL(cells_to_compute("D1"_pos, "1"), 3u);
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell("A2"_pos)->value, CellInterface::Value(2.0));
+
+		// a chain of conditionals is computed without recursion either
+		const int length = 100000;
+		const auto at = [](int i) {
+			return Position{ i / 1000, 5 + i % 1000 };
+		};
+		for (int i = 0; i < length; ++i) {
+			sheet.SetCell(at(i), "=IF(B1,0,"s + at(i + 1).ToString() + "+1)"s);
+		}
+		ASSERT_EQUAL(sheet.GetCell(at(0))->GetValue(), CellInterface::Value(static_cast<double>(length)));
+	}
+
+	// a cancelled worker stops inside the chain of the cell it computes
+	void TestRecalculationCancelsInsideChain() {
+		const int length = 200000;
+		const auto at = [](int i) {
+			return Position{ i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+		};
+		Sheet sheet;
+		std::vector<Sheet::CellEdit> edits;
+		for (int i = 0; i < length; ++i) {
+			edits.push_back({ at(i), "=" + at(i + 1).ToString() + "+1" });
+		}
+		sheet.SetCells(std::move(edits));
+		auto start = std::chrono::steady_clock::now();
+		sheet.Publish();
+		const auto full = std::chrono::steady_clock::now() - start;
+		ASSERT_EQUAL(sheet.GetCell(at(0))->GetValue(), CellInterface::Value(static_cast<double>(length)));
+
+		// A1 reads the whole chain, the worker computes it first
+		sheet.SetCell(at(length), "1");
+		auto recalc = sheet.RecalculateAsync();
+		std::this_thread::sleep_for(full / 4);
+		start = std::chrono::steady_clock::now();
+		recalc.Cancel();
+		ASSERT(!recalc.Wait().has_value());
+		ASSERT(std::chrono::steady_clock::now() - start < full / 10);
+		ASSERT_EQUAL(sheet.GetCell(at(0))->GetValue(), CellInterface::Value(length + 1.0));
+	}
+
+	void TestAsyncRecalculation() {
+		Sheet sheet;
+		const int chain_length = 200;
+		const Position last{ chain_length, 1 };
+		sheet.SetCell("A1"_pos, "1");
+		sheet.SetCell("B1"_pos, "=A1");
+		for (int i = 1; i <= chain_length; ++i) {
+			sheet.SetCell(Position{ i, 1 }, "=B" + std::to_string(i) + "+1");
+		}
+		sheet.Publish();
+
+		sheet.SetCell("A1"_pos, "2");
+		auto recalc = sheet.RecalculateAsync();
+		{
+			auto snapshot = sheet.ReadSnapshot();
+			if (snapshot->HasPending()) {
+				ASSERT(snapshot->IsPending(last));
+				ASSERT_EQUAL(snapshot->GetCell(last)->value, CellInterface::Value(chain_length + 1.0));
+			}
+		}
+		ASSERT(recalc.Wait().has_value());
+		ASSERT_EQUAL(recalc.GetProgress().done, recalc.GetProgress().total);
+		ASSERT(!sheet.ReadSnapshot()->HasPending());
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell(last)->value, CellInterface::Value(chain_length + 2.0));
+
+		// an edit supersedes the recalculation in flight
+		sheet.SetCell("A1"_pos, "3");
+		auto superseded = sheet.RecalculateAsync();
+		sheet.SetCell("A1"_pos, "4");
+		ASSERT(superseded.IsCancelRequested());
+		ASSERT(superseded.GetFuture().wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+
+		auto latest = sheet.RecalculateAsync();
+		latest.Wait();
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell(last)->value, CellInterface::Value(chain_length + 4.0));
+		ASSERT_EQUAL(sheet.ReadSnapshot()->GetCell("A1"_pos)->text, "4");
+	}
+
+	// counts that do not fit the sheet, down to ones overflowing an int, are rejected or clamped
+	void TestStructureEditBounds() {
+		const int huge = std::numeric_limits<int>::max();
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "=SUM(B2:B10)");
+		sheet.SetCell("A3"_pos, "1");
+		sheet.SetCell("C1"_pos, "2");
+		const auto rejected = [&sheet](const std::function<void()>& edit) {
+			try {
+				edit();
+				return false;
+			}
+			catch (const InvalidPositionException&) {
+				return true;
+			}
+		};
+		for (int count : { 0, -1, std::numeric_limits<int>::min() }) {
+			ASSERT(rejected([&] { sheet.InsertRows(0, count); }));
+			ASSERT(rejected([&] { sheet.DeleteCols(0, count); }));
+		}
+		ASSERT(rejected([&] { sheet.InsertRows(1, huge); }));
+		ASSERT(rejected([&] { sheet.InsertCols(0, huge); }));
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "1"s);
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=SUM(B2:B10)"s);
+
+		// only part of the range is past the last stored row, shifted out of the sheet it is cut off
+		sheet.InsertRows(5, huge);
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=SUM(B2:B5)"s);
+		ASSERT(sheet.Undo());
+
+		sheet.DeleteRows(1, huge);
+		ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+		sheet.DeleteCols(1, huge);
+		ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "1"s);
+		ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "2"s);
+	}
+
+	void TestInsertDeleteRowsCols() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "1");
+		sheet.SetCell("A2"_pos, "2");
+		sheet.SetCell("B1"_pos, "=A1+A2");
+		sheet.SetCell("C5"_pos, "=A1*A2");
+		sheet.SetCell("D1"_pos, "=B1+10");
+
+		sheet.InsertRows(1, 2);
+		ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "2");
+		ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+		ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+A4");
+		ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetText(), "=A1*A4");
+		ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=B1+10");
+		ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetValue(), CellInterface::Value(2.0));
+		ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos, "A4"_pos }));
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 7, 4 }));
+
+		sheet.SetCell("A4"_pos, "5");
+		ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(16.0));
+
+		sheet.DeleteRows(0);
+		ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetText(), "=#REF!*A3");
+		ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+		ASSERT_EQUAL(sheet.GetCell("C6"_pos)->GetReferencedCells(), std::vector{ "A3"_pos });
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 6, 3 }));
+
+		sheet.InsertCols(0);
+		ASSERT_EQUAL(sheet.GetCell("D6"_pos)->GetText(), "=#REF!*B3");
+		ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "5");
+		sheet.SetCell("E1"_pos, "=B3+D6");
+		sheet.DeleteCols(1, 2);
+		ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=#REF!+B6");
+		ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetText(), "=#REF!*#REF!");
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 6, 3 }));
+
+		std::ostringstream texts;
+		sheet.PrintTexts(texts);
+		ASSERT_EQUAL(texts.str(), "\t\t=#REF!+B6\n\t\n\t\n\t\n\t\n\t=#REF!*#REF!\t\n");
+
+		bool thrown = false;
+		try {
+			sheet.InsertRows(0, Position::MAX_ROWS);
+		}
+		catch (const InvalidPositionException&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+	}
+
 	void TestFormulaIncorrect() {
 		auto isIncorrect = [](std::string expression) {
 			try {
@@ -333,6 +1129,55 @@ namespace {
 		ASSERT(isIncorrect("2+4-"));
 	}
 
+	void TestFormulaNestingLimit() {
+		auto sheet = CreateSheet();
+		auto isRejected = [&sheet](const std::string& text) {
+			try {
+				sheet->SetCell("A1"_pos, text);
+			}
+			catch (const FormulaException&) {
+				return true;
+			}
+			return false;
+		};
+		auto parens = [](size_t depth) {
+			return "=" + std::string(depth, '(') + "1" + std::string(depth, ')');
+		};
+		auto negations = [](size_t count) {
+			return "=" + std::string(count, '-') + "1";
+		};
+		auto sum = [](size_t operators) {
+			std::string text = "=1e-1";
+			for (size_t i = 0; i < operators; ++i) {
+				text += i % 2 ? "+1e-1" : "-A2";
+			}
+			return text;
+		};
+
+		// at the limits the formulas parse, compute, print and free as any other
+		ASSERT(!isRejected(parens(MAX_FORMULA_NESTING)));
+		ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 1.0);
+		ASSERT(!isRejected(negations(MAX_FORMULA_NESTING)));
+		ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), negations(MAX_FORMULA_NESTING));
+		ASSERT(!isRejected("=" + std::string(MAX_FORMULA_NESTING - 1, '-') + "SUM(A2:A3)"));
+		// a unary operator ends with its operand
+		std::string negated_terms = "=1";
+		for (size_t i = 0; i <= MAX_FORMULA_NESTING; ++i) {
+			negated_terms += "+-1";
+		}
+		ASSERT(!isRejected(negated_terms));
+		ASSERT(!isRejected(sum(MAX_FORMULA_OPERATORS)));
+		ASSERT(std::abs(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()) - 0.1 * (MAX_FORMULA_OPERATORS / 2 + 1)) < 1e-9);
+		const std::string accepted = sheet->GetCell("A1"_pos)->GetText();
+
+		ASSERT(isRejected(parens(MAX_FORMULA_NESTING + 1)));
+		ASSERT(isRejected(negations(MAX_FORMULA_NESTING + 1)));
+		ASSERT(isRejected("=-(" + std::string(MAX_FORMULA_NESTING - 1, '-') + "1)"));
+		ASSERT(isRejected(sum(MAX_FORMULA_OPERATORS + 1)));
+		ASSERT(isRejected(parens(1'000'000)));
+		ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), accepted);
+	}
+
 	void TestCellCircularReferences() {
 		auto sheet = CreateSheet();
 		sheet->SetCell("E2"_pos, "=E4");
@@ -364,6 +1209,187 @@ namespace {
 		ASSERT(caught);
 	}
 
+	void TestResetFormulaWithSameReferences() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("A1"_pos, "1");
+		sheet->SetCell("B1"_pos, "=A1");
+		sheet->SetCell("B1"_pos, "=A1+1");
+		sheet->SetCell("C1"_pos, "=B1+A1");
+		sheet->SetCell("C1"_pos, "=A1*B1");
+		ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+	}
+
+	void TestWorkbookCrossSheetReferences() {
+		Workbook book;
+		Sheet& first = book.CreateSheet("First");
+		// waits for the sheet to exist
+		first.SetCell("A1"_pos, "=Second!B2*2");
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "=Second!B2*2"s);
+
+		Sheet& second = book.CreateSheet("Second");
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+		second.SetCell("B2"_pos, "21");
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+
+		second.SetCell("C3"_pos, "=First!A1+1");
+		ASSERT_EQUAL(second.GetCell("C3"_pos)->GetValue(), CellInterface::Value(43.0));
+		try {
+			second.SetCell("B2"_pos, "=C3");
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+
+		// references to the other sheet follow its structural edits
+		second.InsertRows(0);
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "=Second!B3*2"s);
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+		second.SetCell("B3"_pos, "5");
+		ASSERT_EQUAL(second.GetCell("C4"_pos)->GetValue(), CellInterface::Value(11.0));
+
+		first.Publish();
+		ASSERT_EQUAL(book.RecalculateAsync().Wait().has_value(), true);
+
+		std::stringstream stored;
+		book.UnloadSheet("Second", stored);
+		ASSERT(book.FindSheet("Second") == nullptr);
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+		Sheet& reloaded = book.LoadSheet("Second", stored);
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+		ASSERT_EQUAL(reloaded.GetCell("C4"_pos)->GetValue(), CellInterface::Value(11.0));
+		ASSERT_EQUAL(reloaded.GetCell("C4"_pos)->GetText(), "=First!A1+1"s);
+		reloaded.SetCell("B3"_pos, "1");
+		ASSERT_EQUAL(reloaded.GetCell("C4"_pos)->GetValue(), CellInterface::Value(3.0));
+
+		first.DeleteRows(0);
+		ASSERT_EQUAL(reloaded.GetCell("C4"_pos)->GetText(), "=#REF!+1"s);
+	}
+
+	void TestMemoryReport() {
+		Sheet sheet;
+		ASSERT_EQUAL(sheet.GetMemoryUsage().Total(), 0);
+
+		sheet.SetCell("A1"_pos, "a text long enough to be stored on the heap");
+		sheet.SetCell("A2"_pos, "=A1+B1*2");
+		MemoryReport report = sheet.GetMemoryUsage();
+		for (MemoryCategory category : { MemoryCategory::CellStorage, MemoryCategory::Text, MemoryCategory::AstNodes
+			, MemoryCategory::FormulaCells, MemoryCategory::Dependencies, MemoryCategory::Bookkeeping }) {
+			ASSERT(report[category] > 0);
+		}
+		ASSERT_EQUAL(report[MemoryCategory::Caches], 0);
+		sheet.Publish();
+		ASSERT(sheet.GetMemoryUsage()[MemoryCategory::Caches] > 0);
+
+		// everything but the containers' own buckets is given back
+		sheet.ClearCell("A2"_pos);
+		sheet.ClearCell("A1"_pos);
+		sheet.ClearCell("B1"_pos);
+		// the undo steps and the published snapshot keep the cleared formula
+		sheet.ClearUndoHistory();
+		ASSERT(sheet.GetMemoryUsage()[MemoryCategory::AstNodes] > 0);
+		sheet.Publish();
+		report = sheet.GetMemoryUsage();
+		for (MemoryCategory category : { MemoryCategory::Text, MemoryCategory::AstNodes
+			, MemoryCategory::FormulaCells, MemoryCategory::Dependencies }) {
+			ASSERT_EQUAL(report[category], 0);
+		}
+
+		std::stringstream output;
+		output << report;
+		ASSERT(output.str().find("AST nodes: 0\n") != std::string::npos);
+	}
+
+	// frees out of the sheet's scopes give the bytes back to the sheet all the same
+	void TestMemoryReportUnscopedFrees() {
+		Sheet sheet;
+		const auto fill = [&sheet] {
+			sheet.SetCell("A1"_pos, "a text long enough to be stored on the heap");
+			sheet.SetCell("B1"_pos, "2");
+			sheet.SetCell("A2"_pos, "=A1+B1*2");
+			sheet.Publish();
+		};
+		const auto clear = [&sheet] {
+			sheet.ClearCell("A2"_pos);
+			sheet.ClearCell("A1"_pos);
+			sheet.ClearCell("B1"_pos);
+			sheet.ClearUndoHistory();
+			sheet.Publish();
+		};
+		// the containers keep their buckets once grown
+		fill();
+		clear();
+		const MemoryReport baseline = sheet.GetMemoryUsage();
+		const auto assert_baseline = [&sheet, &baseline] {
+			const MemoryReport report = sheet.GetMemoryUsage();
+			// but for the journal of published changes, which grows
+			for (size_t i = 0; i < report.bytes.size(); ++i) {
+				if (static_cast<MemoryCategory>(i) != MemoryCategory::Bookkeeping) {
+					ASSERT_EQUAL(report.bytes[i], baseline.bytes[i]);
+				}
+			}
+		};
+
+		// a reader keeps a row of a snapshot and a compiled formula past their versions,
+		// they are freed out of any scope
+		fill();
+		SheetSnapshot::RowPtr row = sheet.ReadSnapshot()->GetRows()[1];
+		std::shared_ptr<const FormulaInterface> formula = sheet.ReadSnapshot()->GetCell("A2"_pos)->formula;
+		clear();
+		ASSERT(sheet.GetMemoryUsage()[MemoryCategory::AstNodes] > baseline[MemoryCategory::AstNodes]);
+		ASSERT(sheet.GetMemoryUsage()[MemoryCategory::Caches] > baseline[MemoryCategory::Caches]);
+		row.reset();
+		formula.reset();
+		assert_baseline();
+
+		// freed in the scope of another sheet
+		fill();
+		Sheet other;
+		formula = sheet.ReadSnapshot()->GetCell("A2"_pos)->formula;
+		clear();
+		{
+			MemoryScope scope(other.GetMemoryAccount());
+			formula.reset();
+		}
+		assert_baseline();
+		ASSERT_EQUAL(other.GetMemoryUsage().Total(), 0);
+	}
+
+	void TestTextCellStorage() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "42");
+		sheet.SetCell("A2"_pos, "1.50");
+		sheet.SetCell("A3"_pos, "'7");
+		sheet.SetCell("A4"_pos, "1e5");
+		sheet.SetCell("A5"_pos, "abc");
+		sheet.SetCell("B1"_pos, "=A1+A2+A3+A4");
+		sheet.SetCell("B2"_pos, "=A5");
+		ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(100050.5));
+		ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+		// texts are kept as typed
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value("42"s));
+		ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "1.50"s);
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value("7"s));
+		ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "1e5"s);
+
+		// only texts that are not the shortest form of a number are pooled, once
+		ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 4u);
+		for (int i = 0; i < 100; ++i) {
+			sheet.SetCell(Position{ i, 2 }, "label");
+		}
+		ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 5u);
+		for (int i = 0; i < 100; ++i) {
+			ASSERT_EQUAL(sheet.GetCell(Position{ i, 2 })->GetText(), "label"s);
+			sheet.ClearCell(Position{ i, 2 });
+		}
+		ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 4u);
+
+		sheet.SetCell("A5"_pos, "12");
+		ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(12.0));
+	}
+
 	void TestSize() {
 		auto sheet = CreateSheet();
 		sheet->SetCell("A1"_pos, "");
@@ -385,11 +1411,1019 @@ namespace {
 		sheet->ClearCell("D9"_pos);
 		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 3 }));
 	}
+
+	// evaluation and invalidation must not recurse once per dependency hop
+	void TestMillionCellChain() {
+		const int length = 1000000;
+		const int width = 1000;
+		const auto at = [width](int i) {
+			return Position{ i / width, i % width };
+		};
+		Sheet sheet;
+		for (int i = 0; i + 1 < length; ++i) {
+			sheet.SetCell(at(i), "="s + at(i + 1).ToString() + "+1"s);
+		}
+		sheet.SetCell(at(length - 1), "1");
+		ASSERT_EQUAL(sheet.GetCell(at(0))->GetValue(), CellInterface::Value(static_cast<double>(length)));
+
+		sheet.SetCell(at(length - 1), "2");
+		ASSERT_EQUAL(sheet.GetCell(at(length / 2))->GetValue(), CellInterface::Value(length / 2 + 1.0));
+		ASSERT_EQUAL(sheet.GetCell(at(0))->GetValue(), CellInterface::Value(length + 1.0));
+	}
+
+	void TestRejectedFormulaLeavesNoCell() {
+		auto sheet = CreateSheet();
+		sheet->SetCell("A1"_pos, "=B2");
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 2 }));
+		try {
+			sheet->SetCell("C3"_pos, "=1+");
+		}
+		catch (const FormulaException&) {
+		}
+		try {
+			sheet->SetCell("B2"_pos, "=A1");
+		}
+		catch (const CircularDependencyException&) {
+		}
+		ASSERT(sheet->GetCell("C3"_pos) == nullptr);
+		ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 2 }));
+		ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "");
+	}
+
+	// a fresh path for the files of an edit log, removed at the end of the scope
+	class TemporaryLogPath {
+	private:
+		std::string path_;
+
+	public:
+		explicit TemporaryLogPath(const std::string& name)
+			: path_((std::filesystem::temp_directory_path() / ("spreadsheet_" + name)).string()) {
+			Remove();
+		}
+		~TemporaryLogPath() {
+			Remove();
+		}
+
+		const std::string& Get() const { return path_; }
+
+		void Remove() const {
+			for (const char* suffix : { ".log", ".snapshot", ".log.tmp", ".snapshot.tmp" }) {
+				std::filesystem::remove(path_ + suffix);
+			}
+		}
+		// the files as a crash would leave them now
+		void CopyTo(const TemporaryLogPath& other) const {
+			other.Remove();
+			for (const char* suffix : { ".log", ".snapshot" }) {
+				if (std::filesystem::exists(path_ + suffix)) {
+					std::filesystem::copy_file(path_ + suffix, other.Get() + suffix);
+				}
+			}
+		}
+	};
+
+	std::string PrintedTexts(const Sheet& sheet) {
+		std::ostringstream out;
+		sheet.PrintTexts(out);
+		return out.str();
+	}
+
+	std::string PrintedValues(const Sheet& sheet) {
+		std::ostringstream out;
+		sheet.PrintValues(out);
+		return out.str();
+	}
+
+	void TestEditLogRecovery() {
+		const TemporaryLogPath path("test_edit_log");
+		const TemporaryLogPath crashed("test_edit_log_crashed");
+		EditLog::Options options;
+		options.group_edits = 1000;
+
+		Sheet sheet;
+		std::string synced_texts;
+		{
+			EditLog log(sheet, path.Get(), options);
+			ASSERT_EQUAL(log.GetSequence(), 0u);
+			log.SetCell("A1"_pos, "1");
+			log.SetCell("A2"_pos, "=A1+1");
+			log.SetCell("B1"_pos, "'text with\nnewline\0 and zero"s);
+			log.SetCell("C3"_pos, "=SUM(A1:A2)");
+			bool caught = false;
+			try {
+				log.SetCell("A1"_pos, "=A2");
+			}
+			catch (const CircularDependencyException&) {
+				caught = true;
+			}
+			ASSERT(caught);
+			log.InsertRows(0, 2);
+			log.ClearCell("B3"_pos);
+			log.DeleteCols(1);
+			ASSERT_EQUAL(log.GetSequence(), 7u);
+			log.Sync();
+			synced_texts = PrintedTexts(sheet);
+			path.CopyTo(crashed);
+
+			// buffered only, lost by the crash
+			log.SetCell("D1"_pos, "lost");
+		}
+		ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(3.0));
+
+		{
+			Sheet recovered;
+			EditLog log(recovered, path.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 8u);
+			ASSERT_EQUAL(log.GetRecovery().torn_bytes, 0u);
+			ASSERT_EQUAL(PrintedTexts(recovered), PrintedTexts(sheet));
+			ASSERT_EQUAL(PrintedValues(recovered), PrintedValues(sheet));
+			ASSERT(recovered.ReadSnapshot()->GetCell("B5"_pos) != nullptr);
+		}
+		{
+			Sheet recovered;
+			EditLog log(recovered, crashed.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 7u);
+			ASSERT_EQUAL(PrintedTexts(recovered), synced_texts);
+		}
+
+		// a group cut by the crash is dropped, and the log goes on after the last whole edit
+		const uint64_t size = std::filesystem::file_size(crashed.Get() + ".log");
+		std::filesystem::resize_file(crashed.Get() + ".log", size - 3);
+		{
+			Sheet recovered;
+			EditLog log(recovered, crashed.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 6u);
+			ASSERT(log.GetRecovery().torn_bytes > 0);
+			ASSERT_EQUAL(log.GetSequence(), 6u);
+			ASSERT_EQUAL(recovered.GetCell("C5"_pos)->GetText(), "=SUM(A3:A4)");
+			log.SetCell("E5"_pos, "after the crash");
+		}
+		{
+			Sheet recovered;
+			EditLog log(recovered, crashed.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 7u);
+			ASSERT_EQUAL(log.GetRecovery().torn_bytes, 0u);
+			ASSERT_EQUAL(recovered.GetCell("E5"_pos)->GetText(), "after the crash");
+		}
+	}
+
+	void TestEditLogCompaction() {
+		const TemporaryLogPath path("test_edit_log_compaction");
+		const TemporaryLogPath interrupted("test_edit_log_interrupted");
+		EditLog::Options options;
+		options.group_edits = 4;
+		options.compact_after = 10;
+
+		Sheet sheet;
+		{
+			EditLog log(sheet, path.Get(), options);
+			for (int i = 0; i < 9; ++i) {
+				log.SetCell(Position{ i, 0 }, std::to_string(i));
+			}
+			log.SetCell("B10"_pos, "=A1+A2");
+			log.SetCell("C10"_pos, "=MATCH(1,A1:A3,0)+SUM(A1:A3)");
+			// the formula texts of deleted references read back
+			log.DeleteRows(0);
+			ASSERT_EQUAL(sheet.GetCell("B9"_pos)->GetText(), "=#REF!+A1");
+			ASSERT_EQUAL(sheet.GetCell("C9"_pos)->GetText(), "=MATCH(1,A1:A2,0)+SUM(A1:A2)");
+			log.DeleteRows(0, 5);
+			log.InsertCols(0);
+			ASSERT(std::filesystem::exists(path.Get() + ".snapshot"));
+			log.Sync();
+			path.CopyTo(interrupted);
+			log.Compact();
+			ASSERT_EQUAL(std::filesystem::file_size(path.Get() + ".log"), 16u);
+		}
+		ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=#REF!+#REF!");
+		ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), "=MATCH(1,#REF!,0)+SUM(#REF!)");
+		ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+		{
+			Sheet recovered;
+			EditLog log(recovered, path.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 0u);
+			ASSERT_EQUAL(log.GetSequence(), 14u);
+			ASSERT_EQUAL(PrintedTexts(recovered), PrintedTexts(sheet));
+			ASSERT_EQUAL(PrintedValues(recovered), PrintedValues(sheet));
+		}
+
+		// the new snapshot with the log from before it: the edits it has are not replayed again
+		std::filesystem::copy_file(path.Get() + ".snapshot", interrupted.Get() + ".snapshot"
+			, std::filesystem::copy_options::overwrite_existing);
+		{
+			Sheet recovered;
+			EditLog log(recovered, interrupted.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 0u);
+			ASSERT_EQUAL(PrintedTexts(recovered), PrintedTexts(sheet));
+			log.SetCell("A1"_pos, "5");
+		}
+		{
+			Sheet recovered;
+			EditLog log(recovered, interrupted.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 1u);
+			ASSERT_EQUAL(log.GetSequence(), 15u);
+			ASSERT_EQUAL(recovered.GetCell("A1"_pos)->GetText(), "5");
+		}
+	}
+
+	void TestEditLogUndoRedo() {
+		const TemporaryLogPath path("test_edit_log_undo");
+		const TemporaryLogPath crashed("test_edit_log_undo_crashed");
+		EditLog::Options options;
+		options.group_edits = 3;
+
+		Sheet sheet;
+		std::string synced_texts;
+		{
+			EditLog log(sheet, path.Get(), options);
+			ASSERT(!log.Undo());
+			log.SetCell("A1"_pos, "1");
+			log.SetCells({ { "A2"_pos, "=A1+C5" }, { "B1"_pos, "'text" }, { "B2"_pos, "2" } });
+			log.SetCell("A3"_pos, "=A2*2");
+			bool caught = false;
+			try {
+				log.SetCells({ { "B3"_pos, "3" }, { "A1"_pos, "=A3" } });
+			}
+			catch (const CircularDependencyException&) {
+				caught = true;
+			}
+			ASSERT(caught);
+			log.SetCells({ { "B2"_pos, std::nullopt }, { "B4"_pos, "=B1" } });
+			log.InsertRows(1, 2);
+			log.DeleteRows(0);
+			ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=#REF!+C6");
+
+			// the rows and the formulas turned to #REF! come back
+			ASSERT(log.Undo());
+			ASSERT(log.Undo());
+			ASSERT(log.Undo());
+			ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "2");
+			ASSERT(log.Redo());
+			ASSERT(log.Undo());
+			log.Sync();
+			synced_texts = PrintedTexts(sheet);
+			path.CopyTo(crashed);
+
+			// the cell made for C5 is removed with the formula
+			ASSERT(log.Undo());
+			ASSERT(log.Undo());
+			ASSERT(log.Undo());
+			ASSERT(sheet.GetCell("C5"_pos) == nullptr);
+			ASSERT(log.Redo());
+			ASSERT(log.Redo());
+			ASSERT(sheet.GetCell("C5"_pos) != nullptr);
+			log.DeleteCols(0);
+			ASSERT(log.Undo());
+			ASSERT(log.Redo());
+			ASSERT(!log.Redo());
+		}
+		{
+			Sheet recovered;
+			EditLog log(recovered, path.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 19u);
+			ASSERT_EQUAL(PrintedTexts(recovered), PrintedTexts(sheet));
+			ASSERT_EQUAL(PrintedValues(recovered), PrintedValues(sheet));
+			ASSERT_EQUAL(recovered.GetPrintableSize(), sheet.GetPrintableSize());
+		}
+		{
+			Sheet recovered;
+			EditLog log(recovered, crashed.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 11u);
+			ASSERT_EQUAL(PrintedTexts(recovered), synced_texts);
+		}
+	}
+
+	void TestEditLogReplayComputesOnce() {
+		const TemporaryLogPath path("test_edit_log_replay");
+		EditLog::Options options;
+		options.group_edits = 100000;
+		const int chain = 1000;
+
+		Sheet sheet;
+		{
+			EditLog log(sheet, path.Get(), options);
+			log.SetCell("A1"_pos, "0");
+			for (int row = 1; row <= chain; ++row) {
+				log.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+			}
+			// every edit stales the whole chain
+			for (int i = 1; i <= chain; ++i) {
+				log.SetCell("A1"_pos, std::to_string(i));
+			}
+		}
+
+		// as fast whatever the policy: the replay neither computes nor records undo steps
+		const auto recover = [&](RecalcPolicy policy) {
+			Sheet recovered;
+			recovered.SetRecalcPolicy(policy);
+			const auto start = std::chrono::steady_clock::now();
+			EditLog log(recovered, path.Get(), options);
+			const auto duration = std::chrono::steady_clock::now() - start;
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 2u * chain + 1);
+			ASSERT(!recovered.CanUndo());
+			ASSERT_EQUAL(recovered.ReadSnapshot()->GetCell(Position{ chain, 0 })->value, CellInterface::Value(2.0 * chain));
+			ASSERT(recovered.GetRecalcPolicy() == policy);
+			return duration;
+		};
+		const auto lazy = recover(RecalcPolicy::Lazy);
+		ASSERT(recover(RecalcPolicy::Eager) < 5 * lazy);
+		ASSERT(recover(RecalcPolicy::Background) < 5 * lazy);
+	}
+
+#ifndef _WIN32
+	// a group cut by the file size limit of the process, as by a full disk
+	void TestEditLogFailedSync() {
+		const TemporaryLogPath path("test_edit_log_failed_sync");
+		EditLog::Options options;
+		options.group_edits = 1000;
+
+		Sheet sheet;
+		{
+			EditLog log(sheet, path.Get(), options);
+			log.SetCell("A1"_pos, "1");
+			log.Sync();
+			const uint64_t synced = std::filesystem::file_size(path.Get() + ".log");
+			for (int i = 0; i < 20; ++i) {
+				log.SetCell(Position{ 0, 1 }, "=A1+" + std::to_string(i));
+				log.InsertRows(0);
+			}
+
+			rlimit limit{};
+			ASSERT_EQUAL(getrlimit(RLIMIT_FSIZE, &limit), 0);
+			const rlimit previous_limit = limit;
+			limit.rlim_cur = synced + 100;
+			const auto previous_handler = std::signal(SIGXFSZ, SIG_IGN);
+			ASSERT_EQUAL(setrlimit(RLIMIT_FSIZE, &limit), 0);
+			bool caught = false;
+			try {
+				log.Sync();
+			}
+			catch (const std::system_error&) {
+				caught = true;
+			}
+			setrlimit(RLIMIT_FSIZE, &previous_limit);
+			std::signal(SIGXFSZ, previous_handler);
+			ASSERT(caught);
+			// the part of the group written is cut off, the whole group is written again
+			ASSERT_EQUAL(std::filesystem::file_size(path.Get() + ".log"), synced);
+			log.SetCell("C1"_pos, "after the failure");
+			log.Sync();
+		}
+		{
+			Sheet recovered;
+			EditLog log(recovered, path.Get(), options);
+			ASSERT_EQUAL(log.GetRecovery().log_edits, 42u);
+			ASSERT_EQUAL(log.GetRecovery().torn_bytes, 0u);
+			ASSERT_EQUAL(PrintedTexts(recovered), PrintedTexts(sheet));
+			ASSERT_EQUAL(PrintedValues(recovered), PrintedValues(sheet));
+		}
+	}
+#endif
+
+	void TestUndoRedo() {
+		Sheet sheet;
+		ASSERT(!sheet.Undo());
+		sheet.SetCell("A1"_pos, "1");
+		sheet.SetCell("A2"_pos, "=A1+B1");
+		sheet.SetCell("A3"_pos, "=A2*10");
+		sheet.SetCell("A1"_pos, "label");
+		const std::string texts = PrintedTexts(sheet);
+		sheet.SetCell("A2"_pos, "=A1*2");
+		sheet.ClearCell("A1"_pos);
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(PrintedTexts(sheet), texts);
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+		// the formula put back is linked again, its dependents follow it
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(10.0));
+		sheet.SetCell("B1"_pos, "2");
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(30.0));
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.Undo());
+		// the empty cell made for the reference goes with the formula
+		ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+		ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+
+		ASSERT(sheet.Redo());
+		ASSERT(sheet.Redo());
+		ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), ""s);
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(10.0));
+		ASSERT(sheet.CanRedo());
+		// another edit drops the steps to redo
+		sheet.SetCell("C1"_pos, "3");
+		ASSERT(!sheet.CanRedo());
+		ASSERT(!sheet.Redo());
+
+		// a rejected edit is no step
+		try {
+			sheet.SetCell("A1"_pos, "=A3");
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+		sheet.SetUndoLimit(2);
+		for (int i = 0; i < 5; ++i) {
+			sheet.SetCell("C1"_pos, std::to_string(i));
+		}
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.Undo());
+		ASSERT(!sheet.Undo());
+		ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "2"s);
+	}
+
+	void TestUndoBatch() {
+		Sheet sheet;
+		sheet.SetCells({ { "A1"_pos, "1"s }, { "A2"_pos, "=A1+1"s }, { "A3"_pos, "=A2+1"s } });
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0));
+
+		// a rejected edit reverts the ones before it
+		try {
+			sheet.SetCells({ { "B1"_pos, "=C1"s }, { "A1"_pos, "=A3"s } });
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+		ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+		ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1"s);
+
+		sheet.SetCells({ { "A1"_pos, "5"s }, { "A2"_pos, std::nullopt }, { "A1"_pos, "7"s } });
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(1.0));
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1"s);
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0));
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+		ASSERT(sheet.Redo());
+		ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0));
+	}
+
+	void TestUndoStructure() {
+		Sheet sheet;
+		for (int i = 0; i < 5; ++i) {
+			sheet.SetCell(Position{ i, 0 }, std::to_string(i + 1));
+		}
+		sheet.SetCell("B1"_pos, "=SUM(A1:A5)");
+		sheet.SetCell("B2"_pos, "=A3*10+A5");
+		sheet.SetCell("B3"_pos, "=A5");
+		sheet.SetCell("C1"_pos, "=MATCH(4,A2:A5,0)");
+		const std::string texts = PrintedTexts(sheet);
+		const std::string values = PrintedValues(sheet);
+
+		sheet.DeleteRows(2, 2);
+		ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=#REF!*10+A3"s);
+		ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=SUM(A1:A3)"s);
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(PrintedTexts(sheet), texts);
+		ASSERT_EQUAL(PrintedValues(sheet), values);
+		ASSERT(sheet.Redo());
+		ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=#REF!*10+A3"s);
+		ASSERT(sheet.Undo());
+
+		// the last rows of a range are deleted: its text is put back
+		sheet.DeleteRows(3, 2);
+		ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=SUM(A1:A3)"s);
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(PrintedTexts(sheet), texts);
+
+		sheet.InsertCols(0, 2);
+		sheet.DeleteCols(4);
+		ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetText(), "=C5"s);
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(PrintedTexts(sheet), texts);
+		ASSERT_EQUAL(PrintedValues(sheet), values);
+		sheet.SetCell("A5"_pos, "9");
+		ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(19.0));
+		ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(9.0));
+	}
+
+	void TestUndoMemory() {
+		// the step of an edit holds what it replaced, whatever the size of the sheet
+		const auto step_bytes = [](int rows) {
+			Sheet sheet;
+			for (int i = 0; i < rows; ++i) {
+				sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+				sheet.SetCell(Position{ i, 1 }, "=A" + std::to_string(i + 1) + "*2");
+			}
+			sheet.ClearUndoHistory();
+			sheet.SetCell("A1"_pos, "=1+2");
+			const MemoryReport before = sheet.GetMemoryUsage();
+			sheet.SetCell("B1"_pos, "3");
+			const MemoryReport after = sheet.GetMemoryUsage();
+			return after[MemoryCategory::UndoHistory] - before[MemoryCategory::UndoHistory];
+		};
+		ASSERT(step_bytes(10) > 0);
+		ASSERT_EQUAL(step_bytes(10), step_bytes(10000));
+	}
+
+	void TestSheetFork() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "1");
+		sheet.SetCell("A2"_pos, "2");
+		sheet.SetCell("B1"_pos, "=A1+A2");
+		sheet.SetCell("B2"_pos, "=B1*10");
+		sheet.SetCell("C1"_pos, "=SUM(A1:A3)");
+		sheet.SetCell("D1"_pos, "=A2*3");
+		sheet.Publish();
+
+		SheetFork fork(sheet);
+		ASSERT_EQUAL(fork.GetCell("B2"_pos)->value, CellInterface::Value(30.0));
+		ASSERT_EQUAL(fork.GetDivergedCount(), 0u);
+		fork.SetCell("A1"_pos, "5");
+		// the edited cell and the formulas depending on it, D1 is still shared
+		ASSERT_EQUAL(fork.GetDivergedCount(), 4u);
+		ASSERT_EQUAL(fork.GetCell("B2"_pos)->value, CellInterface::Value(70.0));
+		ASSERT_EQUAL(fork.GetCell("C1"_pos)->value, CellInterface::Value(7.0));
+		ASSERT_EQUAL(fork.GetCell("D1"_pos)->value, CellInterface::Value(6.0));
+
+		// the sheet and the fork do not see the edits of each other
+		ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(30.0));
+		sheet.SetCell("A2"_pos, "100");
+		sheet.InsertRows(0);
+		sheet.Publish();
+		ASSERT_EQUAL(fork.GetCell("B1"_pos)->value, CellInterface::Value(7.0));
+		ASSERT_EQUAL(fork.GetCell("B1"_pos)->text, "=A1+A2"s);
+		ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=SUM(A2:A4)"s);
+
+		// formulas set in the fork are checked as in the sheet
+		fork.SetCell("E1"_pos, "=B2+Z9");
+		ASSERT(fork.GetCell("Z9"_pos) != nullptr);
+		ASSERT_EQUAL(fork.GetCell("E1"_pos)->value, CellInterface::Value(70.0));
+		fork.SetCell("A1"_pos, "6");
+		ASSERT_EQUAL(fork.GetCell("E1"_pos)->value, CellInterface::Value(80.0));
+		try {
+			fork.SetCell("A1"_pos, "=E1");
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+		try {
+			fork.SetCell("A3"_pos, "=SUM(C1:C2)");
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+		ASSERT_EQUAL(fork.GetCell("A1"_pos)->text, "6"s);
+		ASSERT_EQUAL(fork.GetPrintableSize(), (Size{ 9, 26 }));
+
+		// a referenced cell stays empty, the others go
+		fork.ClearCell("A1"_pos);
+		ASSERT(fork.GetCell("A1"_pos) != nullptr);
+		ASSERT_EQUAL(fork.GetCell("B1"_pos)->value, CellInterface::Value(2.0));
+		fork.ClearCell("E1"_pos);
+		fork.ClearCell("Z9"_pos);
+		fork.ClearCell("D1"_pos);
+		ASSERT(fork.GetCell("D1"_pos) == nullptr);
+		ASSERT_EQUAL(fork.GetPrintableSize(), (Size{ 2, 3 }));
+		std::ostringstream values;
+		fork.PrintValues(values);
+		ASSERT_EQUAL(values.str(), "0\t2\t2\n2\t20\t\n"s);
+
+		// a fork of a sheet never published is empty
+		Sheet empty;
+		SheetFork blank(empty);
+		ASSERT_EQUAL(blank.GetPrintableSize(), (Size{ 0, 0 }));
+		blank.SetCell("B2"_pos, "=A1+1");
+		ASSERT_EQUAL(blank.GetCell("B2"_pos)->value, CellInterface::Value(1.0));
+	}
+
+	void TestForkMatchesSheet() {
+		// a fork of a published state edited as a sheet with the same state
+		std::mt19937 random(46);
+		const auto random_pos = [&random]() {
+			return Position{ static_cast<int>(random() % 8), static_cast<int>(random() % 4) };
+		};
+		const auto random_text = [&random, &random_pos]() -> std::string {
+			switch (random() % 6) {
+			case 0:
+				return std::to_string(random() % 10);
+			case 1:
+				return "=" + random_pos().ToString() + "+" + random_pos().ToString();
+			case 2:
+				return "=SUM(A1:" + random_pos().ToString() + ")*2";
+			case 3:
+				return "=IF(" + random_pos().ToString() + ">4," + random_pos().ToString() + ",1)";
+			case 4:
+				return "=MATCH(" + std::to_string(random() % 10) + ",B1:B8,0)";
+			default:
+				return "text";
+			}
+		};
+		for (int round = 0; round < 20; ++round) {
+			Sheet sheet;
+			Sheet expected;
+			const auto edit = [&random, &random_pos, &random_text](auto& target, auto& other) {
+				const Position pos = random_pos();
+				if (random() % 5 == 0) {
+					target.ClearCell(pos);
+					other.ClearCell(pos);
+					return;
+				}
+				const std::string text = random_text();
+				bool rejected = false;
+				try {
+					target.SetCell(pos, text);
+				}
+				catch (const CircularDependencyException&) {
+					rejected = true;
+				}
+				try {
+					other.SetCell(pos, text);
+					ASSERT(!rejected);
+				}
+				catch (const CircularDependencyException&) {
+					ASSERT(rejected);
+				}
+			};
+			for (int i = 0; i < 30; ++i) {
+				edit(sheet, expected);
+			}
+			sheet.Publish();
+			SheetFork fork(sheet);
+			for (int i = 0; i < 30; ++i) {
+				edit(fork, expected);
+				if (i % 10 == 9) {
+					for (const std::string& at : { "A1"s, "B3"s, "C8"s, "D5"s }) {
+						const SheetFork::Entry* entry = fork.GetCell(Position::FromString(at));
+						const CellInterface* cell = expected.GetCell(Position::FromString(at));
+						ASSERT_EQUAL(entry != nullptr, cell != nullptr);
+						if (entry) {
+							ASSERT_EQUAL(entry->value, cell->GetValue());
+						}
+					}
+				}
+			}
+			std::ostringstream fork_texts, fork_values, texts, values;
+			fork.PrintTexts(fork_texts);
+			fork.PrintValues(fork_values);
+			expected.PrintTexts(texts);
+			expected.PrintValues(values);
+			ASSERT_EQUAL(fork_texts.str(), texts.str());
+			ASSERT_EQUAL(fork_values.str(), values.str());
+		}
+	}
+
+	void TestForksRunConcurrently() {
+		Sheet sheet;
+		for (int i = 0; i < 200; ++i) {
+			sheet.SetCell(Position{ i, 0 }, std::to_string(i));
+			sheet.SetCell(Position{ i, 1 }, "=A" + std::to_string(i + 1) + "*C1");
+		}
+		sheet.SetCell("C1"_pos, "2");
+		sheet.SetCell("D1"_pos, "=SUM(B1:B200)");
+		sheet.Publish();
+
+		// the writer keeps rewriting the shared formulas while the forks evaluate them
+		std::atomic<bool> done{ false };
+		std::atomic<int> wrong{ 0 };
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t) {
+			threads.emplace_back([&sheet, &wrong, t]() {
+				for (int scenario = 0; scenario < 50; ++scenario) {
+					SheetFork fork(sheet);
+					// the fork may see the version with a row inserted on top
+					const int top = fork.GetCell("C1"_pos) ? 0 : 1;
+					const int factor = t * 50 + scenario;
+					fork.SetCell(Position{ top, 2 }, std::to_string(factor));
+					const SheetFork::Entry* total = fork.GetCell(Position{ top, 3 });
+					if (!(total->value == CellInterface::Value(19900.0 * factor))) {
+						++wrong;
+					}
+				}
+			});
+		}
+		std::thread writer([&sheet, &done]() {
+			while (!done) {
+				sheet.InsertRows(0);
+				sheet.Publish();
+				sheet.DeleteRows(0);
+				sheet.Publish();
+			}
+		});
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+		done = true;
+		writer.join();
+		ASSERT_EQUAL(wrong.load(), 0);
+	}
+
+	void TestDataTable() {
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "0.5");
+		sheet.SetCell("A2"_pos, "100");
+		sheet.SetCell("B1"_pos, "=A2*(1+A1)");
+		sheet.SetCell("B2"_pos, "=SUM(A1:B1)");
+		sheet.SetCell("B3"_pos, "=1/A1");
+		sheet.Publish();
+
+		DataTable table({ "A1"_pos, "A2"_pos }, { "B1"_pos, "B2"_pos, "B3"_pos, "C9"_pos });
+		for (int rate = 0; rate < 5; ++rate) {
+			for (int amount = 0; amount < 20; ++amount) {
+				table.AddPoint({ std::to_string(rate), std::to_string(amount * 10) });
+			}
+		}
+		table.AddPoint({ "'text", "=A1" });
+		ASSERT_EQUAL(table.GetPointCount(), 101u);
+		try {
+			table.AddPoint({ "1" });
+			ASSERT(false);
+		}
+		catch (const std::invalid_argument&) {
+		}
+
+		for (size_t threads : { 1u, 3u, 0u }) {
+			table.Evaluate(sheet, threads);
+			// the same as setting each point on a copy of the sheet
+			for (size_t point = 0; point < 100; ++point) {
+				Sheet expected;
+				expected.SetCell("A1"_pos, std::to_string(point / 20));
+				expected.SetCell("A2"_pos, std::to_string(point % 20 * 10));
+				expected.SetCell("B1"_pos, "=A2*(1+A1)");
+				expected.SetCell("B2"_pos, "=SUM(A1:B1)");
+				expected.SetCell("B3"_pos, "=1/A1");
+				ASSERT_EQUAL(table.GetResult(point, 0), expected.GetCell("B1"_pos)->GetValue());
+				ASSERT_EQUAL(table.GetResult(point, 1), expected.GetCell("B2"_pos)->GetValue());
+				ASSERT_EQUAL(table.GetResult(point, 2), expected.GetCell("B3"_pos)->GetValue());
+				ASSERT_EQUAL(table.GetResult(point, 3), CellInterface::Value(std::string()));
+			}
+			ASSERT(std::holds_alternative<FormulaError>(table.GetResult(100, 0)));
+		}
+		// the sheet is left as it was
+		ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(150.5));
+
+		DataTable circular({ "A1"_pos }, { "B1"_pos });
+		circular.AddPoint({ "1" });
+		circular.AddPoint({ "=B1" });
+		try {
+			circular.Evaluate(sheet, 2);
+			ASSERT(false);
+		}
+		catch (const CircularDependencyException&) {
+		}
+	}
+
+	void TestRecalcPolicies() {
+		Sheet sheet;
+		ASSERT(sheet.GetRecalcPolicy() == RecalcPolicy::Lazy);
+		sheet.SetCell("A1"_pos, "1");
+		for (int row = 1; row < 50; ++row) {
+			sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "*2");
+		}
+		sheet.SetCell("B1"_pos, "=A50+1");
+		const auto value = [&sheet](Position pos) {
+			return sheet.GetCell(pos)->GetValue();
+		};
+
+		// every edit kind leaves the sheet computed
+		sheet.SetRecalcPolicy(RecalcPolicy::Eager);
+		ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(std::ldexp(1.0, 49) + 1));
+		sheet.SetCell("A1"_pos, "3");
+		ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(3 * std::ldexp(1.0, 49) + 1));
+		sheet.SetCells({ { "A1"_pos, "=C1"s }, { "C1"_pos, "1"s } });
+		ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(std::ldexp(1.0, 49) + 1));
+		sheet.InsertRows(0);
+		ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A51+1"s);
+		sheet.SetCell("C2"_pos, "2");
+		ASSERT_EQUAL(value("B2"_pos), CellInterface::Value(std::ldexp(1.0, 50) + 1));
+		ASSERT(sheet.Undo());
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(std::ldexp(1.0, 49) + 1));
+		ASSERT(sheet.Undo());
+		ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(3 * std::ldexp(1.0, 49) + 1));
+		ASSERT(sheet.Redo());
+		sheet.ClearCell("C1"_pos);
+		ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(1.0));
+		sheet.DeleteRows(10, 5);
+		ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+		// readers of the snapshots get the values without a Publish
+		sheet.SetRecalcPolicy(RecalcPolicy::Background);
+		sheet.SetCell("A41"_pos, "7");
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (sheet.ReadSnapshot()->HasPending() && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		{
+			auto snapshot = sheet.ReadSnapshot();
+			ASSERT(!snapshot->HasPending());
+			ASSERT_EQUAL(snapshot->GetCell("A41"_pos)->text, "7"s);
+			ASSERT_EQUAL(snapshot->GetCell("B1"_pos)->value, CellInterface::Value(std::ldexp(7.0, 4) + 1));
+		}
+
+		// in a workbook an edit computes the eager sheets reading the edited one
+		Workbook book;
+		Sheet& first = book.CreateSheet("First");
+		Sheet& second = book.CreateSheet("Second");
+		first.SetRecalcPolicy(RecalcPolicy::Eager);
+		first.SetCell("A1"_pos, "=Second!A1*2");
+		second.SetCell("A1"_pos, "21");
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+		first.SetRecalcPolicy(RecalcPolicy::Lazy);
+		second.SetCell("A1"_pos, "1");
+		ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+	}
+
+	// Reads of the live cells wait for the Background recalculation running, the writes of
+	// the worker are over when they read; run under ThreadSanitizer they race with nothing
+	void TestBackgroundReadsWait() {
+		Sheet sheet;
+		const int chain = 10000;
+		sheet.SetCell("A1"_pos, "1");
+		for (int row = 1; row < chain; ++row) {
+			sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+		}
+		const Position last{ chain - 1, 0 };
+		const CellInterface* kept = sheet.GetCell(last);
+		const uint64_t version = sheet.Publish();
+		sheet.SetRecalcPolicy(RecalcPolicy::Background);
+
+		sheet.SetCell("A1"_pos, "2");
+		ASSERT_EQUAL(kept->GetValue(), CellInterface::Value(chain + 1.0));
+		sheet.SetCell("A1"_pos, "3");
+		std::ostringstream values;
+		sheet.PrintValues(values);
+		const std::string last_line = "\n" + std::to_string(chain + 2) + "\n";
+		ASSERT_EQUAL(values.str().substr(values.str().size() - last_line.size()), last_line);
+		sheet.SetCell("A1"_pos, "4");
+		const auto changes = sheet.GetChangesSince(version);
+		ASSERT(changes.has_value());
+		ASSERT_EQUAL(changes->size(), static_cast<size_t>(chain));
+		ASSERT(changes->back().value == CellInterface::Value(chain + 3.0));
+		sheet.SetCell("A1"_pos, "5");
+		ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(chain + 4.0));
+		ASSERT(!sheet.ReadSnapshot()->HasPending());
+
+		// a workbook recalculates on one worker for every sheet
+		Workbook book;
+		Sheet& first = book.CreateSheet("First");
+		Sheet& second = book.CreateSheet("Second");
+		second.SetRecalcPolicy(RecalcPolicy::Background);
+		first.SetCell("A1"_pos, "1");
+		for (int row = 0; row < chain; ++row) {
+			second.SetCell(Position{ row, 0 }, row == 0 ? "=First!A1+1" : "=A" + std::to_string(row) + "+1");
+		}
+		first.SetCell("A1"_pos, "2");
+		ASSERT_EQUAL(second.GetCell(last)->GetValue(), CellInterface::Value(chain + 2.0));
+	}
+
+	void TestNumberFormats() {
+		const std::vector<double> numbers = { 0.0, -0.0, 1.0, -2.5, 0.1 + 0.2, 1.0 / 3, 123456789.0, 1e21, 1e-7
+			, 5e-324, std::numeric_limits<double>::max(), -1234.5678, 1e6, 999999.5 };
+		for (double number : numbers) {
+			// the default output is the stream's
+			std::ostringstream stream;
+			stream << number;
+			ASSERT_EQUAL(NumberFormat().ToString(number), stream.str());
+			ASSERT_EQUAL(NumberFormat::General().ToString(number), stream.str());
+			std::ostringstream printed;
+			NumberFormat().Print(printed, number);
+			ASSERT_EQUAL(printed.str(), stream.str());
+
+			// the shortest text reads back to the same double
+			const std::string shortest = NumberFormat::Shortest().ToString(number);
+			double parsed = 0;
+			std::from_chars(shortest.data(), shortest.data() + shortest.size(), parsed);
+			ASSERT_EQUAL(std::memcmp(&parsed, &number, sizeof(double)), 0);
+		}
+		ASSERT_EQUAL(NumberFormat::Shortest().ToString(0.1 + 0.2), "0.30000000000000004"s);
+		ASSERT_EQUAL(NumberFormat::Fixed(2).ToString(3.14159), "3.14"s);
+		ASSERT_EQUAL(NumberFormat::Fixed(0).ToString(-2.5), "-2"s);
+		ASSERT_EQUAL(NumberFormat::Scientific(3).ToString(12345.0), "1.234e+04"s);
+		ASSERT_EQUAL(NumberFormat::General(3).ToString(1234.0), "1.23e+03"s);
+		ASSERT_EQUAL(NumberFormat::Fixed(NumberFormat::MAX_PRECISION).ToString(-std::numeric_limits<double>::max()).size()
+			, NumberFormat::MAX_LENGTH);
+		for (int precision : { -1, NumberFormat::MAX_PRECISION + 1 }) {
+			try {
+				NumberFormat::Fixed(precision);
+				ASSERT(false);
+			}
+			catch (const std::invalid_argument&) {
+			}
+		}
+
+		// every printer of values takes a format, the stream's output stays the default
+		Sheet sheet;
+		sheet.SetCell("A1"_pos, "=0.1+0.2");
+		sheet.SetCell("B1"_pos, "'text");
+		sheet.SetCell("A2"_pos, "=1/0");
+		sheet.SetCell("B2"_pos, "=1234567.25");
+		sheet.Publish();
+		std::ostringstream stream;
+		stream.precision(3);
+		sheet.PrintValues(stream);
+		ASSERT_EQUAL(stream.str(), "0.3\ttext\n#DIV/0!\t1.23e+06\n"s);
+		const std::string shortest = "0.30000000000000004\ttext\n#DIV/0!\t1234567.25\n"s;
+		std::ostringstream sheet_values;
+		std::ostringstream snapshot_values;
+		std::ostringstream fork_values;
+		sheet.PrintValues(sheet_values, NumberFormat::Shortest());
+		sheet.ReadSnapshot()->PrintValues(snapshot_values, NumberFormat::Shortest());
+		SheetFork(sheet).PrintValues(fork_values, NumberFormat::Shortest());
+		ASSERT_EQUAL(sheet_values.str(), shortest);
+		ASSERT_EQUAL(snapshot_values.str(), shortest);
+		ASSERT_EQUAL(fork_values.str(), shortest);
+	}
+
+	void TestColumnKernels() {
+		// uniform columns with per-row errors, computed by runs and one by one
+		const int rows = 200;
+		std::vector<Sheet::CellEdit> edits;
+		for (int row = 0; row < rows; ++row) {
+			const std::string n = std::to_string(row + 1);
+			if (row % 7 == 3) {
+				edits.push_back({ Position{ row, 0 }, "'text"s });
+			} else if (row % 11 == 5) {
+				edits.push_back({ Position{ row, 0 }, "=1/0"s });
+			} else if (row % 13 != 0) {
+				edits.push_back({ Position{ row, 0 }, std::to_string(row % 17 - 8) });
+			}
+			edits.push_back({ Position{ row, 1 }, row % 9 == 0 ? "0"s : row % 10 == 1 ? "1e-7"s : std::to_string(row % 5 + 1) });
+			edits.push_back({ Position{ row, 2 }, row == 150 ? "1e308"s : "0.1"s });
+			edits.push_back({ Position{ row, 3 }, row == 100 ? "=A101+1"s : "=A" + n + "*B" + n + "+C" + n + "/B" + n + "-E1" });
+			edits.push_back({ Position{ row, 5 }, "=(A" + n + ">B" + n + ")-(C" + n + "=0.1)" });
+			edits.push_back({ Position{ row, 6 }, "=-(A" + n + "*0)" });
+			edits.push_back({ Position{ row, 7 }, "=C" + n + "*10+A" + n });
+			edits.push_back({ Position{ row, 8 }, row == 0 ? "=A1"s : "=I" + std::to_string(row) + "+A" + n });
+		}
+		edits.push_back({ "E1"_pos, "3"s });
+		Sheet sheet;
+		Sheet expected;
+		expected.SetColumnKernels(false);
+		sheet.SetCells(edits);
+		expected.SetCells(edits);
+
+		const auto check = [&](bool bottom_up) {
+			for (int i = 0; i < rows; ++i) {
+				const int row = bottom_up ? rows - 1 - i : i;
+				for (int col : { 3, 5, 6, 7, 8 }) {
+					const CellInterface::Value value = sheet.GetCell(Position{ row, col })->GetValue();
+					const CellInterface::Value scalar = expected.GetCell(Position{ row, col })->GetValue();
+					ASSERT_EQUAL(value, scalar);
+					if (std::holds_alternative<double>(value)) {
+						ASSERT_EQUAL(std::signbit(std::get<double>(value)), std::signbit(std::get<double>(scalar)));
+					}
+				}
+			}
+		};
+		check(false);
+		ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+		ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+		ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+		ASSERT_EQUAL(sheet.GetCell("G10"_pos)->GetValue(), CellInterface::Value(-0.0));
+		ASSERT(std::signbit(std::get<double>(sheet.GetCell("G10"_pos)->GetValue())));
+
+		// a fixed reference edited stales whole columns
+		for (Sheet* target : { &sheet, &expected }) {
+			target->SetCell("E1"_pos, "0.5");
+		}
+		check(true);
+
+		// read through an aggregate, which computes the stale formulas of its range first
+		for (Sheet* target : { &sheet, &expected }) {
+			target->SetCell("C160"_pos, "2");
+			target->SetCell("E1"_pos, "1.5");
+			target->SetCell("J1"_pos, "=SUM(H1:H200)+SUM(D1:D200)");
+		}
+		ASSERT_EQUAL(sheet.GetCell("J1"_pos)->GetValue(), expected.GetCell("J1"_pos)->GetValue());
+		check(false);
+	}
+
+	void TestDifferentialFuzz() {
+		for (uint64_t seed = 1; seed <= 4; ++seed) {
+			const FuzzReport report = RunDifferentialFuzz(seed, 2000);
+			ASSERT_EQUAL(report.operations, 2000u);
+			ASSERT_EQUAL(report.mismatches, 0u);
+		}
+	}
 }  // namespace
 
-int main() {
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        RunBenchmarks();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--fuzz") {
+        const uint64_t seed = argc > 2 ? std::stoull(argv[2]) : std::random_device{}();
+        const size_t operations = argc > 3 ? std::stoull(argv[3]) : 100000;
+        const FuzzReport report = RunDifferentialFuzz(seed, operations);
+        std::cout << "seed " << seed << ": " << report.operations << " operations in " << report.seconds
+                  << " s, " << report.mismatches << " mismatches" << std::endl;
+        std::cout << report.first_mismatch;
+        return report.mismatches == 0 ? 0 : 1;
+    }
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionRoundTripFullGrid);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
     RUN_TEST(tr, TestEmpty);
@@ -399,16 +2433,63 @@ int main() {
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestConditionalFunctions);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestLookupIndexMaintenance);
+    RUN_TEST(tr, TestLookupFormulaRows);
+    RUN_TEST(tr, TestAggregateFunctions);
+    RUN_TEST(tr, TestAggregateMaintenance);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestDivisionChain);
+    RUN_TEST(tr, TestConstantFolding);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
     RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestReferencedCellLifetime);
+    RUN_TEST(tr, TestSnapshotIsolation);
+    RUN_TEST(tr, TestChangesSinceVersion);
+    RUN_TEST(tr, TestChangesSinceForgottenVersion);
+    RUN_TEST(tr, TestSnapshotConcurrentReaders);
+    RUN_TEST(tr, TestSnapshotManyGuards);
+    RUN_TEST(tr, TestConditionalDependencies);
+    RUN_TEST(tr, TestAsyncRecalculation);
+    RUN_TEST(tr, TestRecalculationCancelsInsideChain);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestStructureEditBounds);
     RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestFormulaNestingLimit);
     RUN_TEST(tr, TestCellCircularReferences);
     RUN_TEST(tr, TestSelfReference);
+    RUN_TEST(tr, TestResetFormulaWithSameReferences);
     RUN_TEST(tr, TestSize);
+    RUN_TEST(tr, TestWorkbookCrossSheetReferences);
+    RUN_TEST(tr, TestMemoryReport);
+    RUN_TEST(tr, TestMemoryReportUnscopedFrees);
+    RUN_TEST(tr, TestTextCellStorage);
+    RUN_TEST(tr, TestMillionCellChain);
+    RUN_TEST(tr, TestRejectedFormulaLeavesNoCell);
+    RUN_TEST(tr, TestEditLogRecovery);
+    RUN_TEST(tr, TestEditLogCompaction);
+    RUN_TEST(tr, TestEditLogUndoRedo);
+    RUN_TEST(tr, TestEditLogReplayComputesOnce);
+#ifndef _WIN32
+    RUN_TEST(tr, TestEditLogFailedSync);
+#endif
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestUndoBatch);
+    RUN_TEST(tr, TestUndoStructure);
+    RUN_TEST(tr, TestUndoMemory);
+    RUN_TEST(tr, TestSheetFork);
+    RUN_TEST(tr, TestForkMatchesSheet);
+    RUN_TEST(tr, TestForksRunConcurrently);
+    RUN_TEST(tr, TestDataTable);
+    RUN_TEST(tr, TestColumnKernels);
+    RUN_TEST(tr, TestRecalcPolicies);
+    RUN_TEST(tr, TestBackgroundReadsWait);
+    RUN_TEST(tr, TestNumberFormats);
+    RUN_TEST(tr, TestDifferentialFuzz);
     return 0;
 }
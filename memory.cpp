@@ -0,0 +1,78 @@
+#include "memory.h"
+
+#include <iostream>
+
+std::string_view ToString(MemoryCategory category) {
+    switch (category) {
+    case MemoryCategory::CellStorage:
+        return "cell storage";
+    case MemoryCategory::Text:
+        return "text";
+    case MemoryCategory::AstNodes:
+        return "AST nodes";
+    case MemoryCategory::FormulaCells:
+        return "formula cell lists";
+    case MemoryCategory::Dependencies:
+        return "dependencies";
+    case MemoryCategory::Caches:
+        return "caches";
+    case MemoryCategory::Bookkeeping:
+        return "bookkeeping";
+    case MemoryCategory::LookupIndexes:
+        return "lookup indexes";
+    case MemoryCategory::UndoHistory:
+        return "undo history";
+    default:
+        return "";
+    }
+}
+
+int64_t MemoryReport::Total() const {
+    int64_t total = 0;
+    for (int64_t value : bytes) {
+        total += value;
+    }
+    return total;
+}
+
+MemoryReport& MemoryReport::operator+=(const MemoryReport& rhs) {
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        bytes[i] += rhs.bytes[i];
+    }
+    return *this;
+}
+
+std::ostream& operator<<(std::ostream& output, const MemoryReport& report) {
+    for (size_t i = 0; i < report.bytes.size(); ++i) {
+        output << ToString(static_cast<MemoryCategory>(i)) << ": " << report.bytes[i] << '\n';
+    }
+    return output << "total: " << report.Total() << '\n';
+}
+
+std::shared_ptr<MemoryAccount> MemoryAccount::Create() {
+    return std::shared_ptr<MemoryAccount>(new MemoryAccount(), [](MemoryAccount* account) {
+        account->Release();
+    });
+}
+
+void MemoryAccount::Release() {
+    if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+MemoryReport MemoryAccount::GetReport() const {
+    MemoryReport report;
+    for (size_t i = 0; i < bytes_.size(); ++i) {
+        report.bytes[i] = bytes_[i].load(std::memory_order_relaxed);
+    }
+    return report;
+}
+
+MemoryScope::MemoryScope(MemoryAccount& account) : previous_(current_) {
+    current_ = &account;
+}
+
+MemoryScope::~MemoryScope() {
+    current_ = previous_;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <memory>
+#include <new>
+#include <string_view>
+
+// Memory accounting: the structures of a sheet allocate through CountingAllocator or
+// CountedNew, which charge the MemoryAccount of the MemoryScope active on the thread.
+// The sheet opens a scope for itself in every method that allocates its structures.
+// Each allocation is tagged with the account it charged, which its free gives back to
+// wherever it happens, in a scope of any account or in none; the account holds the
+// exact live bytes requested, tags included (malloc's own overhead is not). Allocations
+// made outside any scope are not counted.
+
+enum class MemoryCategory {
+    CellStorage,        // cell objects and the maps holding them
+    Text,               // heap part of text cell strings
+    AstNodes,           // formula objects and their expression trees
+    FormulaCells,       // FormulaAST::cells_ reference lists
+    Dependencies,       // parent and child sets of the dependency graph
+    Caches,             // rows of the published snapshots
+    Bookkeeping,        // row and column counts, changed cells
+    LookupIndexes,      // per-column indexes of the lookup functions
+    UndoHistory,        // steps to undo and redo, the formulas they keep are AST nodes
+    Count
+};
+
+std::string_view ToString(MemoryCategory category);
+
+struct MemoryReport {
+    std::array<int64_t, static_cast<size_t>(MemoryCategory::Count)> bytes{};
+
+    int64_t& operator[](MemoryCategory category) { return bytes[static_cast<size_t>(category)]; }
+    int64_t operator[](MemoryCategory category) const { return bytes[static_cast<size_t>(category)]; }
+    int64_t Total() const;
+    MemoryReport& operator+=(const MemoryReport& rhs);
+};
+
+// one "category: bytes" line per category, then the total
+std::ostream& operator<<(std::ostream& output, const MemoryReport& report);
+
+class MemoryAccount {
+private:        // fields
+    // relaxed atomics: a background recalculation may publish while the writer reads the report
+    std::array<std::atomic<int64_t>, static_cast<size_t>(MemoryCategory::Count)> bytes_{};
+    // the owners' one, and one for each allocation alive that is tagged with the account
+    std::atomic<int64_t> references_{ 1 };
+
+public:         // constructors
+    // Shared by the owners; destroyed once they let it go and the last allocation it
+    // counted is freed, so that a tag never outlives its account
+    static std::shared_ptr<MemoryAccount> Create();
+
+private:        // constructors
+    MemoryAccount() = default;
+    ~MemoryAccount() = default;
+
+public:         // methods
+    // called by the allocations tagged with the account and by their frees
+    void Charge(MemoryCategory category, int64_t bytes) {
+        bytes_[static_cast<size_t>(category)].fetch_add(bytes, std::memory_order_relaxed);
+        references_.fetch_add(1, std::memory_order_relaxed);
+    }
+    void Discharge(MemoryCategory category, int64_t bytes) {
+        bytes_[static_cast<size_t>(category)].fetch_sub(bytes, std::memory_order_relaxed);
+        Release();
+    }
+    MemoryReport GetReport() const;
+
+private:        // methods
+    void Release();
+};
+
+class MemoryScope {
+private:        // fields
+    MemoryAccount* previous_;
+
+public:         // constructors
+    explicit MemoryScope(MemoryAccount& account);
+    MemoryScope(const MemoryScope&) = delete;
+    MemoryScope& operator=(const MemoryScope&) = delete;
+    ~MemoryScope();
+
+public:         // methods
+    static MemoryAccount* Current() { return current_; }
+
+private:        // fields
+    static inline thread_local MemoryAccount* current_ = nullptr;
+};
+
+// The tag precedes the block: the account charged, nullptr out of any scope. Its size
+// keeps the block aligned for anything ::operator new aligns
+inline constexpr size_t MEMORY_TAG_SIZE = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+inline void* AllocateCounted(MemoryCategory category, size_t bytes) {
+    MemoryAccount* account = MemoryScope::Current();
+    char* block = static_cast<char*>(::operator new(bytes + MEMORY_TAG_SIZE));
+    std::memcpy(block, &account, sizeof(account));
+    if (account) {
+        account->Charge(category, static_cast<int64_t>(bytes + MEMORY_TAG_SIZE));
+    }
+    return block + MEMORY_TAG_SIZE;
+}
+
+inline void FreeCounted(MemoryCategory category, void* p, size_t bytes) {
+    char* block = static_cast<char*>(p) - MEMORY_TAG_SIZE;
+    MemoryAccount* account = nullptr;
+    std::memcpy(&account, block, sizeof(account));
+    ::operator delete(block);
+    if (account) {
+        account->Discharge(category, static_cast<int64_t>(bytes + MEMORY_TAG_SIZE));
+    }
+}
+
+// allocator for the containers of a sheet
+template <typename T, MemoryCategory C>
+class CountingAllocator {
+public:         // types
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = CountingAllocator<U, C>;
+    };
+
+public:         // constructors
+    CountingAllocator() = default;
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U, C>&) noexcept { }
+
+public:         // methods
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= MEMORY_TAG_SIZE, "over-aligned types are not counted");
+        if (n > std::allocator<T>().max_size()) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(AllocateCounted(C, n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        FreeCounted(C, p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U, C>&) const { return true; }
+    template <typename U>
+    bool operator!=(const CountingAllocator<U, C>&) const { return false; }
+};
+
+// base class counting the objects of a polymorphic hierarchy allocated with new,
+// the sized delete of a virtual destructor gets the size of the most derived class
+template <MemoryCategory C>
+struct CountedNew {
+    static void* operator new(size_t size) {
+        return AllocateCounted(C, size);
+    }
+
+    static void operator delete(void* p, size_t size) {
+        FreeCounted(C, p, size);
+    }
+};
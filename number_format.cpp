@@ -0,0 +1,56 @@
+#include "number_format.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <variant>
+
+NumberFormat::NumberFormat(Notation notation, int precision)
+    : notation_(notation)
+    , precision_(precision) {
+    if (precision < 0 || precision > MAX_PRECISION) {
+        throw std::invalid_argument("number format precision out of range");
+    }
+}
+
+std::to_chars_result NumberFormat::ToChars(char* first, char* last, double value) const {
+    switch (notation_) {
+    case Notation::Shortest:
+        return std::to_chars(first, last, value);
+    case Notation::Fixed:
+        return std::to_chars(first, last, value, std::chars_format::fixed, precision_);
+    case Notation::Scientific:
+        return std::to_chars(first, last, value, std::chars_format::scientific, precision_);
+    case Notation::General:
+        return std::to_chars(first, last, value, std::chars_format::general, precision_);
+    case Notation::Stream:
+    default:
+        // std::ios_base defaults: no format flags, precision 6
+        return std::to_chars(first, last, value, std::chars_format::general, 6);
+    }
+}
+
+std::string NumberFormat::ToString(double value) const {
+    char buffer[MAX_LENGTH];
+    const auto result = ToChars(buffer, buffer + sizeof(buffer), value);
+    return std::string(buffer, result.ptr);
+}
+
+void NumberFormat::Print(std::ostream& output, double value) const {
+    if (notation_ == Notation::Stream) {
+        output << value;
+        return;
+    }
+    char buffer[MAX_LENGTH];
+    const auto result = ToChars(buffer, buffer + sizeof(buffer), value);
+    output.write(buffer, result.ptr - buffer);
+}
+
+void NumberFormat::Print(std::ostream& output, const CellInterface::Value& value) const {
+    if (const double* number = std::get_if<double>(&value)) {
+        Print(output, *number);
+    } else if (const std::string* text = std::get_if<std::string>(&value)) {
+        output << *text;
+    } else {
+        output << std::get<FormulaError>(value);
+    }
+}
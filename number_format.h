@@ -0,0 +1,53 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+#include "common.h"
+
+// How the printers write the numbers of cell values. Every notation but Stream formats
+// with std::to_chars, free of the locale and of the state of the stream; Stream is the
+// output the printers always had, operator<< of the stream, and stays their default
+class NumberFormat {
+public:         // types
+    enum class Notation : char {
+        Stream,         // as the stream is set, "%g" with 6 digits for a stream left as it is made
+        Shortest,       // the fewest digits that read back to the same double
+        General,        // "%g" with `precision` significant digits
+        Fixed,          // "%f" with `precision` digits after the point
+        Scientific,     // "%e" with `precision` digits after the point
+    };
+
+public:         // constants
+    static constexpr int MAX_PRECISION = 100;
+    // enough for any double in any notation: sign, 309 integer digits, point, precision
+    static constexpr size_t MAX_LENGTH = 1 + 309 + 1 + MAX_PRECISION;
+
+private:        // fields
+    Notation notation_ = Notation::Stream;
+    int precision_ = 6;
+
+public:         // constructors
+    NumberFormat() = default;
+    // throws std::invalid_argument unless 0 <= precision <= MAX_PRECISION
+    NumberFormat(Notation notation, int precision);
+
+    static NumberFormat Shortest() { return NumberFormat(Notation::Shortest, 0); }
+    static NumberFormat General(int precision = 6) { return NumberFormat(Notation::General, precision); }
+    static NumberFormat Fixed(int precision) { return NumberFormat(Notation::Fixed, precision); }
+    static NumberFormat Scientific(int precision) { return NumberFormat(Notation::Scientific, precision); }
+
+public:         // methods
+    Notation GetNotation() const { return notation_; }
+    int GetPrecision() const { return precision_; }
+
+    // Writes the number to [first, last) without a terminating zero, like std::to_chars;
+    // Stream as a stream left as it is made. MAX_LENGTH chars are always enough
+    std::to_chars_result ToChars(char* first, char* last, double value) const;
+    std::string ToString(double value) const;
+    void Print(std::ostream& output, double value) const;
+    // texts as they are, errors as FormulaError::ToString
+    void Print(std::ostream& output, const CellInterface::Value& value) const;
+};
@@ -0,0 +1,55 @@
+#include "recalculation.h"
+
+Recalculation::Recalculation(std::shared_ptr<State> state)
+    : state_(std::move(state))
+    , result_(state_->result.get_future().share()) { }
+
+Recalculation Recalculation::Start(std::thread& worker, std::vector<const CellInterface*> cells
+    , std::function<uint64_t()> publish) {
+    auto state = std::make_shared<State>();
+    state->total = cells.size();
+    Recalculation handle(state);
+
+    worker = std::thread([state, cells = std::move(cells), publish = std::move(publish)] {
+        cancelled_ = &state->cancelled;
+        try {
+            for (const CellInterface* cell : cells) {
+                if (state->cancelled) {
+                    state->result.set_value(std::nullopt);
+                    return;
+                }
+                cell->GetValue();
+                ++state->done;
+            }
+            state->result.set_value(state->cancelled ? Result{} : publish());
+        }
+        catch (const Cancelled&) {
+            // the cells computed so far keep their values
+            state->result.set_value(std::nullopt);
+        }
+        catch (...) {
+            state->result.set_exception(std::current_exception());
+        }
+    });
+    return handle;
+}
+
+Recalculation::Progress Recalculation::GetProgress() const {
+    return { state_->done.load(), state_->total.load() };
+}
+
+void Recalculation::Cancel() {
+    state_->cancelled = true;
+}
+
+bool Recalculation::IsCancelRequested() const {
+    return state_->cancelled;
+}
+
+const std::shared_future<Recalculation::Result>& Recalculation::GetFuture() const {
+    return result_;
+}
+
+Recalculation::Result Recalculation::Wait() const {
+    return result_.get();
+}
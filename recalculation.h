@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+// When a sheet computes the formulas an edit leaves stale, see Sheet::SetRecalcPolicy
+enum class RecalcPolicy : char {
+    Lazy,           // on the first read of each, the cost of an edit falls on the reads
+    Eager,          // at the end of every edit, a read never computes
+    Background,     // on a worker, started by every edit as by RecalculateAsync
+};
+
+// Handle to a background recalculation started by Sheet::RecalculateAsync
+// or Workbook::RecalculateAsync.
+// Cancellation is cooperative: the worker checks for it between cells, and between
+// the formulas a cell computes first, see CheckCancelled.
+class Recalculation {
+public:         // types
+    struct Progress {
+        size_t done = 0;
+        size_t total = 0;
+    };
+
+    // the published snapshot version, nullopt if cancelled or superseded by an edit
+    using Result = std::optional<uint64_t>;
+
+    struct State {
+        std::atomic<size_t> done{ 0 };
+        std::atomic<size_t> total{ 0 };
+        std::atomic<bool> cancelled{ false };
+        std::promise<Result> result;
+    };
+
+    // thrown by CheckCancelled, caught by the worker
+    struct Cancelled {};
+
+private:        // fields
+    std::shared_ptr<State> state_;
+    std::shared_future<Result> result_;
+    // of the recalculation run by this thread, nullptr off the workers
+    static inline thread_local const std::atomic<bool>* cancelled_ = nullptr;
+
+public:         // constructors
+    explicit Recalculation(std::shared_ptr<State> state);
+
+public:         // methods
+    // Starts `worker` computing the cells in turn and then calling publish unless cancelled;
+    // the caller joins the worker
+    static Recalculation Start(std::thread& worker, std::vector<const CellInterface*> cells
+        , std::function<uint64_t()> publish);
+
+    Progress GetProgress() const;
+    void Cancel();
+    bool IsCancelRequested() const;
+    const std::shared_future<Result>& GetFuture() const;
+    Result Wait() const;
+
+    // true on the worker of a recalculation
+    static bool IsWorkerThread() {
+        return cancelled_ != nullptr;
+    }
+
+    // Called between the formulas of a computation: on a worker whose recalculation is
+    // cancelled it throws Cancelled, so that a superseded run inside one long chain stops
+    // without computing it to the end. A no-op on any other thread
+    static void CheckCancelled() {
+        if (cancelled_ && cancelled_->load(std::memory_order_relaxed)) {
+            throw Cancelled{};
+        }
+    }
+};
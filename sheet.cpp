@@ -1,42 +1,252 @@
 #include "sheet.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <optional>
 
-std::ostream& operator<< (std::ostream& out, const CellInterface::Value value ) {
-    struct ValuePrinter {
-        std::ostream& out;
-        void operator() (std::monostate) const {}
-        void operator() (const std::string& val) const {
-            out << val;
-        }
-        void operator() (double val) const {
-            out << val;
-        }
-        void operator() (const FormulaError& val) const {
-            out << val;
+Sheet::Sheet(Workbook& workbook, std::string name)
+    : workbook_(&workbook)
+    , name_(std::move(name)) { }
+
+Sheet::~Sheet() {
+    CancelRecalculation();
+    ClearFormulas();
+    MemoryScope scope(*memory_);
+    undo_.Clear();
+    data_.clear();
+    lookup_.Clear();
+    rows_.clear();
+    cols_.clear();
+    changed_.clear();
+    stale_ = Positions();
+}
+
+void Sheet::ClearFormulas() {
+    MemoryScope scope(*memory_);
+    // no cell may reach a destroyed neighbour through its parents or children
+    for (auto& [row, cols] : data_) {
+        for (auto& [col, cell] : cols) {
+            cell->Clear();
         }
-    };
-    std::visit(ValuePrinter{out}, value);
-    return out;
+    }
 }
 
-Sheet::~Sheet() { }
+Sheet* Sheet::FindSheet(const std::string& name) const {
+    return workbook_ ? workbook_->FindSheet(name) : nullptr;
+}
 
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("");
         return;
     }
-    if (!data_.count(pos.row) || !data_.at(pos.row).count(pos.col)) {
-        data_[pos.row][pos.col] = std::make_unique<Cell>(*this);
+    CancelRecalculation();
+    MemoryScope scope(*memory_);
+    UndoHistory::Step step;
+    step.cells.push_back({ pos, std::move(text) });
+    ApplyStep(step, false);
+    Record(std::move(step));
+    FinishEdit();
+}
+
+void Sheet::SetCells(std::vector<CellEdit> edits) {
+    for (const CellEdit& edit : edits) {
+        if (!edit.pos.IsValid()) {
+            throw InvalidPositionException("");
+        }
+    }
+    CancelRecalculation();
+    MemoryScope scope(*memory_);
+    UndoHistory::Step step;
+    step.cells.reserve(edits.size());
+    for (CellEdit& edit : edits) {
+        step.cells.push_back({ edit.pos, edit.text ? CellContent(std::move(*edit.text)) : CellContent() });
     }
-    data_[pos.row][pos.col]->Set(text);
+    ApplyStep(step, false);
+    Record(std::move(step));
+    FinishEdit();
+}
+
+Cell* Sheet::MakeReferencedCell(Position pos) {
+    if (Cell* cell = FindCell(pos)) {
+        return cell;
+    }
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("");
+    }
+    MemoryScope scope(*memory_);
+    CellContent content = std::string();
+    ExchangeContent(pos, content);
+    if (created_) {
+        created_->push_back({ pos, std::move(content) });
+    }
+    return FindCell(pos);
+}
+
+void Sheet::ExchangeContent(Position pos, CellContent& content) {
+    Cell* cell = FindCell(pos);
+    if (std::holds_alternative<std::monostate>(content)) {
+        if (!cell) {
+            return;
+        }
+        MarkChanged(pos);
+        CellContent previous = EmptyCellContent{};
+        cell->Exchange(previous);
+        if (cell->IsReferenced()) {
+            // formulas hold a handle to this cell, so it stays as an empty cell
+            lookup_.Update(pos, cell);
+        } else {
+            RemoveCell(pos);
+            lookup_.Update(pos, nullptr);
+        }
+        content = std::move(previous);
+        return;
+    }
+
+    const bool created = !cell;
+    if (created) {
+        auto& slot = data_[pos.row][pos.col];
+        slot = std::make_unique<Cell>(*this, pos);
+        cell = slot.get();
+        ++rows_[pos.row];
+        ++cols_[pos.col];
+    }
+    try {
+        cell->Exchange(content);
+    }
+    catch (...) {
+        // a rejected formula leaves no trace, the new cell is nobody's child yet
+        if (created) {
+            RemoveCell(pos);
+        }
+        throw;
+    }
+    if (created) {
+        content = std::monostate{};
+    }
+    lookup_.Update(pos, cell);
+    MarkChanged(pos);
     size_.rows = std::max(pos.row + 1, size_.rows);
     size_.cols = std::max(pos.col + 1, size_.cols);
-    rows_.insert(pos.row);
-    cols_.insert(pos.col);
+}
+
+void Sheet::ApplyStep(UndoHistory::Step& step, bool backwards) {
+    const size_t size = step.cells.size();
+    const auto record = [&step, size, backwards](size_t i) -> UndoHistory::CellRecord& {
+        return step.cells[backwards ? size - 1 - i : i];
+    };
+    created_ = backwards ? nullptr : &step.created;
+    size_t done = 0;
+    try {
+        for (; done < size; ++done) {
+            ExchangeContent(record(done).pos, record(done).content);
+        }
+    }
+    catch (...) {
+        // exchanging again puts both contents back
+        while (done > 0) {
+            --done;
+            ExchangeContent(record(done).pos, record(done).content);
+        }
+        created_ = nullptr;
+        if (!backwards) {
+            RemoveCreated(step);
+        }
+        throw;
+    }
+    created_ = nullptr;
+    if (backwards) {
+        RemoveCreated(step);
+    }
+}
+
+void Sheet::RemoveCreated(UndoHistory::Step& step) {
+    for (auto it = step.created.rbegin(); it != step.created.rend(); ++it) {
+        CellContent none;
+        ExchangeContent(it->pos, none);
+    }
+    step.created.clear();
+}
+
+void Sheet::Record(UndoHistory::Step step) {
+    MemoryScope scope(*memory_);
+    undo_.Record(std::move(step));
+}
+
+bool Sheet::Undo() {
+    if (!undo_.CanUndo()) {
+        return false;
+    }
+    CancelRecalculation();
+    MemoryScope scope(*memory_);
+    UndoHistory::Step step = undo_.TakeUndo();
+    try {
+        if (step.structure == UndoHistory::Structure::None) {
+            ApplyStep(step, true);
+        } else {
+            UndoStructure(step);
+        }
+    }
+    catch (...) {
+        undo_.PushUndo(std::move(step));
+        throw;
+    }
+    if (step.structure == UndoHistory::Structure::None) {
+        undo_.PushRedo(std::move(step));
+    } else {
+        // redone as it was first applied
+        undo_.PushRedo({ step.structure, step.first, step.count, {}, {} });
+    }
+    FinishEdit();
+    return true;
+}
+
+bool Sheet::Redo() {
+    if (!undo_.CanRedo()) {
+        return false;
+    }
+    CancelRecalculation();
+    MemoryScope scope(*memory_);
+    UndoHistory::Step step = undo_.TakeRedo();
+    try {
+        if (step.structure == UndoHistory::Structure::None) {
+            ApplyStep(step, false);
+            undo_.PushUndo(std::move(step));
+        } else {
+            undo_.PushUndo(ApplyStructure(step.structure, step.first, step.count, true));
+        }
+    }
+    catch (...) {
+        undo_.PushRedo(std::move(step));
+        throw;
+    }
+    FinishEdit();
+    return true;
+}
+
+void Sheet::UndoStructure(UndoHistory::Step& step) {
+    // the inverse edit moves every reference back, but those that turned to #REF!
+    ApplyStructure(UndoHistory::Inverse(step.structure), step.first, step.count, false);
+    try {
+        ApplyStep(step, true);
+    }
+    catch (...) {
+        ApplyStructure(step.structure, step.first, step.count, false);
+        throw;
+    }
+}
+
+void Sheet::SetUndoLimit(size_t steps) {
+    MemoryScope scope(*memory_);
+    undo_.SetLimit(steps);
+}
+
+void Sheet::ClearUndoHistory() {
+    MemoryScope scope(*memory_);
+    undo_.Clear();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -44,6 +254,7 @@ const CellInterface* Sheet::GetCell(Position pos) const {
         throw InvalidPositionException("");
         return nullptr;
     }
+    JoinRecalculation();
     if (!data_.count(pos.row) || !data_.at(pos.row).count(pos.col)) {
         return nullptr;
     }
@@ -55,6 +266,7 @@ CellInterface* Sheet::GetCell(Position pos) {
         throw InvalidPositionException("");
         return nullptr;
     }
+    JoinRecalculation();
     if (!data_.count(pos.row) || !data_.at(pos.row).count(pos.col)) {
         return nullptr;
     }
@@ -66,25 +278,297 @@ void Sheet::ClearCell(Position pos) {
         throw InvalidPositionException("");
         return;
     }
-    if (!data_.count(pos.row) || !data_.at(pos.row).count(pos.col)) {
+    CancelRecalculation();
+    MemoryScope scope(*memory_);
+    if (!FindCell(pos)) {
         return;
     }
+    UndoHistory::Step step;
+    step.cells.push_back({ pos, std::monostate{} });
+    ApplyStep(step, false);
+    Record(std::move(step));
+    FinishEdit();
+}
+
+void Sheet::RemoveCell(Position pos) {
     if (data_[pos.row].size() > 1) {
         data_[pos.row].erase(data_[pos.row].find(pos.col));
     } else {
         data_.erase(pos.row);
     }
-    rows_.erase(pos.row);
-    cols_.erase(pos.col);
-    size_.rows = rows_.empty() ? 0 : (*rows_.rbegin())+1;
-    size_.cols = cols_.empty() ? 0 : (*cols_.rbegin())+1;
+    if (--rows_[pos.row] == 0) {
+        rows_.erase(pos.row);
+    }
+    if (--cols_[pos.col] == 0) {
+        cols_.erase(pos.col);
+    }
+    size_.rows = rows_.empty() ? 0 : rows_.rbegin()->first + 1;
+    size_.cols = cols_.empty() ? 0 : cols_.rbegin()->first + 1;
+}
+
+std::optional<int> Sheet::FindInColumn(const CellRange& range, double key, MatchSearch search) const {
+    MemoryScope scope(*memory_);
+    return lookup_.Find(*this, range, key, search);
+}
+
+void Sheet::ForEachFormulaInRange(const CellRange& range, const std::function<void(const Cell*)>& action) const {
+    MemoryScope scope(*memory_);
+    lookup_.ForEachFormula(*this, range, action);
+}
+
+void Sheet::ForEachStaleFormulaInRange(const CellRange& range, const std::function<void(const Cell*)>& action) const {
+    MemoryScope scope(*memory_);
+    lookup_.ForEachStaleFormula(*this, range, action);
+}
+
+RangeSummary Sheet::AggregateRange(const CellRange& range) const {
+    MemoryScope scope(*memory_);
+    return lookup_.Aggregate(*this, range);
 }
 
 Size Sheet::GetPrintableSize() const {
     return size_;
 }
 
+void Sheet::InsertRows(int before, int count) {
+    Record(ApplyStructure(UndoHistory::Structure::InsertRows, before, count, undo_.IsRecording()));
+    FinishEdit();
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    Record(ApplyStructure(UndoHistory::Structure::DeleteRows, first, count, undo_.IsRecording()));
+    FinishEdit();
+}
+
+void Sheet::InsertCols(int before, int count) {
+    Record(ApplyStructure(UndoHistory::Structure::InsertCols, before, count, undo_.IsRecording()));
+    FinishEdit();
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    Record(ApplyStructure(UndoHistory::Structure::DeleteCols, first, count, undo_.IsRecording()));
+    FinishEdit();
+}
+
+UndoHistory::Step Sheet::ApplyStructure(UndoHistory::Structure structure, int first, int count, bool record) {
+    UndoHistory::Step step{ structure, first, count, {}, {} };
+    // an insertion is undone by the deletion of the inserted cells alone
+    UndoHistory::Records* replaced = record ? &step.cells : nullptr;
+    const bool by_rows = structure == UndoHistory::Structure::InsertRows || structure == UndoHistory::Structure::DeleteRows;
+    const int limit = by_rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (first < 0 || first >= limit || count <= 0) {
+        throw InvalidPositionException("");
+    }
+    // computed wide: first + count may not fit an int. A coordinate shifted past the
+    // sheet is `limit`, an invalid position
+    const int64_t end = int64_t{ first } + count;
+    const auto inserted = [first, count, limit](int coordinate) {
+        return coordinate < first ? coordinate : static_cast<int>(std::min<int64_t>(int64_t{ coordinate } + count, limit));
+    };
+    const auto deleted = [first, count, end](int coordinate) -> std::optional<int> {
+        if (coordinate >= end) {
+            return coordinate - count;
+        }
+        return coordinate >= first ? std::nullopt : std::optional(coordinate);
+    };
+    const Counts& stored = by_rows ? rows_ : cols_;
+    switch (structure) {
+    case UndoHistory::Structure::InsertRows:
+    case UndoHistory::Structure::InsertCols:
+        if (!stored.empty() && stored.rbegin()->first >= first && inserted(stored.rbegin()->first) >= limit) {
+            throw InvalidPositionException(by_rows ? "rows would be shifted out of the sheet" : "columns would be shifted out of the sheet");
+        }
+        Restructure(by_rows, first, [by_rows, &inserted](Position pos) {
+            (by_rows ? pos.row : pos.col) = inserted(by_rows ? pos.row : pos.col);
+            return pos;
+        });
+        break;
+    case UndoHistory::Structure::DeleteRows:
+    case UndoHistory::Structure::DeleteCols:
+        Restructure(by_rows, first, [by_rows, &deleted](Position pos) {
+            const std::optional<int> coordinate = deleted(by_rows ? pos.row : pos.col);
+            if (!coordinate) {
+                return Position::NONE;
+            }
+            (by_rows ? pos.row : pos.col) = *coordinate;
+            return pos;
+        }, replaced);
+        break;
+    default:
+        break;
+    }
+    return step;
+}
+
+void Sheet::Restructure(bool by_rows, int first, const std::function<Position(Position)>& remap
+    , UndoHistory::Records* replaced) {
+    CancelRecalculation();
+    MemoryScope scope(*memory_);
+
+    PositionSet changed;
+    for (const Position& pos : changed_) {
+        if (Position moved = remap(pos); moved.IsValid()) {
+            changed.insert(moved);
+        }
+    }
+    changed_ = std::move(changed);
+    for (Position& pos : stale_) {
+        pos = remap(pos);
+    }
+
+    // detach the affected part of the storage: whole rows, or the cells of every row past `first`
+    std::vector<std::pair<int, RowCells>> shifted_rows;
+    std::vector<std::unique_ptr<Cell>> shifted_cells;
+    if (by_rows) {
+        for (auto it = rows_.lower_bound(first); it != rows_.end(); ++it) {
+            auto node = data_.extract(it->first);
+            shifted_rows.emplace_back(it->first, std::move(node.mapped()));
+        }
+    } else {
+        for (auto& [row, cells] : data_) {
+            for (auto it = cells.begin(); it != cells.end();) {
+                if (it->first >= first) {
+                    shifted_cells.push_back(std::move(it->second));
+                    it = cells.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (auto it = data_.begin(); it != data_.end();) {
+            it = it->second.empty() ? data_.erase(it) : std::next(it);
+        }
+    }
+
+    std::vector<Cell*> moved;
+    std::unordered_set<Cell*> deleted;
+    auto classify = [&](Cell* cell) {
+        const Position old_pos = cell->GetPosition();
+        MarkChanged(old_pos);
+        if (--rows_[old_pos.row] == 0) {
+            rows_.erase(old_pos.row);
+        }
+        if (--cols_[old_pos.col] == 0) {
+            cols_.erase(old_pos.col);
+        }
+        if (remap(old_pos).IsValid()) {
+            moved.push_back(cell);
+        } else {
+            deleted.insert(cell);
+        }
+    };
+    for (auto& [row, cells] : shifted_rows) {
+        for (auto& [col, cell] : cells) {
+            classify(cell.get());
+        }
+    }
+    for (auto& cell : shifted_cells) {
+        classify(cell.get());
+    }
+
+    // the parents of shifted cells are exactly the formulas to rewrite, with the lookups
+    // whose range reaches the shifted part, empty cells included
+    std::unordered_set<Cell*> to_rewrite;
+    for (const auto& cells : { std::vector<Cell*>(deleted.begin(), deleted.end()), moved }) {
+        for (Cell* cell : cells) {
+            for (Cell* parent : cell->GetParents()) {
+                if (!deleted.count(parent)) {
+                    to_rewrite.insert(parent);
+                }
+            }
+        }
+    }
+    for (Cell* watcher : lookup_.FindWatchers(by_rows, first)) {
+        if (!deleted.count(watcher)) {
+            to_rewrite.insert(watcher);
+        }
+    }
+
+    if (replaced) {
+        const auto is_deleted = [&remap](Position pos) {
+            return !remap(pos).IsValid();
+        };
+        for (Cell* cell : to_rewrite) {
+            const std::vector<Position> cells = cell->GetReferencedCells();
+            const std::vector<CellRange> ranges = cell->GetReferencedRanges();
+            if (&cell->GetSheet() == this && (std::any_of(cells.begin(), cells.end(), is_deleted)
+                || std::any_of(ranges.begin(), ranges.end(), [&is_deleted](const CellRange& range) {
+                    return is_deleted(range.first) || is_deleted(range.last);
+                }))) {
+                replaced->push_back({ cell->GetPosition(), cell->GetText() });
+            }
+        }
+    }
+
+    // unlink deleted cells while every cell is still alive
+    for (Cell* cell : deleted) {
+        for (Cell* parent : cell->GetParents()) {
+            parent->EraseChild(cell);
+        }
+    }
+    for (Cell* cell : deleted) {
+        if (replaced) {
+            CellContent content = EmptyCellContent{};
+            cell->Exchange(content);
+            replaced->push_back({ cell->GetPosition(), std::move(content) });
+        } else {
+            cell->Clear();
+        }
+    }
+    for (Cell* cell : deleted) {
+        cell->ForgetParents();
+    }
+
+    auto place = [&](std::unique_ptr<Cell>& cell) {
+        const Position new_pos = remap(cell->GetPosition());
+        if (!new_pos.IsValid()) {
+            cell.reset();
+            return;
+        }
+        cell->SetPosition(new_pos);
+        MarkChanged(new_pos);
+        ++rows_[new_pos.row];
+        ++cols_[new_pos.col];
+        data_[new_pos.row][new_pos.col] = std::move(cell);
+    };
+    for (auto& [row, cells] : shifted_rows) {
+        const Position new_row = remap({ row, 0 });
+        if (new_row.IsValid()) {
+            for (auto& [col, cell] : cells) {
+                cell->SetPosition({ new_row.row, col });
+                MarkChanged({ new_row.row, col });
+                ++rows_[new_row.row];
+                ++cols_[col];
+            }
+            // the row is moved as one block
+            data_.emplace(new_row.row, std::move(cells));
+        } else {
+            for (auto& [col, cell] : cells) {
+                place(cell);
+            }
+        }
+    }
+    for (auto& cell : shifted_cells) {
+        place(cell);
+    }
+
+    // indexed rows are stale, the next lookups index the columns again
+    lookup_.Clear();
+    for (Cell* cell : to_rewrite) {
+        // may be a formula of another sheet
+        cell->RewriteReferences(*this, remap);
+    }
+
+    size_.rows = rows_.empty() ? 0 : rows_.rbegin()->first + 1;
+    size_.cols = cols_.empty() ? 0 : cols_.rbegin()->first + 1;
+}
+
 void Sheet::PrintValues(std::ostream& output) const {
+    PrintValues(output, NumberFormat());
+}
+
+void Sheet::PrintValues(std::ostream& output, const NumberFormat& format) const {
+    JoinRecalculation();
     if (size_.rows == 0 || size_.cols == 0) {
         return;
     }
@@ -100,7 +584,7 @@ void Sheet::PrintValues(std::ostream& output) const {
                 if (!data_.at(i).count(j)) {
                     continue;
                 }
-                output << data_.at(i).at(j)->GetValue();
+                format.Print(output, data_.at(i).at(j)->GetValue());
             }
         }
         else {
@@ -136,6 +620,204 @@ void Sheet::PrintTexts(std::ostream& output) const {
     }
 }
 
+void Sheet::MarkChanged(Position pos) {
+    MemoryScope scope(*memory_);
+    changed_.insert(pos);
+    lookup_.MarkStale(pos);
+    if (recalc_policy_ == RecalcPolicy::Eager) {
+        stale_.push_back(pos);
+    }
+}
+
+MemoryReport Sheet::GetMemoryUsage() const {
+    return memory_->GetReport();
+}
+
+uint64_t Sheet::Publish() {
+    CancelRecalculation();
+    return PublishChanges();
+}
+
+uint64_t Sheet::PublishChanges() {
+    MemoryScope scope(*memory_);
+    const SheetSnapshot* latest = snapshots_.GetLatest();
+    std::vector<SheetSnapshot::RowPtr> rows;
+    if (latest) {
+        rows = latest->GetRows();
+    }
+    rows.resize(size_.rows);
+
+    std::optional<int> last_row;
+    for (const Position& pos : changed_) {
+        if (pos.row >= size_.rows || pos.row == last_row) {
+            continue;
+        }
+        last_row = pos.row;
+        auto cells = data_.find(pos.row);
+        if (cells == data_.end()) {
+            rows[pos.row] = nullptr;
+            continue;
+        }
+        auto entries = std::make_shared<SheetSnapshot::Row>();
+        entries->reserve(cells->second.size());
+        for (const auto& [col, cell] : cells->second) {
+            entries->push_back({ col, cell->GetText(), cell->GetValue(), cell->GetFormula() });
+        }
+        std::sort(entries->begin(), entries->end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.col < rhs.col;
+        });
+        rows[pos.row] = std::move(entries);
+    }
+    auto snapshot = std::make_unique<const SheetSnapshot>(++version_, size_, std::move(rows));
+
+    // only the changed cells are compared, a recomputed formula may keep its value
+    for (const Position& pos : changed_) {
+        const SheetSnapshot::Entry* before = latest ? latest->GetCell(pos) : nullptr;
+        const SheetSnapshot::Entry* after = snapshot->GetCell(pos);
+        if (!before != !after || (before && !(before->value == after->value))) {
+            journal_.push_back({ version_, pos });
+        }
+    }
+    changed_.clear();
+    if (journal_.size() > MAX_JOURNAL_LENGTH) {
+        // whole versions are dropped, so the rest is complete after journal_start_
+        const uint64_t last_dropped = journal_[journal_.size() / 2].version;
+        while (!journal_.empty() && journal_.front().version <= last_dropped) {
+            journal_.pop_front();
+        }
+        journal_start_ = last_dropped;
+    }
+
+    snapshots_.Publish(std::move(snapshot));
+    return version_;
+}
+
+std::optional<std::vector<CellChange>> Sheet::GetChangesSince(uint64_t version) const {
+    // the worker publishes, and journals, as it finishes
+    JoinRecalculation();
+    if (version < journal_start_) {
+        return std::nullopt;
+    }
+    const auto first = std::partition_point(journal_.begin(), journal_.end(), [version](const JournalEntry& entry) {
+        return entry.version <= version;
+    });
+    std::vector<Position> positions;
+    positions.reserve(journal_.end() - first);
+    for (auto it = first; it != journal_.end(); ++it) {
+        positions.push_back(it->pos);
+    }
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+
+    const SheetSnapshot* latest = snapshots_.GetLatest();
+    std::vector<CellChange> changes;
+    changes.reserve(positions.size());
+    for (const Position& pos : positions) {
+        const SheetSnapshot::Entry* entry = latest->GetCell(pos);
+        changes.push_back({ pos, entry ? std::optional(entry->value) : std::nullopt });
+    }
+    return changes;
+}
+
+Recalculation Sheet::RecalculateAsync() {
+    if (workbook_) {
+        return workbook_->RecalculateAsync();
+    }
+    CancelRecalculation();
+    std::vector<const CellInterface*> to_compute = PublishPending();
+    recalc_ = Recalculation::Start(recalc_worker_, std::move(to_compute), [this] {
+        return PublishChanges();
+    });
+    return *recalc_;
+}
+
+std::vector<const CellInterface*> Sheet::PublishPending() {
+    MemoryScope scope(*memory_);
+    std::vector<const CellInterface*> to_compute;
+    for (const Position& pos : changed_) {
+        if (const Cell* cell = FindCell(pos)) {
+            to_compute.push_back(cell);
+        }
+    }
+
+    // readers keep the old values, now flagged as pending
+    const SheetSnapshot* latest = snapshots_.GetLatest();
+    snapshots_.Publish(std::make_unique<const SheetSnapshot>(
+        ++version_
+        , latest ? latest->GetPrintableSize() : Size{}
+        , latest ? latest->GetRows() : std::vector<SheetSnapshot::RowPtr>{}
+        , std::vector<Position>(changed_.begin(), changed_.end())));
+    return to_compute;
+}
+
+void Sheet::CancelRecalculation() {
+    if (workbook_) {
+        // formulas of any sheet may read and invalidate the cells of this one
+        workbook_->CancelRecalculation();
+        return;
+    }
+    CancelOwnRecalculation();
+}
+
+void Sheet::JoinRecalculation() const {
+    // the worker reads the cells it computes
+    if (Recalculation::IsWorkerThread()) {
+        return;
+    }
+    if (workbook_) {
+        workbook_->JoinRecalculation();
+    } else if (recalc_worker_.joinable()) {
+        recalc_worker_.join();
+    }
+}
+
+void Sheet::CancelOwnRecalculation() {
+    if (recalc_worker_.joinable()) {
+        recalc_->Cancel();
+        recalc_worker_.join();
+    }
+}
+
+void Sheet::SetRecalcPolicy(RecalcPolicy policy) {
+    CancelRecalculation();
+    MemoryScope scope(*memory_);
+    recalc_policy_ = policy;
+    stale_.clear();
+    if (policy == RecalcPolicy::Eager) {
+        // every cell gone stale since the last publish
+        stale_.assign(changed_.begin(), changed_.end());
+        ComputeStale();
+    } else if (policy == RecalcPolicy::Background) {
+        RecalculateAsync();
+    }
+}
+
+void Sheet::FinishEdit() {
+    if (workbook_) {
+        // the edit may have staled formulas of any sheet
+        workbook_->FinishEdit();
+    } else if (recalc_policy_ == RecalcPolicy::Eager) {
+        ComputeStale();
+    } else if (recalc_policy_ == RecalcPolicy::Background) {
+        RecalculateAsync();
+    }
+}
+
+void Sheet::ComputeStale() {
+    MemoryScope scope(*memory_);
+    // a formula computes the stale ones it reads, found cached when their turn comes
+    for (const Position& pos : stale_) {
+        if (const Cell* cell = pos.IsValid() ? FindCell(pos) : nullptr; cell && cell->IsFormula()) {
+            cell->GetValue();
+        }
+    }
+    stale_.clear();
+}
+
+SnapshotPublisher::ReadGuard Sheet::ReadSnapshot() const {
+    return snapshots_.Read();
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
\ No newline at end of file
@@ -1,22 +1,96 @@
 #pragma once
 
+#include <deque> 
+#include <functional> 
+#include <map> 
+#include <memory> 
+#include <optional> 
 #include <set> 
+#include <string> 
+#include <thread> 
 #include <unordered_map> 
+#include <utility> 
+#include <vector> 
 
 #include "cell.h" 
 #include "common.h" 
+#include "lookup_index.h" 
+#include "memory.h" 
+#include "number_format.h" 
+#include "recalculation.h" 
+#include "snapshot.h" 
+#include "string_pool.h" 
+#include "undo_history.h" 
 
 class Cell;
+class Workbook;
+
+class Sheet final : public SheetInterface {
+    friend class Workbook;
+    friend class LookupIndex;
+    friend class EditLog;
+    friend class SheetFork;
+
+public:         // types
+    // an edit of SetCells: the text to set, nullopt to clear the cell
+    struct CellEdit {
+        Position pos;
+        std::optional<std::string> text;
+    };
+
+    using RowCells = std::unordered_map<int, std::unique_ptr<Cell>, std::hash<int>, std::equal_to<int>
+        , CountingAllocator<std::pair<const int, std::unique_ptr<Cell>>, MemoryCategory::CellStorage>>;
+
+private:        // types
+    using Counts = std::map<int, int, std::less<int>
+        , CountingAllocator<std::pair<const int, int>, MemoryCategory::Bookkeeping>>;
+    using PositionSet = std::set<Position, std::less<Position>
+        , CountingAllocator<Position, MemoryCategory::Bookkeeping>>;
+    struct JournalEntry {
+        uint64_t version;
+        Position pos;
+    };
+    using Journal = std::deque<JournalEntry, CountingAllocator<JournalEntry, MemoryCategory::Bookkeeping>>;
+    using Positions = std::vector<Position, CountingAllocator<Position, MemoryCategory::Bookkeeping>>;
+
+private:        // constants
+    // published value changes kept for GetChangesSince, older ones are dropped by halves
+    static constexpr size_t MAX_JOURNAL_LENGTH = 1 << 16;
 
-class Sheet : public SheetInterface {
 private:        // fields 
+    // first, so that it outlives every counted member; forks keep it for the rows and
+    // formulas they free last
+    std::shared_ptr<MemoryAccount> memory_ = MemoryAccount::Create();
+
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+    StringPool strings_;            // texts of the text cells, outlives them
+    mutable LookupIndex lookup_;    // made by lookups while reading, outlives the cells
+    UndoHistory undo_;
+    // the step of the edit being applied, it records the cells made for references
+    UndoHistory::Records* created_ = nullptr;
+    bool column_kernels_ = true;
+    RecalcPolicy recalc_policy_ = RecalcPolicy::Lazy;
+    Positions stale_;       // Eager: the cells made stale by the edit being applied
+
     Size size_;
-    std::unordered_map<int, std::unordered_map<int, std::unique_ptr<Cell>>> data_;
-    std::set<int> rows_;
-    std::set<int> cols_;
+    std::unordered_map<int, RowCells, std::hash<int>, std::equal_to<int>
+        , CountingAllocator<std::pair<const int, RowCells>, MemoryCategory::CellStorage>> data_;
+    Counts rows_;       // row -> number of stored cells in it
+    Counts cols_;
+
+    SnapshotPublisher snapshots_;
+    uint64_t version_ = 0;
+    PositionSet changed_;    // cells to recompute and rows to rebuild on the next Publish
+    Journal journal_;               // cells whose published value changed, by version
+    uint64_t journal_start_ = 0;    // the journal has every change after this version
+
+    mutable std::thread recalc_worker_;     // joined by the reads, see JoinRecalculation
+    std::optional<Recalculation> recalc_;
 
 public:         // constructors 
     Sheet() = default;
+    Sheet(Workbook& workbook, std::string name);
     ~Sheet();
 
 public:         // methods 
@@ -25,10 +99,149 @@ public:         // methods
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
+    // unchecked lookup of a valid position, used on the formula evaluation path
+    const Cell* FindCell(Position pos) const {
+        const auto row = data_.find(pos.row);
+        if (row == data_.end()) {
+            return nullptr;
+        }
+        const auto cell = row->second.find(pos.col);
+        return cell == row->second.end() ? nullptr : cell->second.get();
+    }
+    Cell* FindCell(Position pos) {
+        return const_cast<Cell*>(std::as_const(*this).FindCell(pos));
+    }
+    // the cell a formula refers to, made as an empty text if missing; undoing the edit
+    // being applied removes it again
+    Cell* MakeReferencedCell(Position pos);
+
     void ClearCell(Position pos) override;
+    // Sets or clears the cells in order as one edit, undone in one step. If an edit is
+    // rejected, the ones before it are reverted and the exception is rethrown
+    void SetCells(std::vector<CellEdit> edits);
+
+    // Undoes the latest edit of the sheet, false if there is none. The edited cells get
+    // their previous contents back, formulas as they were compiled: only their links are
+    // made again and only the values depending on them are dropped. A batch is undone
+    // through the path of SetCells. Throws CircularDependencyException, with nothing
+    // changed, if a formula of another sheet made since would close a cycle. Formulas of
+    // other sheets rewritten by a structural edit are moved back, #REF! stays #REF! there
+    bool Undo();
+    // redoes the latest undone edit, false if there is none; any other edit drops them
+    bool Redo();
+    bool CanUndo() const { return undo_.CanUndo(); }
+    bool CanRedo() const { return undo_.CanRedo(); }
+    // the number of latest edits kept to undo, UndoHistory::DEFAULT_LIMIT at first;
+    // with 0 no edit is recorded
+    void SetUndoLimit(size_t steps);
+    void ClearUndoHistory();
+
+    // Uniform runs of formulas down a column are computed together, see ColumnKernel; on
+    // by default. Off, every formula is evaluated on its own
+    void SetColumnKernels(bool enabled) { column_kernels_ = enabled; }
+    bool UsesColumnKernels() const { return column_kernels_; }
+
+    // Lazy by default. Eager computes the formulas each public edit leaves stale before it
+    // returns, batches and undo steps included; one that throws leaves them to the next.
+    // Background starts RecalculateAsync at the end of each: read through ReadSnapshot
+    // then, the edited cells show as pending until it publishes; a read of the live cells
+    // waits for it. In a workbook the policy
+    // of every sheet applies to its own formulas whichever sheet is edited. Switching
+    // computes, or starts computing, what is stale
+    void SetRecalcPolicy(RecalcPolicy policy);
+    RecalcPolicy GetRecalcPolicy() const { return recalc_policy_; }
+
+    const std::string& GetName() const { return name_; }
+    // nullptr for a standalone sheet
+    Workbook* GetWorkbook() const { return workbook_; }
+    // a loaded sheet of the same workbook, nullptr if there is none with this name
+    Sheet* FindSheet(const std::string& name) const;
 
     Size GetPrintableSize() const override;
 
+    // Shift the cells below (right of) the edit line and rewrite, in place, only the
+    // formulas referencing shifted or deleted cells; references to deleted cells become #REF!.
+    // Throw InvalidPositionException unless count > 0 and `before` (`first`) is in the
+    // sheet, or if an insertion would shift stored cells out of it
+    void InsertRows(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // with the numbers as the stream writes them
     void PrintValues(std::ostream& output) const override;
+    void PrintValues(std::ostream& output, const NumberFormat& format) const;
     void PrintTexts(std::ostream& output) const override;
+
+    // Single writer: computes the values of every changed cell and atomically
+    // makes the result visible to readers, returns the new version
+    uint64_t Publish();
+    // Single writer: does the work of Publish on a background thread. Until it is done
+    // readers see the previous values with the edited cells marked as pending. Any
+    // further edit cancels it; a direct read of the cells waits for it, see
+    // JoinRecalculation. A sheet of a workbook recalculates the whole workbook.
+    Recalculation RecalculateAsync();
+    // Single writer: waits for the running recalculation to finish, it computes and
+    // publishes the cells. GetCell, the values of the cells, PrintValues and
+    // GetChangesSince call it first; a no-op on the worker itself
+    void JoinRecalculation() const;
+    // Any thread, lock-free: the last published state, stays valid while the guard lives
+    SnapshotPublisher::ReadGuard ReadSnapshot() const;
+    // Single writer, once a running recalculation is done: the cells whose published value
+    // changed after `version`, with their current values, in position order; nullopt if
+    // the version is older than the kept history, the whole sheet must be redrawn then.
+    // Readers on other threads diff two snapshots with SheetSnapshot::ForEachChange
+    std::optional<std::vector<CellChange>> GetChangesSince(uint64_t version) const;
+
+    // called by cells whose text or computed value is about to change
+    void MarkChanged(Position pos);
+
+    // live bytes of the sheet structures, see memory.h
+    MemoryReport GetMemoryUsage() const;
+    StringPool& GetStringPool() { return strings_; }
+
+    // the row of the first column of `range` that matches, see LookupIndex::Find
+    std::optional<int> FindInColumn(const CellRange& range, double key, MatchSearch search) const;
+    void ForEachFormulaInRange(const CellRange& range, const std::function<void(const Cell*)>& action) const;
+    // the formulas of the range that may be uncached, see LookupIndex
+    void ForEachStaleFormulaInRange(const CellRange& range, const std::function<void(const Cell*)>& action) const;
+    RangeSummary AggregateRange(const CellRange& range) const;
+    LookupIndex& GetLookupIndex() const { return lookup_; }
+    // charged by cells changing their structures on behalf of another sheet
+    MemoryAccount& GetMemoryAccount() const { return *memory_; }
+
+private:        // methods
+    // puts `content` in the cell at `pos`, std::monostate removing it, and leaves the
+    // replaced content in it; the content stays as it is if the cell rejects it
+    void ExchangeContent(Position pos, CellContent& content);
+    // Exchanges the contents of the step's cells with theirs, in edit order or backwards.
+    // Applied forwards, the step records the cells made for references; backwards, it
+    // removes them after its formulas. If a cell rejects its content, the cells exchanged
+    // before it are put back and the exception is rethrown
+    void ApplyStep(UndoHistory::Step& step, bool backwards);
+    void RemoveCreated(UndoHistory::Step& step);
+    // checks and applies a structural edit, returns the step undoing it if `record`
+    UndoHistory::Step ApplyStructure(UndoHistory::Structure structure, int first, int count, bool record);
+    void UndoStructure(UndoHistory::Step& step);
+    void Record(UndoHistory::Step step);
+    // remap gives the new position of a cell, Position::NONE if it is deleted;
+    // only cells at or past `first` in the given dimension may move. If `replaced` is
+    // given, the deleted cells are moved to it with the formulas of the sheet whose
+    // references to them turn to #REF!, as they were
+    void Restructure(bool by_rows, int first, const std::function<Position(Position)>& remap
+        , UndoHistory::Records* replaced = nullptr);
+    uint64_t PublishChanges();
+    // erases an existing cell and shrinks the printable area
+    void RemoveCell(Position pos);
+    // publishes the last snapshot with the changed cells flagged as pending,
+    // returns the cells to compute
+    std::vector<const CellInterface*> PublishPending();
+    void CancelRecalculation();
+    void CancelOwnRecalculation();
+    // applies the recalculation policies at the end of a public edit
+    void FinishEdit();
+    // Eager: computes the formulas of stale_
+    void ComputeStale();
+    // drops every formula while all cells are still alive
+    void ClearFormulas();
 };
\ No newline at end of file
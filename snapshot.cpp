@@ -0,0 +1,188 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <utility>
+
+SheetSnapshot::SheetSnapshot(uint64_t version, Size size, std::vector<RowPtr> rows, std::vector<Position> pending)
+    : version_(version)
+    , size_(size)
+    , rows_(std::make_shared<const std::vector<RowPtr>>(std::move(rows)))
+    , pending_(std::move(pending)) { }
+
+const SheetSnapshot::Entry* SheetSnapshot::FindEntry(const std::vector<RowPtr>& rows, Position pos) {
+    if (pos.row < 0 || pos.row >= static_cast<int>(rows.size()) || !rows[pos.row]) {
+        return nullptr;
+    }
+    const Row& row = *rows[pos.row];
+    auto it = std::lower_bound(row.begin(), row.end(), pos.col, [](const Entry& entry, int col) {
+        return entry.col < col;
+    });
+    return it != row.end() && it->col == pos.col ? &*it : nullptr;
+}
+
+bool SheetSnapshot::IsPending(Position pos) const {
+    return std::binary_search(pending_.begin(), pending_.end(), pos);
+}
+
+namespace {
+    // same layout as Sheet::PrintValues / Sheet::PrintTexts
+    template <typename EntryPrinter>
+    void PrintRows(std::ostream& output, Size size, const std::vector<SheetSnapshot::RowPtr>& rows
+        , EntryPrinter print) {
+        if (size.rows == 0 || size.cols == 0) {
+            return;
+        }
+        for (int i = 0; i < size.rows; ++i) {
+            if (rows[i]) {
+                auto entry = rows[i]->begin();
+                for (int j = 0; j < size.cols; ++j) {
+                    if (j > 0) {
+                        output << '\t';
+                    }
+                    if (entry != rows[i]->end() && entry->col == j) {
+                        print(*entry);
+                        ++entry;
+                    }
+                }
+            }
+            else {
+                output << '\t';
+            }
+            output << '\n';
+        }
+    }
+}  // namespace
+
+void SheetSnapshot::PrintValues(std::ostream& output, const NumberFormat& format) const {
+    PrintRows(output, size_, *rows_, [&output, &format](const Entry& entry) {
+        format.Print(output, entry.value);
+    });
+}
+
+void SheetSnapshot::PrintTexts(std::ostream& output) const {
+    PrintRows(output, size_, *rows_, [&output](const Entry& entry) {
+        output << entry.text;
+    });
+}
+
+void SheetSnapshot::ForEachChange(const SheetSnapshot& previous
+    , const std::function<void(Position pos, const Entry* entry)>& on_change) const {
+    static const Row no_entries;
+    const std::vector<RowPtr>& previous_rows = *previous.rows_;
+    const size_t rows = std::max(rows_->size(), previous_rows.size());
+    for (size_t i = 0; i < rows; ++i) {
+        const Row* before = i < previous_rows.size() ? previous_rows[i].get() : nullptr;
+        const Row* after = i < rows_->size() ? (*rows_)[i].get() : nullptr;
+        if (before == after) {
+            continue;
+        }
+        before = before ? before : &no_entries;
+        after = after ? after : &no_entries;
+        // both rows are sorted by col
+        auto old_entry = before->begin();
+        auto new_entry = after->begin();
+        while (old_entry != before->end() || new_entry != after->end()) {
+            const int row = static_cast<int>(i);
+            if (new_entry == after->end() || (old_entry != before->end() && old_entry->col < new_entry->col)) {
+                on_change({ row, old_entry->col }, nullptr);
+                ++old_entry;
+            } else if (old_entry == before->end() || new_entry->col < old_entry->col) {
+                on_change({ row, new_entry->col }, &*new_entry);
+                ++new_entry;
+            } else {
+                if (!(old_entry->value == new_entry->value)) {
+                    on_change({ row, new_entry->col }, &*new_entry);
+                }
+                ++old_entry;
+                ++new_entry;
+            }
+        }
+    }
+}
+
+SnapshotPublisher::ReadGuard::ReadGuard(const SnapshotPublisher& publisher)
+    : publisher_(&publisher) {
+    // start from a per-thread slot so that readers rarely contend on a CAS
+    const size_t home = std::hash<std::thread::id>{}(std::this_thread::get_id()) % SLOTS_PER_BLOCK;
+    SlotBlock* block = &publisher.readers_;
+    while (!slot_) {
+        for (size_t i = 0; i < SLOTS_PER_BLOCK && !slot_; ++i) {
+            std::atomic<uint64_t>& epoch = block->slots[(home + i) % SLOTS_PER_BLOCK].epoch;
+            uint64_t free_slot = 0;
+            if (epoch.compare_exchange_strong(free_slot, publisher.epoch_.load())) {
+                slot_ = &epoch;
+            }
+        }
+        if (slot_) {
+            break;
+        }
+        SlotBlock* next = block->next.load();
+        if (!next) {
+            // every slot is taken, by other threads or by guards this one holds
+            auto added = std::make_unique<SlotBlock>();
+            if (block->next.compare_exchange_strong(next, added.get())) {
+                next = added.release();
+            }
+            // otherwise next is the block another reader chained meanwhile
+        }
+        block = next;
+    }
+    snapshot_ = publisher.current_.load();
+}
+
+SnapshotPublisher::ReadGuard::ReadGuard(ReadGuard&& other) noexcept
+    : publisher_(std::exchange(other.publisher_, nullptr))
+    , slot_(other.slot_)
+    , snapshot_(other.snapshot_) { }
+
+SnapshotPublisher::ReadGuard::~ReadGuard() {
+    if (publisher_) {
+        slot_->store(0);
+    }
+}
+
+SnapshotPublisher::~SnapshotPublisher() {
+    delete current_.load();
+    for (const auto& [epoch, snapshot] : retired_) {
+        delete snapshot;
+    }
+    for (SlotBlock* block = readers_.next.load(); block;) {
+        delete std::exchange(block, block->next.load());
+    }
+}
+
+SnapshotPublisher::ReadGuard SnapshotPublisher::Read() const {
+    return ReadGuard(*this);
+}
+
+void SnapshotPublisher::Publish(std::unique_ptr<const SheetSnapshot> snapshot) {
+    const SheetSnapshot* replaced = current_.exchange(snapshot.release());
+    if (replaced) {
+        // a reader that still sees `replaced` pinned an epoch below this one
+        retired_.emplace_back(epoch_.fetch_add(1) + 1, replaced);
+    }
+    Reclaim();
+}
+
+void SnapshotPublisher::Reclaim() {
+    uint64_t oldest_reader = UINT64_MAX;
+    for (const SlotBlock* block = &readers_; block; block = block->next.load()) {
+        for (const ReaderSlot& reader : block->slots) {
+            const uint64_t epoch = reader.epoch.load();
+            if (epoch != 0) {
+                oldest_reader = std::min(oldest_reader, epoch);
+            }
+        }
+    }
+    auto still_visible = std::partition(retired_.begin(), retired_.end(), [oldest_reader](const auto& retired) {
+        return retired.first > oldest_reader;
+    });
+    for (auto it = still_visible; it != retired_.end(); ++it) {
+        delete it->second;
+    }
+    retired_.erase(still_visible, retired_.end());
+}
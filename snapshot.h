@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "memory.h"
+#include "number_format.h"
+
+class FormulaInterface;
+struct ForkBase;
+
+// a displayed cell whose value changed between two versions, no value if the cell is gone
+struct CellChange {
+    Position pos;
+    std::optional<CellInterface::Value> value;
+};
+
+// Immutable copy of the sheet texts, computed values and compiled formulas. Rows are
+// shared between consecutive snapshots, only rows changed by an edit are rebuilt.
+class SheetSnapshot {
+    friend class SheetFork;
+
+public:         // fields
+    struct Entry {
+        int col;
+        std::string text;
+        CellInterface::Value value;
+        // shared with the cell, which copies it before changing it; nullptr for a text
+        std::shared_ptr<const FormulaInterface> formula;
+    };
+    using Row = std::vector<Entry, CountingAllocator<Entry, MemoryCategory::Caches>>;     // sorted by col
+    using RowPtr = std::shared_ptr<const Row>;
+
+private:        // fields
+    uint64_t version_;
+    Size size_;
+    // rows_->size() == size_.rows, nullptr for empty rows; kept by the forks of the snapshot
+    std::shared_ptr<const std::vector<RowPtr>> rows_;
+    std::vector<Position> pending_;         // sorted, cells edited after these values were computed
+    // made by the first fork of this version, see SheetFork
+    mutable std::once_flag fork_base_made_;
+    mutable std::shared_ptr<ForkBase> fork_base_;
+
+public:         // constructors
+    SheetSnapshot(uint64_t version, Size size, std::vector<RowPtr> rows, std::vector<Position> pending = {});
+
+public:         // methods
+    uint64_t GetVersion() const { return version_; }
+    Size GetPrintableSize() const { return size_; }
+    const std::vector<RowPtr>& GetRows() const { return *rows_; }
+
+    // nullptr if there is no cell at pos
+    const Entry* GetCell(Position pos) const { return FindEntry(*rows_, pos); }
+    static const Entry* FindEntry(const std::vector<RowPtr>& rows, Position pos);
+    // true while a recalculation of pos is in flight, GetCell still returns the previous state
+    bool IsPending(Position pos) const;
+    bool HasPending() const { return !pending_.empty(); }
+
+    void PrintValues(std::ostream& output, const NumberFormat& format = NumberFormat()) const;
+    void PrintTexts(std::ostream& output) const;
+
+    // Streaming diff from `previous`, in position order: entry is nullptr for a cell that
+    // is gone. Rows shared with `previous` are skipped by pointer, only rebuilt ones are read
+    void ForEachChange(const SheetSnapshot& previous
+        , const std::function<void(Position pos, const Entry* entry)>& on_change) const;
+};
+
+// Single writer / many readers publication of SheetSnapshot without locks on
+// the read side. Readers pin the current epoch in a slot before loading the
+// snapshot pointer; the writer frees a replaced snapshot only once no slot
+// holds an epoch older than the one it was retired in. There is no bound on the
+// guards alive at once: when every slot is taken, a reader chains another block
+// of slots, kept until the publisher is destroyed.
+class SnapshotPublisher {
+public:         // types
+    class ReadGuard {
+    private:        // fields
+        const SnapshotPublisher* publisher_ = nullptr;
+        std::atomic<uint64_t>* slot_ = nullptr;    // the epoch pinned
+        const SheetSnapshot* snapshot_ = nullptr;
+
+    public:         // constructors
+        ReadGuard(const SnapshotPublisher& publisher);
+        ReadGuard(ReadGuard&& other) noexcept;
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        ReadGuard& operator=(ReadGuard&&) = delete;
+        ~ReadGuard();
+
+    public:         // methods
+        // nullptr until the first Publish
+        const SheetSnapshot* Get() const { return snapshot_; }
+        const SheetSnapshot* operator->() const { return snapshot_; }
+        const SheetSnapshot& operator*() const { return *snapshot_; }
+    };
+
+private:        // fields
+    static const size_t SLOTS_PER_BLOCK = 64;
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{ 0 };   // 0 while the slot is free
+    };
+    struct SlotBlock {
+        std::array<ReaderSlot, SLOTS_PER_BLOCK> slots;
+        std::atomic<SlotBlock*> next{ nullptr };    // chained by readers, never unlinked
+    };
+
+    std::atomic<const SheetSnapshot*> current_{ nullptr };
+    std::atomic<uint64_t> epoch_{ 1 };
+    mutable SlotBlock readers_;
+    std::vector<std::pair<uint64_t, const SheetSnapshot*>> retired_;   // writer only
+
+public:         // constructors
+    SnapshotPublisher() = default;
+    SnapshotPublisher(const SnapshotPublisher&) = delete;
+    SnapshotPublisher& operator=(const SnapshotPublisher&) = delete;
+    ~SnapshotPublisher();
+
+public:         // methods
+    ReadGuard Read() const;
+
+    // writer side
+    void Publish(std::unique_ptr<const SheetSnapshot> snapshot);
+    const SheetSnapshot* GetLatest() const { return current_.load(); }
+
+private:        // methods
+    void Reclaim();
+};
@@ -0,0 +1,66 @@
+#include "string_pool.h"
+
+#include <stdexcept>
+
+StringPool::StringPool()
+    : index_(0, TextHash{ this }, TextEqual{ this }) { }
+
+StringPool::Id StringPool::Intern(std::string_view text) {
+    probe_ = text;
+    if (const auto it = index_.find(PROBE); it != index_.end()) {
+        ++entries_[*it].refs;
+        return *it;
+    }
+    if (buffer_.size() + text.size() > UINT32_MAX) {
+        throw std::length_error("string pool overflow");
+    }
+
+    Id id;
+    if (free_ids_.empty()) {
+        id = static_cast<Id>(entries_.size());
+        entries_.emplace_back();
+    } else {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    }
+    entries_[id] = { static_cast<uint32_t>(buffer_.size()), static_cast<uint32_t>(text.size()), 1 };
+    buffer_.append(text.data(), text.size());
+    index_.insert(id);
+    return id;
+}
+
+void StringPool::Release(Id id) {
+    Entry& entry = entries_[id];
+    if (--entry.refs > 0) {
+        return;
+    }
+    index_.erase(id);
+    if (index_.empty()) {
+        // an empty pool gives all its memory back
+        decltype(buffer_)().swap(buffer_);
+        decltype(entries_)().swap(entries_);
+        decltype(free_ids_)().swap(free_ids_);
+        index_ = decltype(index_)(0, TextHash{ this }, TextEqual{ this });
+        released_bytes_ = 0;
+        return;
+    }
+    free_ids_.push_back(id);
+    released_bytes_ += entry.size;
+    if (released_bytes_ > buffer_.size() / 2) {
+        Compact();
+    }
+}
+
+void StringPool::Compact() {
+    decltype(buffer_) buffer;
+    buffer.reserve(buffer_.size() - released_bytes_);
+    for (Entry& entry : entries_) {
+        if (entry.refs > 0) {
+            const uint32_t offset = static_cast<uint32_t>(buffer.size());
+            buffer.append(buffer_, entry.offset, entry.size);
+            entry.offset = offset;
+        }
+    }
+    buffer_ = std::move(buffer);
+    released_bytes_ = 0;
+}
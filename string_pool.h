@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "memory.h"
+
+// Interned, reference counted strings of a sheet, stored back to back in one buffer.
+// Equal texts share one entry; an id stays valid until its last reference is released,
+// while the buffer is compacted once released bytes outweigh live ones.
+class StringPool {
+public:         // types
+    using Id = uint32_t;
+
+private:        // types
+    struct Entry {
+        uint32_t offset = 0;
+        uint32_t size = 0;
+        uint32_t refs = 0;          // 0 for a free id
+    };
+
+    // hashes the text of an id, PROBE stands for the text being looked up
+    struct TextHash {
+        const StringPool* pool;
+        size_t operator()(Id id) const { return std::hash<std::string_view>()(pool->View(id)); }
+    };
+    struct TextEqual {
+        const StringPool* pool;
+        bool operator()(Id lhs, Id rhs) const { return pool->View(lhs) == pool->View(rhs); }
+    };
+
+    template <typename T>
+    using Allocator = CountingAllocator<T, MemoryCategory::Text>;
+
+    static constexpr Id PROBE = UINT32_MAX;
+
+private:        // fields
+    std::basic_string<char, std::char_traits<char>, Allocator<char>> buffer_;
+    std::vector<Entry, Allocator<Entry>> entries_;
+    std::vector<Id, Allocator<Id>> free_ids_;
+    std::unordered_set<Id, TextHash, TextEqual, Allocator<Id>> index_;
+    size_t released_bytes_ = 0;
+    std::string_view probe_;
+
+public:         // constructors
+    StringPool();
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+public:         // methods
+    // the id of an equal text, with one more reference
+    Id Intern(std::string_view text);
+    void Release(Id id);
+
+    // valid until the next Intern or Release
+    std::string_view View(Id id) const {
+        if (id == PROBE) {
+            return probe_;
+        }
+        return std::string_view(buffer_).substr(entries_[id].offset, entries_[id].size);
+    }
+
+    // distinct texts held
+    size_t GetSize() const { return index_.size(); }
+
+private:        // methods
+    void Compact();
+};
@@ -1,12 +1,11 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
-#include <algorithm>
+#include <charconv>
+#include <tuple>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
+const size_t MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = {-1, -1};
 
@@ -23,54 +22,59 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer, buffer + MAX_STRING_LENGTH).ptr);
+}
+
+std::to_chars_result Position::ToChars(char* first, char* last) const {
     if (!IsValid()) {
-        return "";
+        return { first, std::errc() };
     }
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
+    int letter_count = 1;
+    for (int c = col; c >= LETTERS; c = c / LETTERS - 1) {
+        ++letter_count;
+    }
+    if (last - first < letter_count) {
+        return { last, std::errc::value_too_large };
+    }
     int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
+    for (char* letter = first + letter_count - 1; letter >= first; --letter) {
+        *letter = static_cast<char>('A' + c % LETTERS);
         c = c / LETTERS - 1;
     }
 
-    result += std::to_string(row + 1);
-
-    return result;
+    return std::to_chars(first + letter_count, last, row + 1);
 }
 
 Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
-
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
+    size_t letter_count = 0;
+    while (letter_count < str.size() && str[letter_count] >= 'A' && str[letter_count] <= 'Z') {
+        ++letter_count;
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
+    if (letter_count == 0 || letter_count > MAX_POS_LETTER_COUNT) {
         return Position::NONE;
     }
 
-    if (!std::isdigit(digits[0])) {
+    const char* digits = str.data() + letter_count;
+    const char* end = str.data() + str.size();
+    if (digits == end || !std::isdigit(static_cast<unsigned char>(*digits))) {
         return Position::NONE;
     }
-
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    const auto [ptr, ec] = std::from_chars(digits, end, row);
+    if (ec != std::errc() || ptr != end) {
         return Position::NONE;
     }
 
     int col = 0;
-    for (char ch : letters) {
+    for (char ch : str.substr(0, letter_count)) {
         col *= LETTERS;
         col += ch - 'A' + 1;
     }
 
-    return {row - 1, col - 1};
+    const Position result{ row - 1, col - 1 };
+    return result.IsValid() ? result : Position::NONE;
 }
 
 bool Size::operator==(Size rhs) const {
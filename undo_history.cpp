@@ -0,0 +1,58 @@
+#include "undo_history.h"
+
+void UndoHistory::Record(Step step) {
+    redo_.clear();
+    PushUndo(std::move(step));
+}
+
+void UndoHistory::PushUndo(Step step) {
+    if (limit_ == 0) {
+        return;
+    }
+    undo_.push_back(std::move(step));
+    while (undo_.size() > limit_) {
+        undo_.pop_front();
+    }
+}
+
+UndoHistory::Step UndoHistory::TakeUndo() {
+    Step step = std::move(undo_.back());
+    undo_.pop_back();
+    return step;
+}
+
+UndoHistory::Step UndoHistory::TakeRedo() {
+    Step step = std::move(redo_.back());
+    redo_.pop_back();
+    return step;
+}
+
+void UndoHistory::SetLimit(size_t steps) {
+    limit_ = steps;
+    while (undo_.size() > limit_) {
+        undo_.pop_front();
+    }
+    if (limit_ == 0) {
+        redo_.clear();
+    }
+}
+
+void UndoHistory::Clear() {
+    undo_.clear();
+    redo_.clear();
+}
+
+UndoHistory::Structure UndoHistory::Inverse(Structure structure) {
+    switch (structure) {
+    case Structure::InsertRows:
+        return Structure::DeleteRows;
+    case Structure::DeleteRows:
+        return Structure::InsertRows;
+    case Structure::InsertCols:
+        return Structure::DeleteCols;
+    case Structure::DeleteCols:
+        return Structure::InsertCols;
+    default:
+        return Structure::None;
+    }
+}
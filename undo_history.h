@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "cell.h"
+#include "common.h"
+#include "memory.h"
+
+// The edits of a sheet to undo and to redo, the latest last. A step keeps what its edit
+// replaced and nothing more: the previous content of each edited cell, formulas moved
+// out compiled, the cells made for the references of its formulas, and for a structural
+// edit the cells it deleted with the previous text of the formulas it rewrote. Undoing
+// and redoing exchange these contents with the cells', nothing is copied.
+class UndoHistory {
+public:         // types
+    enum class Structure : uint8_t { None, InsertRows, DeleteRows, InsertCols, DeleteCols };
+
+    struct CellRecord {
+        Position pos;
+        CellContent content;
+    };
+    using Records = std::vector<CellRecord, CountingAllocator<CellRecord, MemoryCategory::UndoHistory>>;
+
+    struct Step {
+        Structure structure = Structure::None;
+        int first = 0;
+        int count = 0;
+        Records cells;          // in the order they were edited
+        Records created;        // empty texts made for references, removed by the undo
+    };
+
+private:        // types
+    using Steps = std::deque<Step, CountingAllocator<Step, MemoryCategory::UndoHistory>>;
+
+public:         // constants
+    static constexpr size_t DEFAULT_LIMIT = 100;
+
+private:        // fields
+    Steps undo_;
+    Steps redo_;
+    size_t limit_ = DEFAULT_LIMIT;
+
+public:         // methods
+    // a new edit, the undone steps cannot be redone any more
+    void Record(Step step);
+    // an undone step, the steps to redo are kept
+    void PushRedo(Step step) { redo_.push_back(std::move(step)); }
+    // a redone step, or an undone one put back
+    void PushUndo(Step step);
+
+    bool CanUndo() const { return !undo_.empty(); }
+    bool CanRedo() const { return !redo_.empty(); }
+    // the latest step, there must be one
+    Step TakeUndo();
+    Step TakeRedo();
+    const Step& PeekUndo() const { return undo_.back(); }
+    const Step& PeekRedo() const { return redo_.back(); }
+
+    // no edit is recorded with a limit of 0
+    bool IsRecording() const { return limit_ > 0; }
+    // the oldest steps past the limit are dropped
+    void SetLimit(size_t steps);
+    size_t GetLimit() const { return limit_; }
+    void Clear();
+
+    static Structure Inverse(Structure structure);
+};
@@ -0,0 +1,194 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+    bool IsSheetName(const std::string& name) {
+        if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+            return false;
+        }
+        return std::all_of(name.begin(), name.end(), [](char c) {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        });
+    }
+}  // namespace
+
+Workbook::~Workbook() {
+    CancelRecalculation();
+    // formulas reach cells of other sheets, so all of them go before any cell
+    for (auto& [name, sheet] : sheets_) {
+        sheet->ClearFormulas();
+    }
+    sheets_.clear();
+}
+
+Sheet& Workbook::CreateSheet(const std::string& name) {
+    Sheet& sheet = AddSheet(name);
+    ResolveSheet(name);
+    return sheet;
+}
+
+Sheet* Workbook::FindSheet(const std::string& name) const {
+    const auto it = sheets_.find(name);
+    return it == sheets_.end() ? nullptr : it->second.get();
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> names;
+    names.reserve(sheets_.size());
+    for (const auto& [name, sheet] : sheets_) {
+        names.push_back(name);
+    }
+    return names;
+}
+
+MemoryReport Workbook::GetMemoryUsage() const {
+    MemoryReport report;
+    for (const auto& [name, sheet] : sheets_) {
+        report += sheet->GetMemoryUsage();
+    }
+    return report;
+}
+
+void Workbook::UnloadSheet(const std::string& name, std::ostream& output) {
+    CancelRecalculation();
+    auto node = sheets_.extract(name);
+    if (node.empty()) {
+        throw std::out_of_range("no sheet named " + name);
+    }
+    std::unique_ptr<Sheet> sheet = std::move(node.mapped());
+
+    std::vector<Position> positions;
+    std::unordered_set<Cell*> dependents;   // formulas of other sheets referring to this one
+    for (const auto& [row, cells] : sheet->data_) {
+        for (const auto& [col, cell] : cells) {
+            positions.push_back({ row, col });
+            for (Cell* parent : cell->GetParents()) {
+                if (&parent->GetSheet() != sheet.get()) {
+                    dependents.insert(parent);
+                }
+            }
+        }
+    }
+
+    std::sort(positions.begin(), positions.end());
+    for (const Position& pos : positions) {
+        const std::string text = sheet->FindCell(pos)->GetText();
+        if (!text.empty()) {
+            output << pos.ToString() << ' ' << text.size() << ' ' << text << '\n';
+        }
+    }
+
+    // the sheet is no longer found, so the dependents wait for it to come back
+    for (Cell* cell : dependents) {
+        cell->Relink();
+    }
+    sheet.reset();
+}
+
+Sheet& Workbook::LoadSheet(const std::string& name, std::istream& input) {
+    Sheet& sheet = AddSheet(name);
+    std::string pos_str;
+    size_t size;
+    while (input >> pos_str >> size) {
+        input.get();
+        std::string text(size, '\0');
+        if (!input.read(text.data(), size)) {
+            throw std::runtime_error("truncated sheet " + name);
+        }
+        sheet.SetCell(Position::FromString(pos_str), std::move(text));
+    }
+    // loading is not an edit to undo
+    sheet.ClearUndoHistory();
+    // after the cells, so that a reference closing a cycle is the one left unbound
+    ResolveSheet(name);
+    return sheet;
+}
+
+uint64_t Workbook::Publish() {
+    CancelRecalculation();
+    for (auto& [name, sheet] : sheets_) {
+        sheet->PublishChanges();
+    }
+    return ++version_;
+}
+
+Recalculation Workbook::RecalculateAsync() {
+    CancelRecalculation();
+    std::vector<const CellInterface*> to_compute;
+    for (auto& [name, sheet] : sheets_) {
+        std::vector<const CellInterface*> cells = sheet->PublishPending();
+        to_compute.insert(to_compute.end(), cells.begin(), cells.end());
+    }
+    recalc_ = Recalculation::Start(recalc_worker_, std::move(to_compute), [this] {
+        for (auto& [name, sheet] : sheets_) {
+            sheet->PublishChanges();
+        }
+        return ++version_;
+    });
+    return *recalc_;
+}
+
+void Workbook::FinishEdit() {
+    bool background = false;
+    for (auto& [name, sheet] : sheets_) {
+        if (sheet->GetRecalcPolicy() == RecalcPolicy::Eager) {
+            sheet->ComputeStale();
+        }
+        background = background || sheet->GetRecalcPolicy() == RecalcPolicy::Background;
+    }
+    // one pass computes every sheet, the eager ones have nothing left
+    if (background) {
+        RecalculateAsync();
+    }
+}
+
+void Workbook::AddUnresolved(const std::string& sheet, Cell* cell) {
+    unresolved_[sheet].insert(cell);
+}
+
+void Workbook::EraseUnresolved(Cell* cell) {
+    for (auto it = unresolved_.begin(); it != unresolved_.end();) {
+        it->second.erase(cell);
+        it = it->second.empty() ? unresolved_.erase(it) : std::next(it);
+    }
+}
+
+void Workbook::CancelRecalculation() {
+    if (recalc_worker_.joinable()) {
+        recalc_->Cancel();
+        recalc_worker_.join();
+    }
+}
+
+void Workbook::JoinRecalculation() {
+    if (recalc_worker_.joinable()) {
+        recalc_worker_.join();
+    }
+}
+
+Sheet& Workbook::AddSheet(const std::string& name) {
+    if (!IsSheetName(name)) {
+        throw std::invalid_argument("invalid sheet name " + name);
+    }
+    if (sheets_.count(name)) {
+        throw std::invalid_argument("duplicate sheet name " + name);
+    }
+    CancelRecalculation();
+    auto& sheet = sheets_[name];
+    sheet = std::make_unique<Sheet>(*this, name);
+    return *sheet;
+}
+
+void Workbook::ResolveSheet(const std::string& name) {
+    auto node = unresolved_.extract(name);
+    if (node.empty()) {
+        return;
+    }
+    for (Cell* cell : node.mapped()) {
+        cell->Relink();
+    }
+}
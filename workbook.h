@@ -0,0 +1,67 @@
+#pragma once
+
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "memory.h"
+#include "recalculation.h"
+#include "sheet.h"
+
+// Named sheets sharing one dependency graph: a formula of one sheet holds direct handles
+// to the cells of another (Sheet2!A1), and an edit invalidates dependents on every sheet.
+// Sheets can be unloaded to a stream and loaded back; while a sheet is absent the
+// references to it evaluate to #REF! and are bound again when it is loaded.
+class Workbook {
+private:        // fields
+    std::map<std::string, std::unique_ptr<Sheet>> sheets_;
+    // formulas waiting for a sheet of this name to be created or loaded
+    std::unordered_map<std::string, std::unordered_set<Cell*>> unresolved_;
+
+    uint64_t version_ = 0;
+    std::thread recalc_worker_;
+    std::optional<Recalculation> recalc_;
+
+public:         // constructors
+    Workbook() = default;
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+    ~Workbook();
+
+public:         // methods
+    // names are identifiers: a letter or '_' followed by letters, digits or '_'
+    Sheet& CreateSheet(const std::string& name);
+    Sheet* FindSheet(const std::string& name) const;
+    std::vector<std::string> GetSheetNames() const;
+    // sum of the reports of the loaded sheets
+    MemoryReport GetMemoryUsage() const;
+
+    // Writes the cell texts of the sheet to `output` and destroys it
+    void UnloadSheet(const std::string& name, std::ostream& output);
+    // Creates the sheet from the output of UnloadSheet
+    Sheet& LoadSheet(const std::string& name, std::istream& input);
+
+    // Single writer: the workbook-wide versions of Sheet::Publish and
+    // Sheet::RecalculateAsync, one computation pass over the changed cells of every sheet
+    uint64_t Publish();
+    Recalculation RecalculateAsync();
+
+    // called by cells
+    void AddUnresolved(const std::string& sheet, Cell* cell);
+    void EraseUnresolved(Cell* cell);
+    void CancelRecalculation();
+    void JoinRecalculation();
+    // called by sheets at the end of an edit, applies the policy of every sheet
+    void FinishEdit();
+
+private:        // methods
+    Sheet& AddSheet(const std::string& name);
+    // binds the formulas that waited for this sheet
+    void ResolveSheet(const std::string& name);
+};